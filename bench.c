@@ -0,0 +1,574 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "dsm.h"
+
+/*
+ * Microbenchmarks of the DSM on one machine: the benchmark forks the nodes
+ * of a two node cluster on loopback ports, runs every benchmark in turn
+ * and prints one result per benchmark and node as JSON or CSV, for runs of
+ * different versions to be compared.
+ *
+ *   fault_read, fault_write  latency of single faults, a round trip each,
+ *                            in an order the prefetcher does not follow
+ *   seq_scan                 read throughput of a sequential scan
+ *   pingpong                 a counter both nodes increment in turn; the
+ *                            latency is that of a round trip of the page
+ *   false_sharing_shared     increments of a word of each node's own, in
+ *   false_sharing_private    the same page and in separate pages; the hold
+ *                            window is off, so the shared page moves on
+ *                            every write the other node makes meanwhile
+ *   scaling                  read faults of 1, 2, 4, ... threads at once
+ *
+ * Next to the rate every result has the faults the node took and the pages
+ * it sent and rcvd per operation, from dsm_get_stats(), which tell a rate
+ * kept up by few transfers from one paid for with a transfer each.
+ *
+ * usage: bench [-f json|csv] [-n faults] [-s scan_mb] [-d ms] [-t threads]
+ *              [-p base_port] [-u] [-T]
+ */
+
+#define BENCH_NUM_NODES         (2)
+#define BENCH_PAGE_SIZE         (4096)
+#define BENCH_MAX_THREADS       (64)
+#define BENCH_SCALING_PAGES     (500)   /* faulted by each thread */
+#define BENCH_LCG_SEED          (12345)
+
+typedef struct {
+    char                name[32];
+    int                 nodeId;
+    int                 threads;
+    unsigned long long  count;          /* operations timed */
+    double              seconds;
+    double              rate;           /* operations per second */
+    double              mbPerSec;       /* seq_scan only */
+    double              meanUs;         /* latencies, if taken */
+    double              p50Us;
+    double              p90Us;
+    double              p99Us;
+    double              p999Us;
+    double              maxUs;
+    double              faultsPerOp;    /* read and write faults */
+    double              pagesPerOp;     /* pages sent and rcvd */
+}benchResult;
+
+typedef struct {
+    unsigned            numFaults;
+    unsigned            scanMb;
+    unsigned            durationMs;
+    unsigned            maxThreads;
+    int                 basePort;
+    int                 useUffd;
+    int                 useTcp;         /* tcp even though the nodes share a host */
+    int                 csv;
+}benchConfig;
+
+typedef struct {
+    volatile char*      pPages;         /* pages of the thread */
+    unsigned            numPages;
+    unsigned long long* pSamples;       /* latency of each fault in ns */
+}benchThreadArg;
+
+static benchConfig      config = {2000, 64, 1000, 8, 0, 0, 0, 0};
+static int              resultFd = -1;  /* results go to the parent here */
+static int              nodeId = 0;
+static dsm_stats_t      startStats;     /* of the benchmark running */
+
+/*
+ * Returns the time in ns on a monotonic clock
+ */
+unsigned long long benchNowNs(void)
+{
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * takes the statistics of the node at the start of a benchmark
+ * Returns the time in ns the benchmark starts at
+ */
+unsigned long long benchStart(void)
+{
+    dsm_get_stats(&startStats);
+    return benchNowNs();
+}
+
+/*
+ * orders latencies, shortest first
+ */
+int benchCmpSamples(const void* pA, const void* pB)
+{
+    unsigned long long  a = *(const unsigned long long*)pA;
+    unsigned long long  b = *(const unsigned long long*)pB;
+
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+/*
+ * Returns the sample below which pct percent of the sorted samples lie
+ */
+double benchPercentileUs(const unsigned long long* pSamples, unsigned long long num,
+        double pct)
+{
+    unsigned long long  rank = (unsigned long long)(pct / 100.0 * num + 0.999999);
+
+    return pSamples[(rank > 0) ? rank - 1 : 0] / 1000.0;
+}
+
+/*
+ * fills in a result and sends it to the parent; the latencies are taken
+ * from samples, which are sorted in place, unless it is NULL, and the
+ * faults and pages from the statistics since benchStart()
+ * Returns void
+ */
+void benchReport(const char* pName, int threads, unsigned long long count,
+        unsigned long long elapsedNs, unsigned long long* pSamples,
+        unsigned long long numSamples, double bytes)
+{
+    benchResult         result;
+    dsm_stats_t         stats;
+    unsigned long long  sum = 0;
+    unsigned long long  i = 0;
+
+    memset(&result, 0, sizeof(benchResult));
+    strncpy(result.name, pName, sizeof(result.name) - 1);
+    result.nodeId = nodeId;
+    result.threads = threads;
+    result.count = count;
+    result.seconds = elapsedNs / 1e9;
+    result.rate = (0 == elapsedNs) ? 0 : count / result.seconds;
+    result.mbPerSec = (0 == elapsedNs) ? 0 : bytes / (1024.0 * 1024.0) / result.seconds;
+    if (NULL != pSamples && numSamples > 0) {
+        qsort(pSamples, numSamples, sizeof(unsigned long long), benchCmpSamples);
+        for (i = 0; i < numSamples; i += 1) {
+            sum += pSamples[i];
+        }
+        result.meanUs = sum / 1000.0 / numSamples;
+        result.p50Us = benchPercentileUs(pSamples, numSamples, 50);
+        result.p90Us = benchPercentileUs(pSamples, numSamples, 90);
+        result.p99Us = benchPercentileUs(pSamples, numSamples, 99);
+        result.p999Us = benchPercentileUs(pSamples, numSamples, 99.9);
+        result.maxUs = pSamples[numSamples - 1] / 1000.0;
+    }
+    dsm_get_stats(&stats);
+    if (count > 0) {
+        result.faultsPerOp = (double)(stats.read_faults + stats.write_faults -
+                startStats.read_faults - startStats.write_faults) / count;
+        result.pagesPerOp = (double)(stats.pages_sent + stats.pages_rcvd -
+                startStats.pages_sent - startStats.pages_rcvd) / count;
+    }
+    /* a result is less than PIPE_BUF, so it is written in one piece */
+    if (sizeof(benchResult) != write(resultFd, &result, sizeof(benchResult))) {
+        perror("bench: result not written");
+    }
+}
+
+/*
+ * fills order with a permutation of 0 .. num - 1 drawn with a fixed seed,
+ * so that every run touches the pages in the same order and the prefetcher
+ * sees no stride
+ * Returns void
+ */
+void benchShuffle(unsigned* pOrder, unsigned num)
+{
+    unsigned            seed = BENCH_LCG_SEED;
+    unsigned            i = 0;
+    unsigned            j = 0;
+    unsigned            tmp = 0;
+
+    for (i = 0; i < num; i += 1) {
+        pOrder[i] = i;
+    }
+    for (i = num; i > 1; i -= 1) {
+        seed = seed * 1103515245 + 12345;
+        j = (seed >> 8) % i;
+        tmp = pOrder[i - 1];
+        pOrder[i - 1] = pOrder[j];
+        pOrder[j] = tmp;
+    }
+}
+
+/*
+ * faults on each of the pages, owned by the master, once in shuffled order
+ * and times every fault
+ * Returns void
+ */
+void benchFaults(const char* pName, volatile char* pPages, unsigned numPages, int isWrite)
+{
+    unsigned*           pOrder = (unsigned*)malloc(numPages * sizeof(unsigned));
+    unsigned long long* pSamples = (unsigned long long*)malloc(numPages *
+                            sizeof(unsigned long long));
+    unsigned long long  start = 0;
+    unsigned long long  begin = 0;
+    unsigned            i = 0;
+    volatile char       sink = 0;
+
+    benchShuffle(pOrder, numPages);
+    begin = benchStart();
+    for (i = 0; i < numPages; i += 1) {
+        start = benchNowNs();
+        if (isWrite) {
+            pPages[(size_t)pOrder[i] * BENCH_PAGE_SIZE] = 1;
+        }
+        else {
+            sink = pPages[(size_t)pOrder[i] * BENCH_PAGE_SIZE];
+        }
+        pSamples[i] = benchNowNs() - start;
+    }
+    benchReport(pName, 1, numPages, benchNowNs() - begin, pSamples, numPages, 0);
+    (void)sink;
+    free(pOrder);
+    free(pSamples);
+}
+
+/*
+ * reads the pages in order, a word every 64 bytes
+ * Returns void
+ */
+void benchScan(volatile char* pPages, unsigned numPages)
+{
+    size_t              len = (size_t)numPages * BENCH_PAGE_SIZE;
+    unsigned long long  begin = 0;
+    unsigned long long  sum = 0;
+    size_t              i = 0;
+
+    begin = benchStart();
+    for (i = 0; i < len; i += 64) {
+        sum += *(volatile unsigned long long*)(pPages + i);
+    }
+    benchReport("seq_scan", 1, numPages, benchNowNs() - begin, NULL, 0, (double)len);
+    (void)sum;
+}
+
+/*
+ * increments the counter when it is this node's turn, until the time is up
+ * on either node; the latency is the time from an increment to the next
+ * turn, a round trip of the page
+ * Returns void
+ */
+void benchPingPong(volatile unsigned* pCounter, volatile unsigned* pStop)
+{
+    unsigned long long* pSamples = NULL;
+    unsigned long long  maxSamples = 1 << 20;
+    unsigned long long  numSamples = 0;
+    unsigned long long  begin = 0;
+    unsigned long long  end = 0;
+    unsigned long long  last = 0;
+    unsigned            value = 0;
+
+    pSamples = (unsigned long long*)malloc(maxSamples * sizeof(unsigned long long));
+    begin = benchStart();
+    end = begin + config.durationMs * 1000000ULL;
+    while (!*pStop) {
+        value = *pCounter;
+        if ((value & 1) != (unsigned)nodeId) {
+            sched_yield();      /* lets the other node run on a shared cpu */
+            continue;
+        }
+        if (0 != last && numSamples < maxSamples) {
+            pSamples[numSamples++] = benchNowNs() - last;
+        }
+        if (benchNowNs() >= end) {
+            *pStop = 1;
+            break;
+        }
+        *pCounter = value + 1;
+        last = benchNowNs();
+    }
+    benchReport("pingpong", 1, numSamples, benchNowNs() - begin, pSamples, numSamples, 0);
+    free(pSamples);
+}
+
+/*
+ * increments a word of this node's own for the configured time
+ * Returns void
+ */
+void benchIncrement(const char* pName, volatile unsigned* pWord)
+{
+    unsigned long long  count = 0;
+    unsigned long long  begin = benchStart();
+    unsigned long long  end = begin + config.durationMs * 1000000ULL;
+    unsigned long long  now = begin;
+
+    while (now < end) {
+        *pWord += 1;
+        count += 1;
+        if (0 == (count & 63)) {
+            now = benchNowNs();
+        }
+    }
+    benchReport(pName, 1, count, benchNowNs() - begin, NULL, 0, 0);
+}
+
+/*
+ * a thread of the scaling benchmark; read faults on its pages in shuffled
+ * order
+ * Returns NULL
+ */
+void* benchScalingThread(void* pArg)
+{
+    benchThreadArg*     pThread = (benchThreadArg*)pArg;
+    unsigned*           pOrder = (unsigned*)malloc(pThread->numPages * sizeof(unsigned));
+    unsigned long long  start = 0;
+    unsigned            i = 0;
+    volatile char       sink = 0;
+
+    benchShuffle(pOrder, pThread->numPages);
+    for (i = 0; i < pThread->numPages; i += 1) {
+        start = benchNowNs();
+        sink = pThread->pPages[(size_t)pOrder[i] * BENCH_PAGE_SIZE];
+        pThread->pSamples[i] = benchNowNs() - start;
+    }
+    (void)sink;
+    free(pOrder);
+    return NULL;
+}
+
+/*
+ * faults on BENCH_SCALING_PAGES pages per thread with numThreads threads at
+ * once
+ * Returns void
+ */
+void benchScaling(volatile char* pPages, unsigned numThreads)
+{
+    pthread_t           threads[BENCH_MAX_THREADS];
+    benchThreadArg      args[BENCH_MAX_THREADS];
+    unsigned long long* pSamples = NULL;
+    unsigned long long  begin = 0;
+    unsigned long long  elapsed = 0;
+    unsigned            i = 0;
+
+    pSamples = (unsigned long long*)malloc((size_t)numThreads * BENCH_SCALING_PAGES *
+            sizeof(unsigned long long));
+    begin = benchStart();
+    for (i = 0; i < numThreads; i += 1) {
+        args[i].pPages = pPages + (size_t)i * BENCH_SCALING_PAGES * BENCH_PAGE_SIZE;
+        args[i].numPages = BENCH_SCALING_PAGES;
+        args[i].pSamples = pSamples + (size_t)i * BENCH_SCALING_PAGES;
+        pthread_create(&threads[i], NULL, benchScalingThread, &args[i]);
+    }
+    for (i = 0; i < numThreads; i += 1) {
+        pthread_join(threads[i], NULL);
+    }
+    elapsed = benchNowNs() - begin;
+    benchReport("scaling", numThreads, (unsigned long long)numThreads * BENCH_SCALING_PAGES,
+            elapsed, pSamples, (unsigned long long)numThreads * BENCH_SCALING_PAGES, 0);
+    free(pSamples);
+}
+
+/*
+ * runs a node of the benchmark cluster; node 0, the master, owns the pages
+ * at start and node 1 faults them. The region is laid out as the faulted
+ * pages, the scanned pages, the pages of the threads and a few pages for
+ * the counters.
+ * Returns 0 on success
+ */
+int benchNode(unsigned numPages, unsigned scanPages, unsigned scalingPages)
+{
+    char*               ipAddrs[BENCH_NUM_NODES] = {(char*)"127.0.0.1", (char*)"127.0.0.1"};
+    int                 ports[BENCH_NUM_NODES];
+    volatile char*      pRegion = NULL;
+    volatile char*      pFaultPages = NULL;
+    volatile char*      pWritePages = NULL;
+    volatile char*      pScanPages = NULL;
+    volatile char*      pScalingPages = NULL;
+    volatile unsigned*  pMisc = NULL;
+    dsm_barrier_t       barrier;
+    unsigned            threads = 0;
+    int                 i = 0;
+
+    for (i = 0; i < BENCH_NUM_NODES; i += 1) {
+        ports[i] = config.basePort + i;
+    }
+    if (config.useUffd) {
+        dsm_setopt(DSM_OPT_FAULT_ENGINE, DSM_FAULT_ENGINE_UFFD);
+    }
+    if (config.useTcp) {
+        dsm_setopt(DSM_OPT_LOCAL_TRANSPORT, 0);
+    }
+    initializeDSMCluster(nodeId, BENCH_NUM_NODES, ipAddrs, ports,
+            2 * numPages + scanPages + scalingPages + 4);
+    pRegion = (volatile char*)getsharedregion();
+    pFaultPages = pRegion;
+    pWritePages = pFaultPages + (size_t)numPages * BENCH_PAGE_SIZE;
+    pScanPages = pWritePages + (size_t)numPages * BENCH_PAGE_SIZE;
+    pScalingPages = pScanPages + (size_t)scanPages * BENCH_PAGE_SIZE;
+    pMisc = (volatile unsigned*)(pScalingPages + (size_t)scalingPages * BENCH_PAGE_SIZE);
+    dsm_barrier_init(&barrier, 1, BENCH_NUM_NODES);
+    dsm_barrier_wait(&barrier);
+
+    if (1 == nodeId) {
+        benchFaults("fault_read", pFaultPages, numPages, 0);
+        benchFaults("fault_write", pWritePages, numPages, 1);
+        benchScan(pScanPages, scanPages);
+    }
+    dsm_barrier_wait(&barrier);
+
+    /* counter and stop flag of the ping-pong share a page */
+    benchPingPong(&pMisc[0], &pMisc[1]);
+    dsm_barrier_wait(&barrier);
+
+    /* words of each node in one page, then in pages of their own; a page
+     * kept for the hold window would hide the ping-pong */
+    dsm_setopt(DSM_OPT_HOLD_WINDOW_US, 0);
+    benchIncrement("false_sharing_shared",
+            (volatile unsigned*)((volatile char*)pMisc + BENCH_PAGE_SIZE) + nodeId);
+    dsm_barrier_wait(&barrier);
+    benchIncrement("false_sharing_private",
+            (volatile unsigned*)((volatile char*)pMisc + (2 + nodeId) * BENCH_PAGE_SIZE));
+    dsm_barrier_wait(&barrier);
+
+    if (1 == nodeId) {
+        for (threads = 1; threads <= config.maxThreads; threads *= 2) {
+            benchScaling(pScalingPages, threads);
+            pScalingPages += (size_t)threads * BENCH_SCALING_PAGES * BENCH_PAGE_SIZE;
+        }
+    }
+
+    /* the master serves the pages until the others are done */
+    dsm_barrier_wait(&barrier);
+    return 0;
+}
+
+/*
+ * prints the results as a JSON array of objects or as CSV with a header
+ * Returns void
+ */
+void benchPrint(const benchResult* pResults, unsigned numResults)
+{
+    const benchResult*  pResult = NULL;
+    unsigned            i = 0;
+
+    if (config.csv) {
+        printf("name,node,threads,count,seconds,rate,mb_per_sec,mean_us,p50_us,p90_us,"
+                "p99_us,p999_us,max_us,faults_per_op,pages_per_op\n");
+    }
+    else {
+        printf("[\n");
+    }
+    for (i = 0; i < numResults; i += 1) {
+        pResult = &pResults[i];
+        printf(config.csv ? "%s,%d,%d,%llu,%.6f,%.1f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f,%.6f,%.6f\n" :
+                "  {\"name\": \"%s\", \"node\": %d, \"threads\": %d, \"count\": %llu, "
+                "\"seconds\": %.6f, \"rate\": %.1f, \"mb_per_sec\": %.1f, "
+                "\"mean_us\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, "
+                "\"p999_us\": %.2f, \"max_us\": %.2f, \"faults_per_op\": %.6f, "
+                "\"pages_per_op\": %.6f}",
+                pResult->name, pResult->nodeId, pResult->threads, pResult->count,
+                pResult->seconds, pResult->rate, pResult->mbPerSec, pResult->meanUs,
+                pResult->p50Us, pResult->p90Us, pResult->p99Us, pResult->p999Us,
+                pResult->maxUs, pResult->faultsPerOp, pResult->pagesPerOp);
+        if (!config.csv) {
+            printf((i + 1 < numResults) ? ",\n" : "\n");
+        }
+    }
+    if (!config.csv) {
+        printf("]\n");
+    }
+}
+
+int main(int argc, char** argv)
+{
+    benchResult         results[256];
+    unsigned            numResults = 0;
+    unsigned            scanPages = 0;
+    unsigned            scalingPages = 0;
+    unsigned            threads = 0;
+    pid_t               pids[BENCH_NUM_NODES];
+    int                 pipeFds[2];
+    int                 status = 0;
+    int                 failed = 0;
+    int                 opt = 0;
+    int                 i = 0;
+
+    config.basePort = 20000 + 2 * (getpid() % 10000);
+    while (-1 != (opt = getopt(argc, argv, "f:n:s:d:t:p:uT"))) {
+        switch (opt) {
+            case 'f':
+                config.csv = (0 == strcmp(optarg, "csv"));
+                break;
+            case 'n':
+                config.numFaults = strtoul(optarg, NULL, 0);
+                break;
+            case 's':
+                config.scanMb = strtoul(optarg, NULL, 0);
+                break;
+            case 'd':
+                config.durationMs = strtoul(optarg, NULL, 0);
+                break;
+            case 't':
+                config.maxThreads = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                config.basePort = atoi(optarg);
+                break;
+            case 'u':
+                config.useUffd = 1;
+                break;
+            case 'T':
+                config.useTcp = 1;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-f json|csv] [-n faults] [-s scan_mb] "
+                        "[-d ms] [-t threads] [-p base_port] [-u] [-T]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (0 == config.numFaults || 0 == config.maxThreads ||
+            config.maxThreads > BENCH_MAX_THREADS) {
+        fprintf(stderr, "bench: faults must be > 0 and threads 1 to %d\n",
+                BENCH_MAX_THREADS);
+        return 1;
+    }
+    scanPages = config.scanMb * (1024 * 1024 / BENCH_PAGE_SIZE);
+    for (threads = 1; threads <= config.maxThreads; threads *= 2) {
+        scalingPages += threads * BENCH_SCALING_PAGES;
+    }
+
+    /* the nodes are processes of their own; the library is set up in each */
+    if (-1 == pipe(pipeFds)) {
+        perror("bench: pipe");
+        return 1;
+    }
+    fflush(stdout);
+    for (i = 0; i < BENCH_NUM_NODES; i += 1) {
+        pids[i] = fork();
+        if (0 == pids[i]) {
+            close(pipeFds[0]);
+            resultFd = pipeFds[1];
+            nodeId = i;
+            benchNode(config.numFaults, scanPages, scalingPages);
+            _exit(0);
+        }
+    }
+    close(pipeFds[1]);
+
+    while (numResults < sizeof(results) / sizeof(results[0]) &&
+            sizeof(benchResult) == read(pipeFds[0], &results[numResults],
+                sizeof(benchResult))) {
+        numResults += 1;
+    }
+    for (i = 0; i < BENCH_NUM_NODES; i += 1) {
+        if (-1 == waitpid(pids[i], &status, 0) || !WIFEXITED(status) ||
+                0 != WEXITSTATUS(status)) {
+            failed = 1;
+        }
+    }
+    benchPrint(results, numResults);
+    if (failed) {
+        fprintf(stderr, "bench: a node failed\n");
+        return 1;
+    }
+    return 0;
+}
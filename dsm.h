@@ -1,8 +1,189 @@
 #ifndef DSM_H
 #define DSM_H
 
+#include <stddef.h>
+
 void initializeDSM(int ismaster, char * masterip, int mport, char *otherip, int oport,
         unsigned numpagestoalloc);
+/* node 0 is the master; ipaddrs/ports list every node by node id (2-32 nodes) */
+void initializeDSMCluster(int nodeid, int numnodes, char **ipaddrs, int *ports,
+        unsigned numpagestoalloc);
 void * getsharedregion();
 
+/* options; set before initializing */
+#define DSM_OPT_FAULT_ENGINE        (1)     /* how faults on the region are caught */
+#define DSM_FAULT_ENGINE_SIGSEGV    (0)     /* SIGSEGV handler and mprotect (default) */
+#define DSM_FAULT_ENGINE_UFFD       (1)     /* userfaultfd, falls back to SIGSEGV */
+#define DSM_OPT_PAGE_SIZE           (2)     /* coherence unit in bytes, power of two
+                                               from 4KB to 2MB; honoured on the
+                                               master, which the others follow.
+                                               2MB units are backed by huge pages */
+#define DSM_OPT_PREFETCH_MAX_PAGES  (3)     /* most pages read ahead on a sequential or
+                                               strided read fault, 0 to 32, default
+                                               16; 0 disables prefetching */
+#define DSM_OPT_WRITE_MODE          (4)     /* honoured on the master like the page size */
+#define DSM_WRITE_MODE_SINGLE       (0)     /* one writer of a page at a time (default) */
+#define DSM_WRITE_MODE_MULTI        (1)     /* concurrent writers, merged at dsm_sync() */
+#define DSM_WRITE_MODE_LAZY_RELEASE (2)     /* concurrent writers, seen by the next
+                                               dsm_acquire() of a lock released after */
+#define DSM_OPT_COMPRESSION         (5)     /* pages on the wire; the lesser of the
+                                               sender's and the requester's is used */
+#define DSM_COMPRESS_NONE           (0)     /* pages sent as they are (default) */
+#define DSM_COMPRESS_FILL           (1)     /* pages of one repeated byte sent as it */
+#define DSM_COMPRESS_LZ             (2)     /* fill, else LZ77 if the page shrinks */
+#define DSM_OPT_HOLD_WINDOW_US      (6)     /* longest time in microseconds a page
+                                               that came here for writing is kept
+                                               before it is given up, default 1000;
+                                               the window of each page grows while
+                                               it ping-pongs. 0 disables it */
+#define DSM_OPT_STATS_DUMP_MS       (7)     /* prints the stats of dsm_get_stats() to
+                                               stderr every so many ms, default 0
+                                               (never) */
+#define DSM_OPT_LOCAL_TRANSPORT     (8)     /* peers on this host are reached over a
+                                               unix socket instead of tcp, default
+                                               1; 0 always uses tcp */
+
+int dsm_setopt(int option, long value);
+
+/* backs the region of the master with the file at path, mapped read/write
+ * and extended with zeros to the size of the region if shorter, so that the
+ * data in it is there from the start and read in as it is used; set before
+ * initializing the master, single writer mode only. The file has the pages
+ * while the master owns them or holds a copy of them */
+int dsm_set_backing_file(const char *path);
+
+/* brings the pages of [addr, addr + len) local with the access given in as
+ * few round trips as possible; a hint, pages left out are fetched on access */
+#define DSM_ACCESS_READ             (0)
+#define DSM_ACCESS_WRITE            (1)
+
+int dsm_prefetch(void *addr, size_t len, int access);
+
+/* tells how the pages of [addr, addr + len) are going to be used; the
+ * first four are kept for the pages until advised otherwise, the last two
+ * are acted on at once */
+#define DSM_ADVICE_NORMAL           (0)     /* read ahead strides seen (default) */
+#define DSM_ADVICE_SEQUENTIAL       (1)     /* read in order: read ahead the full
+                                               window from the first read fault */
+#define DSM_ADVICE_RANDOM           (2)     /* read in no order: no read ahead */
+#define DSM_ADVICE_READ_MOSTLY      (3)     /* seldom written: the owner sends
+                                               copies without holding the page */
+#define DSM_ADVICE_WILLNEED         (4)     /* fetch read-only copies now, in bulk */
+#define DSM_ADVICE_DONTNEED         (5)     /* drop the copies, give the pages owned
+                                               back to the master, free the memory */
+
+int dsm_advise(void *addr, size_t len, int advice);
+
+/* with DSM_WRITE_MODE_MULTI: sends this node's modifications to the homes of
+ * the pages and drops the copies of pages homed elsewhere, so that the
+ * modifications other nodes synced before are seen; no-op otherwise */
+int dsm_sync(void);
+
+/* distributed locks, ids from 0 to DSM_MAX_LOCKS - 1. With
+ * DSM_WRITE_MODE_LAZY_RELEASE the writes made before a release are seen
+ * after the next acquire of the same lock, and only the copies they made
+ * stale are dropped; with DSM_WRITE_MODE_MULTI release syncs the writes and
+ * acquire drops all copies */
+#define DSM_MAX_LOCKS               (1024)
+int dsm_acquire(int lockId);
+int dsm_release(int lockId);
+
+/* A node keeps a lock it released until another node asks for it, so
+ * acquiring it again there costs no message. Locks and rwlocks share the
+ * lock ids; a lock is used by the thread that locked it until unlocked. */
+typedef struct {
+    int         id;
+}dsm_lock_t;
+
+typedef struct {
+    int         id;
+}dsm_rwlock_t;
+
+/* count threads, on any of the nodes, wait for each other at the barrier */
+#define DSM_MAX_BARRIERS            (64)
+typedef struct {
+    int         id;
+    unsigned    count;
+}dsm_barrier_t;
+
+int dsm_lock_init(dsm_lock_t *lock, int id);
+int dsm_lock(dsm_lock_t *lock);
+int dsm_unlock(dsm_lock_t *lock);
+int dsm_rwlock_init(dsm_rwlock_t *rwlock, int id);
+int dsm_rwlock_rdlock(dsm_rwlock_t *rwlock);
+int dsm_rwlock_wrlock(dsm_rwlock_t *rwlock);
+int dsm_rwlock_unlock(dsm_rwlock_t *rwlock);
+int dsm_barrier_init(dsm_barrier_t *barrier, int id, unsigned count);
+int dsm_barrier_wait(dsm_barrier_t *barrier);
+
+/* atomic operations on 32 and 64 bit words of the shared region, aligned to
+ * their size. They run at the owner of the page, which keeps it, instead of
+ * bringing the page here; with multiple writers at the home of the page, and
+ * the copy of the page here sees them like the writes of other nodes. The
+ * old value is stored in *old unless old is NULL. */
+int dsm_atomic_fetch_add32(void *addr, unsigned int val, unsigned int *old);
+int dsm_atomic_fetch_add64(void *addr, unsigned long long val, unsigned long long *old);
+int dsm_atomic_exchange32(void *addr, unsigned int val, unsigned int *old);
+int dsm_atomic_exchange64(void *addr, unsigned long long val, unsigned long long *old);
+/* return 1 if the word held *expected and was set to desired, else 0 with
+ * *expected set to the value the word holds */
+int dsm_atomic_compare_exchange32(void *addr, unsigned int *expected,
+        unsigned int desired);
+int dsm_atomic_compare_exchange64(void *addr, unsigned long long *expected,
+        unsigned long long desired);
+
+/* runtime statistics, kept per thread without locks and summed on demand.
+ * Latencies are in histograms of power of two buckets of nanoseconds:
+ * bucket i counts the samples from 2^i to 2^(i+1) - 1 ns, the last bucket
+ * all the longer ones. */
+#define DSM_STATS_BUCKETS           (32)
+typedef struct {
+    unsigned long long  count;
+    unsigned long long  sum_ns;
+    unsigned long long  buckets[DSM_STATS_BUCKETS];
+}dsm_hist_t;
+
+/* phases of the fault path timed; the phases are only timed within a fault */
+#define DSM_PHASE_FAULT             (0)     /* the whole fault, as the thread sees it */
+#define DSM_PHASE_CONNECT           (1)     /* connecting to a peer */
+#define DSM_PHASE_SEND              (2)     /* sending a request */
+#define DSM_PHASE_WAIT              (3)     /* waiting for and reading its response */
+#define DSM_PHASE_COPY              (4)     /* copying a page rcvd into the region */
+#define DSM_PHASE_MPROTECT          (5)     /* changing the access of a page */
+#define DSM_NUM_PHASES              (6)
+
+typedef struct {
+    unsigned long long  read_faults;
+    unsigned long long  write_faults;
+    unsigned long long  pages_sent;
+    unsigned long long  pages_rcvd;
+    unsigned long long  msgs_sent;
+    unsigned long long  msgs_rcvd;
+    unsigned long long  bytes_sent;     /* on the wire, headers included */
+    unsigned long long  bytes_rcvd;
+    dsm_hist_t          phases[DSM_NUM_PHASES];
+}dsm_stats_t;
+
+/* sums the statistics of the threads of this node since it started */
+int dsm_get_stats(dsm_stats_t *stats);
+/* the latency below which pct percent of the samples lie, rounded up to the
+ * end of its bucket; 0 if there are none */
+unsigned long long dsm_hist_percentile(const dsm_hist_t *hist, double pct);
+
+/* records the faults, page requests, transfers, installs and invalidations
+ * of this node in a binary file at path, one per node, until stopped; read
+ * it with the dsmtrace tool */
+int dsm_trace_start(const char *path);
+int dsm_trace_stop(void);
+
+/* appends the pages this node owns that changed since its last checkpoint
+ * to the file at path, one per node, and syncs it to disk. Called by every
+ * node at the same point with no page moving meanwhile: between barriers,
+ * after dsm_sync() with multiple writers */
+int dsm_checkpoint(const char *path);
+/* restores the pages of this node from its checkpoint file at path, the
+ * latest copy of each; called by every node right after it initialized,
+ * then a barrier before the region is used */
+int dsm_restore(const char *path);
+
 #endif
@@ -0,0 +1,227 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Advice on the use of ranges of the shared region. The lasting advice of
+ * a page is a byte of dsmPageAdvice, reserved alongside the page table:
+ * the fault path reads ahead at once on sequential pages and never on
+ * random ones, and the owner of a read mostly page neither holds it nor
+ * declines it to a prefetch. Willneed and dontneed are acted on when
+ * given: the pages are fetched in bulk, or the copies dropped and the
+ * pages owned handed back to master, which takes them with a batch fetch.
+ */
+
+/*
+ * frees the memory of a page no longer accessible here. With userfaultfd
+ * it was dropped when its access was revoked; a shared region keeps it
+ * until it is removed through the writable alias. The file backing the
+ * region of master is left as it is.
+ * Returns void
+ */
+void dsmReleasePage(uInt32 pageOffset)
+{
+    if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine || NULL == pDsmRegionAlias ||
+            (dsmMmapInfo.isMaster && NULL != dsmConfig.pBackingFile)) {
+        return;
+    }
+    madvise(DSM_PAGE_ALIAS(pageOffset), DSM_PAGE_SIZE, MADV_REMOVE);
+}
+
+/*
+ * drops the read-only copy of a page and frees its memory; the owner may
+ * still count this node in the copyset, its invalidation then finds the
+ * copy gone. A copy written since the last dsm_sync(), or whose lock is
+ * busy, is kept.
+ * Returns true if the copy was dropped
+ */
+bool dsmDiscardCopy(uInt32 pageOffset)
+{
+    bool        isDropped = false;
+
+    if (DSM_PTE(pageOffset).owner ||
+            DSM_PAGE_READ_ONLY != DSM_PTE(pageOffset).pageStatus ||
+            0 != dsmTryLockPte(pageOffset)) {
+        return false;
+    }
+    if (!DSM_PTE(pageOffset).owner && NULL == DSM_PAGE_META(pageOffset).pTwin &&
+            DSM_PAGE_READ_ONLY == DSM_PTE(pageOffset).pageStatus) {
+        dsmLockPageProt(pageOffset);
+        dsmSetPageAccess(pageOffset, PROT_NONE);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_NOT_PRESENT;
+        dsmUnlockPageProt(pageOffset);
+        dsmReleasePage(pageOffset);
+        DSM_TRACE_EVENT(DSM_EVENT_INVALIDATED, pageOffset, DSM_TRACE_NO_PEER, 0, 0);
+        isDropped = true;
+    }
+    dsmUnlockPte(pageOffset);
+    return isDropped;
+}
+
+/*
+ * sends master the runs of pages filled in after the msg header
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmSendReclaim(dsmMsg* pMsg, uInt32 numRanges)
+{
+    dsmPageReclaimInfo  reclaimInfo;
+
+    reclaimInfo.numRanges = numRanges;
+    memcpy(pMsg->payload, &reclaimInfo, sizeof(dsmPageReclaimInfo));
+    pMsg->msgType = DSM_MSG_PAGE_RECLAIM;
+    pMsg->payloadLen = sizeof(dsmPageReclaimInfo) + numRanges * sizeof(dsmPageRange);
+    return dsmSendToPeer(&dsmPeers[DSM_MASTER_NODE_ID], pMsg);
+}
+
+/*
+ * asks master to take back the pages of [firstPage, firstPage + numPages)
+ * owned here, with the runs of them, DSM_MAX_BATCH_PAGES runs a msg; the
+ * pages are marked to have their memory freed when they leave. Master
+ * fetches them when it gets to it; the msg is not answered.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmReclaimPages(uInt32 firstPage, uInt32 numPages)
+{
+    dsmPageRange*       pRanges = NULL;
+    dsmMsg*             pMsg = NULL;
+    uInt32              numRanges = 0;
+    uInt32              page = 0;
+    int32               retval = 0;
+
+    pMsg = (dsmMsg*)malloc(sizeof(dsmMsg) + sizeof(dsmPageReclaimInfo) +
+            DSM_MAX_BATCH_PAGES * sizeof(dsmPageRange));
+    if (NULL == pMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for reclaim of "
+                "[%u] pages\n", numPages);
+        return -1;
+    }
+    pRanges = (dsmPageRange*)(pMsg->payload + sizeof(dsmPageReclaimInfo));
+
+    for (page = firstPage; page < firstPage + numPages; page += 1) {
+        if (!DSM_PTE(page).owner) {
+            continue;
+        }
+        __sync_fetch_and_or(&DSM_PTE(page).pteFlags, DSM_PTE_FLAG_RELEASE);
+        if (numRanges > 0 && page == pRanges[numRanges - 1].firstPage +
+                pRanges[numRanges - 1].numPages) {
+            pRanges[numRanges - 1].numPages += 1;
+            continue;
+        }
+        if (DSM_MAX_BATCH_PAGES == numRanges) {
+            if (-1 == dsmSendReclaim(pMsg, numRanges)) {
+                retval = -1;
+            }
+            numRanges = 0;
+        }
+        pRanges[numRanges].firstPage = page;
+        pRanges[numRanges].numPages = 1;
+        numRanges += 1;
+    }
+    if (numRanges > 0 && -1 == dsmSendReclaim(pMsg, numRanges)) {
+        retval = -1;
+    }
+    free(pMsg);
+    return retval;
+}
+
+/*
+ * master: fetches the pages a node handed back, owned for writing; the
+ * arg is a copy of the msg payload
+ * Returns NULL
+ */
+void* dsmReclaimThread(void* pArg)
+{
+    dsmPageReclaimInfo* pInfo = (dsmPageReclaimInfo*)pArg;
+
+    /* a page missed stays where it is, freed when it next leaves */
+    if (0 != dsmFetchPages((dsmPageRange*)(pInfo + 1), pInfo->numRanges, true)) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "Pages of [%u] ranges not all reclaimed\n",
+                pInfo->numRanges);
+    }
+    free(pArg);
+    return NULL;
+}
+
+/*
+ * master: takes back the pages a node has no more use for; the fetch sends
+ * reqs to that node, so it runs detached
+ * Returns 0 on success, -1 on failure
+ */
+int dsmPageReclaimHandler(void* payload)
+{
+    dsmPageReclaimInfo  reclaimInfo;
+    size_t              len = 0;
+    void*               pCopy = NULL;
+
+    dsmEnterFunc();
+    memcpy(&reclaimInfo, payload, sizeof(dsmPageReclaimInfo));
+    if (reclaimInfo.numRanges > DSM_MAX_BATCH_PAGES) {
+        dsmExitFunc();
+        return -1;
+    }
+    len = sizeof(dsmPageReclaimInfo) + reclaimInfo.numRanges * sizeof(dsmPageRange);
+    pCopy = malloc(len);
+    if (NULL == pCopy) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for reclaim of "
+                "[%u] ranges\n", reclaimInfo.numRanges);
+        dsmExitFunc();
+        return -1;
+    }
+    memcpy(pCopy, payload, len);
+    dsmExitFunc();
+    return dsmRunDetached(dsmReclaimThread, pCopy);
+}
+
+/*
+ * Advises how the pages of [addr, addr + len) are going to be used, one of
+ * DSM_ADVICE_*; the advice given last for a page holds. Willneed is a hint
+ * as dsm_prefetch() is. Dontneed drops the read-only copies here; in the
+ * single writer mode the pages owned here go back to master, which frees
+ * their memory here once they are gone.
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_advise(void* addr, size_t len, int advice)
+{
+    uInt8*          pStart = (uInt8*)addr;
+    uInt8*          pRegion = (uInt8*)pDsmSharedRegion;
+    uInt32          firstPage = 0;
+    uInt32          numPages = 0;
+    uInt32          page = 0;
+    int32           retval = 0;
+
+    dsmEnterFunc();
+    if (NULL == pRegion || pStart < pRegion || 0 == len ||
+            len > (size_t)dsmMmapInfo.numPagesToAlloc * DSM_PAGE_SIZE ||
+            pStart + len > pRegion + (size_t)dsmMmapInfo.numPagesToAlloc * DSM_PAGE_SIZE ||
+            advice < DSM_ADVICE_NORMAL || advice > DSM_ADVICE_DONTNEED) {
+        errno = EINVAL;
+        dsmExitFunc();
+        return -1;
+    }
+    firstPage = (pStart - pRegion) / DSM_PAGE_SIZE;
+    numPages = ((pStart + len - pRegion - 1) / DSM_PAGE_SIZE) - firstPage + 1;
+
+    switch (advice) {
+        case DSM_ADVICE_WILLNEED:
+            retval = dsm_prefetch(addr, len, DSM_ACCESS_READ);
+            break;
+        case DSM_ADVICE_DONTNEED:
+            for (page = firstPage; page < firstPage + numPages; page += 1) {
+                dsmDiscardCopy(page);
+            }
+            if (!dsmMmapInfo.isMaster && !DSM_MULTI_WRITER()) {
+                retval = dsmReclaimPages(firstPage, numPages);
+            }
+            break;
+        default:
+            memset((void*)&DSM_PAGE_ADVICE(firstPage), advice, numPages);
+            /* the page cache reads ahead a backing file likewise */
+            madvise(DSM_PAGE_ADDR(firstPage), (size_t)numPages * DSM_PAGE_SIZE,
+                    (DSM_ADVICE_SEQUENTIAL == advice) ? MADV_SEQUENTIAL :
+                    (DSM_ADVICE_RANDOM == advice) ? MADV_RANDOM : MADV_NORMAL);
+            break;
+    }
+    dsmExitFunc();
+    return retval;
+}
@@ -0,0 +1,475 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Atomic operations on words of the shared region run where the page is
+ * instead of moving the page to the caller: an owner runs them on its copy
+ * and keeps the page, any other node ships the operation to the owner as a
+ * small msg, following the owner hints like a page request. With multiple
+ * writers the home copy of a page is the one that counts, so operations run
+ * at the home, which notes the write like a merged diff.
+ */
+
+static __thread dsmAtomicInfo   dsmAtomicRsp;   /* rsp rcvd by this thread */
+
+/*
+ * runs an operation on a word of size bytes at pAddr of this node's memory
+ * Returns the value the word held before
+ */
+uInt64 dsmAtomicExec(void* pAddr, uInt32 op, uInt32 size, uInt64 operand,
+        uInt64 compare)
+{
+    uInt32*     pWord32 = (uInt32*)pAddr;
+    uInt64*     pWord64 = (uInt64*)pAddr;
+    uInt32      old32 = 0;
+    uInt32      prev32 = 0;
+    uInt64      old64 = 0;
+    uInt64      prev64 = 0;
+
+    if (sizeof(uInt32) == size) {
+        if (DSM_ATOMIC_OP_FETCH_ADD == op) {
+            return __sync_fetch_and_add(pWord32, (uInt32)operand);
+        }
+        if (DSM_ATOMIC_OP_COMPARE_EXCHANGE == op) {
+            return __sync_val_compare_and_swap(pWord32, (uInt32)compare, (uInt32)operand);
+        }
+        old32 = *(volatile uInt32*)pWord32;
+        while (old32 != (prev32 = __sync_val_compare_and_swap(pWord32, old32,
+                        (uInt32)operand))) {
+            old32 = prev32;
+        }
+        return old32;
+    }
+
+    if (DSM_ATOMIC_OP_FETCH_ADD == op) {
+        return __sync_fetch_and_add(pWord64, operand);
+    }
+    if (DSM_ATOMIC_OP_COMPARE_EXCHANGE == op) {
+        return __sync_val_compare_and_swap(pWord64, compare, operand);
+    }
+    old64 = *(volatile uInt64*)pWord64;
+    while (old64 != (prev64 = __sync_val_compare_and_swap(pWord64, old64, operand))) {
+        old64 = prev64;
+    }
+    return old64;
+}
+
+/*
+ * owner: runs an operation shipped by another node on the page, which
+ * stays here; the read-only copies are invalidated first. A non-owner, or
+ * an owner busy with the page, answers with a redirect like a page request.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmAtomicAtOwner(dsmAtomicInfo* pInfo)
+{
+    uInt32      pageOffset = pInfo->pageOffset;
+    uInt8*      pageBaseAddr = NULL;
+
+    pInfo->status = DSM_ATOMIC_STATUS_REDIRECT;
+    pInfo->ownerId = dsmMmapInfo.nodeId;
+    pInfo->ownerVersion = DSM_PTE(pageOffset).ownerVersion;
+    if (!DSM_PTE(pageOffset).owner) {
+        pInfo->ownerId = DSM_PTE(pageOffset).probOwner;
+        return 0;
+    }
+    if (0 != dsmTryLockPte(pageOffset)) {
+        return 0;
+    }
+    if (!DSM_PTE(pageOffset).owner) {
+        pInfo->ownerId = DSM_PTE(pageOffset).probOwner;
+        pInfo->ownerVersion = DSM_PTE(pageOffset).ownerVersion;
+        dsmUnlockPte(pageOffset);
+        return 0;
+    }
+
+    if (DSM_PAGE_READ_ONLY == DSM_PTE(pageOffset).pageStatus) {
+        if (-1 == dsmInvalidateCopies(pageOffset)) {
+            pInfo->status = DSM_ATOMIC_STATUS_FAILED;
+            dsmUnlockPte(pageOffset);
+            return -1;
+        }
+        dsmSetPageAccess(pageOffset, PROT_READ | PROT_WRITE);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_PRESENT;
+    }
+    /* a page never touched here is not mapped yet with userfaultfd; this
+     * thread must not fault on it while it holds the page lock */
+    if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+        dsmUffdPopulatePage(pageOffset, PROT_READ | PROT_WRITE);
+    }
+    DSM_PAGE_META(pageOffset).writeTimeMs = dsmNowMs();
+
+    pageBaseAddr = DSM_PAGE_ADDR(pageOffset);
+    pInfo->result = dsmAtomicExec(pageBaseAddr + pInfo->offset, pInfo->op,
+            pInfo->size, pInfo->operand, pInfo->compare);
+    pInfo->status = DSM_ATOMIC_STATUS_DONE;
+
+    dsmWakePte(pageOffset);
+    dsmUnlockPte(pageOffset);
+    return 0;
+}
+
+/*
+ * home, with multiple writers: runs an operation on the home copy of the
+ * page and bumps its version, as dsmApplyDiff() does for a diff
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmAtomicAtHome(dsmAtomicInfo* pInfo)
+{
+    uInt32      pageOffset = pInfo->pageOffset;
+    uInt8*      pageBaseAddr = NULL;
+    bool        isReadOnly = false;
+
+    if (DSM_HOME_NODE(pageOffset) != dsmMmapInfo.nodeId ||
+            !DSM_PTE(pageOffset).owner) {
+        pInfo->status = DSM_ATOMIC_STATUS_FAILED;
+        return -1;
+    }
+
+    pageBaseAddr = DSM_PAGE_ADDR(pageOffset);
+    dsmLockPageProt(pageOffset);
+    isReadOnly = (DSM_PAGE_READ_ONLY == DSM_PTE(pageOffset).pageStatus);
+    if (isReadOnly) {
+        dsmSetPageAccess(pageOffset, PROT_READ | PROT_WRITE);
+    }
+    else if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+        dsmUffdPopulatePage(pageOffset, PROT_READ | PROT_WRITE);
+    }
+    pInfo->result = dsmAtomicExec(pageBaseAddr + pInfo->offset, pInfo->op,
+            pInfo->size, pInfo->operand, pInfo->compare);
+    if (isReadOnly) {
+        dsmSetPageAccess(pageOffset, PROT_READ);
+        __sync_fetch_and_or(&DSM_PTE(pageOffset).pteFlags, DSM_PTE_FLAG_HOME_DIRTY);
+    }
+    pInfo->version = __sync_add_and_fetch(&DSM_PAGE_META(pageOffset).pageVersion, 1);
+    dsmUnlockPageProt(pageOffset);
+    pInfo->status = DSM_ATOMIC_STATUS_DONE;
+    return 0;
+}
+
+/*
+ * runs an operation shipped by another node and answers with the value the
+ * word held before, or with a redirect. The invalidations sent by an owner
+ * are handled without further requests, so it may send them from here.
+ * Returns 0 on success, -1 on failure
+ */
+int dsmAtomicReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmAtomicInfo       atomicInfo;
+    uInt8               msgBuf[sizeof(dsmMsg) + sizeof(dsmAtomicInfo)];
+    dsmMsg*             pMsg = (dsmMsg*)msgBuf;
+
+    dsmEnterFunc();
+    memcpy(&atomicInfo, payload, sizeof(dsmAtomicInfo));
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Atomic op [%u] on page with offset [%u] at "
+            "[%u]\n", atomicInfo.op, atomicInfo.pageOffset, atomicInfo.offset);
+
+    if (atomicInfo.pageOffset >= dsmMmapInfo.numPagesToAlloc ||
+            (sizeof(uInt32) != atomicInfo.size && sizeof(uInt64) != atomicInfo.size) ||
+            atomicInfo.offset > DSM_PAGE_SIZE - atomicInfo.size ||
+            0 != atomicInfo.offset % atomicInfo.size ||
+            atomicInfo.op > DSM_ATOMIC_OP_COMPARE_EXCHANGE) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid atomic op [%u] on page with "
+                "offset [%u] at [%u]\n", atomicInfo.op, atomicInfo.pageOffset,
+                atomicInfo.offset);
+        atomicInfo.status = DSM_ATOMIC_STATUS_FAILED;
+    }
+    else if (DSM_MULTI_WRITER()) {
+        dsmAtomicAtHome(&atomicInfo);
+    }
+    else {
+        dsmAtomicAtOwner(&atomicInfo);
+    }
+
+    pMsg->msgType = DSM_MSG_ATOMIC_RSP;
+    pMsg->payloadLen = sizeof(dsmAtomicInfo);
+    memcpy(pMsg->payload, &atomicInfo, sizeof(dsmAtomicInfo));
+    if (-1 == dsmReplyMsg(pConn, pMsg)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_ATOMIC_RSP]\n");
+        dsmExitFunc();
+        return -1;
+    }
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * keeps the rsp for the thread that shipped the operation and records the
+ * owner hint of a redirect
+ * Returns 0 on success, -1 on failure
+ */
+int dsmAtomicRspHandler(void* payload)
+{
+    memcpy(&dsmAtomicRsp, payload, sizeof(dsmAtomicInfo));
+    if (DSM_ATOMIC_STATUS_REDIRECT == dsmAtomicRsp.status) {
+        dsmUpdateProbOwner(dsmAtomicRsp.pageOffset, dsmAtomicRsp.ownerId,
+                dsmAtomicRsp.ownerVersion);
+    }
+    return 0;
+}
+
+/*
+ * ships an operation to the node it runs at: with multiple writers the
+ * home of the page, else its owner, found as dsmRequestPage() finds it.
+ * The page lock is held meanwhile so that the page does not come here.
+ * Returns 0 on success with the rsp in pInfo, 1 if the operation is to be
+ * tried again (the page is owned here now, or the owner was not found),
+ * -1 on failure
+ */
+int32 dsmAtomicAskOwner(dsmAtomicInfo* pInfo)
+{
+    uInt32              pageOffset = pInfo->pageOffset;
+    uInt32              target = 0;
+    uInt32              homeId = 0;
+    bool                askedHome = false;
+    int32               hops = 0;
+    int32               retval = 1;
+    uInt8               msgBuf[sizeof(dsmMsg) + sizeof(dsmAtomicInfo)];
+    dsmMsg*             pMsg = (dsmMsg*)msgBuf;
+
+    pMsg->msgType = DSM_MSG_ATOMIC_REQ;
+    pMsg->payloadLen = sizeof(dsmAtomicInfo);
+    memcpy(pMsg->payload, pInfo, sizeof(dsmAtomicInfo));
+    homeId = DSM_HOME_NODE(pageOffset);
+
+    if (DSM_MULTI_WRITER()) {
+        if (-1 == dsmSendAndRecv(&dsmPeers[homeId], pMsg) ||
+                DSM_ATOMIC_STATUS_DONE != dsmAtomicRsp.status) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Atomic op failed on page with offset "
+                    "[%u]\n", pageOffset);
+            return -1;
+        }
+        /* told of at the next release like a merged diff */
+        dsmNoteWrite(pageOffset, dsmAtomicRsp.version);
+        memcpy(pInfo, &dsmAtomicRsp, sizeof(dsmAtomicInfo));
+        return 0;
+    }
+
+    dsmLockPte(pageOffset);
+    if ((__sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags,
+                    ~DSM_PTE_FLAG_INV_PENDING) & DSM_PTE_FLAG_INV_PENDING) &&
+            !DSM_PTE(pageOffset).owner &&
+            DSM_PAGE_READ_ONLY == DSM_PTE(pageOffset).pageStatus) {
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_NOT_PRESENT;
+    }
+    while (DSM_PAGE_REQUESTED == DSM_PTE(pageOffset).pageStatus ||
+            DSM_PAGE_IN_TRANSFER == DSM_PTE(pageOffset).pageStatus) {
+        dsmWaitPte(pageOffset);
+    }
+    if (DSM_PTE(pageOffset).owner) {
+        dsmUnlockPte(pageOffset);
+        return 1;
+    }
+
+    target = DSM_PTE(pageOffset).probOwner;
+    if (target == dsmMmapInfo.nodeId) {
+        target = homeId;
+    }
+    for (hops = 0; hops < DSM_MAX_FAULT_HOPS; hops += 1) {
+        askedHome = askedHome || (target == homeId);
+        if (-1 == dsmSendAndRecv(&dsmPeers[target], pMsg) ||
+                DSM_ATOMIC_STATUS_FAILED == dsmAtomicRsp.status) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Atomic op failed on page with offset "
+                    "[%u]\n", pageOffset);
+            retval = -1;
+            break;
+        }
+        if (DSM_ATOMIC_STATUS_DONE == dsmAtomicRsp.status) {
+            memcpy(pInfo, &dsmAtomicRsp, sizeof(dsmAtomicInfo));
+            retval = 0;
+            break;
+        }
+
+        /* redirected; follow a newer hint, else ask the home node */
+        if (DSM_PTE(pageOffset).probOwner != target) {
+            target = DSM_PTE(pageOffset).probOwner;
+        }
+        else if (!askedHome && homeId != dsmMmapInfo.nodeId) {
+            target = homeId;
+        }
+        else {
+            /* the owner is busy with the page; back off */
+            usleep(DSM_BUSY_RETRY_US);
+        }
+    }
+    dsmUnlockPte(pageOffset);
+    if (1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "Owner of page with offset [%u] not found "
+                "in [%d] hops\n", pageOffset, DSM_MAX_FAULT_HOPS);
+    }
+    return retval;
+}
+
+/*
+ * runs an operation on the word of size bytes at pAddr of the shared region
+ * and stores the value the word held before in *pOld. An owner, or with
+ * multiple writers the home, runs it on its copy; a write fault there takes
+ * care of the read-only copies. Other nodes ship it.
+ * Returns 0 on success, -1 on failure with errno EINVAL for a word outside
+ * the shared region or not aligned to its size, EIO if it could not be run
+ */
+int32 dsmAtomicOp(void* pAddr, uInt32 op, uInt32 size, uInt64 operand,
+        uInt64 compare, uInt64* pOld)
+{
+    dsmAtomicInfo   atomicInfo;
+    uInt8*          pWord = (uInt8*)pAddr;
+    uInt8*          pRegion = (uInt8*)pDsmSharedRegion;
+    uInt32          pageOffset = 0;
+    int32           retval = 1;
+
+    dsmEnterFunc();
+    if (NULL == pRegion || pWord < pRegion ||
+            pWord + size > pRegion + (size_t)dsmMmapInfo.numPagesToAlloc * DSM_PAGE_SIZE ||
+            0 != (unsigned long)pWord % size) {
+        errno = EINVAL;
+        dsmExitFunc();
+        return -1;
+    }
+
+    pageOffset = (pWord - pRegion) / DSM_PAGE_SIZE;
+    memset(&atomicInfo, 0, sizeof(dsmAtomicInfo));
+    atomicInfo.pageOffset = pageOffset;
+    atomicInfo.offset = (pWord - pRegion) % DSM_PAGE_SIZE;
+    atomicInfo.op = op;
+    atomicInfo.size = size;
+    atomicInfo.operand = operand;
+    atomicInfo.compare = compare;
+
+    while (1 == retval) {
+        if (DSM_MULTI_WRITER() ? (DSM_HOME_NODE(pageOffset) == dsmMmapInfo.nodeId) :
+                DSM_PTE(pageOffset).owner) {
+            /* should the page leave meanwhile, the access faults it back */
+            *pOld = dsmAtomicExec(pWord, op, size, operand, compare);
+            dsmExitFunc();
+            return 0;
+        }
+        retval = dsmAtomicAskOwner(&atomicInfo);
+    }
+    if (-1 == retval) {
+        errno = EIO;
+        dsmExitFunc();
+        return -1;
+    }
+    *pOld = atomicInfo.result;
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Adds val to the 32 bit word at addr
+ * Returns 0 on success with the old value in *old, -1 on failure
+ */
+int dsm_atomic_fetch_add32(void* addr, unsigned int val, unsigned int* old)
+{
+    uInt64      prev = 0;
+
+    if (-1 == dsmAtomicOp(addr, DSM_ATOMIC_OP_FETCH_ADD, sizeof(uInt32), val, 0, &prev)) {
+        return -1;
+    }
+    if (NULL != old) {
+        *old = (uInt32)prev;
+    }
+    return 0;
+}
+
+/*
+ * Adds val to the 64 bit word at addr
+ * Returns 0 on success with the old value in *old, -1 on failure
+ */
+int dsm_atomic_fetch_add64(void* addr, unsigned long long val, unsigned long long* old)
+{
+    uInt64      prev = 0;
+
+    if (-1 == dsmAtomicOp(addr, DSM_ATOMIC_OP_FETCH_ADD, sizeof(uInt64), val, 0, &prev)) {
+        return -1;
+    }
+    if (NULL != old) {
+        *old = prev;
+    }
+    return 0;
+}
+
+/*
+ * Stores val in the 32 bit word at addr
+ * Returns 0 on success with the old value in *old, -1 on failure
+ */
+int dsm_atomic_exchange32(void* addr, unsigned int val, unsigned int* old)
+{
+    uInt64      prev = 0;
+
+    if (-1 == dsmAtomicOp(addr, DSM_ATOMIC_OP_EXCHANGE, sizeof(uInt32), val, 0, &prev)) {
+        return -1;
+    }
+    if (NULL != old) {
+        *old = (uInt32)prev;
+    }
+    return 0;
+}
+
+/*
+ * Stores val in the 64 bit word at addr
+ * Returns 0 on success with the old value in *old, -1 on failure
+ */
+int dsm_atomic_exchange64(void* addr, unsigned long long val, unsigned long long* old)
+{
+    uInt64      prev = 0;
+
+    if (-1 == dsmAtomicOp(addr, DSM_ATOMIC_OP_EXCHANGE, sizeof(uInt64), val, 0, &prev)) {
+        return -1;
+    }
+    if (NULL != old) {
+        *old = prev;
+    }
+    return 0;
+}
+
+/*
+ * Stores desired in the 32 bit word at addr if it holds *expected
+ * Returns 1 if stored, 0 if not with the value held in *expected, -1 on
+ * failure
+ */
+int dsm_atomic_compare_exchange32(void* addr, unsigned int* expected, unsigned int desired)
+{
+    uInt64      prev = 0;
+
+    if (NULL == expected) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (-1 == dsmAtomicOp(addr, DSM_ATOMIC_OP_COMPARE_EXCHANGE, sizeof(uInt32), desired,
+                *expected, &prev)) {
+        return -1;
+    }
+    if ((uInt32)prev == *expected) {
+        return 1;
+    }
+    *expected = (uInt32)prev;
+    return 0;
+}
+
+/*
+ * Stores desired in the 64 bit word at addr if it holds *expected
+ * Returns 1 if stored, 0 if not with the value held in *expected, -1 on
+ * failure
+ */
+int dsm_atomic_compare_exchange64(void* addr, unsigned long long* expected,
+        unsigned long long desired)
+{
+    uInt64      prev = 0;
+
+    if (NULL == expected) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (-1 == dsmAtomicOp(addr, DSM_ATOMIC_OP_COMPARE_EXCHANGE, sizeof(uInt64), desired,
+                *expected, &prev)) {
+        return -1;
+    }
+    if (prev == *expected) {
+        return 1;
+    }
+    *expected = prev;
+    return 0;
+}
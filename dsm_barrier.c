@@ -0,0 +1,365 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Barriers: each barrier is kept by a manager node,
+ * DSM_BARRIER_MANAGER(barrierId), which counts the threads arrived. An
+ * arrival is a release and the opening an acquire: the write notices of
+ * every arrival are merged and sent to every node with a thread waiting,
+ * less those of pages only the node itself wrote (dsm_lrc.c). The opening
+ * tells a node how many of its arrivals were counted so far, so a thread
+ * arrived for the next opening meanwhile keeps waiting. A waiter applies
+ * the notices, so the opening msg is served without sending any.
+ */
+
+static dsmBarrierInfo   dsmBarriers[DSM_MAX_BARRIERS];
+
+/*
+ * initializes the barriers, before the peers can arrive at them
+ */
+void dsmInitBarriers(void)
+{
+    uInt32      i = 0;
+
+    for (i = 0; i < DSM_MAX_BARRIERS; i += 1) {
+        pthread_mutex_init(&dsmBarriers[i].barrierMutex, NULL);
+        pthread_mutex_init(&dsmBarriers[i].openMutex, NULL);
+        pthread_mutex_init(&dsmBarriers[i].arriveMutex, NULL);
+        pthread_mutex_init(&dsmBarriers[i].waitMutex, NULL);
+        pthread_cond_init(&dsmBarriers[i].waitCondVar, NULL);
+    }
+}
+
+/*
+ * manager: counts a thread of nodeId arrived at a barrier for count
+ * threads with the notices of its release; the last one to arrive opens
+ * the barrier on every node with a thread waiting. The openings are sent
+ * in order, one at a time.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmBarrierArriveAt(uInt32 barrierId, uInt32 nodeId, uInt32 count,
+        const dsmWriteNotice* pNotices, uInt32 numNotices)
+{
+    dsmBarrierInfo*     pBarrier = &dsmBarriers[barrierId];
+    dsmBarrierMsgInfo   barrierInfo;
+    dsmNoticeSet        notices;
+    dsmWriteNotice      notice;
+    dsmMsg*             pMsg = NULL;
+    dsmMsg*             pLocal = NULL;
+    uInt32              counted[DSM_MAX_NODES];
+    uInt32              nodes = 0;
+    uInt32              i = 0;
+    int32               retval = 0;
+
+    pthread_mutex_lock(&pBarrier->barrierMutex);
+    retval = dsmMergeNotices(&pBarrier->notices, pNotices, numNotices, nodeId);
+    pBarrier->arrived += 1;
+    pBarrier->nodes |= DSM_NODE_BIT(nodeId);
+    pBarrier->counted[nodeId] += 1;
+    if (pBarrier->arrived < count) {
+        pthread_mutex_unlock(&pBarrier->barrierMutex);
+        return retval;
+    }
+
+    /* the arrivals at the next opening start over meanwhile */
+    nodes = pBarrier->nodes;
+    memcpy(counted, pBarrier->counted, sizeof(counted));
+    memcpy(&notices, &pBarrier->notices, sizeof(dsmNoticeSet));
+    memset(&pBarrier->notices, 0, sizeof(dsmNoticeSet));
+    pBarrier->arrived = 0;
+    pBarrier->nodes = 0;
+    pthread_mutex_lock(&pBarrier->openMutex);
+    pthread_mutex_unlock(&pBarrier->barrierMutex);
+
+    dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Barrier [%u] open with [%u] notices\n",
+            barrierId, notices.numNotices);
+    pMsg = (dsmMsg*)malloc(2 * DSM_MAX_NOTICE_MSG_LEN);
+    if (NULL == pMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                "bytes\n", 2 * DSM_MAX_NOTICE_MSG_LEN);
+        pthread_mutex_unlock(&pBarrier->openMutex);
+        free(notices.pNotices);
+        return -1;
+    }
+    pLocal = (dsmMsg*)((uInt8*)pMsg + DSM_MAX_NOTICE_MSG_LEN);
+    for (nodeId = 0; nodeId < dsmMmapInfo.numNodes; nodeId += 1) {
+        if (!(nodes & DSM_NODE_BIT(nodeId))) {
+            continue;
+        }
+        barrierInfo.barrierId = barrierId;
+        barrierInfo.nodeId = nodeId;
+        barrierInfo.count = count;
+        barrierInfo.arrivals = counted[nodeId];
+        barrierInfo.numNotices = 0;
+        for (i = 0; i < notices.numNotices; i += 1) {
+            if (DSM_NODE_BIT(nodeId) == notices.pNotices[i].writers) {
+                continue;
+            }
+            notice.pageOffset = notices.pNotices[i].pageOffset;
+            notice.version = notices.pNotices[i].version;
+            memcpy(pMsg->payload + sizeof(dsmBarrierMsgInfo) +
+                    barrierInfo.numNotices * sizeof(dsmWriteNotice), &notice,
+                    sizeof(dsmWriteNotice));
+            barrierInfo.numNotices += 1;
+        }
+        pMsg->msgType = DSM_MSG_BARRIER_DONE_REQ;
+        pMsg->payloadLen = sizeof(dsmBarrierMsgInfo) +
+            barrierInfo.numNotices * sizeof(dsmWriteNotice);
+        memcpy(pMsg->payload, &barrierInfo, sizeof(dsmBarrierMsgInfo));
+
+        if (nodeId == dsmMmapInfo.nodeId) {
+            memcpy(pLocal, pMsg, DSM_MSG_HDR_LEN + pMsg->payloadLen);
+        }
+        else if (-1 == dsmSendAndRecv(&dsmPeers[nodeId], pMsg)) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                    "[DSM_MSG_BARRIER_DONE_REQ]\n");
+            retval = -1;
+        }
+    }
+
+    /* opened here last, the local threads may go on to exit */
+    if (nodes & DSM_NODE_BIT(dsmMmapInfo.nodeId)) {
+        dsmBarrierOpened(pLocal->payload);
+    }
+    pthread_mutex_unlock(&pBarrier->openMutex);
+    free(pMsg);
+    free(notices.pNotices);
+    return retval;
+}
+
+/*
+ * a barrier opened: adds the notices that came with the opening to those
+ * not applied yet and wakes up the threads waiting at it
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmBarrierOpened(void* payload)
+{
+    dsmBarrierMsgInfo   barrierInfo;
+    dsmBarrierInfo*     pBarrier = NULL;
+    dsmWriteNotice*     pNotices = NULL;
+    int32               retval = 0;
+
+    memcpy(&barrierInfo, payload, sizeof(dsmBarrierMsgInfo));
+    if (barrierInfo.barrierId >= DSM_MAX_BARRIERS) {
+        return -1;
+    }
+    pBarrier = &dsmBarriers[barrierInfo.barrierId];
+
+    pthread_mutex_lock(&pBarrier->waitMutex);
+    if (barrierInfo.numNotices > 0) {
+        pNotices = (dsmWriteNotice*)realloc(pBarrier->pOpenNotices,
+                (pBarrier->numOpenNotices + barrierInfo.numNotices) *
+                sizeof(dsmWriteNotice));
+        if (NULL == pNotices) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                    "notices\n", barrierInfo.numNotices);
+            retval = -1;
+        }
+        else {
+            memcpy(pNotices + pBarrier->numOpenNotices,
+                    (uInt8*)payload + sizeof(dsmBarrierMsgInfo),
+                    barrierInfo.numNotices * sizeof(dsmWriteNotice));
+            pBarrier->pOpenNotices = pNotices;
+            pBarrier->numOpenNotices += barrierInfo.numNotices;
+        }
+    }
+    pBarrier->opened = barrierInfo.arrivals;
+    pthread_cond_broadcast(&pBarrier->waitCondVar);
+    pthread_mutex_unlock(&pBarrier->waitMutex);
+    return retval;
+}
+
+/*
+ * manager: serves the arrival of a thread of a peer at a barrier. The
+ * arrival is acked first; the peer waits for the opening, which is sent
+ * from here if this is the last arrival.
+ * Returns 0 on success, -1 on failure
+ */
+int dsmBarrierReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmBarrierMsgInfo   barrierInfo;
+    dsmMsg              rspMsg;
+    dsmMsg*             pMsgHdr = NULL;
+    int32               retval = 0;
+
+    dsmEnterFunc();
+    memcpy(&barrierInfo, payload, sizeof(dsmBarrierMsgInfo));
+    pMsgHdr = (dsmMsg*)((uInt8*)payload - DSM_MSG_HDR_LEN);
+    if (barrierInfo.barrierId >= DSM_MAX_BARRIERS ||
+            barrierInfo.nodeId >= dsmMmapInfo.numNodes ||
+            DSM_BARRIER_MANAGER(barrierInfo.barrierId) != dsmMmapInfo.nodeId ||
+            sizeof(dsmBarrierMsgInfo) + barrierInfo.numNotices * sizeof(dsmWriteNotice) >
+            pMsgHdr->payloadLen) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid arrival at barrier [%u] from "
+                "node [%u]\n", barrierInfo.barrierId, barrierInfo.nodeId);
+        dsmExitFunc();
+        return -1;
+    }
+
+    /* the next arrival of the peer comes on this connection, so after the
+     * count below; the opening is served without sending any msg */
+    rspMsg.msgType = DSM_MSG_BARRIER_RSP;
+    rspMsg.payloadLen = 0;
+    retval = dsmReplyMsg(pConn, &rspMsg);
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_BARRIER_RSP]\n");
+    }
+    dsmBarrierArriveAt(barrierInfo.barrierId, barrierInfo.nodeId, barrierInfo.count,
+            (dsmWriteNotice*)((uInt8*)payload + sizeof(dsmBarrierMsgInfo)),
+            barrierInfo.numNotices);
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * a barrier opened at its manager
+ * Returns 0 on success, -1 on failure
+ */
+int dsmBarrierDoneReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmMsg          rspMsg;
+    int32           retval = 0;
+
+    dsmEnterFunc();
+    dsmBarrierOpened(payload);
+    rspMsg.msgType = DSM_MSG_BARRIER_DONE_RSP;
+    rspMsg.payloadLen = 0;
+    retval = dsmReplyMsg(pConn, &rspMsg);
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_BARRIER_DONE_RSP]\n");
+    }
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Initializes a barrier on barrier id for count threads over all the
+ * nodes; every node uses the same id and count for it
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_barrier_init(dsm_barrier_t* barrier, int id, unsigned count)
+{
+    if (NULL == barrier || id < 0 || id >= DSM_MAX_BARRIERS || 0 == count) {
+        errno = EINVAL;
+        return -1;
+    }
+    barrier->id = id;
+    barrier->count = count;
+    return 0;
+}
+
+/*
+ * Waits until count threads arrived at a barrier; the writes made before
+ * arriving are seen by all of them after
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_barrier_wait(dsm_barrier_t* barrier)
+{
+    dsmBarrierInfo*     pBarrier = NULL;
+    dsmBarrierMsgInfo   barrierInfo;
+    dsmWriteNotice*     pNotices = NULL;
+    dsmMsg*             pMsg = NULL;
+    uInt32              numNotices = 0;
+    uInt32              managerId = 0;
+    uInt32              arrival = 0;
+    uInt32              opened = 0;
+    int32               retval = 0;
+
+    dsmEnterFunc();
+    if (NULL == barrier || barrier->id < 0 || barrier->id >= DSM_MAX_BARRIERS ||
+            0 == barrier->count) {
+        errno = EINVAL;
+        dsmExitFunc();
+        return -1;
+    }
+    pMsg = (dsmMsg*)malloc(DSM_MAX_NOTICE_MSG_LEN);
+    if (NULL == pMsg) {
+        errno = ENOMEM;
+        dsmExitFunc();
+        return -1;
+    }
+    pBarrier = &dsmBarriers[barrier->id];
+    managerId = DSM_BARRIER_MANAGER(barrier->id);
+
+    if (DSM_MULTI_WRITER() && -1 == dsmReleaseWrites()) {
+        retval = -1;
+    }
+
+    /* the arrivals of the node reach the manager in the order numbered */
+    pthread_mutex_lock(&pBarrier->arriveMutex);
+    barrierInfo.barrierId = barrier->id;
+    barrierInfo.nodeId = dsmMmapInfo.nodeId;
+    barrierInfo.count = barrier->count;
+    barrierInfo.arrivals = 0;
+    barrierInfo.numNotices = 0;
+    if (DSM_WRITE_MODE_LAZY_RELEASE == dsmMmapInfo.writeMode) {
+        barrierInfo.numNotices = dsmGatherNotices(&pBarrier->releaseSeq,
+                pMsg->payload + sizeof(dsmBarrierMsgInfo));
+    }
+    pBarrier->arrivals += 1;
+    arrival = pBarrier->arrivals;
+
+    if (managerId == dsmMmapInfo.nodeId) {
+        if (-1 == dsmBarrierArriveAt(barrier->id, managerId, barrier->count,
+                    (dsmWriteNotice*)(pMsg->payload + sizeof(dsmBarrierMsgInfo)),
+                    barrierInfo.numNotices)) {
+            retval = -1;
+        }
+    }
+    else {
+        pMsg->msgType = DSM_MSG_BARRIER_REQ;
+        pMsg->payloadLen = sizeof(dsmBarrierMsgInfo) +
+            barrierInfo.numNotices * sizeof(dsmWriteNotice);
+        memcpy(pMsg->payload, &barrierInfo, sizeof(dsmBarrierMsgInfo));
+        if (-1 == dsmSendAndRecv(&dsmPeers[managerId], pMsg)) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                    "[DSM_MSG_BARRIER_REQ]\n");
+            pBarrier->arrivals -= 1;
+            pthread_mutex_unlock(&pBarrier->arriveMutex);
+            free(pMsg);
+            errno = EIO;
+            dsmExitFunc();
+            return -1;
+        }
+    }
+    pthread_mutex_unlock(&pBarrier->arriveMutex);
+    free(pMsg);
+
+    /* the first waiter up makes the writes released at the barrier seen
+     * here; the others go on once it is done */
+    pthread_mutex_lock(&pBarrier->waitMutex);
+    while ((int32)(pBarrier->released - arrival) < 0) {
+        if (pBarrier->opened == pBarrier->released || pBarrier->applying) {
+            pthread_cond_wait(&pBarrier->waitCondVar, &pBarrier->waitMutex);
+            continue;
+        }
+        opened = pBarrier->opened;
+        pNotices = pBarrier->pOpenNotices;
+        numNotices = pBarrier->numOpenNotices;
+        pBarrier->pOpenNotices = NULL;
+        pBarrier->numOpenNotices = 0;
+        pBarrier->applying = true;
+        pthread_mutex_unlock(&pBarrier->waitMutex);
+
+        if (-1 == dsmAcquireWrites(pNotices, numNotices)) {
+            retval = -1;
+        }
+        free(pNotices);
+
+        pthread_mutex_lock(&pBarrier->waitMutex);
+        pBarrier->applying = false;
+        pBarrier->released = opened;
+        pthread_cond_broadcast(&pBarrier->waitCondVar);
+    }
+    pthread_mutex_unlock(&pBarrier->waitMutex);
+
+    if (-1 == retval) {
+        errno = EIO;
+    }
+    dsmExitFunc();
+    return retval;
+}
@@ -0,0 +1,493 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Takes the lock of a page to be fetched, without waiting, if the page is
+ * not local with the access needed, and marks it requested. A read-only
+ * copy invalidated while its lock was held is dropped first.
+ * Returns 1 if the page is picked and locked, 0 otherwise
+ */
+int32 dsmPickPage(uInt32 pageOffset, bool isWrite, dsmPageStatus* pPrevStatus)
+{
+    if (0 != dsmTryLockPte(pageOffset)) {
+        return 0;
+    }
+    if ((__sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags,
+                    ~DSM_PTE_FLAG_INV_PENDING) & DSM_PTE_FLAG_INV_PENDING) &&
+            !DSM_PTE(pageOffset).owner &&
+            DSM_PAGE_READ_ONLY == DSM_PTE(pageOffset).pageStatus) {
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_NOT_PRESENT;
+    }
+
+    /* an owned page with copies is upgraded locally on its write fault */
+    if (DSM_PTE(pageOffset).owner ||
+            (DSM_PAGE_NOT_PRESENT != DSM_PTE(pageOffset).pageStatus &&
+             (!isWrite || DSM_PAGE_READ_ONLY != DSM_PTE(pageOffset).pageStatus))) {
+        dsmUnlockPte(pageOffset);
+        return 0;
+    }
+    *pPrevStatus = (dsmPageStatus)DSM_PTE(pageOffset).pageStatus;
+    DSM_PTE(pageOffset).pageStatus = DSM_PAGE_REQUESTED;
+    return 1;
+}
+
+/*
+ * Returns the node a page is asked from: its probable owner, or its home
+ * node without a hint
+ */
+uInt32 dsmBatchTarget(uInt32 pageOffset)
+{
+    if (DSM_PTE(pageOffset).probOwner == dsmMmapInfo.nodeId) {
+        return DSM_HOME_NODE(pageOffset);
+    }
+    return DSM_PTE(pageOffset).probOwner;
+}
+
+/*
+ * Brings the pages of the given ranges local, read only or owned for
+ * writing. Pages are picked in batches of up to DSM_BATCH_PAGES; the pages
+ * of a batch are asked from each probable owner in one exchange. Pages
+ * local already, or whose lock is busy, are left out.
+ * Returns the number of pages that could not be fetched
+ */
+int32 dsmFetchPages(const dsmPageRange* pRanges, uInt32 numRanges, bool isWrite)
+{
+    uInt32          picked[DSM_MAX_BATCH_PAGES];
+    dsmPageStatus   prevStatus[DSM_MAX_BATCH_PAGES];
+    uInt32          numPicked = 0;
+    uInt32          range = 0;
+    uInt32          page = 0;
+    uInt32          endPage = 0;
+    int32           numMissed = 0;
+
+    dsmEnterFunc();
+    for (range = 0; range < numRanges; range += 1) {
+        endPage = pRanges[range].firstPage + pRanges[range].numPages;
+        if (endPage > dsmMmapInfo.numPagesToAlloc) {
+            endPage = dsmMmapInfo.numPagesToAlloc;
+        }
+        for (page = pRanges[range].firstPage; page < endPage; page += 1) {
+            if (dsmPickPage(page, isWrite, &prevStatus[numPicked])) {
+                picked[numPicked] = page;
+                numPicked += 1;
+            }
+            if (DSM_BATCH_PAGES == numPicked) {
+                numMissed += dsmFetchPicked(picked, prevStatus, numPicked, isWrite);
+                numPicked = 0;
+            }
+        }
+    }
+    if (numPicked > 0) {
+        numMissed += dsmFetchPicked(picked, prevStatus, numPicked, isWrite);
+    }
+    dsmExitFunc();
+    return numMissed;
+}
+
+/*
+ * Fetches a batch of picked pages and releases their locks. The pages are
+ * grouped by probable owner and each group is asked for in one request;
+ * the owner sends the pages it owns and hints for the others, which are
+ * asked for again from the node hinted, for at most DSM_MAX_FAULT_HOPS
+ * rounds. A page not fetched is left as it was.
+ * Returns the number of pages that could not be fetched
+ */
+int32 dsmFetchPicked(uInt32* pPicked, dsmPageStatus* pPrevStatus, uInt32 numPicked,
+        bool isWrite)
+{
+    bool                grouped[DSM_MAX_BATCH_PAGES];
+    dsmPageBatchReqInfo reqInfo;
+    dsmOwnerInfo        ownerInfo;
+    dsmPageRange*       pRanges = NULL;
+    dsmMsg*             pMsg = NULL;
+    uInt8               msgBuf[sizeof(dsmMsg) + sizeof(dsmOwnerInfo)];
+    dsmMsg*             pUpdateMsg = (dsmMsg*)msgBuf;
+    uInt32              numRanges = 0;
+    uInt32              target = 0;
+    uInt32              homeId = 0;
+    uInt32              page = 0;
+    uInt32              i = 0;
+    uInt32              j = 0;
+    int32               hops = 0;
+    int32               numLeft = 0;
+    int32               numMissed = 0;
+
+    dsmEnterFunc();
+
+    /* the request holds at most one range per page */
+    pMsg = (dsmMsg*)malloc(sizeof(dsmMsg) + sizeof(dsmPageBatchReqInfo) +
+            numPicked * sizeof(dsmPageRange));
+    if (NULL == pMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for batch of "
+                "[%u] pages\n", numPicked);
+        hops = DSM_MAX_FAULT_HOPS;
+    }
+    pRanges = (NULL == pMsg) ? NULL : (dsmPageRange*)(pMsg->payload +
+            sizeof(dsmPageBatchReqInfo));
+    reqInfo.requesterId = dsmMmapInfo.nodeId;
+    reqInfo.isWrite = isWrite;
+
+    for (; hops < DSM_MAX_FAULT_HOPS; hops += 1) {
+        numLeft = 0;
+        for (i = 0; i < numPicked; i += 1) {
+            grouped[i] = (DSM_PAGE_REQUESTED != DSM_PTE(pPicked[i]).pageStatus);
+            numLeft += grouped[i] ? 0 : 1;
+        }
+        if (0 == numLeft) {
+            break;
+        }
+        if (hops > 0) {
+            /* owners busy with some of the pages; back off */
+            usleep(DSM_BUSY_RETRY_US);
+        }
+
+        /* one request per probable owner, with the runs of its pages */
+        for (i = 0; i < numPicked; i += 1) {
+            if (grouped[i]) {
+                continue;
+            }
+            target = dsmBatchTarget(pPicked[i]);
+            numRanges = 0;
+            for (j = i; j < numPicked; j += 1) {
+                page = pPicked[j];
+                if (grouped[j] || target != dsmBatchTarget(page)) {
+                    continue;
+                }
+                grouped[j] = true;
+                DSM_TRACE_EVENT(DSM_EVENT_REQ_SENT, page, target,
+                        reqInfo.isWrite ? DSM_EVENT_FLAG_WRITE : 0, 0);
+                if (numRanges > 0 && page == pRanges[numRanges - 1].firstPage +
+                        pRanges[numRanges - 1].numPages) {
+                    pRanges[numRanges - 1].numPages += 1;
+                    continue;
+                }
+                pRanges[numRanges].firstPage = page;
+                pRanges[numRanges].numPages = 1;
+                numRanges += 1;
+            }
+
+            reqInfo.numRanges = numRanges;
+            memcpy(pMsg->payload, &reqInfo, sizeof(dsmPageBatchReqInfo));
+            pMsg->msgType = DSM_MSG_PAGE_BATCH_REQ;
+            pMsg->payloadLen = sizeof(dsmPageBatchReqInfo) +
+                numRanges * sizeof(dsmPageRange);
+            if (-1 == dsmSendAndRecv(&dsmPeers[target], pMsg)) {
+                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Batch request of [%u] ranges to "
+                        "node [%u] failed\n", numRanges, target);
+            }
+        }
+    }
+    free(pMsg);
+
+    for (i = 0; i < numPicked; i += 1) {
+        page = pPicked[i];
+        if (DSM_PAGE_REQUESTED == DSM_PTE(page).pageStatus) {
+            DSM_PTE(page).pageStatus = pPrevStatus[i];
+            numMissed += 1;
+        }
+        else if (isWrite && DSM_PTE(page).owner) {
+            /* tell the home node of the new owner */
+            homeId = DSM_HOME_NODE(page);
+            if (homeId != dsmMmapInfo.nodeId) {
+                ownerInfo.pageOffset = page;
+                ownerInfo.ownerId = dsmMmapInfo.nodeId;
+                ownerInfo.ownerVersion = DSM_PTE(page).ownerVersion;
+                pUpdateMsg->msgType = DSM_MSG_OWNER_UPDATE;
+                pUpdateMsg->payloadLen = sizeof(dsmOwnerInfo);
+                memcpy(pUpdateMsg->payload, &ownerInfo, sizeof(dsmOwnerInfo));
+                dsmSendToPeer(&dsmPeers[homeId], pUpdateMsg);
+            }
+        }
+        dsmWakePte(page);
+        dsmUnlockPte(page);
+    }
+
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Batch of [%u] pages fetched, [%d] missed\n",
+            numPicked, numMissed);
+    dsmExitFunc();
+    return numMissed;
+}
+
+/*
+ * Sends the pages of a batch request owned here in one msg, read-only
+ * copies or ownership, followed by hints for the pages not owned here.
+ * A page whose lock is busy is left out; the requester asks again.
+ * Returns 0 on success, -1 on failure
+ */
+int dsmPageBatchReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmPageBatchReqInfo     reqInfo;
+    dsmPageBatchRspInfo     rspInfo;
+    dsmMsg                  msgHdr;
+    dsmPageRange            range;
+    dsmPageRspInfo*         pPageInfo = NULL;
+    dsmOwnerInfo*           pHints = NULL;
+    struct iovec*           pIov = NULL;
+    uInt8*                  pEncodeBuf = NULL;
+    const uInt8*            pData = NULL;
+    uInt32                  numReq = 0;
+    uInt32                  numIov = 0;
+    uInt32                  page = 0;
+    uInt32                  i = 0;
+    int32                   retval = 0;
+
+    dsmEnterFunc();
+    memcpy(&reqInfo, payload, sizeof(dsmPageBatchReqInfo));
+    memset(&rspInfo, 0, sizeof(dsmPageBatchRspInfo));
+    rspInfo.isWrite = reqInfo.isWrite;
+
+    /* the response must fit the requester's limit */
+    for (i = 0; i < reqInfo.numRanges && i < DSM_BATCH_PAGES; i += 1) {
+        memcpy(&range, (uInt8*)payload + sizeof(dsmPageBatchReqInfo) +
+                i * sizeof(dsmPageRange), sizeof(dsmPageRange));
+        if (range.firstPage >= dsmMmapInfo.numPagesToAlloc ||
+                range.numPages > dsmMmapInfo.numPagesToAlloc - range.firstPage) {
+            break;
+        }
+        numReq += range.numPages;
+    }
+    if (i != reqInfo.numRanges || numReq > DSM_BATCH_PAGES) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid batch request of [%u] ranges "
+                "from node [%u]\n", reqInfo.numRanges, reqInfo.requesterId);
+        reqInfo.numRanges = 0;
+        numReq = 0;
+    }
+
+    pIov = (struct iovec*)malloc((3 + 2 * numReq) * sizeof(struct iovec));
+    if (numReq > 0) {
+        pPageInfo = (dsmPageRspInfo*)malloc(numReq * sizeof(dsmPageRspInfo));
+        pHints = (dsmOwnerInfo*)malloc(numReq * sizeof(dsmOwnerInfo));
+    }
+    if (NULL == pIov || (numReq > 0 && (NULL == pPageInfo || NULL == pHints))) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for batch of "
+                "[%u] pages\n", numReq);
+        reqInfo.numRanges = 0;
+        numReq = 0;
+    }
+
+    /* lock and prepare the pages owned here; the others get a hint */
+    for (i = 0; i < reqInfo.numRanges; i += 1) {
+        memcpy(&range, (uInt8*)payload + sizeof(dsmPageBatchReqInfo) +
+                i * sizeof(dsmPageRange), sizeof(dsmPageRange));
+        for (page = range.firstPage; page < range.firstPage + range.numPages; page += 1) {
+            if (DSM_PTE(page).owner &&
+                    0 == dsmTryLockPte(page)) {
+                /* a page within its hold window is left out like a busy one */
+                if (DSM_PTE(page).owner && !dsmPageHeld(page, reqInfo.isWrite)) {
+                    if (reqInfo.isWrite) {
+                        dsmPrepareTransfer(page, reqInfo.requesterId,
+                                &pPageInfo[rspInfo.numPages]);
+                    }
+                    else {
+                        dsmPrepareReadCopy(page, &pPageInfo[rspInfo.numPages]);
+                    }
+                    rspInfo.numPages += 1;
+                    continue;
+                }
+                dsmUnlockPte(page);
+            }
+            if (!DSM_PTE(page).owner) {
+                pHints[rspInfo.numHints].pageOffset = page;
+                pHints[rspInfo.numHints].ownerId = DSM_PTE(page).probOwner;
+                pHints[rspInfo.numHints].ownerVersion = DSM_PTE(page).ownerVersion;
+                rspInfo.numHints += 1;
+            }
+        }
+    }
+
+    /* send the pages straight from the shared region, or compressed with
+     * the codec agreed on for the connection */
+    if (DSM_CODEC_RAW != pConn->codec && rspInfo.numPages > 0) {
+        pEncodeBuf = (uInt8*)malloc(rspInfo.numPages * DSM_PAGE_SIZE);
+    }
+    msgHdr.msgType = DSM_MSG_PAGE_BATCH_RSP;
+    msgHdr.reqId = pConn->reqId;
+    msgHdr.payloadLen = sizeof(dsmPageBatchRspInfo) +
+        rspInfo.numHints * sizeof(dsmOwnerInfo);
+    for (i = 0; i < rspInfo.numPages; i += 1) {
+        pData = DSM_PAGE_ADDR(pPageInfo[i].pageOffset);
+        dsmEncodePage(pData, (NULL == pEncodeBuf) ? DSM_CODEC_RAW : pConn->codec,
+                (NULL == pEncodeBuf) ? NULL : pEncodeBuf + i * DSM_PAGE_SIZE,
+                &pPageInfo[i]);
+        msgHdr.payloadLen += sizeof(dsmPageRspInfo) + pPageInfo[i].dataLen;
+    }
+    if (NULL == pIov) {
+        /* no memory to describe the msg; the header alone has no pages */
+        msgHdr.payloadLen = sizeof(dsmPageBatchRspInfo);
+        if (-1 == dsmSendAll(pConn->sd, &msgHdr, DSM_MSG_HDR_LEN) ||
+                -1 == dsmSendAll(pConn->sd, &rspInfo, sizeof(dsmPageBatchRspInfo))) {
+            retval = -1;
+        }
+    }
+    else {
+        pIov[numIov].iov_base = &msgHdr;
+        pIov[numIov++].iov_len = DSM_MSG_HDR_LEN;
+        pIov[numIov].iov_base = &rspInfo;
+        pIov[numIov++].iov_len = sizeof(dsmPageBatchRspInfo);
+        for (i = 0; i < rspInfo.numPages; i += 1) {
+            pIov[numIov].iov_base = &pPageInfo[i];
+            pIov[numIov++].iov_len = sizeof(dsmPageRspInfo);
+            pIov[numIov].iov_base = (DSM_CODEC_RAW == pPageInfo[i].codec) ?
+                DSM_PAGE_ADDR(pPageInfo[i].pageOffset) :
+                pEncodeBuf + i * DSM_PAGE_SIZE;
+            pIov[numIov++].iov_len = pPageInfo[i].dataLen;
+        }
+        pIov[numIov].iov_base = pHints;
+        pIov[numIov++].iov_len = rspInfo.numHints * sizeof(dsmOwnerInfo);
+        if (-1 == dsmSendAllv(pConn->sd, pIov, numIov)) {
+            retval = -1;
+        }
+    }
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_PAGE_BATCH_RSP]\n");
+    }
+    else {
+        dsmStats()->stats.msgs_sent += 1;
+        dsmStats()->stats.pages_sent += rspInfo.numPages;
+    }
+
+    for (i = 0; i < rspInfo.numPages; i += 1) {
+        page = pPageInfo[i].pageOffset;
+        if (0 == retval) {
+            DSM_TRACE_EVENT(DSM_EVENT_PAGE_SERVED, page, reqInfo.requesterId,
+                    reqInfo.isWrite ? DSM_EVENT_FLAG_WRITE : 0, 0);
+        }
+        if (reqInfo.isWrite) {
+            dsmCompleteTransfer(page, reqInfo.requesterId, &pPageInfo[i], (0 == retval));
+        }
+        else if (0 == retval) {
+            /* track the copy so that it is invalidated on the next write */
+            DSM_PTE(page).copyset |= DSM_NODE_BIT(reqInfo.requesterId);
+        }
+        dsmWakePte(page);
+        dsmUnlockPte(page);
+    }
+    free(pPageInfo);
+    free(pHints);
+    free(pIov);
+    free(pEncodeBuf);
+
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Installs the pages of a batch response of payloadLen bytes and takes the
+ * hints for the pages the sender does not own. The response holds no more
+ * pages and hints than a batch asks for; it is taken up to the first part
+ * that is out of bounds, the pages left out stay requested.
+ * Returns 0 on success, -1 on failure
+ */
+int dsmPageBatchRspHandler(void* payload, uInt32 payloadLen)
+{
+    dsmPageBatchRspInfo     rspInfo;
+    dsmPageRspInfo          pageInfo;
+    dsmOwnerInfo            ownerInfo;
+    const uInt8*            pPage = NULL;
+    uInt8*                  pCur = (uInt8*)payload;
+    uInt8*                  pEnd = (uInt8*)payload + payloadLen;
+    uInt32                  i = 0;
+
+    dsmEnterFunc();
+    if (payloadLen < sizeof(dsmPageBatchRspInfo)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid batch response of [%u] bytes\n",
+                payloadLen);
+        dsmExitFunc();
+        return -1;
+    }
+    memcpy(&rspInfo, pCur, sizeof(dsmPageBatchRspInfo));
+    pCur += sizeof(dsmPageBatchRspInfo);
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Batch of [%u] pages and [%u] hints rcvd\n",
+            rspInfo.numPages, rspInfo.numHints);
+    if (rspInfo.numPages > DSM_BATCH_PAGES || rspInfo.numHints > DSM_BATCH_PAGES) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid batch response of [%u] pages and "
+                "[%u] hints\n", rspInfo.numPages, rspInfo.numHints);
+        dsmExitFunc();
+        return -1;
+    }
+
+    for (i = 0; i < rspInfo.numPages; i += 1) {
+        if ((uInt32)(pEnd - pCur) < sizeof(dsmPageRspInfo)) {
+            break;
+        }
+        memcpy(&pageInfo, pCur, sizeof(dsmPageRspInfo));
+        pCur += sizeof(dsmPageRspInfo);
+        if (pageInfo.pageOffset >= dsmMmapInfo.numPagesToAlloc ||
+                pageInfo.dataLen > (uInt32)(pEnd - pCur) ||
+                pageInfo.dataLen > DSM_PAGE_SIZE ||
+                (DSM_CODEC_RAW == pageInfo.codec && DSM_PAGE_SIZE != pageInfo.dataLen)) {
+            break;
+        }
+        pPage = dsmDecodePage(&pageInfo, pCur);
+        pCur += pageInfo.dataLen;
+        if (NULL == pPage) {
+            continue;
+        }
+        if (rspInfo.isWrite) {
+            dsmInstallOwnedPage(&pageInfo, pPage);
+        }
+        else {
+            dsmInstallReadCopy(&pageInfo, pPage);
+        }
+    }
+    if (i != rspInfo.numPages ||
+            (uInt32)(pEnd - pCur) < rspInfo.numHints * sizeof(dsmOwnerInfo)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid batch response, page [%u] of [%u] "
+                "out of bounds\n", i, rspInfo.numPages);
+        dsmExitFunc();
+        return -1;
+    }
+    for (i = 0; i < rspInfo.numHints; i += 1) {
+        memcpy(&ownerInfo, pCur, sizeof(dsmOwnerInfo));
+        pCur += sizeof(dsmOwnerInfo);
+        if (ownerInfo.pageOffset >= dsmMmapInfo.numPagesToAlloc ||
+                ownerInfo.ownerId >= dsmMmapInfo.numNodes) {
+            continue;
+        }
+        dsmUpdateProbOwner(ownerInfo.pageOffset, ownerInfo.ownerId,
+                ownerInfo.ownerVersion);
+    }
+
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Brings the pages of [addr, addr + len) of the shared region local, with
+ * write access if access is DSM_ACCESS_WRITE, else read only
+ * Returns 0 if every page is local, -1 otherwise with errno EINVAL for a
+ * range outside the shared region and EAGAIN when some pages could not be
+ * fetched now; those are fetched on access
+ */
+int dsm_prefetch(void* addr, size_t len, int access)
+{
+    dsmPageRange    range;
+    uInt8*          pStart = (uInt8*)addr;
+    uInt8*          pRegion = (uInt8*)pDsmSharedRegion;
+
+    dsmEnterFunc();
+    if (NULL == pRegion || pStart < pRegion || 0 == len ||
+            len > (size_t)dsmMmapInfo.numPagesToAlloc * DSM_PAGE_SIZE ||
+            pStart + len > pRegion + (size_t)dsmMmapInfo.numPagesToAlloc * DSM_PAGE_SIZE ||
+            (DSM_ACCESS_READ != access && DSM_ACCESS_WRITE != access)) {
+        errno = EINVAL;
+        dsmExitFunc();
+        return -1;
+    }
+
+    range.firstPage = (pStart - pRegion) / DSM_PAGE_SIZE;
+    range.numPages = ((pStart + len - pRegion - 1) / DSM_PAGE_SIZE) - range.firstPage + 1;
+    /* with multiple writers the copies are fetched read-only and twinned on
+     * the first write */
+    if (0 != dsmFetchPages(&range, 1, (DSM_ACCESS_WRITE == access &&
+                    !DSM_MULTI_WRITER()))) {
+        errno = EAGAIN;
+        dsmExitFunc();
+        return -1;
+    }
+    dsmExitFunc();
+    return 0;
+}
@@ -0,0 +1,478 @@
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Incremental checkpoints: every node appends the pages it owns that
+ * changed since its last checkpoint to a file of its own. A page is noted
+ * as changed when it is made writable or installed; a checkpoint saves it
+ * and write protects it, so the next write faults and notes it again. A
+ * page saved before that is owned elsewhere now gets a drop record, it is
+ * in the file of its new owner. The pages of a chunk of the page table
+ * never set up and not resident were never written and are skipped, so a
+ * checkpoint costs the pages written, not the region.
+ */
+
+static char             dsmCkptPath[PATH_MAX];  /* file checkpointed last */
+static uInt64           dsmCkptLen = 0;         /* its length, all complete */
+
+/*
+ * Returns true if any page of [pageOffset, pageOffset + numPages) of the
+ * region is in memory; a page never touched is not, and holds zeros or
+ * what the backing file of the region has
+ */
+bool dsmCkptResident(uInt32 pageOffset, uInt32 numPages)
+{
+    size_t          len = (size_t)numPages * DSM_PAGE_SIZE;
+    size_t          sysPageSize = sysconf(_SC_PAGESIZE);
+    unsigned char*  pVec = NULL;
+    size_t          i = 0;
+    bool            resident = false;
+
+    pVec = (unsigned char*)malloc((len + sysPageSize - 1) / sysPageSize);
+    if (NULL == pVec || -1 == mincore(DSM_PAGE_ADDR(pageOffset), len, pVec)) {
+        /* when unsure the pages are looked at */
+        free(pVec);
+        return true;
+    }
+    for (; i < (len + sysPageSize - 1) / sysPageSize && !resident; i++) {
+        resident = (0 != (pVec[i] & 1));
+    }
+    free(pVec);
+    return resident;
+}
+
+/*
+ * Walks the checkpoints of a file mapped at pFile and fills in the pages
+ * of the complete ones, in file order, if pPages is not NULL, at most
+ * maxPages of them; the length of the file up to the end of its last
+ * complete checkpoint is returned in pValidLen
+ * Returns the number of pages found, -1 if the file is not a checkpoint
+ * of this node
+ */
+int32 dsmCkptScan(const uInt8* pFile, uInt64 fileLen, dsmCkptPage* pPages,
+        uInt32 maxPages, uInt64* pValidLen)
+{
+    const dsmCkptHeader*    pHeader = (const dsmCkptHeader*)pFile;
+    const dsmCkptRecord*    pRecord = NULL;
+    uInt64                  pos = sizeof(dsmCkptHeader);
+    uInt32                  numPages = 0;       /* of the complete checkpoints */
+    uInt32                  numFound = 0;       /* those and the current one */
+    uInt64                  numRecords = 0;
+    bool                    inCkpt = false;
+
+    if (fileLen < sizeof(dsmCkptHeader) ||
+            0 != memcmp(pHeader->magic, DSM_CKPT_MAGIC, sizeof(pHeader->magic)) ||
+            DSM_CKPT_VERSION != pHeader->version ||
+            dsmMmapInfo.nodeId != pHeader->nodeId ||
+            dsmMmapInfo.numNodes != pHeader->numNodes ||
+            dsmMmapInfo.pageSize != pHeader->pageSize ||
+            dsmMmapInfo.numPagesToAlloc != pHeader->numPages) {
+        return -1;
+    }
+
+    *pValidLen = pos;
+    while (pos + sizeof(dsmCkptRecord) <= fileLen) {
+        pRecord = (const dsmCkptRecord*)(pFile + pos);
+        if (!inCkpt) {
+            if (DSM_CKPT_TAG_BEGIN != pRecord->tag) {
+                break;
+            }
+            inCkpt = true;
+            numRecords = 0;
+            pos += sizeof(dsmCkptRecord);
+            continue;
+        }
+        if (DSM_CKPT_TAG_END == pRecord->tag) {
+            if (numRecords != pRecord->value) {
+                break;
+            }
+            inCkpt = false;
+            numPages = numFound;
+            pos += sizeof(dsmCkptRecord);
+            *pValidLen = pos;
+            continue;
+        }
+        if ((DSM_CKPT_TAG_PAGE != pRecord->tag && DSM_CKPT_TAG_DROP != pRecord->tag) ||
+                pRecord->pageOffset >= dsmMmapInfo.numPagesToAlloc ||
+                (DSM_CKPT_TAG_PAGE == pRecord->tag &&
+                 pos + sizeof(dsmCkptRecord) + DSM_PAGE_SIZE > fileLen)) {
+            break;
+        }
+        if (NULL != pPages && numFound >= maxPages) {
+            break;
+        }
+        if (NULL != pPages) {
+            pPages[numFound].pageOffset = pRecord->pageOffset;
+            pPages[numFound].seq = numFound;
+            pPages[numFound].pData = (DSM_CKPT_TAG_PAGE == pRecord->tag) ?
+                (pFile + pos + sizeof(dsmCkptRecord)) : NULL;
+        }
+        numFound += 1;
+        numRecords += 1;
+        pos += sizeof(dsmCkptRecord) +
+            ((DSM_CKPT_TAG_PAGE == pRecord->tag) ? DSM_PAGE_SIZE : 0);
+    }
+    return numPages;
+}
+
+/*
+ * Opens the checkpoint file at path for appending a checkpoint; a new
+ * file gets its header, a checkpoint a crash cut short at the end of an
+ * old one is cut off
+ * Returns the file, NULL on failure
+ */
+FILE* dsmCkptOpen(const char* path)
+{
+    dsmCkptHeader   header;
+    struct stat     fileStat;
+    void*           pMap = NULL;
+    uInt64          validLen = 0;
+    int32           fd = -1;
+    FILE*           pFile = NULL;
+
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == fd || -1 == fstat(fd, &fileStat)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Checkpoint file [%s] not opened, errno: "
+                "[%d]\n", path, errno);
+        if (-1 != fd) {
+            close(fd);
+        }
+        return NULL;
+    }
+
+    if (0 == fileStat.st_size) {
+        memset(&header, 0, sizeof(dsmCkptHeader));
+        memcpy(header.magic, DSM_CKPT_MAGIC, sizeof(header.magic));
+        header.version = DSM_CKPT_VERSION;
+        header.nodeId = dsmMmapInfo.nodeId;
+        header.numNodes = dsmMmapInfo.numNodes;
+        header.pageSize = dsmMmapInfo.pageSize;
+        header.numPages = dsmMmapInfo.numPagesToAlloc;
+        if (sizeof(dsmCkptHeader) != write(fd, &header, sizeof(dsmCkptHeader))) {
+            close(fd);
+            return NULL;
+        }
+        validLen = sizeof(dsmCkptHeader);
+    }
+    else if (0 == strcmp(dsmCkptPath, path) && (uInt64)fileStat.st_size == dsmCkptLen) {
+        /* appended to last by this node, known to be whole */
+        validLen = dsmCkptLen;
+    }
+    else {
+        pMap = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (MAP_FAILED == pMap ||
+                -1 == dsmCkptScan((const uInt8*)pMap, fileStat.st_size, NULL, 0, &validLen)) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "[%s] is not a checkpoint of this node\n",
+                    path);
+            if (MAP_FAILED != pMap) {
+                munmap(pMap, fileStat.st_size);
+            }
+            close(fd);
+            errno = EINVAL;
+            return NULL;
+        }
+        munmap(pMap, fileStat.st_size);
+        if (validLen < (uInt64)fileStat.st_size && -1 == ftruncate(fd, validLen)) {
+            close(fd);
+            return NULL;
+        }
+    }
+
+    pFile = fdopen(fd, "ab");
+    if (NULL == pFile) {
+        close(fd);
+        return NULL;
+    }
+    return pFile;
+}
+
+/*
+ * Saves a page for the checkpoint being written to pFile if it changed
+ * since it was saved last and is owned here, or drops it if it was saved
+ * but is owned elsewhere now. A page saved is write protected while the
+ * page lock is held, so no write of it is missed; the file is written
+ * after the lock is released. A page of zeros never saved is left out.
+ * Returns the number of records written, -1 on failure
+ */
+int32 dsmCkptSavePage(uInt32 pageOffset, FILE* pFile, uInt8* pBuf)
+{
+    dsmCkptRecord       record;
+    uInt32              flags = DSM_PTE(pageOffset).pteFlags;
+    bool                isSaved = false;
+
+    /* a cheap look first; most pages are untouched */
+    if (DSM_PTE(pageOffset).owner ? (!(flags & DSM_PTE_FLAG_CKPT_DIRTY) &&
+                DSM_PAGE_PRESENT != DSM_PTE(pageOffset).pageStatus) :
+            !(flags & DSM_PTE_FLAG_CKPT_SAVED)) {
+        return 0;
+    }
+
+    memset(&record, 0, sizeof(dsmCkptRecord));
+    record.pageOffset = pageOffset;
+    dsmLockPte(pageOffset);
+    flags = DSM_PTE(pageOffset).pteFlags;
+    isSaved = (0 != (flags & DSM_PTE_FLAG_CKPT_SAVED));
+    if (!DSM_PTE(pageOffset).owner) {
+        if (isSaved) {
+            __sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags, ~DSM_PTE_FLAG_CKPT_SAVED);
+            record.tag = DSM_CKPT_TAG_DROP;
+        }
+    }
+    else if (((flags & DSM_PTE_FLAG_CKPT_DIRTY) ||
+                DSM_PAGE_PRESENT == DSM_PTE(pageOffset).pageStatus) &&
+            dsmCkptResident(pageOffset, 1)) {
+        /* the prot lock keeps a diff or atomic op at the home off the copy */
+        dsmLockPageProt(pageOffset);
+        if (DSM_PAGE_PRESENT == DSM_PTE(pageOffset).pageStatus) {
+            dsmSetPageAccess(pageOffset, PROT_READ);
+            DSM_PTE(pageOffset).pageStatus = DSM_PAGE_READ_ONLY;
+        }
+        __sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags, ~DSM_PTE_FLAG_CKPT_DIRTY);
+        memcpy(pBuf, DSM_PAGE_ADDR(pageOffset), DSM_PAGE_SIZE);
+        dsmUnlockPageProt(pageOffset);
+        if (isSaved || 0 != pBuf[0] || 0 != memcmp(pBuf, pBuf + 1, DSM_PAGE_SIZE - 1)) {
+            __sync_fetch_and_or(&DSM_PTE(pageOffset).pteFlags, DSM_PTE_FLAG_CKPT_SAVED);
+            record.tag = DSM_CKPT_TAG_PAGE;
+        }
+    }
+    dsmUnlockPte(pageOffset);
+
+    if (0 == record.tag) {
+        return 0;
+    }
+    if (1 != fwrite(&record, sizeof(dsmCkptRecord), 1, pFile) ||
+            (DSM_CKPT_TAG_PAGE == record.tag &&
+             1 != fwrite(pBuf, DSM_PAGE_SIZE, 1, pFile))) {
+        return -1;
+    }
+    return 1;
+}
+
+/*
+ * Appends a checkpoint of the pages of this node changed since its last
+ * checkpoint to the file at path, and syncs it to disk. Every node
+ * checkpoints to a file of its own at the same point of the program, with
+ * no page moving meanwhile: between two barriers, after dsm_sync() with
+ * multiple writers.
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_checkpoint(const char* path)
+{
+    dsmCkptRecord       record;
+    FILE*               pFile = NULL;
+    uInt8*              pBuf = NULL;
+    uInt32              numChunks = 0;
+    uInt32              chunk = 0;
+    uInt32              page = 0;
+    uInt32              endPage = 0;
+    uInt64              numRecords = 0;
+    int32               retval = 0;
+    struct timespec     now;
+
+    dsmEnterFunc();
+    if (NULL == path || NULL == pDsmSharedRegion || strlen(path) >= PATH_MAX) {
+        errno = EINVAL;
+        dsmExitFunc();
+        return -1;
+    }
+    pBuf = (uInt8*)malloc(DSM_PAGE_SIZE);
+    pFile = (NULL == pBuf) ? NULL : dsmCkptOpen(path);
+    if (NULL == pFile) {
+        free(pBuf);
+        dsmExitFunc();
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memset(&record, 0, sizeof(dsmCkptRecord));
+    record.tag = DSM_CKPT_TAG_BEGIN;
+    record.value = (uInt64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    fwrite(&record, sizeof(dsmCkptRecord), 1, pFile);
+
+    numChunks = (dsmMmapInfo.numPagesToAlloc + DSM_PTE_CHUNK_PAGES - 1) /
+        DSM_PTE_CHUNK_PAGES;
+    for (chunk = 0; chunk < numChunks && 0 == retval; chunk++) {
+        page = chunk * DSM_PTE_CHUNK_PAGES;
+        endPage = page + DSM_PTE_CHUNK_PAGES;
+        if (endPage > dsmMmapInfo.numPagesToAlloc) {
+            endPage = dsmMmapInfo.numPagesToAlloc;
+        }
+        /* a chunk never set up was never saved; its pages were not
+         * written unless they are in memory */
+        if (!DSM_PTE_READY(page) && !dsmCkptResident(page, endPage - page)) {
+            continue;
+        }
+        for (; page < endPage; page++) {
+            retval = dsmCkptSavePage(page, pFile, pBuf);
+            if (-1 == retval) {
+                break;
+            }
+            numRecords += retval;
+            retval = 0;
+        }
+    }
+
+    record.tag = DSM_CKPT_TAG_END;
+    record.value = numRecords;
+    if (0 != retval || 1 != fwrite(&record, sizeof(dsmCkptRecord), 1, pFile) ||
+            0 != fflush(pFile) || 0 != fdatasync(fileno(pFile))) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Checkpoint to [%s] failed, errno: [%d]\n",
+                path, errno);
+        retval = -1;
+    }
+    else {
+        strcpy(dsmCkptPath, path);
+        dsmCkptLen = ftell(pFile);
+        dsmPrintLog(DSM_TRACE_TYPE_INFO, "Checkpoint of [%llu] pages written to [%s]\n",
+                (unsigned long long)numRecords, path);
+    }
+    fclose(pFile);
+    free(pBuf);
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * orders the pages of checkpoint files by page, in file order for a page
+ * Returns <0, 0 or >0 as qsort() expects
+ */
+int dsmCkptCmpPage(const void* pA, const void* pB)
+{
+    const dsmCkptPage*  pPageA = (const dsmCkptPage*)pA;
+    const dsmCkptPage*  pPageB = (const dsmCkptPage*)pB;
+
+    if (pPageA->pageOffset != pPageB->pageOffset) {
+        return (pPageA->pageOffset < pPageB->pageOffset) ? -1 : 1;
+    }
+    return (pPageA->seq < pPageB->seq) ? -1 : (pPageA->seq > pPageB->seq);
+}
+
+/*
+ * installs a page restored from a checkpoint if it is owned here with no
+ * copies to invalidate, read-only and marked saved as if checkpointed
+ * Returns true if installed, false if the page is not here to install
+ */
+bool dsmCkptInstallPage(uInt32 pageOffset, const uInt8* pData)
+{
+    bool        isInstalled = false;
+
+    dsmLockPte(pageOffset);
+    if (DSM_PTE(pageOffset).owner &&
+            (DSM_MULTI_WRITER() || 0 == DSM_PTE(pageOffset).copyset)) {
+        dsmLockPageProt(pageOffset);
+        dsmInstallPage(pageOffset, pData, PROT_READ);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_READ_ONLY;
+        __sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags, ~DSM_PTE_FLAG_CKPT_DIRTY);
+        __sync_fetch_and_or(&DSM_PTE(pageOffset).pteFlags, DSM_PTE_FLAG_CKPT_SAVED);
+        dsmUnlockPageProt(pageOffset);
+        isInstalled = true;
+    }
+    dsmUnlockPte(pageOffset);
+    return isInstalled;
+}
+
+/*
+ * Restores the pages of this node from its checkpoint file at path: the
+ * latest copy of each page saved and not dropped since. The file is
+ * mapped, so only the pages restored are read from it; ownership of the
+ * pages is taken in batches. Every node restores its own file right after
+ * it initialized and before the region is used, followed by a barrier.
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_restore(const char* path)
+{
+    struct stat     fileStat;
+    void*           pMap = NULL;
+    dsmCkptPage*    pPages = NULL;
+    uInt64          validLen = 0;
+    int32           numPages = 0;
+    uInt32          numLatest = 0;
+    uInt32          i = 0;
+    uInt32          run = 0;
+    int32           fd = -1;
+    int32           retval = 0;
+
+    dsmEnterFunc();
+    if (NULL == path || NULL == pDsmSharedRegion) {
+        errno = EINVAL;
+        dsmExitFunc();
+        return -1;
+    }
+    fd = open(path, O_RDONLY);
+    if (-1 == fd || -1 == fstat(fd, &fileStat) || 0 == fileStat.st_size) {
+        if (-1 != fd) {
+            close(fd);
+            errno = EINVAL;
+        }
+        dsmExitFunc();
+        return -1;
+    }
+    pMap = mmap(NULL, fileStat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (MAP_FAILED == pMap) {
+        dsmExitFunc();
+        return -1;
+    }
+
+    numPages = dsmCkptScan((const uInt8*)pMap, fileStat.st_size, NULL, 0, &validLen);
+    if (numPages > 0) {
+        pPages = (dsmCkptPage*)malloc(numPages * sizeof(dsmCkptPage));
+    }
+    if (-1 == numPages || (numPages > 0 && NULL == pPages)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "[%s] is not a checkpoint of this node\n",
+                path);
+        munmap(pMap, fileStat.st_size);
+        errno = (-1 == numPages) ? EINVAL : ENOMEM;
+        dsmExitFunc();
+        return -1;
+    }
+    if (numPages > 0) {
+        /* a checkpoint cut short at the end is left out */
+        numPages = dsmCkptScan((const uInt8*)pMap, validLen, pPages, numPages, &validLen);
+        qsort(pPages, numPages, sizeof(dsmCkptPage), dsmCkptCmpPage);
+    }
+
+    /* the last record of a page is its latest; a drop leaves it out */
+    for (i = 0; i < (uInt32)numPages; i++) {
+        if ((i + 1 < (uInt32)numPages && pPages[i + 1].pageOffset == pPages[i].pageOffset) ||
+                NULL == pPages[i].pData) {
+            continue;
+        }
+        pPages[numLatest++] = pPages[i];
+    }
+
+    /* the pages are taken over a run of consecutive pages at a time; a
+     * page still elsewhere is taken by writing it */
+    for (i = 0; i < numLatest; i += run) {
+        for (run = 1; i + run < numLatest && run < DSM_MAX_BATCH_PAGES &&
+                pPages[i + run].pageOffset == pPages[i].pageOffset + run; run++);
+        if (!DSM_MULTI_WRITER()) {
+            dsm_prefetch(DSM_PAGE_ADDR(pPages[i].pageOffset), (size_t)run * DSM_PAGE_SIZE,
+                    DSM_ACCESS_WRITE);
+        }
+    }
+    for (i = 0; i < numLatest; i++) {
+        if (!dsmCkptInstallPage(pPages[i].pageOffset, pPages[i].pData)) {
+            memcpy(DSM_PAGE_ADDR(pPages[i].pageOffset), pPages[i].pData, DSM_PAGE_SIZE);
+            if (!dsmCkptInstallPage(pPages[i].pageOffset, pPages[i].pData)) {
+                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Page with offset [%u] not restored\n",
+                        pPages[i].pageOffset);
+                retval = -1;
+            }
+        }
+    }
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "[%u] pages restored from [%s]\n", numLatest, path);
+
+    free(pPages);
+    munmap(pMap, fileStat.st_size);
+    if (-1 == retval) {
+        errno = EAGAIN;
+    }
+    dsmExitFunc();
+    return retval;
+}
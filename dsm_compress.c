@@ -0,0 +1,361 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Page compression on the wire. A codec turns a page into fewer bytes or
+ * reports that it cannot; the sender tries the codecs agreed on with the
+ * requester in order and sends the page as it is if none shrinks it. The
+ * codec used is told in the rsp info of every page, so the receiver needs
+ * no state of its own.
+ */
+
+/* scratch buffers of the calling thread, the size of the largest page */
+static __thread uInt8*  pDsmEncodeBuf = NULL;
+static __thread uInt8*  pDsmDecodeBuf = NULL;
+
+/*
+ * encodes a page whose bytes are all the same as that byte
+ * Returns the encoded length, 0 if the page is not a fill
+ */
+uInt32 dsmFillEncode(const uInt8* pSrc, uInt32 srcLen, uInt8* pDst, uInt32 dstCap)
+{
+    if (dstCap < 1 || 0 != memcmp(pSrc, pSrc + 1, srcLen - 1)) {
+        return 0;
+    }
+    pDst[0] = pSrc[0];
+    return 1;
+}
+
+/*
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmFillDecode(const uInt8* pSrc, uInt32 srcLen, uInt8* pDst, uInt32 dstLen)
+{
+    if (1 != srcLen) {
+        return -1;
+    }
+    memset(pDst, pSrc[0], dstLen);
+    return 0;
+}
+
+/*
+ * writes a length in the extension bytes following a token nibble of 15
+ * Returns the new output position, -1 if the output is full
+ */
+int32 dsmLzPutLen(uInt8* pDst, int32 pos, uInt32 dstCap, uInt32 len)
+{
+    for (; len >= 255; len -= 255) {
+        if ((uInt32)pos >= dstCap) {
+            return -1;
+        }
+        pDst[pos++] = 255;
+    }
+    if ((uInt32)pos >= dstCap) {
+        return -1;
+    }
+    pDst[pos++] = (uInt8)len;
+    return pos;
+}
+
+/*
+ * writes a sequence: a token with the literal and match lengths, the
+ * literals, and the match as an offset back into the output; a match
+ * length of 0 ends the data with the literals alone
+ * Returns the new output position, -1 if the output is full
+ */
+int32 dsmLzPutSeq(uInt8* pDst, int32 pos, uInt32 dstCap, const uInt8* pLit,
+        uInt32 litLen, uInt32 offset, uInt32 matchLen)
+{
+    uInt32      matchCode = (matchLen > 0) ? matchLen - DSM_LZ_MIN_MATCH : 0;
+
+    if ((uInt32)pos >= dstCap) {
+        return -1;
+    }
+    pDst[pos++] = (uInt8)(((litLen < 15) ? litLen : 15) << 4) |
+        (uInt8)((matchCode < 15) ? matchCode : 15);
+    if (litLen >= 15 && -1 == (pos = dsmLzPutLen(pDst, pos, dstCap, litLen - 15))) {
+        return -1;
+    }
+    if ((uInt32)pos + litLen > dstCap) {
+        return -1;
+    }
+    memcpy(pDst + pos, pLit, litLen);
+    pos += litLen;
+    if (0 == matchLen) {
+        return pos;
+    }
+
+    if ((uInt32)pos + 2 > dstCap) {
+        return -1;
+    }
+    pDst[pos++] = (uInt8)(offset & 0xff);
+    pDst[pos++] = (uInt8)(offset >> 8);
+    if (matchCode >= 15 && -1 == (pos = dsmLzPutLen(pDst, pos, dstCap, matchCode - 15))) {
+        return -1;
+    }
+    return pos;
+}
+
+/*
+ * LZ77 compression in the style of LZ4: repeats of at least 4 bytes within
+ * the last 64KB are found with a hash of the next 4 bytes and sent as an
+ * offset and a length
+ * Returns the encoded length, 0 if it does not fit in dstCap
+ */
+uInt32 dsmLzEncode(const uInt8* pSrc, uInt32 srcLen, uInt8* pDst, uInt32 dstCap)
+{
+    uInt32      table[1 << DSM_LZ_HASH_BITS];
+    uInt32      ip = 0;
+    uInt32      anchor = 0;
+    uInt32      ref = 0;
+    uInt32      seq = 0;
+    uInt32      hash = 0;
+    uInt32      matchLen = 0;
+    int32       pos = 0;
+
+    memset(table, 0, sizeof(table));
+    while (srcLen > DSM_LZ_MIN_MATCH + 4 && ip < srcLen - DSM_LZ_MIN_MATCH - 4) {
+        memcpy(&seq, pSrc + ip, sizeof(uInt32));
+        hash = (seq * 2654435761U) >> (32 - DSM_LZ_HASH_BITS);
+        ref = table[hash];
+        table[hash] = ip;
+        if (ref >= ip || ip - ref > 0xffff || 0 != memcmp(pSrc + ref, &seq, sizeof(uInt32))) {
+            /* step faster through data that does not repeat */
+            ip += 1 + ((ip - anchor) >> DSM_LZ_SKIP_SHIFT);
+            continue;
+        }
+
+        matchLen = DSM_LZ_MIN_MATCH;
+        while (ip + matchLen < srcLen && pSrc[ref + matchLen] == pSrc[ip + matchLen]) {
+            matchLen += 1;
+        }
+        pos = dsmLzPutSeq(pDst, pos, dstCap, pSrc + anchor, ip - anchor, ip - ref, matchLen);
+        if (-1 == pos) {
+            return 0;
+        }
+        ip += matchLen;
+        anchor = ip;
+    }
+
+    pos = dsmLzPutSeq(pDst, pos, dstCap, pSrc + anchor, srcLen - anchor, 0, 0);
+    return (-1 == pos) ? 0 : (uInt32)pos;
+}
+
+/*
+ * reads a length in the extension bytes following a token nibble of 15
+ * Returns the new input position, -1 if the input ends first
+ */
+int32 dsmLzGetLen(const uInt8* pSrc, uInt32 pos, uInt32 srcLen, uInt32* pLen)
+{
+    uInt8       byte = 255;
+
+    while (255 == byte) {
+        if (pos >= srcLen) {
+            return -1;
+        }
+        byte = pSrc[pos++];
+        *pLen += byte;
+    }
+    return pos;
+}
+
+/*
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLzDecode(const uInt8* pSrc, uInt32 srcLen, uInt8* pDst, uInt32 dstLen)
+{
+    uInt32      ip = 0;
+    uInt32      op = 0;
+    uInt32      litLen = 0;
+    uInt32      matchLen = 0;
+    uInt32      offset = 0;
+    int32       pos = 0;
+    uInt8       token = 0;
+
+    while (ip < srcLen) {
+        token = pSrc[ip++];
+        litLen = token >> 4;
+        if (15 == litLen) {
+            if (-1 == (pos = dsmLzGetLen(pSrc, ip, srcLen, &litLen))) {
+                return -1;
+            }
+            ip = pos;
+        }
+        if (litLen > srcLen - ip || litLen > dstLen - op) {
+            return -1;
+        }
+        memcpy(pDst + op, pSrc + ip, litLen);
+        ip += litLen;
+        op += litLen;
+        if (ip == srcLen) {
+            break;
+        }
+
+        if (ip + 2 > srcLen) {
+            return -1;
+        }
+        offset = pSrc[ip] | (pSrc[ip + 1] << 8);
+        ip += 2;
+        matchLen = token & 0xf;
+        if (15 == matchLen) {
+            if (-1 == (pos = dsmLzGetLen(pSrc, ip, srcLen, &matchLen))) {
+                return -1;
+            }
+            ip = pos;
+        }
+        matchLen += DSM_LZ_MIN_MATCH;
+        if (0 == offset || offset > op || matchLen > dstLen - op) {
+            return -1;
+        }
+        if (offset >= matchLen) {
+            memcpy(pDst + op, pDst + op - offset, matchLen);
+            op += matchLen;
+            continue;
+        }
+        /* the match overlaps the bytes it produces */
+        for (; matchLen > 0; matchLen -= 1, op += 1) {
+            pDst[op] = pDst[op - offset];
+        }
+    }
+    return (op == dstLen) ? 0 : -1;
+}
+
+/* codecs by id, the order they are tried in; a node decodes all of them */
+static const dsmCodec dsmCodecs[DSM_NUM_CODECS] = {
+    {"raw",     NULL,           NULL},
+    {"fill",    dsmFillEncode,  dsmFillDecode},
+    {"lz",      dsmLzEncode,    dsmLzDecode},
+};
+
+/*
+ * Returns the name of a codec
+ */
+const char* dsmCodecName(uInt32 codec)
+{
+    return (codec < DSM_NUM_CODECS) ? dsmCodecs[codec].pName : "unknown";
+}
+
+/*
+ * encodes a page to be sent with the first codec up to maxCodec that
+ * shrinks it, into buf of DSM_PAGE_SIZE bytes, or into the scratch buffer
+ * of the calling thread if buf is NULL; the codec used and the length sent
+ * are set in the rsp info
+ * Returns the data to send, the page itself if it is sent as it is
+ */
+const uInt8* dsmEncodePage(const uInt8* pPage, uInt32 maxCodec, uInt8* pBuf,
+        dsmPageRspInfo* pRspInfo)
+{
+    uInt32      codec = 0;
+    uInt32      len = 0;
+
+    pRspInfo->codec = DSM_CODEC_RAW;
+    pRspInfo->dataLen = DSM_PAGE_SIZE;
+    if (DSM_CODEC_RAW == maxCodec) {
+        return pPage;
+    }
+    if (NULL == pBuf && NULL == pDsmEncodeBuf) {
+        pDsmEncodeBuf = (uInt8*)malloc(DSM_MAX_PAGE_SIZE);
+    }
+    if (NULL == pBuf) {
+        pBuf = pDsmEncodeBuf;
+    }
+    if (NULL == pBuf) {
+        return pPage;
+    }
+
+    for (codec = DSM_CODEC_RAW + 1; codec <= maxCodec && codec < DSM_NUM_CODECS;
+            codec += 1) {
+        /* a page that does not shrink by a tenth goes as it is */
+        len = dsmCodecs[codec].pEncode(pPage, DSM_PAGE_SIZE, pBuf,
+                DSM_PAGE_SIZE - DSM_PAGE_SIZE / 10);
+        if (len > 0) {
+            pRspInfo->codec = codec;
+            pRspInfo->dataLen = len;
+            return pBuf;
+        }
+    }
+    return pPage;
+}
+
+/*
+ * decodes the data of a page rcvd, into the scratch buffer of the calling
+ * thread unless it was sent as it is
+ * Returns the page, NULL on failure
+ */
+const uInt8* dsmDecodePage(const dsmPageRspInfo* pRspInfo, const uInt8* pData)
+{
+    if (DSM_CODEC_RAW == pRspInfo->codec) {
+        return pData;
+    }
+    if (pRspInfo->codec >= DSM_NUM_CODECS) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Unknown codec [%u] of page with offset "
+                "[%u]\n", pRspInfo->codec, pRspInfo->pageOffset);
+        return NULL;
+    }
+    if (NULL == pDsmDecodeBuf) {
+        pDsmDecodeBuf = (uInt8*)malloc(DSM_MAX_PAGE_SIZE);
+        if (NULL == pDsmDecodeBuf) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
+                    "bytes\n", DSM_MAX_PAGE_SIZE);
+            return NULL;
+        }
+    }
+    if (-1 == dsmCodecs[pRspInfo->codec].pDecode(pData, pRspInfo->dataLen,
+                pDsmDecodeBuf, DSM_PAGE_SIZE)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Corrupt [%s] data of page with offset "
+                "[%u]\n", dsmCodecName(pRspInfo->codec), pRspInfo->pageOffset);
+        return NULL;
+    }
+    return pDsmDecodeBuf;
+}
+
+/*
+ * picks the codec for the pages sent on the connection: the best one both
+ * this node and the peer are configured for
+ * Returns 0 on success, -1 on failure
+ */
+int dsmHelloReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmHelloInfo        helloInfo;
+    uInt8               msgBuf[DSM_MSG_HDR_LEN + sizeof(dsmHelloInfo)];
+    dsmMsg*             pMsg = (dsmMsg*)msgBuf;
+    int32               retval = 0;
+
+    dsmEnterFunc();
+    memcpy(&helloInfo, payload, sizeof(dsmHelloInfo));
+    pConn->codec = (helloInfo.codec < dsmConfig.compression) ?
+        helloInfo.codec : dsmConfig.compression;
+    if (pConn->codec >= DSM_NUM_CODECS) {
+        pConn->codec = DSM_CODEC_RAW;
+    }
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Pages to node [%u] compressed with [%s]\n",
+            helloInfo.nodeId, dsmCodecName(pConn->codec));
+
+    helloInfo.nodeId = dsmMmapInfo.nodeId;
+    helloInfo.codec = pConn->codec;
+    pMsg->msgType = DSM_MSG_HELLO_RSP;
+    pMsg->payloadLen = sizeof(dsmHelloInfo);
+    memcpy(pMsg->payload, &helloInfo, sizeof(dsmHelloInfo));
+    retval = dsmReplyMsg(pConn, pMsg);
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_HELLO_RSP]\n");
+    }
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Returns 0 on success, -1 on failure
+ */
+int dsmHelloRspHandler(void* payload)
+{
+    dsmHelloInfo        helloInfo;
+
+    memcpy(&helloInfo, payload, sizeof(dsmHelloInfo));
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Pages from node [%u] compressed with [%s]\n",
+            helloInfo.nodeId, dsmCodecName(helloInfo.codec));
+    return 0;
+}
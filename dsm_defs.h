@@ -14,22 +14,144 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <signal.h>
+#include <ucontext.h>
+#include <time.h>
 #include "dsm_types.h"
 
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE         (0x100000)          /* Linux 4.17 */
+#endif
 
-#define DSM_MAX_THREADS             (2)
+#define DSM_NUM_WORKER_THREADS      (4)     /* threads serving peer requests */
+#define DSM_MAX_THREADS             (DSM_WORKER_THREAD + DSM_NUM_WORKER_THREADS)
 #define DSM_MAX_IP_ADDR_LEN         (16)
-#define DSM_PAGE_SIZE               (4096)
+#define DSM_PAGE_SIZE               (dsmMmapInfo.pageSize)  /* coherence unit */
 #define DSM_DEF_PAGE_SIZE           (4096)
-#define DSM_MAX_PAGE_TABLE_ENTRY    (50000)
-#define DSM_MSG_HDR_LEN             (8)
-#define DSM_MAX_MSG_LEN             (DSM_PAGE_SIZE + DSM_MSG_HDR_LEN + sizeof(uInt32))
+#define DSM_MIN_PAGE_SIZE           (4096)              /* unit of numpagestoalloc */
+#define DSM_MAX_PAGE_SIZE           (2 * 1024 * 1024)
+#define DSM_HUGE_PAGE_SIZE          (2 * 1024 * 1024)
+#define DSM_REGION_BASE             (0x100000000000ULL) /* first address the master
+                                                           places the region at */
+#define DSM_REGION_PLACE_STEP       (0x100000000000ULL) /* between the next ones */
+#define DSM_REGION_PLACE_TRIES      (6)
+#define DSM_MSG_HDR_LEN             (12)
+#define DSM_MAX_BATCH_PAGES         (256)   /* pages moved in one batch msg */
+#define DSM_BATCH_PAGES             ((DSM_MAX_PAGE_SIZE / DSM_PAGE_SIZE < DSM_MAX_BATCH_PAGES) ? \
+                                     (DSM_MAX_PAGE_SIZE / DSM_PAGE_SIZE) : DSM_MAX_BATCH_PAGES)
+#define DSM_MAX_MSG_LEN             (DSM_MSG_HDR_LEN + sizeof(dsmPageBatchRspInfo) + \
+                                     DSM_MAX_BATCH_PAGES * sizeof(dsmPageRspInfo) + \
+                                     DSM_MAX_PAGE_SIZE)
+/* a lock or barrier msg holds up to a notice per page of the region */
+#define DSM_NOTICE_MSG_LEN          (DSM_MSG_HDR_LEN + sizeof(dsmLockMsgInfo) + \
+                                     sizeof(dsmBarrierMsgInfo) + \
+                                     dsmMmapInfo.numPagesToAlloc * sizeof(dsmWriteNotice))
+#define DSM_MAX_NOTICE_MSG_LEN      ((DSM_NOTICE_MSG_LEN > DSM_MAX_MSG_LEN) ? \
+                                     DSM_NOTICE_MSG_LEN : DSM_MAX_MSG_LEN)
+#define DSM_MASTER_NODE_ID          (0)
+#define DSM_MAX_FAULT_HOPS          (4)     /* redirects followed before retrying */
+#define DSM_BUSY_RETRY_US           (50)    /* backoff when the owner is busy */
+#define DSM_HOME_BLOCK_PAGES        (DSM_MAX_PAGE_SIZE / DSM_PAGE_SIZE) /* pages homed
+                                     together, so their mappings merge */
+#define DSM_HOME_NODE(pageOffset)   (((pageOffset) / DSM_HOME_BLOCK_PAGES) % dsmMmapInfo.numNodes)
+#define DSM_LOCK_MANAGER(lockId)    ((lockId) % dsmMmapInfo.numNodes)
+#define DSM_BARRIER_MANAGER(barrierId) ((barrierId) % dsmMmapInfo.numNodes)
+#define DSM_LOCK_MODE_NONE          (0)
+#define DSM_LOCK_MODE_SHARED        (1)
+#define DSM_LOCK_MODE_EXCL          (2)
+#define DSM_LOCK_TASK_RETURN        (0)     /* give a lock back to its manager */
+#define DSM_LOCK_TASK_REVOKE        (1)     /* manager: ask holders for a lock back */
+#define DSM_LOCK_TASK_RELEASE       (2)     /* manager: take a lock back, hand it on */
+#define DSM_ATOMIC_OP_FETCH_ADD     (0)
+#define DSM_ATOMIC_OP_EXCHANGE      (1)
+#define DSM_ATOMIC_OP_COMPARE_EXCHANGE (2)
+#define DSM_ATOMIC_STATUS_DONE      (0)
+#define DSM_ATOMIC_STATUS_REDIRECT  (1)     /* not the owner, or busy with the page */
+#define DSM_ATOMIC_STATUS_FAILED    (2)
+#define DSM_MULTI_WRITER()          (DSM_WRITE_MODE_SINGLE != dsmMmapInfo.writeMode)
+#define DSM_NODE_BIT(nodeId)        (1U << (nodeId))
+#define DSM_PTE_FLAG_INV_PENDING    (0x1)   /* invalidated while the pte was locked */
+#define DSM_PTE_FLAG_PROT_BUSY      (0x2)   /* page protection/contents being changed */
+#define DSM_PTE_FLAG_HOME_DIRTY     (0x4)   /* home page written since the last release */
+#define DSM_PTE_FLAG_CKPT_DIRTY     (0x8)   /* made writable since the last checkpoint */
+#define DSM_PTE_FLAG_CKPT_SAVED     (0x10)  /* in the checkpoint file of this node */
+#define DSM_PTE_FLAG_RELEASE        (0x20)  /* memory freed once the page leaves */
+#define DSM_PTE_CHUNK_PAGES         (4096)  /* page table entries set up together */
+#define DSM_PTE_READY(pageOffset)   (dsmPteChunkReady[(pageOffset) / DSM_PTE_CHUNK_PAGES])
+#define DSM_PTE(pageOffset)         (*(DSM_PTE_READY(pageOffset) ? \
+                                       &dsmPageTable[pageOffset] : dsmInitPteChunk(pageOffset)))
+#define DSM_PAGE_META(pageOffset)   (dsmPageMeta[pageOffset])
+#define DSM_PAGE_ADVICE(pageOffset) (dsmPageAdvice[pageOffset])   /* DSM_ADVICE_* */
+#define DSM_PAGE_ADDR(pageOffset)   ((uInt8*)pDsmSharedRegion + \
+                                     (size_t)(pageOffset) * DSM_PAGE_SIZE)
+#define DSM_PAGE_ALIAS(pageOffset)  ((uInt8*)pDsmRegionAlias + \
+                                     (size_t)(pageOffset) * DSM_PAGE_SIZE)
+#define DSM_MAX_CONNECTIONS         (2 * DSM_MAX_NODES)
+#define DSM_CONNECT_RETRY_US        (100)
+#define DSM_CONNECT_MAX_RETRY_US    (100000)
+#define DSM_MAX_EPOLL_EVENTS        (16)
+#define DSM_LOCAL_TRANSPORT         (1)     /* unix sockets to peers on this host */
+#define DSM_LOCAL_SOCK_NAME         "dsm.%s.%d"     /* abstract, from the tcp addr */
+#define DSM_PREFETCH_MAX_PAGES      (16)    /* default cap of the prefetch window */
+#define DSM_PREFETCH_MAX_MASK_PAGES (32)    /* bits of dsmPageReqInfo.prefetchMask */
+#define DSM_PREFETCH_MAX_BYTES      (4 * 1024 * 1024)
+#define DSM_PREFETCH_HOLD_MS        (5)     /* owner keeps pages written this recently */
+#define DSM_HOLD_WINDOW_US          (1000)  /* default cap of the ownership hold window */
+#define DSM_MAX_HOLD_WINDOW_US      (100000)
+#define DSM_HOLD_MIN_US             (50)    /* first window of a page coming back fast */
+#define DSM_HOLD_PINGPONG_US        (500)   /* back within this plus twice the window */
+#define DSM_MAX_STATS_DUMP_MS       (3600 * 1000)
+
+/* events of the binary trace, see dsm_trace_start() */
+#define DSM_EVENT_FAULT             (1)     /* fault taken */
+#define DSM_EVENT_FAULT_DONE        (2)     /* fault served; arg: ns it took */
+#define DSM_EVENT_REQ_SENT          (3)     /* page asked of the peer */
+#define DSM_EVENT_PAGE_SERVED       (4)     /* page sent to the peer */
+#define DSM_EVENT_PAGE_INSTALLED    (5)     /* page rcvd; peer: sender if known */
+#define DSM_EVENT_INVALIDATED       (6)     /* copy dropped; peer: node that asked */
+#define DSM_EVENT_DROPPED           (7)     /* arg: events lost to a full ring */
+#define DSM_NUM_EVENTS              (8)
+#define DSM_EVENT_FLAG_WRITE        (0x1)   /* write fault, ownership moved */
+#define DSM_TRACE_NO_PEER           (0xff)
+#define DSM_TRACE_MAGIC             "DSMTRACE"
+#define DSM_TRACE_VERSION           (1)
+#define DSM_TRACE_FLUSH_US          (10000) /* rings written to the file this often */
+#define DSM_TRACE_EVENT(event, pageOffset, peerId, flags, arg) \
+    do { \
+        if (dsmTraceOn) { \
+            dsmTraceRecord((event), (pageOffset), (peerId), (flags), (arg)); \
+        } \
+    } while (0)
+
+/* records of a checkpoint file, see dsm_checkpoint() */
+#define DSM_CKPT_MAGIC              "DSMCKPT"
+#define DSM_CKPT_VERSION            (1)
+#define DSM_CKPT_TAG_BEGIN          (1)     /* value: wall clock ns */
+#define DSM_CKPT_TAG_PAGE           (2)     /* the page follows */
+#define DSM_CKPT_TAG_DROP           (3)     /* page saved before, owned elsewhere now */
+#define DSM_CKPT_TAG_END            (4)     /* value: records since the begin */
+
+/* page codecs, in the order they are tried; see DSM_COMPRESS_* */
+#define DSM_CODEC_RAW               (0)
+#define DSM_CODEC_FILL              (1)
+#define DSM_CODEC_LZ                (2)
+#define DSM_NUM_CODECS              (3)
+#define DSM_LZ_MIN_MATCH            (4)
+#define DSM_LZ_HASH_BITS            (11)
+#define DSM_LZ_SKIP_SHIFT           (5)     /* step grows by 1 every 32 misses */
 
 extern void*                pDsmSharedRegion;
+extern volatile bool        dsmTraceOn;
+extern void*                pDsmRegionAlias;    /* writable view, see dsmMapRegionAlias() */
 extern int*                 pDsmMasterInitAddr;
 extern dsmSocketInfo        dsmSockInfo;
+extern dsmConnQueue         dsmReadyConns;
+extern dsmPeerInfo          dsmPeers[DSM_MAX_NODES];
 extern dsmMapInitInfo       dsmMmapInfo;
-extern dsmPageTableEntry    dsmPageTable[DSM_MAX_PAGE_TABLE_ENTRY];
+extern dsmConfigInfo        dsmConfig;
+extern dsmPageTableEntry*   dsmPageTable;
+extern dsmPageMetaEntry*    dsmPageMeta;
+extern volatile uInt8*      dsmPteChunkReady;
+extern volatile uInt8*      dsmPageAdvice;
 
 
 #ifdef DSM_ENABLE_LOG
@@ -0,0 +1,565 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Multiple writers: a node writes its copy of a page homed elsewhere after
+ * saving a twin of it; at dsm_sync() the bytes that differ from the twin
+ * are sent to the home as runs and merged into the home copy, so writers of
+ * different parts of a page do not take it from each other.
+ */
+
+static pthread_mutex_t  dsmFlushMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   dsmFlushCondVar = PTHREAD_COND_INITIALIZER;
+static uInt32           dsmFlushesPending = 0;  /* pages diffed, not acked yet */
+
+/*
+ * counts the writes of numPages pages taken out of their twins (or closed
+ * at the home) and not yet acked by the home; the twins are shared by the
+ * threads of the node, so a release waits for those of the other threads
+ * Returns void
+ */
+void dsmFlushBegin(uInt32 numPages)
+{
+    pthread_mutex_lock(&dsmFlushMutex);
+    dsmFlushesPending += numPages;
+    pthread_mutex_unlock(&dsmFlushMutex);
+}
+
+/*
+ * the writes of numPages pages counted by dsmFlushBegin() are acked
+ * Returns void
+ */
+void dsmFlushEnd(uInt32 numPages)
+{
+    pthread_mutex_lock(&dsmFlushMutex);
+    dsmFlushesPending -= numPages;
+    if (0 == dsmFlushesPending) {
+        pthread_cond_broadcast(&dsmFlushCondVar);
+    }
+    pthread_mutex_unlock(&dsmFlushMutex);
+}
+
+/*
+ * waits until the writes taken out of the twins here are all acked
+ * Returns void
+ */
+void dsmFlushWait(void)
+{
+    pthread_mutex_lock(&dsmFlushMutex);
+    while (0 != dsmFlushesPending) {
+        pthread_cond_wait(&dsmFlushCondVar, &dsmFlushMutex);
+    }
+    pthread_mutex_unlock(&dsmFlushMutex);
+}
+
+/*
+ * makes a twin of the read-only copy of a page and gives write access to
+ * it. Must be called with the page lock held.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmMakeTwin(uInt32 pageOffset)
+{
+    uInt8*      pTwin = NULL;
+
+    pTwin = (uInt8*)malloc(DSM_PAGE_SIZE);
+    if (NULL == pTwin) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for twin of "
+                "page with offset [%u]\n", pageOffset);
+        return -1;
+    }
+    memcpy(pTwin, DSM_PAGE_ADDR(pageOffset),
+            DSM_PAGE_SIZE);
+    DSM_PAGE_META(pageOffset).pTwin = pTwin;
+    dsmSetPageAccess(pageOffset, PROT_READ | PROT_WRITE);
+    DSM_PTE(pageOffset).pageStatus = DSM_PAGE_PRESENT;
+    return 0;
+}
+
+/*
+ * encodes the bytes of a page that differ from its twin, from *pStart on,
+ * as runs into buf; a run that does not fit is split. *pStart is moved
+ * past the bytes encoded, to the page size once the page is done.
+ * Returns the number of bytes written to buf
+ */
+uInt32 dsmEncodeDiff(const uInt8* pPage, const uInt8* pTwin, uInt32* pStart,
+        uInt8* pBuf, uInt32 bufLen)
+{
+    dsmDiffRun  run;
+    uInt32      i = *pStart;
+    uInt32      len = 0;
+
+    while (i < DSM_PAGE_SIZE) {
+        /* skip the bytes left as they were, a word at a time */
+        while (i + sizeof(long) <= DSM_PAGE_SIZE &&
+                0 == memcmp(pPage + i, pTwin + i, sizeof(long))) {
+            i += sizeof(long);
+        }
+        while (i < DSM_PAGE_SIZE && pPage[i] == pTwin[i]) {
+            i += 1;
+        }
+        if (i >= DSM_PAGE_SIZE) {
+            break;
+        }
+        if (len + sizeof(dsmDiffRun) >= bufLen) {
+            break;
+        }
+
+        run.offset = i;
+        while (i < DSM_PAGE_SIZE && pPage[i] != pTwin[i] &&
+                len + sizeof(dsmDiffRun) + (i - run.offset) < bufLen) {
+            i += 1;
+        }
+        run.length = i - run.offset;
+        memcpy(pBuf + len, &run, sizeof(dsmDiffRun));
+        memcpy(pBuf + len + sizeof(dsmDiffRun), pPage + run.offset, run.length);
+        len += sizeof(dsmDiffRun) + run.length;
+    }
+
+    *pStart = i;
+    return len;
+}
+
+/*
+ * merges the runs of a diff into the copy of a page homed here and bumps
+ * the version of the page; the prot lock keeps the page mapped and
+ * writable while the runs are copied. A home copy write protected for lazy
+ * release is opened meanwhile, so a write of the home may slip through
+ * unnoted; the page is noted as written by the home to cover it.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmApplyDiff(uInt32 pageOffset, const uInt8* pDiff, uInt32 diffLen,
+        uInt32* pVersion)
+{
+    dsmDiffRun  run;
+    uInt8*      pageBaseAddr = NULL;
+    uInt32      pos = 0;
+    bool        isReadOnly = false;
+
+    pageBaseAddr = DSM_PAGE_ADDR(pageOffset);
+    dsmLockPageProt(pageOffset);
+    isReadOnly = (DSM_PAGE_READ_ONLY == DSM_PTE(pageOffset).pageStatus);
+    if (isReadOnly) {
+        dsmSetPageAccess(pageOffset, PROT_READ | PROT_WRITE);
+    }
+    else if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+        dsmUffdPopulatePage(pageOffset, PROT_READ | PROT_WRITE);
+    }
+    while (pos + sizeof(dsmDiffRun) <= diffLen) {
+        memcpy(&run, pDiff + pos, sizeof(dsmDiffRun));
+        pos += sizeof(dsmDiffRun);
+        if (run.offset >= DSM_PAGE_SIZE || run.length > DSM_PAGE_SIZE - run.offset ||
+                run.length > diffLen - pos) {
+            break;
+        }
+        memcpy(pageBaseAddr + run.offset, pDiff + pos, run.length);
+        pos += run.length;
+    }
+    if (isReadOnly) {
+        dsmSetPageAccess(pageOffset, PROT_READ);
+        __sync_fetch_and_or(&DSM_PTE(pageOffset).pteFlags, DSM_PTE_FLAG_HOME_DIRTY);
+    }
+    /* bumped after the copy; a copy sent with the new version has the runs */
+    *pVersion = __sync_add_and_fetch(&DSM_PAGE_META(pageOffset).pageVersion, 1);
+    dsmUnlockPageProt(pageOffset);
+
+    if (pos != diffLen) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid diff of [%u] bytes for page with "
+                "offset [%u]\n", diffLen, pageOffset);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * merges the diffs rcvd into the pages homed here and acks them with the
+ * write notices of the pages; the page locks are not taken, the writers of
+ * the pages here are not waited for
+ * Returns 0 on success, -1 on failure
+ */
+int dsmDiffReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmDiffBatchInfo    batchInfo;
+    dsmDiffInfo         diffInfo;
+    dsmNoticeBatchInfo  noticeInfo;
+    dsmWriteNotice*     pNotices = NULL;
+    dsmMsg*             pRspMsg = NULL;
+    dsmMsg*             pMsgHdr = NULL;
+    uInt32              version = 0;
+    uInt8*              pEnd = NULL;
+    uInt8*              pPos = NULL;
+    uInt32              i = 0;
+    int32               retval = 0;
+
+    dsmEnterFunc();
+    memcpy(&batchInfo, payload, sizeof(dsmDiffBatchInfo));
+    /* the payload follows the msg header in the buffer rcvd */
+    pMsgHdr = (dsmMsg*)((uInt8*)payload - DSM_MSG_HDR_LEN);
+    pEnd = (uInt8*)payload + pMsgHdr->payloadLen;
+    pPos = (uInt8*)payload + sizeof(dsmDiffBatchInfo);
+
+    /* a notice per diff at most, each diff takes more room than its notice */
+    pRspMsg = (dsmMsg*)malloc(DSM_MSG_HDR_LEN + sizeof(dsmNoticeBatchInfo) +
+            pMsgHdr->payloadLen);
+    if (NULL == pRspMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
+                "bytes\n", DSM_MSG_HDR_LEN + sizeof(dsmNoticeBatchInfo) +
+                pMsgHdr->payloadLen);
+        dsmExitFunc();
+        return -1;
+    }
+    pNotices = (dsmWriteNotice*)(pRspMsg->payload + sizeof(dsmNoticeBatchInfo));
+    noticeInfo.numNotices = 0;
+
+    for (i = 0; i < batchInfo.numDiffs; i += 1) {
+        if (pPos + sizeof(dsmDiffInfo) > pEnd) {
+            break;
+        }
+        memcpy(&diffInfo, pPos, sizeof(dsmDiffInfo));
+        pPos += sizeof(dsmDiffInfo);
+        if (diffInfo.pageOffset >= dsmMmapInfo.numPagesToAlloc ||
+                !DSM_PTE(diffInfo.pageOffset).owner ||
+                diffInfo.diffLen > (uInt32)(pEnd - pPos) ||
+                -1 == dsmApplyDiff(diffInfo.pageOffset, pPos, diffInfo.diffLen,
+                    &version)) {
+            break;
+        }
+        pPos += diffInfo.diffLen;
+
+        /* the diff of a page split over entries gets one notice */
+        if (0 == noticeInfo.numNotices ||
+                pNotices[noticeInfo.numNotices - 1].pageOffset != diffInfo.pageOffset) {
+            noticeInfo.numNotices += 1;
+        }
+        pNotices[noticeInfo.numNotices - 1].pageOffset = diffInfo.pageOffset;
+        pNotices[noticeInfo.numNotices - 1].version = version;
+    }
+    if (i != batchInfo.numDiffs) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid diff [%u] of [%u] rcvd\n", i,
+                batchInfo.numDiffs);
+    }
+
+    pRspMsg->msgType = DSM_MSG_DIFF_RSP;
+    pRspMsg->payloadLen = sizeof(dsmNoticeBatchInfo) +
+        noticeInfo.numNotices * sizeof(dsmWriteNotice);
+    memcpy(pRspMsg->payload, &noticeInfo, sizeof(dsmNoticeBatchInfo));
+    retval = dsmReplyMsg(pConn, pRspMsg);
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_DIFF_RSP]\n");
+    }
+    free(pRspMsg);
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * notes the write notices of the diffs merged at a home
+ * Returns 0 on success, -1 on failure
+ */
+int dsmDiffRspHandler(void* payload)
+{
+    dsmNoticeBatchInfo  noticeInfo;
+    dsmWriteNotice      notice;
+    uInt32              i = 0;
+
+    memcpy(&noticeInfo, payload, sizeof(dsmNoticeBatchInfo));
+    for (i = 0; i < noticeInfo.numNotices; i += 1) {
+        memcpy(&notice, (uInt8*)payload + sizeof(dsmNoticeBatchInfo) +
+                i * sizeof(dsmWriteNotice), sizeof(dsmWriteNotice));
+        dsmNoteWrite(notice.pageOffset, notice.version);
+    }
+    return 0;
+}
+
+/*
+ * sends the diffs collected in msg to the home node and waits for the ack
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmSendDiffs(uInt32 homeId, dsmMsg* pMsg)
+{
+    dsmDiffBatchInfo    batchInfo;
+
+    memcpy(&batchInfo, pMsg->payload, sizeof(dsmDiffBatchInfo));
+    if (0 == batchInfo.numDiffs) {
+        return 0;
+    }
+    dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Sending [%u] diffs of [%u] bytes to node "
+            "[%u]\n", batchInfo.numDiffs, pMsg->payloadLen, homeId);
+    if (-1 == dsmSendAndRecv(&dsmPeers[homeId], pMsg)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_DIFF_REQ]\n");
+        return -1;
+    }
+
+    batchInfo.numDiffs = 0;
+    memcpy(pMsg->payload, &batchInfo, sizeof(dsmDiffBatchInfo));
+    pMsg->payloadLen = sizeof(dsmDiffBatchInfo);
+    return 0;
+}
+
+/*
+ * starts a msg of diffs
+ * Returns void
+ */
+void dsmInitDiffMsg(dsmMsg* pMsg)
+{
+    dsmDiffBatchInfo    batchInfo;
+
+    pMsg->msgType = DSM_MSG_DIFF_REQ;
+    pMsg->payloadLen = sizeof(dsmDiffBatchInfo);
+    batchInfo.numDiffs = 0;
+    memcpy(pMsg->payload, &batchInfo, sizeof(dsmDiffBatchInfo));
+}
+
+/*
+ * diffs a twinned page against its twin into pMsg, sending the msg to the
+ * home when full. The page is write protected before it is diffed and
+ * stays a read-only copy; writes to it afterwards make a new twin. The
+ * caller ends the flush with dsmFlushEnd() once the msg is acked. Must be
+ * called with the page lock held.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmDiffPage(uInt32 page, dsmMsg* pMsg)
+{
+    dsmDiffBatchInfo    batchInfo;
+    dsmDiffInfo         diffInfo;
+    uInt8*              pageBaseAddr = NULL;
+    uInt32              homeId = DSM_HOME_NODE(page);
+    uInt32              start = 0;
+    int32               retval = 0;
+
+    /* the writers of the page wait for the diff */
+    dsmFlushBegin(1);
+    dsmSetPageAccess(page, PROT_READ);
+    pageBaseAddr = DSM_PAGE_ADDR(page);
+    while (start < DSM_PAGE_SIZE) {
+        if (pMsg->payloadLen + sizeof(dsmDiffInfo) + sizeof(dsmDiffRun) >=
+                DSM_MAX_MSG_LEN - DSM_MSG_HDR_LEN &&
+                -1 == dsmSendDiffs(homeId, pMsg)) {
+            retval = -1;
+            break;
+        }
+        diffInfo.pageOffset = page;
+        diffInfo.diffLen = dsmEncodeDiff(pageBaseAddr, DSM_PAGE_META(page).pTwin,
+                &start, pMsg->payload + pMsg->payloadLen + sizeof(dsmDiffInfo),
+                DSM_MAX_MSG_LEN - DSM_MSG_HDR_LEN - pMsg->payloadLen -
+                sizeof(dsmDiffInfo));
+        if (diffInfo.diffLen > 0) {
+            memcpy(pMsg->payload + pMsg->payloadLen, &diffInfo, sizeof(dsmDiffInfo));
+            pMsg->payloadLen += sizeof(dsmDiffInfo) + diffInfo.diffLen;
+            memcpy(&batchInfo, pMsg->payload, sizeof(dsmDiffBatchInfo));
+            batchInfo.numDiffs += 1;
+            memcpy(pMsg->payload, &batchInfo, sizeof(dsmDiffBatchInfo));
+        }
+        if (start < DSM_PAGE_SIZE && -1 == dsmSendDiffs(homeId, pMsg)) {
+            retval = -1;
+            break;
+        }
+    }
+
+    free(DSM_PAGE_META(page).pTwin);
+    DSM_PAGE_META(page).pTwin = NULL;
+    DSM_PTE(page).pageStatus = DSM_PAGE_READ_ONLY;
+    dsmWakePte(page);
+    return retval;
+}
+
+/*
+ * diffs the twinned pages given, all homed at homeId, against their twins
+ * and sends the diffs to the home, as many to a msg as fit.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmFlushDiffs(uInt32 homeId, const uInt32* pPages, uInt32 numPages, dsmMsg* pMsg)
+{
+    uInt32              numDiffed = 0;
+    uInt32              page = 0;
+    uInt32              i = 0;
+    int32               retval = 0;
+
+    dsmInitDiffMsg(pMsg);
+    for (i = 0; i < numPages && 0 == retval; i += 1) {
+        page = pPages[i];
+        dsmLockPte(page);
+        if (NULL != DSM_PAGE_META(page).pTwin) {
+            retval = dsmDiffPage(page, pMsg);
+            numDiffed += 1;
+        }
+        dsmUnlockPte(page);
+    }
+
+    if (0 == retval) {
+        retval = dsmSendDiffs(homeId, pMsg);
+    }
+    dsmFlushEnd(numDiffed);
+    return retval;
+}
+
+/*
+ * drops the copy of a page homed elsewhere, so that the next access
+ * fetches the page with the diffs merged at its home since; the writes
+ * made to the copy are sent to the home first. Must be called with the
+ * page lock held.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmDropCopy(uInt32 page, dsmMsg* pMsg)
+{
+    int32       retval = 0;
+
+    if (NULL != DSM_PAGE_META(page).pTwin) {
+        dsmInitDiffMsg(pMsg);
+        retval = dsmDiffPage(page, pMsg);
+        if (0 == retval) {
+            retval = dsmSendDiffs(DSM_HOME_NODE(page), pMsg);
+        }
+        dsmFlushEnd(1);
+        if (-1 == retval) {
+            return -1;
+        }
+    }
+    if (!DSM_PTE(page).owner &&
+            DSM_PAGE_READ_ONLY == DSM_PTE(page).pageStatus) {
+        dsmSetPageAccess(page, PROT_NONE);
+        DSM_PTE(page).pageStatus = DSM_PAGE_NOT_PRESENT;
+        DSM_TRACE_EVENT(DSM_EVENT_INVALIDATED, page, DSM_TRACE_NO_PEER, 0, 0);
+    }
+    return 0;
+}
+
+/*
+ * drops the copies of the pages homed elsewhere; pages written since their
+ * diffs were sent are diffed again first
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmDropCopies(void)
+{
+    dsmMsg*     pMsg = NULL;
+    uInt32      page = 0;
+    int32       retval = 0;
+
+    /* a page being fetched is waited for; the copy may predate the acquire */
+    for (page = 0; page < dsmMmapInfo.numPagesToAlloc; page += 1) {
+        if (!DSM_PTE_READY(page)) {
+            page |= DSM_PTE_CHUNK_PAGES - 1;    /* chunk never used */
+            continue;
+        }
+        if (DSM_PTE(page).owner ||
+                (DSM_PAGE_NOT_PRESENT == DSM_PTE(page).pageStatus &&
+                 NULL == DSM_PAGE_META(page).pTwin)) {
+            continue;
+        }
+        if (NULL == pMsg && NULL == (pMsg = (dsmMsg*)malloc(DSM_MAX_MSG_LEN))) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                    "bytes\n", DSM_MAX_MSG_LEN);
+            return -1;
+        }
+        dsmLockPte(page);
+        if (-1 == dsmDropCopy(page, pMsg)) {
+            retval = -1;
+        }
+        dsmUnlockPte(page);
+    }
+    free(pMsg);
+    return retval;
+}
+
+/*
+ * sends the diffs of the pages written here to their homes, grouped by
+ * home; with lazy release the home also notes the writes to its own pages
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmReleaseWrites(void)
+{
+    dsmMsg*     pMsg = NULL;
+    uInt32*     pPages = NULL;
+    uInt32*     pHome = NULL;
+    uInt32      numPages = 0;
+    uInt32      numHome = 0;
+    uInt32      homeId = 0;
+    uInt32      page = 0;
+    uInt32      i = 0;
+    int32       retval = 0;
+
+    if (DSM_WRITE_MODE_LAZY_RELEASE == dsmMmapInfo.writeMode) {
+        dsmCloseHomeWrites();
+    }
+
+    /* the twins are read without the page locks; rechecked when diffed */
+    for (page = 0; page < dsmMmapInfo.numPagesToAlloc; page += 1) {
+        if (!DSM_PTE_READY(page)) {
+            page |= DSM_PTE_CHUNK_PAGES - 1;    /* chunk never used */
+            continue;
+        }
+        if (NULL != DSM_PAGE_META(page).pTwin) {
+            break;
+        }
+    }
+    if (page >= dsmMmapInfo.numPagesToAlloc) {
+        dsmFlushWait();
+        return 0;
+    }
+
+    pMsg = (dsmMsg*)malloc(DSM_MAX_MSG_LEN);
+    pPages = (uInt32*)malloc(2 * dsmMmapInfo.numPagesToAlloc * sizeof(uInt32));
+    if (NULL == pMsg || NULL == pPages) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for sync\n");
+        free(pMsg);
+        free(pPages);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for (; page < dsmMmapInfo.numPagesToAlloc; page += 1) {
+        if (!DSM_PTE_READY(page)) {
+            page |= DSM_PTE_CHUNK_PAGES - 1;    /* chunk never used */
+            continue;
+        }
+        if (NULL != DSM_PAGE_META(page).pTwin) {
+            pPages[numPages++] = page;
+        }
+    }
+
+    pHome = pPages + numPages;
+    for (homeId = 0; homeId < dsmMmapInfo.numNodes && 0 == retval; homeId += 1) {
+        numHome = 0;
+        for (i = 0; i < numPages; i += 1) {
+            if (DSM_HOME_NODE(pPages[i]) == homeId) {
+                pHome[numHome++] = pPages[i];
+            }
+        }
+        retval = dsmFlushDiffs(homeId, pHome, numHome, pMsg);
+    }
+    if (-1 == retval) {
+        errno = EIO;
+    }
+    /* the writes other threads took out of the twins before are acked too */
+    dsmFlushWait();
+
+    free(pMsg);
+    free(pPages);
+    return retval;
+}
+
+/*
+ * with multiple writers, sends the diffs of the pages written here to their
+ * homes and drops the copies of pages homed elsewhere
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_sync(void)
+{
+    int32       retval = 0;
+
+    dsmEnterFunc();
+    if (!DSM_MULTI_WRITER()) {
+        dsmExitFunc();
+        return 0;
+    }
+
+    retval = dsmReleaseWrites();
+    if (0 == retval) {
+        retval = dsmDropCopies();
+    }
+    dsmExitFunc();
+    return retval;
+}
@@ -0,0 +1,101 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Ownership hysteresis: a page that came here for writing is kept for a
+ * window of time before a request for it is honoured, so that a page two
+ * nodes keep writing is used between the transfers instead of spending its
+ * time on the wire. Requests within the window are told the owner is busy
+ * and retried. Each page has its own window: it doubles, from
+ * DSM_HOLD_MIN_US up to the cap set with DSM_OPT_HOLD_WINDOW_US, every time
+ * the page comes back soon after it was given up, and halves when it comes
+ * back late, so pages nobody competes for are not held at all.
+ */
+
+/*
+ * Returns the current time in microseconds, wrapping around
+ */
+uInt32 dsmNowUs(void)
+{
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uInt32)(now.tv_sec * 1000000 + now.tv_nsec / 1000);
+}
+
+/*
+ * adapts the window of a page that came here to be written to how soon it
+ * came back since it was last given up. Must be called with the page lock
+ * held.
+ * Returns void
+ */
+void dsmHoldAcquired(uInt32 pageOffset)
+{
+    dsmPageMetaEntry*   pMeta = &DSM_PAGE_META(pageOffset);
+    uInt32              now = dsmNowUs();
+    uInt32              holdUs = pMeta->holdUs;
+
+    pMeta->acquireTimeUs = now;
+    if (0 == dsmConfig.holdWindowUs) {
+        pMeta->holdUs = 0;
+        return;
+    }
+
+    /* the other writers hold it about as long as it is held here */
+    if (0 != pMeta->lossTimeUs &&
+            now - pMeta->lossTimeUs < 2 * holdUs + DSM_HOLD_PINGPONG_US) {
+        holdUs = (0 == holdUs) ? DSM_HOLD_MIN_US : 2 * holdUs;
+        if (holdUs > dsmConfig.holdWindowUs) {
+            holdUs = dsmConfig.holdWindowUs;
+        }
+    }
+    else {
+        holdUs /= 2;
+        if (holdUs < DSM_HOLD_MIN_US) {
+            holdUs = 0;
+        }
+    }
+    if (holdUs != pMeta->holdUs) {
+        dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Hold window of page with offset [%u] "
+                "now [%u] us\n", pageOffset, holdUs);
+    }
+    pMeta->holdUs = holdUs;
+}
+
+/*
+ * notes that the ownership of a page was given up. Must be called with the
+ * page lock held.
+ * Returns void
+ */
+void dsmHoldLost(uInt32 pageOffset)
+{
+    DSM_PAGE_META(pageOffset).lossTimeUs = dsmNowUs();
+}
+
+/*
+ * tells whether a request for a page owned here is put off because the page
+ * is within its window; a read only takes the page away from a writer, so
+ * it is put off only while the page is writable here. With multiple writers
+ * pages stay at their homes and are never held, nor are pages advised read
+ * mostly. Must be called with the
+ * page lock held.
+ * Returns true if the requester is to retry later
+ */
+bool dsmPageHeld(uInt32 pageOffset, bool isWrite)
+{
+    dsmPageMetaEntry*   pMeta = &DSM_PAGE_META(pageOffset);
+
+    if (DSM_MULTI_WRITER() || 0 == pMeta->holdUs ||
+            DSM_ADVICE_READ_MOSTLY == DSM_PAGE_ADVICE(pageOffset) ||
+            (!isWrite && DSM_PAGE_PRESENT != DSM_PTE(pageOffset).pageStatus)) {
+        return false;
+    }
+    if (dsmNowUs() - pMeta->acquireTimeUs >= pMeta->holdUs) {
+        return false;
+    }
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Holding page with offset [%u] for [%u] us\n",
+            pageOffset, pMeta->holdUs);
+    return true;
+}
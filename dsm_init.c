@@ -6,49 +6,266 @@
 
 /* Global definitions */
 void*               pDsmSharedRegion = NULL;
+void*               pDsmRegionAlias = NULL;
 int32*                pDsmMasterInitAddr = NULL;
 dsmMapInitInfo      dsmMmapInfo;
-dsmPageTableEntry   dsmPageTable[DSM_MAX_PAGE_TABLE_ENTRY];
+dsmConfigInfo       dsmConfig = {DSM_FAULT_ENGINE_SIGSEGV, DSM_DEF_PAGE_SIZE,
+                                 DSM_PREFETCH_MAX_PAGES, DSM_WRITE_MODE_SINGLE,
+                                 DSM_COMPRESS_NONE, DSM_HOLD_WINDOW_US, 0,
+                                 DSM_LOCAL_TRANSPORT, NULL};
+
+/*
+ * Maps len bytes for the shared region, at pAddr if given and anywhere
+ * aligned to the coherence unit otherwise, from the start of the file fd
+ * if it is not -1. A mapping already at pAddr is never replaced. Units of
+ * DSM_HUGE_PAGE_SIZE are backed by hugetlb pages when the system has them
+ * reserved and by transparent huge pages otherwise.
+ * Returns the base addr on success, MAP_FAILED on failure
+ */
+void* dsmMapRegion(void* pAddr, unsigned long len, int32 prot, int32 flags, int32 fd)
+{
+    uInt8*          pRegion = (uInt8*)MAP_FAILED;
+    uInt8*          pAligned = NULL;
+    int32           isHuge = (DSM_HUGE_PAGE_SIZE == DSM_PAGE_SIZE);
+
+    dsmEnterFunc();
+    if (NULL != pAddr) {
+        flags |= MAP_FIXED_NOREPLACE;
+    }
+
+    /* userfaultfd support of hugetlb pages varies with the kernel */
+    if (isHuge && DSM_FAULT_ENGINE_SIGSEGV == dsmConfig.faultEngine && -1 == fd) {
+        pRegion = (uInt8*)mmap(pAddr, len, prot, flags | MAP_HUGETLB, -1, 0);
+        if (MAP_FAILED == (void*)pRegion) {
+            dsmPrintLog(DSM_TRACE_TYPE_WARN, "No hugetlb pages, errno: [%d]; using "
+                    "transparent huge pages\n", errno);
+        }
+    }
+
+    /* memory is committed as the pages are used, not for the whole region */
+    flags |= MAP_NORESERVE;
+    if (MAP_FAILED != (void*)pRegion) {
+        isHuge = 0;
+    }
+    else if (NULL != pAddr) {
+        pRegion = (uInt8*)mmap(pAddr, len, prot, flags, fd, 0);
+    }
+    else {
+        /* map a unit more than needed and trim it to an aligned base; a
+         * file is then mapped from its start over the space so reserved */
+        pRegion = (uInt8*)mmap(NULL, len + DSM_PAGE_SIZE, (-1 == fd) ? prot : PROT_NONE,
+                (-1 == fd) ? flags : (MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE), -1, 0);
+        if (MAP_FAILED != (void*)pRegion) {
+            pAligned = (uInt8*)(((unsigned long)pRegion + DSM_PAGE_SIZE - 1) &
+                    ~((unsigned long)DSM_PAGE_SIZE - 1));
+            if (pAligned != pRegion) {
+                munmap(pRegion, pAligned - pRegion);
+            }
+            munmap(pAligned + len, DSM_PAGE_SIZE - (pAligned - pRegion));
+            pRegion = pAligned;
+        }
+        if (MAP_FAILED != (void*)pRegion && -1 != fd &&
+                MAP_FAILED == mmap(pRegion, len, prot, flags | MAP_FIXED, fd, 0)) {
+            munmap(pRegion, len);
+            pRegion = (uInt8*)MAP_FAILED;
+        }
+    }
+
+    /* kernels before 4.17 take MAP_FIXED_NOREPLACE as a mere hint */
+    if (MAP_FAILED != (void*)pRegion && NULL != pAddr && pAddr != (void*)pRegion) {
+        munmap(pRegion, len);
+        pRegion = (uInt8*)MAP_FAILED;
+        errno = EEXIST;
+    }
+    if (MAP_FAILED != (void*)pRegion && isHuge) {
+        madvise(pRegion, len, MADV_HUGEPAGE);
+    }
+    dsmExitFunc();
+    return pRegion;
+}
+
+/*
+ * Maps the region on master at the first free one of DSM_REGION_PLACE_TRIES
+ * addresses from DSM_REGION_BASE, high in the address space and far apart,
+ * so that the clients find the same address free when they map the region
+ * there. Anywhere else only if none of them is free.
+ * Returns the base addr on success, MAP_FAILED on failure
+ */
+void* dsmPlaceRegion(unsigned long len, int32 prot, int32 flags, int32 fd)
+{
+    void*           pRegion = MAP_FAILED;
+    uInt64          addr = DSM_REGION_BASE;
+    int32           i = 0;
+
+    dsmEnterFunc();
+    for (i = 0; i < DSM_REGION_PLACE_TRIES && sizeof(void*) == sizeof(uInt64); i += 1) {
+        pRegion = dsmMapRegion((void*)(unsigned long)addr, len, prot, flags, fd);
+        if (MAP_FAILED != pRegion) {
+            dsmExitFunc();
+            return pRegion;
+        }
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "Region address [%llx] not free, errno: "
+                "[%d]\n", addr, errno);
+        addr += DSM_REGION_PLACE_STEP;
+    }
+    pRegion = dsmMapRegion(NULL, len, prot, flags, fd);
+    dsmExitFunc();
+    return pRegion;
+}
+
+/*
+ * Opens the file backing the region of master, extended with zeros to len
+ * bytes if it is shorter; a longer file is mapped in part
+ * Returns the file descriptor on success, -1 on failure
+ */
+int32 dsmOpenBackingFile(const char* path, unsigned long len)
+{
+    struct stat     fileStat;
+    int32           fd = -1;
+
+    dsmEnterFunc();
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (-1 == fd || -1 == fstat(fd, &fileStat) ||
+            ((unsigned long)fileStat.st_size < len && -1 == ftruncate(fd, len))) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Backing file [%s] not opened, errno: "
+                "[%d]\n", path, errno);
+        if (-1 != fd) {
+            close(fd);
+        }
+        dsmExitFunc();
+        return -1;
+    }
+    dsmExitFunc();
+    return fd;
+}
+
+/*
+ * Maps the shared region a second time, writable, for the SIGSEGV handler
+ * to install pages through; a page being installed is then not writable to
+ * the other threads before its access is set. Without the alias the pages
+ * are installed in place.
+ * Returns void
+ */
+void dsmMapRegionAlias(void* pRegion, unsigned long len)
+{
+    void*           pAlias = MAP_FAILED;
+
+    dsmEnterFunc();
+    if (MAP_FAILED != pRegion) {
+        pAlias = mremap(pRegion, 0, len, MREMAP_MAYMOVE);
+    }
+    if (MAP_FAILED != pAlias && -1 == mprotect(pAlias, len, PROT_READ | PROT_WRITE)) {
+        munmap(pAlias, len);
+        pAlias = MAP_FAILED;
+    }
+    if (MAP_FAILED == pAlias) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "Alias of the shared region failed with "
+                "errno: [%d]\n", errno);
+        dsmExitFunc();
+        return;
+    }
+    pDsmRegionAlias = pAlias;
+    dsmExitFunc();
+}
 
 /*
  * Creates a new shared region depending on the given parameters
  * At Master :     Creates a shared region with write enabled permissions
  * At Client :     Creates a shared region with base address received from
  *                 Master, and no read/write permissions
+ * With userfaultfd the region is private and accessible and registered with
+ * the userfaultfd instead; pages are only mapped when installed. If it
+ * cannot be registered the SIGSEGV handler is used.
+ * With a backing file the region of master is a shared mapping of the file.
+ * The region is numPagesToAlloc pages of 4KB rounded up to whole pages of
+ * the coherence unit; numPagesToAlloc is converted to coherence pages.
  */
 void* dsmCreateSharedRegion()
 {
-    int             pageSize = -1;
+    long            sysPageSize = -1;
+    unsigned long   regionLen = 0;
+    void*           pRegion = NULL;
+    int32           fd = -1;
 
     dsmEnterFunc();
-    pageSize = sysconf(_SC_PAGE_SIZE);
-    if (pageSize == -1) {
+    sysPageSize = sysconf(_SC_PAGE_SIZE);
+    if (sysPageSize == -1) {
         dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Failed to retrieve system page size. "
                 "Errno: [%d]\n", errno);
         /* Continuing assuming the default page size */
         dsmPrintLog(DSM_TRACE_TYPE_WARN, "Continuing with default page size of 4KB\n");
-        pageSize = DSM_DEF_PAGE_SIZE;
+        sysPageSize = DSM_DEF_PAGE_SIZE;
     }
 
-    if (dsmMmapInfo.isMaster) {
-        pDsmSharedRegion = mmap((void*)NULL, (dsmMmapInfo.numPagesToAlloc * pageSize),
-                PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    /* pages smaller than the system page cannot be protected on their own;
+     * clients follow the unit of master */
+    if (dsmMmapInfo.isMaster && DSM_PAGE_SIZE < sysPageSize) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "Page size [%u] is below the system page "
+                "size, using [%ld]\n", DSM_PAGE_SIZE, sysPageSize);
+        dsmMmapInfo.pageSize = sysPageSize;
+    }
+    dsmMmapInfo.numPagesToAlloc = ((unsigned long)dsmMmapInfo.numPagesToAlloc *
+            DSM_MIN_PAGE_SIZE + DSM_PAGE_SIZE - 1) / DSM_PAGE_SIZE;
+    regionLen = (unsigned long)dsmMmapInfo.numPagesToAlloc * DSM_PAGE_SIZE;
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Shared region of [%u] pages of [%u] bytes\n",
+            dsmMmapInfo.numPagesToAlloc, DSM_PAGE_SIZE);
+
+    if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+        pRegion = dsmMmapInfo.isMaster ?
+            dsmPlaceRegion(regionLen, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1) :
+            dsmMapRegion((void*)pDsmMasterInitAddr, regionLen, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1);
+        if (MAP_FAILED != pRegion && -1 == dsmUffdRegister(pRegion, regionLen)) {
+            dsmPrintLog(DSM_TRACE_TYPE_WARN, "userfaultfd registration failed, "
+                    "falling back to SIGSEGV handler\n");
+            dsmConfig.faultEngine = DSM_FAULT_ENGINE_SIGSEGV;
+            dsmInstallFaultHandler();
+            mprotect(pRegion, regionLen, (dsmMmapInfo.isMaster && !DSM_MULTI_WRITER()) ?
+                    PROT_WRITE : PROT_NONE);
+        }
+    }
+    else if (dsmMmapInfo.isMaster && NULL != dsmConfig.pBackingFile) {
+        /* the page cache loads the pages of the file as they are used */
+        fd = dsmOpenBackingFile(dsmConfig.pBackingFile, regionLen);
+        pRegion = (-1 == fd) ? MAP_FAILED :
+            dsmPlaceRegion(regionLen, PROT_WRITE, MAP_SHARED, fd);
+        if (-1 != fd) {
+            close(fd);
+        }
+        dsmMapRegionAlias(pRegion, regionLen);
+    }
+    else if (dsmMmapInfo.isMaster) {
+        /* with multiple writers the pages master is home of are opened as
+         * their page table entries are set up */
+        pRegion = dsmPlaceRegion(regionLen, DSM_MULTI_WRITER() ? PROT_NONE : PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1);
+        dsmMapRegionAlias(pRegion, regionLen);
     }
     else {
-        pDsmSharedRegion = mmap((void*)pDsmMasterInitAddr, (dsmMmapInfo.numPagesToAlloc * pageSize),
-                PROT_NONE, MAP_SHARED | MAP_FIXED | MAP_ANONYMOUS, -1, 0);
+        pRegion = dsmMapRegion((void*)pDsmMasterInitAddr, regionLen, PROT_NONE,
+                MAP_SHARED | MAP_ANONYMOUS, -1);
+        dsmMapRegionAlias(pRegion, regionLen);
     }
 
-    if (NULL == pDsmSharedRegion) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Shared memory region creation failed\n");
+    if (MAP_FAILED == pRegion && !dsmMmapInfo.isMaster && EEXIST == errno) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Shared region address [%p] of master "
+                "is taken here\n", (void*)pDsmMasterInitAddr);
+        dsmExitFunc();
+        abort();
+    }
+    if (MAP_FAILED == pRegion) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Shared memory region creation failed "
+                "with errno: [%d]\n", errno);
         dsmExitFunc();
         abort();
     }
     else {
+       pDsmSharedRegion = pRegion;
        dsmPrintLog(DSM_TRACE_TYPE_INFO, "Shared memory region created with "
           "base address : %p\n", pDsmSharedRegion);
     }
     dsmExitFunc();
+    return pDsmSharedRegion;
 }
 
 /*
@@ -69,54 +286,21 @@ int32 dsmSharedMemoryInit()
         dsmCreateSharedRegion();
     }
     else {
-        /* client waits for master to be up */
-        do {
-            /* Connect to the Master for Shared region base address */
-            usleep(100);
-            retval = dsmConnectToPeer(dsmSockInfo.reqSockSd, dsmMmapInfo.mIpAddr,
-                    dsmMmapInfo.mPort);
-            /* Abort if the network is unreachable */
-            if (errno == ENETUNREACH) {
-                dsmPrintLog(DSM_TRACE_TYPE_ERROR,"errno: [%d], Error Desc: "
-                        "[The network isn't reachable from this host]\n Aborting ...\n", errno);
-                dsmExitFunc();
-                abort();
-            }
-        } while (-1 == retval);
-
-        /* request for shared region base address */
+        /* request for shared region base address; the persistent connection
+         * to master is set up here and waits for master to be up */
         dsmMsg msg;
         memset(&msg, 0, sizeof(dsmMsg)); 
         msg.msgType = DSM_MSG_INIT_SHARED_REGION_REQ;
         msg.payloadLen = 0;
 
-        retval = dsmSendMsg(dsmSockInfo.reqSockSd, &msg);
-        if (-1 == retval) {
-            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Error sending message, Please check below for description \n");
-            if (errno == EINTR) {
-                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "errno: [%d], Error Desc: "
-                        "[Operation interrupted by a signal before completion]\n", errno);
-                close(dsmSockInfo.reqSockSd);
-                abort();
-            }
-            else if (errno == EPIPE) {
-                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "errno: [%d], Error Desc: "
-                        "[The other side closed the connection]\n Aborting ...\n", errno);
-                close(dsmSockInfo.reqSockSd);
-                abort();
-            }
-        }
-
-        retval = dsmRecvMsg(dsmSockInfo.reqSockSd);
-        if (-1 == retval) {
-            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Error receiving message!\n");
-            if (errno == EINTR) {
-                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "errno: [%d], Error Desc: "
-                        "[Operation interrupted by a signal before completion]\n", errno);
-                close(dsmSockInfo.reqSockSd);
-                abort();
+        do {
+            retval = dsmSendAndRecv(&dsmPeers[DSM_MASTER_NODE_ID], &msg);
+            if (-1 == retval) {
+                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Shared region base address "
+                        "request failed with errno: [%d], retrying\n", errno);
+                usleep(DSM_CONNECT_MAX_RETRY_US);
             }
-        }
+        } while (-1 == retval);
 
         while ((int32*)0 == pDsmMasterInitAddr) {
             usleep(100);
@@ -130,65 +314,65 @@ int32 dsmSharedMemoryInit()
 
 /*
  * 1. initializes sockets
- * 2. spawns communication thread
+ * 2. spawns communication thread and the workers serving peer requests
  * 3. creates shared memory region
  * Returns 0 on success, -1 on error 
  */
-int32 dsmThreadInit(int isMaster, char* mIpAddr, int mPort, char* oIpAddr, int oPort,
+int32 dsmThreadInit(int nodeId, int numNodes, char** ipAddrs, int* ports,
         unsigned numPagesToAlloc)
 {
     int32               retval;
     pthread_t           threadId[DSM_MAX_THREADS] = {0};
+    pthread_t           statsThreadId;
     pthread_attr_t      attr;
-    int32               port = -1;
-    int8                ipAddr[DSM_MAX_IP_ADDR_LEN];
+    int32               i = 0;
 
     dsmEnterFunc();
 
+    if (numNodes < 2 || numNodes > DSM_MAX_NODES || nodeId < 0 || nodeId >= numNodes) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid cluster configuration, node id: "
+                "[%d], number of nodes: [%d]\n", nodeId, numNodes);
+        dsmExitFunc();
+        return -1;
+    }
+
     /* populate the mmap info struct */
-    dsmMmapInfo.isMaster = isMaster;
-    dsmMmapInfo.mIpAddr  = mIpAddr;
-    dsmMmapInfo.mPort    = mPort;
-    dsmMmapInfo.oIpAddr  = oIpAddr;
-    dsmMmapInfo.oPort    = oPort;
+    dsmMmapInfo.isMaster = (DSM_MASTER_NODE_ID == nodeId);
+    dsmMmapInfo.nodeId   = nodeId;
+    dsmMmapInfo.numNodes = numNodes;
+    dsmMmapInfo.ipAddrs  = ipAddrs;
+    dsmMmapInfo.ports    = ports;
     dsmMmapInfo.numPagesToAlloc = numPagesToAlloc;
+    dsmMmapInfo.pageSize = dsmMmapInfo.isMaster ? dsmConfig.pageSize : DSM_DEF_PAGE_SIZE;
+    dsmMmapInfo.writeMode = dsmConfig.writeMode;
 
-    /* open socket for listening to peer request */
-    if (dsmMmapInfo.isMaster) {
-        port = mPort;
-        memcpy(ipAddr, mIpAddr, strlen(mIpAddr)+1); 
-    }
-    else {
-        port = oPort;
-        memcpy(ipAddr, oIpAddr, strlen(oIpAddr)+1); 
+    /* the region is at most numPagesToAlloc pages of the coherence unit */
+    if (-1 == dsmInitPageTable(numPagesToAlloc)) {
+        dsmExitFunc();
+        return -1;
     }
 
     /* This socket accepts all client requests throughout the program */
-    retval= dsmOpenSocket(ipAddr, port);
+    retval= dsmOpenSocket(ipAddrs[nodeId], ports[nodeId]);
     if (-1 == retval) {
         dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Error opening socket!\n");
         dsmExitFunc();
         return -1;
     }
 
-    /* open another socket for sending request to peer */
-    retval = dsmCreateSocket();
-    if (-1 == retval) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Error encountered in creating a socket!\n");
-        if (errno == EPROTONOSUPPORT) {
-            dsmPrintLog(DSM_TRACE_TYPE_INFO, "errno: [%d], Error Desc: "
-                    "[No protocol support]\nAborting...\n", errno);
-        }
-        else if(errno == ENFILE || errno == EMFILE) {
-            dsmPrintLog(DSM_TRACE_TYPE_INFO, "errno: [%d], Error Desc : "
-                    "[Too many file descriptors open]\n Aborting...\n", errno);
+    /* resolve the peers once; the connection to each is persistent and
+     * reused for every request */
+    for (i = 0; i < numNodes; i += 1) {
+        if (i == nodeId) {
+            continue;
         }
-        else if (errno == EACCES) {
-            dsmPrintLog(DSM_TRACE_TYPE_INFO, "errno: [%d], Error Desc: "
-                    "[Not enough privileges to create an AF_INET socket]\n"
-                    "Aborting...\n", errno);
+        if (-1 == dsmResolvePeer(&dsmPeers[i], ipAddrs[i], ports[i])) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Error resolving address of node "
+                    "[%d]!\n", i);
+            dsmExitFunc();
+            return -1;
         }
-        abort();
+        dsmPeers[i].nodeId = i;
     }
 
     /* intialize thread with default attributes;
@@ -208,6 +392,26 @@ int32 dsmThreadInit(int isMaster, char* mIpAddr, int mPort, char* oIpAddr, int o
     dsmPrintLog(DSM_TRACE_TYPE_INFO, "Comm. Thread created with id: %x\n",
             threadId[DSM_COMMUNICATION_THREAD]);
 
+    /* spawn the workers serving the requests of the peers */
+    for (i = DSM_WORKER_THREAD; i < DSM_MAX_THREADS; i += 1) {
+        retval = pthread_create(&threadId[i], NULL, dsmServeConnections, NULL);
+        if (0 != retval) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Worker Thread creation failed with "
+                    "errno: %d\n", errno);
+            return -1;
+        }
+        dsmPrintLog(DSM_TRACE_TYPE_INFO, "Worker Thread created with id: %x\n",
+                threadId[i]);
+    }
+
+    /* dump the stats periodically if asked for; the node runs without */
+    if (0 != dsmConfig.statsDumpMs) {
+        if (0 != pthread_create(&statsThreadId, &attr, dsmStatsDump, NULL)) {
+            dsmPrintLog(DSM_TRACE_TYPE_WARN, "Stats Thread creation failed with "
+                    "errno: %d\n", errno);
+        }
+    }
+
     /* initialize shared memory region */
     dsmSharedMemoryInit();
 
@@ -216,37 +420,14 @@ int32 dsmThreadInit(int isMaster, char* mIpAddr, int mPort, char* oIpAddr, int o
 }
 
 /*
- * Initializes the page table for the shared region
- * Master: Initially has access to all the pages
+ * Registers the page fault handler for SIGSEGV
  */
-void dsmInitPageTable()
-{
-    int32 i = 0;
-
-    dsmEnterFunc();
-    for (i = 0; i < dsmMmapInfo.numPagesToAlloc; i += 1) {
-        if (dsmMmapInfo.isMaster) {
-            dsmPageTable[i].owner = true;
-            dsmPageTable[i].pageStatus = DSM_PAGE_PRESENT;
-        }
-        else {
-            dsmPageTable[i].owner = false;
-            dsmPageTable[i].pageStatus = DSM_PAGE_NOT_PRESENT;
-        }
-        pthread_mutex_init(&dsmPageTable[i].pteMutexVar, NULL);
-        pthread_cond_init(&dsmPageTable[i].pteCondVar, NULL);
-    }
-    dsmExitFunc();
-}
-
-void initializeDSM(int ismaster, char * masterip, int mport, char *otherip, int oport,
-        unsigned numpagestoalloc)
+void dsmInstallFaultHandler()
 {
-    dsmEnterFunc();
     struct sigaction    newAction;
     struct sigaction    oldAction;
-    int32 retval = -1;
 
+    dsmEnterFunc();
     /* Register the signal handler 
      * Set up the structure to specify the new action. */
     newAction.sa_sigaction = dsmPageFaultHandler;
@@ -261,24 +442,183 @@ void initializeDSM(int ismaster, char * masterip, int mport, char *otherip, int
         }
     }
     dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Handler for SIGSEGV registered!\n");
+    dsmExitFunc();
+}
+
+/*
+ * Sets an option; options are read when the node is initialized
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_setopt(int option, long value)
+{
+    dsmEnterFunc();
+    switch (option) {
+        case DSM_OPT_FAULT_ENGINE:
+            if (DSM_FAULT_ENGINE_SIGSEGV != value && DSM_FAULT_ENGINE_UFFD != value) {
+                break;
+            }
+            dsmConfig.faultEngine = value;
+            dsmExitFunc();
+            return 0;
+        case DSM_OPT_PAGE_SIZE:
+            if (value < DSM_MIN_PAGE_SIZE || value > DSM_MAX_PAGE_SIZE ||
+                    0 != (value & (value - 1))) {
+                break;
+            }
+            dsmConfig.pageSize = value;
+            dsmExitFunc();
+            return 0;
+        case DSM_OPT_PREFETCH_MAX_PAGES:
+            if (value < 0 || value > DSM_PREFETCH_MAX_MASK_PAGES) {
+                break;
+            }
+            dsmConfig.prefetchMaxPages = value;
+            dsmExitFunc();
+            return 0;
+        case DSM_OPT_WRITE_MODE:
+            if (value < DSM_WRITE_MODE_SINGLE || value > DSM_WRITE_MODE_LAZY_RELEASE) {
+                break;
+            }
+            dsmConfig.writeMode = value;
+            dsmExitFunc();
+            return 0;
+        case DSM_OPT_COMPRESSION:
+            if (value < DSM_COMPRESS_NONE || value > DSM_COMPRESS_LZ) {
+                break;
+            }
+            dsmConfig.compression = value;
+            dsmExitFunc();
+            return 0;
+        case DSM_OPT_HOLD_WINDOW_US:
+            if (value < 0 || value > DSM_MAX_HOLD_WINDOW_US) {
+                break;
+            }
+            dsmConfig.holdWindowUs = value;
+            dsmExitFunc();
+            return 0;
+        case DSM_OPT_STATS_DUMP_MS:
+            if (value < 0 || value > DSM_MAX_STATS_DUMP_MS) {
+                break;
+            }
+            dsmConfig.statsDumpMs = value;
+            dsmExitFunc();
+            return 0;
+        case DSM_OPT_LOCAL_TRANSPORT:
+            if (value < 0 || value > 1) {
+                break;
+            }
+            dsmConfig.localTransport = value;
+            dsmExitFunc();
+            return 0;
+        default:
+            break;
+    }
+    dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid option [%d] or value [%ld]\n",
+            option, value);
+    errno = EINVAL;
+    dsmExitFunc();
+    return -1;
+}
+
+/*
+ * Backs the shared region of master with the file at path, mapped shared,
+ * instead of anonymous memory; NULL for anonymous memory again. Read when
+ * master is initialized.
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_set_backing_file(const char* path)
+{
+    char*       pPath = NULL;
+
+    dsmEnterFunc();
+    if (NULL != path) {
+        pPath = strdup(path);
+        if (NULL == pPath) {
+            dsmExitFunc();
+            return -1;
+        }
+    }
+    free((void*)dsmConfig.pBackingFile);
+    dsmConfig.pBackingFile = pPath;
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Initializes this node as member nodeid of a cluster of numnodes nodes;
+ * ipaddrs and ports list the listening addr of every node by node id and
+ * must stay valid. Node 0 is the master which creates the shared region.
+ */
+void initializeDSMCluster(int nodeid, int numnodes, char **ipaddrs, int *ports,
+        unsigned numpagestoalloc)
+{
+    dsmEnterFunc();
+    int32 retval = -1;
+
+    /* a backing file is for the pages master owns at start; userfaultfd
+     * serves missing pages of private anonymous memory only */
+    if (DSM_MASTER_NODE_ID == nodeid && NULL != dsmConfig.pBackingFile) {
+        if (DSM_WRITE_MODE_SINGLE != dsmConfig.writeMode) {
+            dsmPrintLog(DSM_TRACE_TYPE_WARN, "Backing file [%s] ignored with multiple "
+                    "writers\n", dsmConfig.pBackingFile);
+            dsm_set_backing_file(NULL);
+        }
+        else if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+            dsmPrintLog(DSM_TRACE_TYPE_WARN, "Backing file [%s] uses the SIGSEGV "
+                    "handler\n", dsmConfig.pBackingFile);
+            dsmConfig.faultEngine = DSM_FAULT_ENGINE_SIGSEGV;
+        }
+    }
+
+    /* catch the faults on the shared region with userfaultfd if asked for
+     * and supported, else with the SIGSEGV handler */
+    if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine && -1 == dsmUffdOpen()) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "userfaultfd not available, falling back "
+                "to SIGSEGV handler\n");
+        dsmConfig.faultEngine = DSM_FAULT_ENGINE_SIGSEGV;
+    }
+    if (DSM_FAULT_ENGINE_SIGSEGV == dsmConfig.faultEngine) {
+        dsmInstallFaultHandler();
+    }
+
+    /* the locks and barriers are used as soon as the peers are up */
+    dsmInitLocks();
+    dsmInitBarriers();
 
     /* initialize the threads */
-    retval = dsmThreadInit(ismaster, masterip, mport, otherip, oport, numpagestoalloc);
+    retval = dsmThreadInit(nodeid, numnodes, ipaddrs, ports, numpagestoalloc);
 
     if(-1 == retval) {
         dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Error in thread initialization! Aborting...\n");
         abort();
     }
 
-    /* initialize page table */
-    dsmInitPageTable();
-
     while (NULL == pDsmSharedRegion) {
         usleep(1000);
     }
     dsmExitFunc();
 }
 
+/*
+ * Initializes a two node cluster of master and one other node
+ */
+void initializeDSM(int ismaster, char * masterip, int mport, char *otherip, int oport,
+        unsigned numpagestoalloc)
+{
+    static char*    ipAddrs[2];
+    static int      ports[2];
+
+    dsmEnterFunc();
+    ipAddrs[DSM_MASTER_NODE_ID] = masterip;
+    ports[DSM_MASTER_NODE_ID] = mport;
+    ipAddrs[DSM_MASTER_NODE_ID + 1] = otherip;
+    ports[DSM_MASTER_NODE_ID + 1] = oport;
+
+    initializeDSMCluster(ismaster ? DSM_MASTER_NODE_ID : DSM_MASTER_NODE_ID + 1, 2,
+            ipAddrs, ports, numpagestoalloc);
+    dsmExitFunc();
+}
+
 void * getsharedregion()
 {
     dsmEnterFunc();
@@ -0,0 +1,940 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Locks: each lock is kept by a manager node, DSM_LOCK_MANAGER(lockId),
+ * which grants it exclusive to one node or shared to several and queues
+ * the others in order. A node keeps a lock granted to it after its threads
+ * unlock it, so they take it again without a message, until the manager
+ * asks for it back (revoke) because another node is queued. The grants to
+ * a node are numbered, so a revoke rcvd before or after the grant it is
+ * about is told apart from one for an earlier grant. The write notices
+ * given back with a lock go to the next nodes granted it (dsm_lrc.c).
+ */
+
+static dsmLockInfo  dsmLocks[DSM_MAX_LOCKS];
+
+/*
+ * initializes the locks, before the peers can ask for them
+ */
+void dsmInitLocks(void)
+{
+    uInt32      i = 0;
+
+    for (i = 0; i < DSM_MAX_LOCKS; i += 1) {
+        pthread_mutex_init(&dsmLocks[i].lockMutex, NULL);
+        pthread_mutex_init(&dsmLocks[i].grantMutex, NULL);
+        pthread_cond_init(&dsmLocks[i].grantCondVar, NULL);
+        dsmLocks[i].holder = -1;
+    }
+}
+
+/*
+ * manager: whether a lock can be granted in mode to a node not queued
+ * Must be called with the lock mutex held.
+ */
+bool dsmLockGrantable(dsmLockInfo* pLock, uInt32 mode)
+{
+    if (-1 != pLock->holder) {
+        return false;
+    }
+    return (DSM_LOCK_MODE_SHARED == mode || 0 == pLock->sharers);
+}
+
+/*
+ * manager: grants a lock to nodeId and fills pMsg with the grant and the
+ * notices merged since the node was last granted it
+ * Must be called with the lock mutex held.
+ */
+void dsmPrepareGrant(uInt32 lockId, uInt32 nodeId, uInt32 mode, dsmMsgType msgType,
+        dsmMsg* pMsg)
+{
+    dsmLockInfo*    pLock = &dsmLocks[lockId];
+    dsmLockMsgInfo  lockInfo;
+    dsmWriteNotice  notice;
+    uInt32          i = 0;
+
+    if (DSM_LOCK_MODE_EXCL == mode) {
+        pLock->holder = nodeId;
+    }
+    else {
+        pLock->sharers |= DSM_NODE_BIT(nodeId);
+    }
+    pLock->grantSeq[nodeId] += 1;
+
+    lockInfo.lockId = lockId;
+    lockInfo.nodeId = nodeId;
+    lockInfo.mode = mode;
+    lockInfo.granted = 1;
+    lockInfo.seq = pLock->grantSeq[nodeId];
+    lockInfo.numNotices = 0;
+    for (i = 0; i < pLock->notices.numNotices; i += 1) {
+        if (pLock->notices.pNotices[i].seq <= pLock->sentSeq[nodeId]) {
+            continue;
+        }
+        notice.pageOffset = pLock->notices.pNotices[i].pageOffset;
+        notice.version = pLock->notices.pNotices[i].version;
+        memcpy(pMsg->payload + sizeof(dsmLockMsgInfo) +
+                lockInfo.numNotices * sizeof(dsmWriteNotice), &notice,
+                sizeof(dsmWriteNotice));
+        lockInfo.numNotices += 1;
+    }
+    pLock->sentSeq[nodeId] = pLock->notices.seq;
+
+    pMsg->msgType = msgType;
+    pMsg->payloadLen = sizeof(dsmLockMsgInfo) + lockInfo.numNotices * sizeof(dsmWriteNotice);
+    memcpy(pMsg->payload, &lockInfo, sizeof(dsmLockMsgInfo));
+}
+
+/*
+ * manager: picks the holders of a lock not asked for it back yet, with the
+ * grants they hold in pSeqs
+ * Must be called with the lock mutex held.
+ * Returns the nodes to ask, as a bitmask
+ */
+uInt32 dsmLockRevokeTargets(dsmLockInfo* pLock, uInt32* pSeqs)
+{
+    uInt32      targets = 0;
+    uInt32      nodeId = 0;
+
+    targets = pLock->sharers;
+    if (-1 != pLock->holder) {
+        targets |= DSM_NODE_BIT(pLock->holder);
+    }
+    targets &= ~pLock->revoked;
+    pLock->revoked |= targets;
+    for (nodeId = 0; nodeId < dsmMmapInfo.numNodes; nodeId += 1) {
+        if (targets & DSM_NODE_BIT(nodeId)) {
+            pSeqs[nodeId] = pLock->grantSeq[nodeId];
+        }
+    }
+    return targets;
+}
+
+/*
+ * manager: asks the nodes in targets to give a lock back
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLockSendRevokes(uInt32 lockId, uInt32 targets, const uInt32* pSeqs)
+{
+    dsmLockMsgInfo  lockInfo;
+    uInt8           msgBuf[sizeof(dsmMsg) + sizeof(dsmLockMsgInfo)];
+    dsmMsg*         pMsg = (dsmMsg*)msgBuf;
+    uInt32          nodeId = 0;
+    int32           retval = 0;
+
+    for (nodeId = 0; nodeId < dsmMmapInfo.numNodes; nodeId += 1) {
+        if (!(targets & DSM_NODE_BIT(nodeId))) {
+            continue;
+        }
+        dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Lock [%u] asked back from node [%u]\n",
+                lockId, nodeId);
+        if (nodeId == dsmMmapInfo.nodeId) {
+            if (dsmLockRevoked(lockId, pSeqs[nodeId])) {
+                dsmLockReturn(lockId);
+            }
+            continue;
+        }
+        lockInfo.lockId = lockId;
+        lockInfo.nodeId = nodeId;
+        lockInfo.mode = DSM_LOCK_MODE_NONE;
+        lockInfo.granted = 0;
+        lockInfo.seq = pSeqs[nodeId];
+        lockInfo.numNotices = 0;
+        pMsg->msgType = DSM_MSG_LOCK_REVOKE_REQ;
+        pMsg->payloadLen = sizeof(dsmLockMsgInfo);
+        memcpy(pMsg->payload, &lockInfo, sizeof(dsmLockMsgInfo));
+        if (-1 == dsmSendAndRecv(&dsmPeers[nodeId], pMsg)) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                    "[DSM_MSG_LOCK_REVOKE_REQ]\n");
+            retval = -1;
+        }
+    }
+    return retval;
+}
+
+/*
+ * manager: grants a lock to nodeId if it is free for mode and nobody is
+ * queued, else queues the node; pMsg is filled with the
+ * DSM_MSG_LOCK_ACQUIRE_RSP to send back
+ * Returns the holders to ask for the lock back, see dsmLockSendRevokes()
+ */
+uInt32 dsmLockAcquireAt(uInt32 lockId, uInt32 nodeId, uInt32 mode, dsmMsg* pMsg,
+        uInt32* pSeqs)
+{
+    dsmLockInfo*    pLock = &dsmLocks[lockId];
+    dsmLockMsgInfo  lockInfo;
+    uInt32          targets = 0;
+
+    pthread_mutex_lock(&pLock->lockMutex);
+    if (0 == pLock->numWaiters && dsmLockGrantable(pLock, mode)) {
+        dsmPrepareGrant(lockId, nodeId, mode, DSM_MSG_LOCK_ACQUIRE_RSP, pMsg);
+        pthread_mutex_unlock(&pLock->lockMutex);
+        return 0;
+    }
+
+    /* a node asks once at a time, see pending */
+    pLock->waiters[(pLock->firstWaiter + pLock->numWaiters) % DSM_MAX_NODES] = nodeId;
+    pLock->waiterModes[(pLock->firstWaiter + pLock->numWaiters) % DSM_MAX_NODES] = mode;
+    pLock->numWaiters += 1;
+    targets = dsmLockRevokeTargets(pLock, pSeqs);
+    pthread_mutex_unlock(&pLock->lockMutex);
+
+    dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Lock [%u] busy, node [%u] queued\n",
+            lockId, nodeId);
+    lockInfo.lockId = lockId;
+    lockInfo.nodeId = nodeId;
+    lockInfo.mode = mode;
+    lockInfo.granted = 0;
+    lockInfo.seq = 0;
+    lockInfo.numNotices = 0;
+    pMsg->msgType = DSM_MSG_LOCK_ACQUIRE_RSP;
+    pMsg->payloadLen = sizeof(dsmLockMsgInfo);
+    memcpy(pMsg->payload, &lockInfo, sizeof(dsmLockMsgInfo));
+    return targets;
+}
+
+/*
+ * manager: takes a lock back from nodeId with the notices of its release,
+ * grants it to the nodes queued first as far as their modes allow and asks
+ * the new holders for it back if others are still queued
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLockReleaseAt(uInt32 lockId, uInt32 nodeId, const dsmWriteNotice* pNotices,
+        uInt32 numNotices)
+{
+    dsmLockInfo*    pLock = &dsmLocks[lockId];
+    dsmMsg*         pMsg = NULL;
+    uInt32          seqs[DSM_MAX_NODES];
+    uInt32          targets = 0;
+    uInt32          prevSeq = 0;
+    uInt32          nextId = 0;
+    uInt32          mode = 0;
+    int32           retval = 0;
+
+    pMsg = (dsmMsg*)malloc(DSM_MAX_NOTICE_MSG_LEN);
+    if (NULL == pMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                "bytes\n", DSM_MAX_NOTICE_MSG_LEN);
+        return -1;
+    }
+
+    pthread_mutex_lock(&pLock->lockMutex);
+    if (pLock->holder == (int32)nodeId) {
+        pLock->holder = -1;
+    }
+    else if (pLock->sharers & DSM_NODE_BIT(nodeId)) {
+        pLock->sharers &= ~DSM_NODE_BIT(nodeId);
+    }
+    else {
+        pthread_mutex_unlock(&pLock->lockMutex);
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Lock [%u] released by node [%u], held "
+                "by node [%d]\n", lockId, nodeId, pLock->holder);
+        free(pMsg);
+        return -1;
+    }
+    pLock->revoked &= ~DSM_NODE_BIT(nodeId);
+
+    /* the releaser has its own writes; it is not told of them again */
+    prevSeq = pLock->notices.seq;
+    retval = dsmMergeNotices(&pLock->notices, pNotices, numNotices, nodeId);
+    if (pLock->sentSeq[nodeId] == prevSeq) {
+        pLock->sentSeq[nodeId] = pLock->notices.seq;
+    }
+
+    /* the grants are sent without the lock mutex, one at a time */
+    while (pLock->numWaiters > 0 &&
+            dsmLockGrantable(pLock, pLock->waiterModes[pLock->firstWaiter])) {
+        nextId = pLock->waiters[pLock->firstWaiter];
+        mode = pLock->waiterModes[pLock->firstWaiter];
+        pLock->firstWaiter = (pLock->firstWaiter + 1) % DSM_MAX_NODES;
+        pLock->numWaiters -= 1;
+        dsmPrepareGrant(lockId, nextId, mode, DSM_MSG_LOCK_GRANT_REQ, pMsg);
+        pthread_mutex_unlock(&pLock->lockMutex);
+
+        dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Lock [%u] granted to node [%u] in mode "
+                "[%u]\n", lockId, nextId, mode);
+        if (nextId == dsmMmapInfo.nodeId) {
+            dsmLockGranted(pMsg->payload);
+        }
+        else if (-1 == dsmSendAndRecv(&dsmPeers[nextId], pMsg)) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                    "[DSM_MSG_LOCK_GRANT_REQ]\n");
+            retval = -1;
+        }
+        pthread_mutex_lock(&pLock->lockMutex);
+    }
+    if (pLock->numWaiters > 0) {
+        targets = dsmLockRevokeTargets(pLock, seqs);
+    }
+    pthread_mutex_unlock(&pLock->lockMutex);
+
+    if (0 != targets && -1 == dsmLockSendRevokes(lockId, targets, seqs)) {
+        retval = -1;
+    }
+    free(pMsg);
+    return retval;
+}
+
+/*
+ * takes the grant of a lock asked for here, with the notices that came
+ * with it, and wakes up the thread that asked
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLockGranted(void* payload)
+{
+    dsmLockMsgInfo  lockInfo;
+    dsmLockInfo*    pLock = NULL;
+    dsmWriteNotice* pNotices = NULL;
+
+    memcpy(&lockInfo, payload, sizeof(dsmLockMsgInfo));
+    if (lockInfo.lockId >= DSM_MAX_LOCKS) {
+        return -1;
+    }
+    pLock = &dsmLocks[lockInfo.lockId];
+    if (lockInfo.numNotices > 0) {
+        pNotices = (dsmWriteNotice*)malloc(lockInfo.numNotices * sizeof(dsmWriteNotice));
+        if (NULL == pNotices) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                    "notices\n", lockInfo.numNotices);
+            lockInfo.numNotices = 0;
+        }
+        else {
+            memcpy(pNotices, (uInt8*)payload + sizeof(dsmLockMsgInfo),
+                    lockInfo.numNotices * sizeof(dsmWriteNotice));
+        }
+    }
+
+    pthread_mutex_lock(&pLock->grantMutex);
+    pLock->pGrantNotices = pNotices;
+    pLock->numGrantNotices = lockInfo.numNotices;
+    pLock->grantMode = lockInfo.mode;
+    pLock->tenureSeq = lockInfo.seq;
+    pLock->granted = true;
+    pthread_cond_broadcast(&pLock->grantCondVar);
+    pthread_mutex_unlock(&pLock->grantMutex);
+    return 0;
+}
+
+/*
+ * whether a lock held here was asked back and no local thread holds it
+ * Must be called with the grant mutex held.
+ */
+bool dsmLockToReturn(dsmLockInfo* pLock)
+{
+    return (DSM_LOCK_MODE_NONE != pLock->heldMode &&
+            pLock->revokeSeq >= pLock->tenureSeq &&
+            0 == pLock->readers && !pLock->writer);
+}
+
+/*
+ * gives a lock held here back to its manager with the notices noted since
+ * its last release here; heldMode was cleared and returning set by the
+ * caller, so no local thread asks for it meanwhile
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLockReturn(uInt32 lockId)
+{
+    dsmLockInfo*    pLock = &dsmLocks[lockId];
+    dsmLockMsgInfo  lockInfo;
+    dsmMsg*         pMsg = NULL;
+    uInt32          managerId = DSM_LOCK_MANAGER(lockId);
+    int32           retval = 0;
+
+    pMsg = (dsmMsg*)malloc(DSM_MAX_NOTICE_MSG_LEN);
+    if (NULL == pMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                "bytes\n", DSM_MAX_NOTICE_MSG_LEN);
+        retval = -1;
+    }
+    else {
+        lockInfo.lockId = lockId;
+        lockInfo.nodeId = dsmMmapInfo.nodeId;
+        lockInfo.mode = DSM_LOCK_MODE_NONE;
+        lockInfo.granted = 0;
+        lockInfo.seq = pLock->tenureSeq;
+        lockInfo.numNotices = 0;
+        if (DSM_WRITE_MODE_LAZY_RELEASE == dsmMmapInfo.writeMode) {
+            lockInfo.numNotices = dsmGatherNotices(&pLock->releaseSeq,
+                    pMsg->payload + sizeof(dsmLockMsgInfo));
+        }
+
+        if (managerId == dsmMmapInfo.nodeId) {
+            retval = dsmLockReleaseAt(lockId, managerId, (dsmWriteNotice*)(pMsg->payload +
+                        sizeof(dsmLockMsgInfo)), lockInfo.numNotices);
+        }
+        else {
+            pMsg->msgType = DSM_MSG_LOCK_RELEASE_REQ;
+            pMsg->payloadLen = sizeof(dsmLockMsgInfo) +
+                lockInfo.numNotices * sizeof(dsmWriteNotice);
+            memcpy(pMsg->payload, &lockInfo, sizeof(dsmLockMsgInfo));
+            retval = dsmSendAndRecv(&dsmPeers[managerId], pMsg);
+            if (-1 == retval) {
+                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                        "[DSM_MSG_LOCK_RELEASE_REQ]\n");
+            }
+        }
+        free(pMsg);
+    }
+
+    pthread_mutex_lock(&pLock->grantMutex);
+    pLock->returning = false;
+    pthread_cond_broadcast(&pLock->grantCondVar);
+    pthread_mutex_unlock(&pLock->grantMutex);
+    return retval;
+}
+
+/*
+ * the manager asks for the grant seq of a lock back; it is to be given
+ * back now if no local thread holds it, else at the last unlock here
+ * Returns true if the caller is to give it back with dsmLockReturn()
+ */
+bool dsmLockRevoked(uInt32 lockId, uInt32 seq)
+{
+    dsmLockInfo*    pLock = &dsmLocks[lockId];
+    bool            toReturn = false;
+
+    pthread_mutex_lock(&pLock->grantMutex);
+    if (seq > pLock->revokeSeq) {
+        pLock->revokeSeq = seq;
+    }
+    toReturn = dsmLockToReturn(pLock);
+    if (toReturn) {
+        pLock->heldMode = DSM_LOCK_MODE_NONE;
+        pLock->returning = true;
+    }
+    pthread_mutex_unlock(&pLock->grantMutex);
+    return toReturn;
+}
+
+/*
+ * runs a lock task handed off by a handler, see dsmLockHandOff()
+ * Returns NULL
+ */
+void* dsmLockTaskThread(void* pArg)
+{
+    dsmLockTask*    pTask = (dsmLockTask*)pArg;
+
+    switch (pTask->taskType) {
+        case DSM_LOCK_TASK_RETURN:
+            dsmLockReturn(pTask->lockId);
+            break;
+        case DSM_LOCK_TASK_REVOKE:
+            dsmLockSendRevokes(pTask->lockId, pTask->targets, pTask->seqs);
+            break;
+        case DSM_LOCK_TASK_RELEASE:
+            dsmLockReleaseAt(pTask->lockId, pTask->nodeId,
+                    (dsmWriteNotice*)(pTask + 1), pTask->numNotices);
+            break;
+        default:
+            break;
+    }
+    free(pTask);
+    return NULL;
+}
+
+/*
+ * hands the msgs a handler is to send for a lock to a thread of its own,
+ * with a copy of the task and of the notices after it; see dsmRunDetached()
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLockHandOff(const dsmLockTask* pTask, const dsmWriteNotice* pNotices)
+{
+    dsmLockTask*    pCopy = NULL;
+
+    pCopy = (dsmLockTask*)malloc(sizeof(dsmLockTask) +
+            pTask->numNotices * sizeof(dsmWriteNotice));
+    if (NULL == pCopy) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for task of "
+                "lock [%u]\n", pTask->lockId);
+        return -1;
+    }
+    memcpy(pCopy, pTask, sizeof(dsmLockTask));
+    if (pTask->numNotices > 0) {
+        memcpy(pCopy + 1, pNotices, pTask->numNotices * sizeof(dsmWriteNotice));
+    }
+    return dsmRunDetached(dsmLockTaskThread, pCopy);
+}
+
+/*
+ * asks the manager of a lock for it
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLockAsk(uInt32 lockId, uInt32 mode)
+{
+    dsmLockMsgInfo  lockInfo;
+    dsmMsg*         pMsg = NULL;
+    uInt32          seqs[DSM_MAX_NODES];
+    uInt32          managerId = DSM_LOCK_MANAGER(lockId);
+    uInt32          targets = 0;
+    int32           retval = 0;
+
+    pMsg = (dsmMsg*)malloc(DSM_MAX_NOTICE_MSG_LEN);
+    if (NULL == pMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                "bytes\n", DSM_MAX_NOTICE_MSG_LEN);
+        return -1;
+    }
+
+    if (managerId == dsmMmapInfo.nodeId) {
+        targets = dsmLockAcquireAt(lockId, managerId, mode, pMsg, seqs);
+        dsmLockAcquireRspHandler(pMsg->payload);
+        if (0 != targets) {
+            retval = dsmLockSendRevokes(lockId, targets, seqs);
+        }
+    }
+    else {
+        lockInfo.lockId = lockId;
+        lockInfo.nodeId = dsmMmapInfo.nodeId;
+        lockInfo.mode = mode;
+        lockInfo.granted = 0;
+        lockInfo.seq = 0;
+        lockInfo.numNotices = 0;
+        pMsg->msgType = DSM_MSG_LOCK_ACQUIRE_REQ;
+        pMsg->payloadLen = sizeof(dsmLockMsgInfo);
+        memcpy(pMsg->payload, &lockInfo, sizeof(dsmLockMsgInfo));
+        retval = dsmSendAndRecv(&dsmPeers[managerId], pMsg);
+        if (-1 == retval) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                    "[DSM_MSG_LOCK_ACQUIRE_REQ]\n");
+        }
+    }
+    free(pMsg);
+    return retval;
+}
+
+/*
+ * takes a lock in mode for the calling thread, waiting while it is held
+ * elsewhere; a lock still held here from an earlier grant is taken without
+ * a message
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLockAcquire(int32 lockId, uInt32 mode)
+{
+    dsmLockInfo*    pLock = NULL;
+    dsmWriteNotice* pNotices = NULL;
+    uInt32          numNotices = 0;
+    bool            revoked = false;
+
+    if (lockId < 0 || lockId >= DSM_MAX_LOCKS) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid lock id [%d]\n", lockId);
+        errno = EINVAL;
+        return -1;
+    }
+    pLock = &dsmLocks[lockId];
+
+    pthread_mutex_lock(&pLock->grantMutex);
+    for (;;) {
+        /* a lock asked back is not taken again before it is given back */
+        revoked = (pLock->revokeSeq >= pLock->tenureSeq);
+        if (DSM_LOCK_MODE_NONE != pLock->heldMode && !revoked && !pLock->writer &&
+                (DSM_LOCK_MODE_SHARED == mode ||
+                 (DSM_LOCK_MODE_EXCL == pLock->heldMode && 0 == pLock->readers))) {
+            break;
+        }
+
+        if (DSM_LOCK_MODE_NONE == pLock->heldMode && !pLock->pending &&
+                !pLock->returning) {
+            pLock->pending = true;
+            pLock->granted = false;
+            pthread_mutex_unlock(&pLock->grantMutex);
+            if (-1 == dsmLockAsk(lockId, mode)) {
+                pthread_mutex_lock(&pLock->grantMutex);
+                pLock->pending = false;
+                pthread_cond_broadcast(&pLock->grantCondVar);
+                pthread_mutex_unlock(&pLock->grantMutex);
+                errno = EIO;
+                return -1;
+            }
+
+            pthread_mutex_lock(&pLock->grantMutex);
+            while (!pLock->granted) {
+                pthread_cond_wait(&pLock->grantCondVar, &pLock->grantMutex);
+            }
+            pNotices = pLock->pGrantNotices;
+            numNotices = pLock->numGrantNotices;
+            pLock->pGrantNotices = NULL;
+            pLock->numGrantNotices = 0;
+            pthread_mutex_unlock(&pLock->grantMutex);
+
+            dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Lock [%d] granted with [%u] notices\n",
+                    lockId, numNotices);
+            dsmAcquireWrites(pNotices, numNotices);
+            free(pNotices);
+
+            /* the thread that asked uses the grant even if asked back since */
+            pthread_mutex_lock(&pLock->grantMutex);
+            pLock->heldMode = pLock->grantMode;
+            pLock->pending = false;
+            pthread_cond_broadcast(&pLock->grantCondVar);
+            break;
+        }
+
+        if (DSM_LOCK_MODE_SHARED == pLock->heldMode && DSM_LOCK_MODE_EXCL == mode &&
+                0 == pLock->readers && !pLock->pending && !pLock->returning) {
+            /* the shared grant is given back before asking for exclusive */
+            pLock->heldMode = DSM_LOCK_MODE_NONE;
+            pLock->returning = true;
+            pthread_mutex_unlock(&pLock->grantMutex);
+            dsmLockReturn(lockId);
+            pthread_mutex_lock(&pLock->grantMutex);
+            continue;
+        }
+
+        pthread_cond_wait(&pLock->grantCondVar, &pLock->grantMutex);
+    }
+
+    if (DSM_LOCK_MODE_EXCL == mode) {
+        pLock->writer = true;
+    }
+    else {
+        pLock->readers += 1;
+    }
+    pthread_mutex_unlock(&pLock->grantMutex);
+    return 0;
+}
+
+/*
+ * unlocks a lock held by the calling thread; with multiple writers the
+ * writes made here are sent to the homes before another node can take it
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmLockRelease(int32 lockId)
+{
+    dsmLockInfo*    pLock = NULL;
+    bool            isWriter = false;
+    bool            toReturn = false;
+    int32           retval = 0;
+
+    if (lockId < 0 || lockId >= DSM_MAX_LOCKS) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid lock id [%d]\n", lockId);
+        errno = EINVAL;
+        return -1;
+    }
+    pLock = &dsmLocks[lockId];
+
+    pthread_mutex_lock(&pLock->grantMutex);
+    if (!pLock->writer && 0 == pLock->readers) {
+        pthread_mutex_unlock(&pLock->grantMutex);
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Lock [%d] not held\n", lockId);
+        errno = EPERM;
+        return -1;
+    }
+    isWriter = pLock->writer;
+    pthread_mutex_unlock(&pLock->grantMutex);
+
+    /* the lock stays held until the writes are with the homes */
+    if (isWriter && DSM_MULTI_WRITER() && -1 == dsmReleaseWrites()) {
+        retval = -1;
+    }
+
+    pthread_mutex_lock(&pLock->grantMutex);
+    if (isWriter) {
+        pLock->writer = false;
+    }
+    else {
+        pLock->readers -= 1;
+    }
+    toReturn = dsmLockToReturn(pLock);
+    if (toReturn) {
+        pLock->heldMode = DSM_LOCK_MODE_NONE;
+        pLock->returning = true;
+    }
+    pthread_cond_broadcast(&pLock->grantCondVar);
+    pthread_mutex_unlock(&pLock->grantMutex);
+
+    if (toReturn && -1 == dsmLockReturn(lockId)) {
+        retval = -1;
+    }
+    if (-1 == retval) {
+        errno = EIO;
+    }
+    return retval;
+}
+
+/*
+ * manager: serves an acquire of a lock by a peer; the holders are asked
+ * for it back after the rsp is sent, from a thread of its own
+ * Returns 0 on success, -1 on failure
+ */
+int dsmLockAcquireReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmLockMsgInfo  lockInfo;
+    dsmLockTask     task;
+    dsmMsg*         pRspMsg = NULL;
+    int32           retval = 0;
+
+    dsmEnterFunc();
+    memcpy(&lockInfo, payload, sizeof(dsmLockMsgInfo));
+    if (lockInfo.lockId >= DSM_MAX_LOCKS || lockInfo.nodeId >= dsmMmapInfo.numNodes ||
+            DSM_LOCK_MANAGER(lockInfo.lockId) != dsmMmapInfo.nodeId ||
+            (DSM_LOCK_MODE_SHARED != lockInfo.mode && DSM_LOCK_MODE_EXCL != lockInfo.mode)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid acquire of lock [%u] by node "
+                "[%u]\n", lockInfo.lockId, lockInfo.nodeId);
+        dsmExitFunc();
+        return -1;
+    }
+
+    pRspMsg = (dsmMsg*)malloc(DSM_MAX_NOTICE_MSG_LEN);
+    if (NULL == pRspMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                "bytes\n", DSM_MAX_NOTICE_MSG_LEN);
+        dsmExitFunc();
+        return -1;
+    }
+    task.taskType = DSM_LOCK_TASK_REVOKE;
+    task.lockId = lockInfo.lockId;
+    task.nodeId = lockInfo.nodeId;
+    task.numNotices = 0;
+    task.targets = dsmLockAcquireAt(lockInfo.lockId, lockInfo.nodeId, lockInfo.mode,
+            pRspMsg, task.seqs);
+    retval = dsmReplyMsg(pConn, pRspMsg);
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_LOCK_ACQUIRE_RSP]\n");
+    }
+    free(pRspMsg);
+    if (0 != task.targets) {
+        dsmLockHandOff(&task, NULL);
+    }
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * takes the grant of a lock if it was free at the manager; else the grant
+ * comes later as a DSM_MSG_LOCK_GRANT_REQ
+ * Returns 0 on success, -1 on failure
+ */
+int dsmLockAcquireRspHandler(void* payload)
+{
+    dsmLockMsgInfo  lockInfo;
+
+    memcpy(&lockInfo, payload, sizeof(dsmLockMsgInfo));
+    if (!lockInfo.granted) {
+        return 0;
+    }
+    return dsmLockGranted(payload);
+}
+
+/*
+ * manager: serves a release of a lock by a peer; the lock is handed on
+ * from a thread of its own, as that sends grants and revokes
+ * Returns 0 on success, -1 on failure
+ */
+int dsmLockReleaseReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmLockMsgInfo  lockInfo;
+    dsmLockTask     task;
+    dsmMsg          rspMsg;
+    dsmMsg*         pMsgHdr = NULL;
+    int32           retval = 0;
+
+    dsmEnterFunc();
+    memcpy(&lockInfo, payload, sizeof(dsmLockMsgInfo));
+    pMsgHdr = (dsmMsg*)((uInt8*)payload - DSM_MSG_HDR_LEN);
+    if (lockInfo.lockId >= DSM_MAX_LOCKS || lockInfo.nodeId >= dsmMmapInfo.numNodes ||
+            sizeof(dsmLockMsgInfo) + lockInfo.numNotices * sizeof(dsmWriteNotice) >
+            pMsgHdr->payloadLen) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid release of lock [%u] by node "
+                "[%u]\n", lockInfo.lockId, lockInfo.nodeId);
+        dsmExitFunc();
+        return -1;
+    }
+
+    task.taskType = DSM_LOCK_TASK_RELEASE;
+    task.lockId = lockInfo.lockId;
+    task.nodeId = lockInfo.nodeId;
+    task.targets = 0;
+    task.numNotices = lockInfo.numNotices;
+    dsmLockHandOff(&task, (dsmWriteNotice*)((uInt8*)payload + sizeof(dsmLockMsgInfo)));
+
+    rspMsg.msgType = DSM_MSG_LOCK_RELEASE_RSP;
+    rspMsg.payloadLen = 0;
+    retval = dsmReplyMsg(pConn, &rspMsg);
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_LOCK_RELEASE_RSP]\n");
+    }
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * takes the grant of a lock handed on by its manager at a release
+ * Returns 0 on success, -1 on failure
+ */
+int dsmLockGrantReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmMsg          rspMsg;
+    int32           retval = 0;
+
+    dsmEnterFunc();
+    dsmLockGranted(payload);
+    rspMsg.msgType = DSM_MSG_LOCK_GRANT_RSP;
+    rspMsg.payloadLen = 0;
+    retval = dsmReplyMsg(pConn, &rspMsg);
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_LOCK_GRANT_RSP]\n");
+    }
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * the manager asks for a lock back; it is given back from a thread of its
+ * own, as that sends a release to the manager
+ * Returns 0 on success, -1 on failure
+ */
+int dsmLockRevokeReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmLockMsgInfo  lockInfo;
+    dsmLockTask     task;
+    dsmMsg          rspMsg;
+    int32           retval = 0;
+
+    dsmEnterFunc();
+    memcpy(&lockInfo, payload, sizeof(dsmLockMsgInfo));
+    if (lockInfo.lockId >= DSM_MAX_LOCKS) {
+        dsmExitFunc();
+        return -1;
+    }
+    rspMsg.msgType = DSM_MSG_LOCK_REVOKE_RSP;
+    rspMsg.payloadLen = 0;
+    retval = dsmReplyMsg(pConn, &rspMsg);
+    if (-1 == retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_LOCK_REVOKE_RSP]\n");
+    }
+    if (dsmLockRevoked(lockInfo.lockId, lockInfo.seq)) {
+        task.taskType = DSM_LOCK_TASK_RETURN;
+        task.lockId = lockInfo.lockId;
+        task.nodeId = dsmMmapInfo.nodeId;
+        task.targets = 0;
+        task.numNotices = 0;
+        dsmLockHandOff(&task, NULL);
+    }
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Acquires a lock exclusive for the calling thread, waiting while it is
+ * held; the other threads of this node asking for it wait here.
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_acquire(int lockId)
+{
+    int32       retval = 0;
+
+    dsmEnterFunc();
+    retval = dsmLockAcquire(lockId, DSM_LOCK_MODE_EXCL);
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Releases a lock held by the calling thread
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_release(int lockId)
+{
+    int32       retval = 0;
+
+    dsmEnterFunc();
+    retval = dsmLockRelease(lockId);
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Initializes a lock on lock id; every node uses the same id for it
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_lock_init(dsm_lock_t* lock, int id)
+{
+    if (NULL == lock || id < 0 || id >= DSM_MAX_LOCKS) {
+        errno = EINVAL;
+        return -1;
+    }
+    lock->id = id;
+    return 0;
+}
+
+/*
+ * Locks a lock for the calling thread
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_lock(dsm_lock_t* lock)
+{
+    return dsm_acquire(lock->id);
+}
+
+/*
+ * Unlocks a lock held by the calling thread
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_unlock(dsm_lock_t* lock)
+{
+    return dsm_release(lock->id);
+}
+
+/*
+ * Initializes a rwlock on lock id; every node uses the same id for it
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_rwlock_init(dsm_rwlock_t* rwlock, int id)
+{
+    if (NULL == rwlock || id < 0 || id >= DSM_MAX_LOCKS) {
+        errno = EINVAL;
+        return -1;
+    }
+    rwlock->id = id;
+    return 0;
+}
+
+/*
+ * Locks a rwlock shared for the calling thread; the threads reading here
+ * share one grant
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_rwlock_rdlock(dsm_rwlock_t* rwlock)
+{
+    int32       retval = 0;
+
+    dsmEnterFunc();
+    retval = dsmLockAcquire(rwlock->id, DSM_LOCK_MODE_SHARED);
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Locks a rwlock exclusive for the calling thread
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_rwlock_wrlock(dsm_rwlock_t* rwlock)
+{
+    int32       retval = 0;
+
+    dsmEnterFunc();
+    retval = dsmLockAcquire(rwlock->id, DSM_LOCK_MODE_EXCL);
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Unlocks a rwlock held by the calling thread, shared or exclusive
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_rwlock_unlock(dsm_rwlock_t* rwlock)
+{
+    int32       retval = 0;
+
+    dsmEnterFunc();
+    retval = dsmLockRelease(rwlock->id);
+    dsmExitFunc();
+    return retval;
+}
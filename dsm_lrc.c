@@ -0,0 +1,241 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Lazy release consistency: a release sends the diffs of the writes made
+ * here to the homes of the pages, which answer with the new versions of
+ * the pages (write notices). The notices go with the release to the manager
+ * of the lock (dsm_lock.c) or barrier (dsm_barrier.c) and on to the nodes
+ * acquiring it next, which drop the copies older than the notices. Copies
+ * of pages no notice tells of are kept across acquires. A manager keeps one
+ * notice per page; the merges are numbered so a node is sent the notices
+ * merged since it was last sent any.
+ */
+
+static uInt32       dsmNoticeSeq = 0;      /* local order of the notices */
+
+/*
+ * notes that the home copy of a page reached version, to be told of at the
+ * next release of a lock here
+ */
+void dsmNoteWrite(uInt32 pageOffset, uInt32 version)
+{
+    dsmLockPageProt(pageOffset);
+    if (version > DSM_PAGE_META(pageOffset).noticeVersion) {
+        DSM_PAGE_META(pageOffset).noticeVersion = version;
+        DSM_PAGE_META(pageOffset).noticeSeq = __sync_add_and_fetch(&dsmNoticeSeq, 1);
+    }
+    dsmUnlockPageProt(pageOffset);
+}
+
+/*
+ * lazy release: write protects the pages homed here written since the last
+ * release and notes their new versions; the next write faults again
+ */
+void dsmCloseHomeWrites(void)
+{
+    uInt32      page = 0;
+    uInt32      version = 0;
+
+    for (page = 0; page < dsmMmapInfo.numPagesToAlloc; page += 1) {
+        if (DSM_HOME_NODE(page) != dsmMmapInfo.nodeId) {
+            page |= DSM_HOME_BLOCK_PAGES - 1;   /* block homed elsewhere */
+            continue;
+        }
+        if (!DSM_PTE_READY(page) ||
+                !(DSM_PTE_FLAG_HOME_DIRTY & DSM_PTE(page).pteFlags)) {
+            continue;
+        }
+        dsmLockPte(page);
+        if (!(DSM_PTE_FLAG_HOME_DIRTY & DSM_PTE(page).pteFlags)) {
+            dsmUnlockPte(page);
+            continue;
+        }
+        dsmFlushBegin(1);
+        dsmLockPageProt(page);
+        if (DSM_PAGE_PRESENT == DSM_PTE(page).pageStatus) {
+            dsmSetPageAccess(page, PROT_READ);
+            DSM_PTE(page).pageStatus = DSM_PAGE_READ_ONLY;
+        }
+        __sync_fetch_and_and(&DSM_PTE(page).pteFlags, ~DSM_PTE_FLAG_HOME_DIRTY);
+        version = __sync_add_and_fetch(&DSM_PAGE_META(page).pageVersion, 1);
+        dsmUnlockPageProt(page);
+        dsmUnlockPte(page);
+        dsmNoteWrite(page, version);
+        dsmFlushEnd(1);
+    }
+}
+
+/*
+ * writes into pBuf the notices noted here since *pReleaseSeq and moves it
+ * on; at most one per page, pBuf is after the info of a msg of
+ * DSM_MAX_NOTICE_MSG_LEN bytes
+ * Returns the number of notices
+ */
+uInt32 dsmGatherNotices(uInt32* pReleaseSeq, uInt8* pBuf)
+{
+    dsmWriteNotice  notice;
+    uInt32          numNotices = 0;
+    uInt32          seq = 0;
+    uInt32          page = 0;
+
+    /* notices noted meanwhile may be sent again next time */
+    seq = dsmNoticeSeq;
+    for (page = 0; page < dsmMmapInfo.numPagesToAlloc; page += 1) {
+        if (!DSM_PTE_READY(page)) {
+            page |= DSM_PTE_CHUNK_PAGES - 1;    /* chunk never used */
+            continue;
+        }
+        if (DSM_PAGE_META(page).noticeSeq <= *pReleaseSeq) {
+            continue;
+        }
+        dsmLockPageProt(page);
+        notice.pageOffset = page;
+        notice.version = DSM_PAGE_META(page).noticeVersion;
+        dsmUnlockPageProt(page);
+        memcpy(pBuf + numNotices * sizeof(dsmWriteNotice), &notice,
+                sizeof(dsmWriteNotice));
+        numNotices += 1;
+    }
+    *pReleaseSeq = seq;
+    return numNotices;
+}
+
+/*
+ * manager: merges the notices of a release by nodeId into a set; the set
+ * is kept in page order, as the notices of a release are gathered, so the
+ * two are merged in one pass from the back
+ * Must be called with the lock of the set held.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmMergeNotices(dsmNoticeSet* pSet, const dsmWriteNotice* pNotices,
+        uInt32 numNotices, uInt32 nodeId)
+{
+    dsmLockNotice*  pNew = NULL;
+    dsmWriteNotice  notice;
+    uInt32          prevPage = 0;
+    uInt32          numNew = numNotices;    /* pages not in the set yet */
+    uInt32          i = 0;
+    uInt32          j = 0;
+    uInt32          k = 0;
+
+    if (0 == numNotices) {
+        return 0;
+    }
+    for (i = 0; i < numNotices; i += 1) {
+        memcpy(&notice, &pNotices[i], sizeof(dsmWriteNotice));
+        if (i > 0 && notice.pageOffset <= prevPage) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Notices from node [%u] out of page "
+                    "order\n", nodeId);
+            return -1;
+        }
+        for (; j < pSet->numNotices && pSet->pNotices[j].pageOffset < notice.pageOffset;
+                j += 1);
+        if (j < pSet->numNotices && pSet->pNotices[j].pageOffset == notice.pageOffset) {
+            numNew -= 1;
+        }
+        prevPage = notice.pageOffset;
+    }
+    if (pSet->numNotices + numNew > pSet->maxNotices) {
+        pNew = (dsmLockNotice*)realloc(pSet->pNotices, (pSet->numNotices +
+                    numNew) * 2 * sizeof(dsmLockNotice));
+        if (NULL == pNew) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                    "notices\n", pSet->numNotices + numNew);
+            return -1;
+        }
+        pSet->pNotices = pNew;
+        pSet->maxNotices = (pSet->numNotices + numNew) * 2;
+    }
+
+    pSet->seq += 1;
+    j = pSet->numNotices;
+    k = pSet->numNotices + numNew;
+    for (i = numNotices; i > 0; i -= 1) {
+        memcpy(&notice, &pNotices[i - 1], sizeof(dsmWriteNotice));
+        for (; j > 0 && pSet->pNotices[j - 1].pageOffset > notice.pageOffset; j -= 1) {
+            pSet->pNotices[--k] = pSet->pNotices[j - 1];
+        }
+        if (j > 0 && pSet->pNotices[j - 1].pageOffset == notice.pageOffset) {
+            pSet->pNotices[--k] = pSet->pNotices[--j];
+        }
+        else {
+            k -= 1;
+            pSet->pNotices[k].pageOffset = notice.pageOffset;
+            pSet->pNotices[k].version = 0;
+            pSet->pNotices[k].writers = 0;
+        }
+        if (notice.version > pSet->pNotices[k].version) {
+            pSet->pNotices[k].version = notice.version;
+        }
+        pSet->pNotices[k].seq = pSet->seq;
+        pSet->pNotices[k].writers |= DSM_NODE_BIT(nodeId);
+    }
+    pSet->numNotices += numNew;
+    return 0;
+}
+
+/*
+ * lazy release: drops the copies of pages homed elsewhere that are older
+ * than the notices rcvd with a grant; the writes made here to such a copy
+ * are sent to the home first
+ */
+void dsmApplyNotices(const dsmWriteNotice* pNotices, uInt32 numNotices, dsmMsg* pMsg)
+{
+    uInt32      page = 0;
+    uInt32      i = 0;
+
+    for (i = 0; i < numNotices; i += 1) {
+        page = pNotices[i].pageOffset;
+        if (page >= dsmMmapInfo.numPagesToAlloc) {
+            continue;
+        }
+        dsmNoteWrite(page, pNotices[i].version);
+        if (DSM_HOME_NODE(page) == dsmMmapInfo.nodeId) {
+            continue;
+        }
+
+        if (DSM_PAGE_META(page).pageVersion >= pNotices[i].version) {
+            continue;
+        }
+        dsmLockPte(page);
+        dsmDropCopy(page, pMsg);
+        dsmUnlockPte(page);
+    }
+}
+
+/*
+ * makes the writes released before an acquire seen here: with lazy release
+ * the copies the notices made stale are dropped, with multiple writers all
+ * the copies of pages homed elsewhere
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmAcquireWrites(const dsmWriteNotice* pNotices, uInt32 numNotices)
+{
+    dsmMsg*     pMsg = NULL;
+
+    if (!DSM_MULTI_WRITER()) {
+        return 0;
+    }
+    /* a dropped copy is fetched again from its home, which must first have
+     * the writes other threads here took out of the twins */
+    dsmFlushWait();
+    if (DSM_WRITE_MODE_MULTI == dsmMmapInfo.writeMode) {
+        return dsmDropCopies();
+    }
+    if (0 == numNotices) {
+        return 0;
+    }
+
+    pMsg = (dsmMsg*)malloc(DSM_MAX_MSG_LEN);
+    if (NULL == pMsg) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                "bytes\n", DSM_MAX_MSG_LEN);
+        return -1;
+    }
+    dsmApplyNotices(pNotices, numNotices, pMsg);
+    free(pMsg);
+    return 0;
+}
@@ -5,10 +5,11 @@
 #include "dsm_prototype.h"
 
 /*
- * decodes header info from msg buffer and calls appropriate handler function
+ * decodes header info from msg buffer and calls appropriate handler function;
+ * request handlers reply on the connection the msg came in on
  * Returns void
  */
-void dsmDecodeMsg(void *buffer)
+void dsmDecodeMsg(void *buffer, dsmConnCtx* pConn)
 {
     dsmMsgType      msgType;
     dsmMsg          msg;
@@ -21,14 +22,14 @@ void dsmDecodeMsg(void *buffer)
     msg = *(dsmMsg*)buffer;
     msgType = msg.msgType;
     payloadLen = msg.payloadLen;
-    pPayload = (uInt8*)((uInt8*)buffer + sizeof(dsmMsgType) + sizeof(uInt32));
+    pPayload = (uInt8*)buffer + DSM_MSG_HDR_LEN;
 
     /* depending on msg type invoke its handler */
     switch (msgType) {
         case DSM_MSG_INIT_SHARED_REGION_REQ:
             dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
                     "[DSM_MSG_INIT_SHARED_REGION_REQ]\n");
-            dsmInitSharedRegionReqHandler(pPayload);
+            dsmInitSharedRegionReqHandler(pPayload, pConn);
             break;
         case DSM_MSG_INIT_SHARED_REGION_RSP:
             dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
@@ -38,13 +39,147 @@ void dsmDecodeMsg(void *buffer)
         case DSM_MSG_PAGE_REQ:
             dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
                     "[DSM_MSG_PAGE_REQ]\n");
-            dsmPageReqHandler(pPayload);
+            dsmPageReqHandler(pPayload, pConn);
             break;
         case DSM_MSG_PAGE_RSP:
             dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
                     "[DSM_MSG_PAGE_RSP]\n");
             dsmPageRspHandler(pPayload);
             break;
+        case DSM_MSG_PAGE_READ_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_PAGE_READ_REQ]\n");
+            dsmPageReadReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_PAGE_READ_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_PAGE_READ_RSP]\n");
+            dsmPageReadRspHandler(pPayload);
+            break;
+        case DSM_MSG_PAGE_PREFETCH_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_PAGE_PREFETCH_RSP]\n");
+            dsmPageReadRspHandler(pPayload);
+            break;
+        case DSM_MSG_PAGE_BATCH_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_PAGE_BATCH_REQ]\n");
+            dsmPageBatchReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_PAGE_BATCH_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_PAGE_BATCH_RSP]\n");
+            dsmPageBatchRspHandler(pPayload, payloadLen);
+            break;
+        case DSM_MSG_DIFF_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_DIFF_REQ]\n");
+            dsmDiffReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_DIFF_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_DIFF_RSP]\n");
+            dsmDiffRspHandler(pPayload);
+            break;
+        case DSM_MSG_HELLO_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_HELLO_REQ]\n");
+            dsmHelloReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_HELLO_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_HELLO_RSP]\n");
+            dsmHelloRspHandler(pPayload);
+            break;
+        case DSM_MSG_LOCK_ACQUIRE_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_LOCK_ACQUIRE_REQ]\n");
+            dsmLockAcquireReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_LOCK_ACQUIRE_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_LOCK_ACQUIRE_RSP]\n");
+            dsmLockAcquireRspHandler(pPayload);
+            break;
+        case DSM_MSG_LOCK_RELEASE_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_LOCK_RELEASE_REQ]\n");
+            dsmLockReleaseReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_LOCK_RELEASE_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_LOCK_RELEASE_RSP]\n");
+            break;
+        case DSM_MSG_LOCK_GRANT_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_LOCK_GRANT_REQ]\n");
+            dsmLockGrantReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_LOCK_GRANT_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_LOCK_GRANT_RSP]\n");
+            break;
+        case DSM_MSG_LOCK_REVOKE_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_LOCK_REVOKE_REQ]\n");
+            dsmLockRevokeReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_LOCK_REVOKE_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_LOCK_REVOKE_RSP]\n");
+            break;
+        case DSM_MSG_BARRIER_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_BARRIER_REQ]\n");
+            dsmBarrierReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_BARRIER_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_BARRIER_RSP]\n");
+            break;
+        case DSM_MSG_BARRIER_DONE_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_BARRIER_DONE_REQ]\n");
+            dsmBarrierDoneReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_BARRIER_DONE_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_BARRIER_DONE_RSP]\n");
+            break;
+        case DSM_MSG_ATOMIC_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_ATOMIC_REQ]\n");
+            dsmAtomicReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_ATOMIC_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_ATOMIC_RSP]\n");
+            dsmAtomicRspHandler(pPayload);
+            break;
+        case DSM_MSG_INVALIDATE_REQ:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_INVALIDATE_REQ]\n");
+            dsmInvalidateReqHandler(pPayload, pConn);
+            break;
+        case DSM_MSG_INVALIDATE_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_INVALIDATE_RSP]\n");
+            break;
+        case DSM_MSG_PAGE_REDIRECT_RSP:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_PAGE_REDIRECT_RSP]\n");
+            dsmPageRedirectRspHandler(pPayload);
+            break;
+        case DSM_MSG_OWNER_UPDATE:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_OWNER_UPDATE]\n");
+            dsmOwnerUpdateHandler(pPayload);
+            break;
+        case DSM_MSG_PAGE_RECLAIM:
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Message rcvd with API id: "
+                    "[DSM_MSG_PAGE_RECLAIM]\n");
+            dsmPageReclaimHandler(pPayload);
+            break;
         default:
             dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid Msg type\n");
     }
@@ -53,21 +188,27 @@ void dsmDecodeMsg(void *buffer)
 
 /*
  * prepares shared region rsp msg containing shared region base addr
- * and sends back to peer.
+ * and page size and sends back to peer.
  * Returns 0 on success, -1 on failure
  */
-int dsmInitSharedRegionReqHandler(void* payload)
+int dsmInitSharedRegionReqHandler(void* payload, dsmConnCtx* pConn)
 {
-    dsmMsg*     pMsg = NULL;
-    uInt8*      pPayload = NULL;
-    uInt8       headerLen = 0;
-    uInt32      payloadLen = 0;
-    
+    dsmMsg*         pMsg = NULL;
+    uInt8           headerLen = 0;
+    uInt32          payloadLen = 0;
+    dsmRegionInfo   regionInfo;
+
     dsmEnterFunc();
 
+    /* the comm thread runs before the master has created the region; a
+     * node that comes up early waits for it */
+    while (NULL == pDsmSharedRegion) {
+        usleep(100);
+    }
+
     /* prepare msg to send to peer */
-    headerLen = sizeof(uInt32) + sizeof(uInt32);
-    payloadLen = sizeof(uInt32);
+    headerLen = DSM_MSG_HDR_LEN;
+    payloadLen = sizeof(dsmRegionInfo);
     pMsg = (dsmMsg*)malloc(headerLen + payloadLen);
     if (NULL == pMsg) {
         dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
@@ -76,11 +217,14 @@ int dsmInitSharedRegionReqHandler(void* payload)
         return -1;
     }
     pMsg->msgType = DSM_MSG_INIT_SHARED_REGION_RSP;
-    pMsg->payloadLen = sizeof(uInt32);
-    memcpy(pMsg->payload, &pDsmSharedRegion, sizeof(uInt32));
+    pMsg->payloadLen = sizeof(dsmRegionInfo);
+    regionInfo.regionAddr = (uInt64)(unsigned long)pDsmSharedRegion;
+    regionInfo.pageSize = DSM_PAGE_SIZE;
+    regionInfo.writeMode = dsmMmapInfo.writeMode;
+    memcpy(pMsg->payload, &regionInfo, sizeof(dsmRegionInfo));
 
     /* send msg and free the memory */
-    if (-1 == dsmSendMsg(dsmSockInfo.currentClientSd, pMsg)) {
+    if (-1 == dsmReplyMsg(pConn, pMsg)) {
         dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
                 "[DSM_MSG_INIT_SHARED_REGION_RSP]\n");
         dsmExitFunc();
@@ -94,191 +238,881 @@ int dsmInitSharedRegionReqHandler(void* payload)
 
 /*
  * assigns shared region base addr rcvd in payload to global shared region variable
+ * and takes over the page size and write mode of master
  * Returns 0 on success, -1 on failure
  */
 int dsmInitSharedRegionRspHandler(void* payload)
 {
+    dsmRegionInfo   regionInfo;
+
     dsmEnterFunc();
-    pDsmMasterInitAddr = (int*)(*(int*)payload);
+    memcpy(&regionInfo, payload, sizeof(dsmRegionInfo));
+    if (dsmConfig.pageSize != regionInfo.pageSize) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "Using page size [%u] of master\n",
+                regionInfo.pageSize);
+    }
+    dsmMmapInfo.pageSize = regionInfo.pageSize;
+    dsmMmapInfo.writeMode = regionInfo.writeMode;
+    pDsmMasterInitAddr = (int*)(unsigned long)regionInfo.regionAddr;
     dsmExitFunc();
     return 0;
 }
 
 /*
- * make requested page read-only and prepares copy of requested page;
- * sends requested to peer and make page inaccessible on the local machine
+ * make requested page read-only and sends it to peer straight from the
+ * shared region; then makes the page inaccessible on the local machine.
+ * The read-only copies handed out earlier are passed on with the page, the
+ * requester invalidates them before it writes.
  * Returns 0 on success, -1 on failure
  */
-int dsmPageReqHandler(void* payload)
+int dsmPageReqHandler(void* payload, dsmConnCtx* pConn)
 {
-    dsmMsg*             pMsg = NULL;
+    dsmPageReqInfo      reqInfo;
+    dsmPageRspInfo      rspInfo;
     uInt32              pageOffset = 0;
     uInt8*              pageBaseAddr = NULL;
-    uInt8               pageBuffer[DSM_PAGE_SIZE] = {0};
+    int32               retval = 0;
 
     dsmEnterFunc();
-    pageOffset = *(int*)payload;
+    memcpy(&reqInfo, payload, sizeof(dsmPageReqInfo));
+    pageOffset = reqInfo.pageOffset;
 
-    /* acquire lock on the page */
-    pthread_mutex_lock(&dsmPageTable[pageOffset].pteMutexVar);
-	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Mutex Lock acquired successfully\n");
+    /* a non-owner redirects without taking the page lock, which its own
+     * fault handler may hold while it waits for the page */
+    if (!DSM_PTE(pageOffset).owner) {
+        dsmExitFunc();
+        return dsmPageRedirect(pageOffset, pConn);
+    }
 
-    /* make the page read only */
-    pageBaseAddr = (uInt8*)pDsmSharedRegion + (pageOffset * DSM_PAGE_SIZE);
-    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Page Transfer Request from slave with "
-            "addr: [%p]\n", pageBaseAddr);
-    mprotect(pageBaseAddr, DSM_PAGE_SIZE, PROT_READ);
-    
-    /* copy the page */
-    memcpy(pageBuffer, pageBaseAddr, DSM_PAGE_SIZE);
-
-    /* make page inaccessible and update page table */
-    mprotect(pageBaseAddr, DSM_PAGE_SIZE, PROT_NONE);
-    dsmPageTable[pageOffset].owner = false;
-    dsmPageTable[pageOffset].pageStatus = DSM_PAGE_IN_TRANSFER;
-
-    /* send msg and free the memory; payload = page offset + page
-     * make page unavailable on the local machine */
-    pMsg = (dsmMsg*)malloc(sizeof(dsmMsg) + sizeof(uInt32) + DSM_PAGE_SIZE);
-    if (NULL == pMsg) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
-                "bytes\n", sizeof(dsmMsg) + sizeof(uInt32) + DSM_PAGE_SIZE);
+    /* acquire lock on the page; the local fault handler may hold it while
+     * it waits on other nodes, which may in turn wait on this thread, so
+     * the requester is told to retry instead */
+    if (0 != dsmTryLockPte(pageOffset)) {
         dsmExitFunc();
-        return -1;
+        return dsmPageRedirect(pageOffset, pConn);
+    }
+	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Mutex Lock acquired successfully\n");
+    /* a page that just came here is kept for its window; the requester
+     * retries as if the page were busy */
+    if (!DSM_PTE(pageOffset).owner || dsmPageHeld(pageOffset, true)) {
+        dsmUnlockPte(pageOffset);
+        dsmExitFunc();
+        return dsmPageRedirect(pageOffset, pConn);
     }
-    pMsg->msgType = DSM_MSG_PAGE_RSP;
-    pMsg->payloadLen = DSM_PAGE_SIZE + sizeof(uInt32);
-    memcpy(pMsg->payload, &pageOffset, sizeof(uInt32));
-    memcpy((void*)(pMsg->payload+sizeof(uInt32)), pageBuffer, DSM_PAGE_SIZE);
 
-    if (-1 == dsmSendMsg(dsmSockInfo.currentClientSd, pMsg)) {
+    pageBaseAddr = DSM_PAGE_ADDR(pageOffset);
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Page Transfer Request from node [%u] with "
+            "addr: [%p]\n", reqInfo.requesterId, pageBaseAddr);
+    dsmPrepareTransfer(pageOffset, reqInfo.requesterId, &rspInfo);
+    if (-1 == dsmSendPageMsg(pConn, DSM_MSG_PAGE_RSP, &rspInfo, pageBaseAddr)) {
         dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
                 "[DSM_MSG_PAGE_RSP]\n");
-        free(pMsg);
-        dsmExitFunc();
-        return -1;
+        retval = -1;
+    }
+    else {
+        DSM_TRACE_EVENT(DSM_EVENT_PAGE_SERVED, pageOffset, reqInfo.requesterId,
+                DSM_EVENT_FLAG_WRITE, 0);
     }
-    dsmPageTable[pageOffset].pageStatus = DSM_PAGE_NOT_PRESENT;
+    dsmCompleteTransfer(pageOffset, reqInfo.requesterId, &rspInfo, (0 == retval));
 
     /* Signal the other waiting thread if any */
-    pthread_cond_signal(&dsmPageTable[pageOffset].pteCondVar);
-    pthread_mutex_unlock(&dsmPageTable[pageOffset].pteMutexVar);
+    dsmWakePte(pageOffset);
+    dsmUnlockPte(pageOffset);
 	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Mutex Lock released successfully\n");
 
-    /* see can cause seg fault
-    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Page with base addr [%p] transfered\n",
-            pageBaseAddr);
-    */
-    free(pMsg);
     dsmExitFunc();
-    return 0;
+    return retval;
+}
+
+/*
+ * gives up ownership of a page about to be sent to a requester for
+ * writing: the page is made read only, so it stays intact until it is in
+ * the socket buffer, and marked in transfer; fills in the response info.
+ * Must be called with the page lock held.
+ * Returns void
+ */
+void dsmPrepareTransfer(uInt32 pageOffset, uInt32 requesterId, dsmPageRspInfo* pRspInfo)
+{
+    dsmSetPageAccess(pageOffset, PROT_READ);
+    DSM_PTE(pageOffset).owner = false;
+    DSM_PTE(pageOffset).pageStatus = DSM_PAGE_IN_TRANSFER;
+
+    pRspInfo->pageOffset = pageOffset;
+    pRspInfo->copyset = DSM_PTE(pageOffset).copyset & ~DSM_NODE_BIT(requesterId);
+    pRspInfo->ownerId = requesterId;
+    pRspInfo->ownerVersion = DSM_PTE(pageOffset).ownerVersion + 1;
+    pRspInfo->pageVersion = DSM_PAGE_META(pageOffset).pageVersion;
+}
+
+/*
+ * completes the transfer of a page prepared with dsmPrepareTransfer(); a
+ * page that was sent is made inaccessible on the local machine, one that
+ * never left stays owned here. Must be called with the page lock held.
+ * Returns void
+ */
+void dsmCompleteTransfer(uInt32 pageOffset, uInt32 requesterId,
+        dsmPageRspInfo* pRspInfo, bool isSent)
+{
+    uInt32      copyset = DSM_PTE(pageOffset).copyset;
+
+    if (isSent) {
+        /* make page unavailable on the local machine */
+        dsmSetPageAccess(pageOffset, PROT_NONE);
+        DSM_PTE(pageOffset).copyset = 0;
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_NOT_PRESENT;
+        dsmUpdateProbOwner(pageOffset, requesterId, pRspInfo->ownerVersion);
+        dsmHoldLost(pageOffset);
+        /* a page handed back with dsm_advise() leaves no memory behind */
+        if (__sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags, ~DSM_PTE_FLAG_RELEASE) &
+                DSM_PTE_FLAG_RELEASE) {
+            dsmReleasePage(pageOffset);
+        }
+        return;
+    }
+
+    /* the page never left; keep ownership */
+    dsmSetPageAccess(pageOffset, (0 == copyset) ? (PROT_READ | PROT_WRITE) : PROT_READ);
+    DSM_PTE(pageOffset).owner = true;
+    DSM_PTE(pageOffset).pageStatus = (0 == copyset) ? DSM_PAGE_PRESENT :
+        DSM_PAGE_READ_ONLY;
 }
 
 /*
- * copies the page rcvd to the corresponding shared memory region
- * and assigns read-write permission to it.
+ * copies the page rcvd to the corresponding shared memory region and takes
+ * ownership of it
  * Returns 0 on success, -1 on failure
  */
 int dsmPageRspHandler(void* payload)
 {
+    dsmPageRspInfo      rspInfo;
+    const uInt8*        pPage = NULL;
+
+    dsmEnterFunc();
+    memcpy(&rspInfo, payload, sizeof(dsmPageRspInfo));
+    pPage = dsmDecodePage(&rspInfo, ((uInt8*)payload)+sizeof(dsmPageRspInfo));
+    if (NULL == pPage) {
+        dsmExitFunc();
+        return -1;
+    }
+    dsmInstallOwnedPage(&rspInfo, pPage);
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * installs a page rcvd from its previous owner and takes ownership of it;
+ * the page is made read-write right away unless read-only copies are left
+ * to invalidate, in which case the faulting thread upgrades it once they
+ * are gone.
+ * Returns void
+ */
+void dsmInstallOwnedPage(dsmPageRspInfo* pRspInfo, const void* pPage)
+{
+    uInt32              pageOffset = pRspInfo->pageOffset;
+
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "New page with offset [%u] rcvd from "
+            "owner\n", pageOffset);
+    dsmStats()->stats.pages_rcvd += 1;
+    DSM_TRACE_EVENT(DSM_EVENT_PAGE_INSTALLED, pageOffset, DSM_TRACE_NO_PEER,
+            DSM_EVENT_FLAG_WRITE, 0);
+
+    /* install the page and update page table; an invalidation of the
+     * read-only copy this node held is superseded by the ownership */
+    dsmLockPageProt(pageOffset);
+    __sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags, ~DSM_PTE_FLAG_INV_PENDING);
+    DSM_PTE(pageOffset).owner = true;
+    DSM_PTE(pageOffset).ownerVersion = pRspInfo->ownerVersion;
+    DSM_PTE(pageOffset).copyset = pRspInfo->copyset &
+        ~DSM_NODE_BIT(dsmMmapInfo.nodeId);
+    DSM_PAGE_META(pageOffset).writeTimeMs = dsmNowMs();
+    dsmHoldAcquired(pageOffset);
+    if (0 == DSM_PTE(pageOffset).copyset) {
+        dsmInstallPage(pageOffset, pPage, PROT_READ | PROT_WRITE);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_PRESENT;
+    }
+    else {
+        dsmInstallPage(pageOffset, pPage, PROT_READ);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_READ_ONLY;
+    }
+    dsmUnlockPageProt(pageOffset);
+}
+
+/*
+ * downgrades the local copy of a page owned here to read only, for a copy
+ * of it to be sent, and fills in the response info; with multiple writers
+ * the home copy is left writable. Must be called with the page lock held.
+ * Returns void
+ */
+void dsmPrepareReadCopy(uInt32 pageOffset, dsmPageRspInfo* pRspInfo)
+{
+    if (DSM_MULTI_WRITER()) {
+        /* the home copy stays writable; with userfaultfd map it if untouched */
+        if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+            dsmUffdPopulatePage(pageOffset, PROT_READ | PROT_WRITE);
+        }
+    }
+    else if (DSM_PAGE_PRESENT == DSM_PTE(pageOffset).pageStatus) {
+        dsmSetPageAccess(pageOffset, PROT_READ);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_READ_ONLY;
+    }
+
+    pRspInfo->pageOffset = pageOffset;
+    pRspInfo->copyset = 0;
+    pRspInfo->ownerId = dsmMmapInfo.nodeId;
+    pRspInfo->ownerVersion = DSM_PTE(pageOffset).ownerVersion;
+    pRspInfo->pageVersion = DSM_PAGE_META(pageOffset).pageVersion;
+}
+
+/*
+ * sends a read-only copy of a page owned here to peer with the msg type
+ * given; the owner keeps its copy but write protects it, so that its next
+ * write invalidates the copies. Must be called with the page lock held.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmSendReadCopy(uInt32 pageOffset, uInt32 requesterId, dsmMsgType msgType,
+        dsmConnCtx* pConn)
+{
+    dsmPageRspInfo      rspInfo;
+
+    dsmPrepareReadCopy(pageOffset, &rspInfo);
+    if (-1 == dsmSendPageMsg(pConn, msgType, &rspInfo,
+                DSM_PAGE_ADDR(pageOffset))) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[%d]\n", msgType);
+        return -1;
+    }
+
+    /* track the copy so that it is invalidated on the next write */
+    DSM_PTE(pageOffset).copyset |= DSM_NODE_BIT(requesterId);
+    DSM_TRACE_EVENT(DSM_EVENT_PAGE_SERVED, pageOffset, requesterId, 0, 0);
+    return 0;
+}
+
+/*
+ * sends a read-only copy of the requested page to peer, preceded by the
+ * pages the peer prefetches along with it
+ * Returns 0 on success, -1 on failure
+ */
+int dsmPageReadReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmPageReqInfo      reqInfo;
     uInt32              pageOffset = 0;
-    uInt8*              pageBaseAddr = NULL;
+    int32               retval = 0;
 
     dsmEnterFunc();
-    /* make the page write only */
-    pageOffset = *(int*)payload;
-    pageBaseAddr = (uInt8*)pDsmSharedRegion + (pageOffset * DSM_PAGE_SIZE);
-    mprotect(pageBaseAddr, DSM_PAGE_SIZE, PROT_WRITE);
-    dsmPrintLog(DSM_TRACE_TYPE_INFO, "New page with base addr [%p] rcvd from "
-            "owner\n", pageBaseAddr);
-
-    /* copy the page */
-    memcpy(pageBaseAddr, ((uInt8*)payload)+sizeof(uInt32), DSM_PAGE_SIZE);
-
-    /* make the page accessible and update page table */
-    mprotect(pageBaseAddr, DSM_PAGE_SIZE, PROT_WRITE | PROT_READ);
-    dsmPageTable[pageOffset].owner = true;
-    dsmPageTable[pageOffset].pageStatus = DSM_PAGE_PRESENT;
-
-    dsmPrintLog(DSM_TRACE_TYPE_INFO, "New page with base addr [%p] updated "
-            "locally\n", pageBaseAddr);
+    memcpy(&reqInfo, payload, sizeof(dsmPageReqInfo));
+    pageOffset = reqInfo.pageOffset;
+
+    /* a non-owner redirects without taking the page lock */
+    if (!DSM_PTE(pageOffset).owner) {
+        dsmExitFunc();
+        return dsmPageRedirect(pageOffset, pConn);
+    }
+
+    /* acquire lock on the page; retried by the requester when busy */
+    if (0 != dsmTryLockPte(pageOffset)) {
+        dsmExitFunc();
+        return dsmPageRedirect(pageOffset, pConn);
+    }
+	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Mutex Lock acquired successfully\n");
+    if (!DSM_PTE(pageOffset).owner || dsmPageHeld(pageOffset, false)) {
+        dsmUnlockPte(pageOffset);
+        dsmExitFunc();
+        return dsmPageRedirect(pageOffset, pConn);
+    }
+
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Page Read Request from node [%u] for page "
+            "with offset: [%u]\n", reqInfo.requesterId, pageOffset);
+    if (0 != reqInfo.prefetchMask) {
+        dsmPrefetchServe(&reqInfo, pConn);
+    }
+    retval = dsmSendReadCopy(pageOffset, reqInfo.requesterId, DSM_MSG_PAGE_READ_RSP,
+            pConn);
+
+    dsmUnlockPte(pageOffset);
+	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Mutex Lock released successfully\n");
+
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * installs the read-only copy of the page rcvd from the owner
+ * Returns 0 on success, -1 on failure
+ */
+int dsmPageReadRspHandler(void* payload)
+{
+    dsmPageRspInfo      rspInfo;
+    const uInt8*        pPage = NULL;
+
+    dsmEnterFunc();
+    memcpy(&rspInfo, payload, sizeof(dsmPageRspInfo));
+    pPage = dsmDecodePage(&rspInfo, ((uInt8*)payload)+sizeof(dsmPageRspInfo));
+    if (NULL == pPage) {
+        dsmExitFunc();
+        return -1;
+    }
+    dsmInstallReadCopy(&rspInfo, pPage);
     dsmExitFunc();
     return 0;
 }
 
 /*
- * signal handler invoked on page fault
- * prepares page request msg and sends request to peer.
- * waits for response from peer
+ * installs a read-only copy of a page rcvd from its owner. If the copy got
+ * invalidated while it was on the way it is dropped again, the faulting
+ * thread then requests a fresh one.
+ * Returns void
+ */
+void dsmInstallReadCopy(dsmPageRspInfo* pRspInfo, const void* pPage)
+{
+    uInt32              pageOffset = pRspInfo->pageOffset;
+
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Read-only copy of page with offset [%u] "
+            "rcvd from owner\n", pageOffset);
+    dsmStats()->stats.pages_rcvd += 1;
+    DSM_TRACE_EVENT(DSM_EVENT_PAGE_INSTALLED, pageOffset, pRspInfo->ownerId, 0, 0);
+
+    /* install the page read only; the protection lock keeps an invalidation
+     * from revoking the page while it is being installed */
+    dsmLockPageProt(pageOffset);
+    DSM_PTE(pageOffset).owner = false;
+    if (__sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags,
+                ~DSM_PTE_FLAG_INV_PENDING) & DSM_PTE_FLAG_INV_PENDING) {
+        /* the copy got invalidated on the way */
+        dsmPrintLog(DSM_TRACE_TYPE_INFO, "Read-only copy of page with offset "
+                "[%u] invalidated in transfer\n", pageOffset);
+        dsmSetPageAccess(pageOffset, PROT_NONE);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_NOT_PRESENT;
+    }
+    else {
+        dsmInstallPage(pageOffset, pPage, PROT_READ);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_READ_ONLY;
+        DSM_PAGE_META(pageOffset).pageVersion = pRspInfo->pageVersion;
+    }
+    dsmUnlockPageProt(pageOffset);
+    dsmUpdateProbOwner(pageOffset, pRspInfo->ownerId, pRspInfo->ownerVersion);
+}
+
+/*
+ * serializes changes of a page's protection and contents with an
+ * invalidation that cannot take the page lock; held only around the access
+ * change and the page install, never across network i/o
+ */
+void dsmLockPageProt(uInt32 pageOffset)
+{
+    while (__sync_fetch_and_or(&DSM_PTE(pageOffset).pteFlags,
+                DSM_PTE_FLAG_PROT_BUSY) & DSM_PTE_FLAG_PROT_BUSY) {
+        sched_yield();
+    }
+}
+
+void dsmUnlockPageProt(uInt32 pageOffset)
+{
+    __sync_fetch_and_and(&DSM_PTE(pageOffset).pteFlags, ~DSM_PTE_FLAG_PROT_BUSY);
+}
+
+/*
+ * drops the local read-only copy of a page and acknowledges it to the new
+ * writer. If a local thread holds the page lock it is fetching the page
+ * itself; the copy is then revoked right away and the invalidation recorded
+ * in the pte for that thread, so this handler never blocks on a page lock.
+ * Returns 0 on success, -1 on failure
+ */
+int dsmInvalidateReqHandler(void* payload, dsmConnCtx* pConn)
+{
+    dsmInvalidateInfo   invInfo;
+    uInt8               msgBuf[sizeof(dsmMsg) + sizeof(dsmInvalidateInfo)];
+    dsmMsg*             pMsg = (dsmMsg*)msgBuf;
+
+    dsmEnterFunc();
+    memcpy(&invInfo, payload, sizeof(dsmInvalidateInfo));
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Invalidate Request from node [%u] for page "
+            "with addr: [%p]\n", invInfo.ownerId, DSM_PAGE_ADDR(invInfo.pageOffset));
+    DSM_TRACE_EVENT(DSM_EVENT_INVALIDATED, invInfo.pageOffset, invInfo.ownerId, 0, 0);
+
+    if (0 == dsmTryLockPte(invInfo.pageOffset)) {
+        if (!DSM_PTE(invInfo.pageOffset).owner) {
+            dsmSetPageAccess(invInfo.pageOffset, PROT_NONE);
+            DSM_PTE(invInfo.pageOffset).pageStatus = DSM_PAGE_NOT_PRESENT;
+            dsmUpdateProbOwner(invInfo.pageOffset, invInfo.ownerId, invInfo.ownerVersion);
+        }
+        dsmWakePte(invInfo.pageOffset);
+        dsmUnlockPte(invInfo.pageOffset);
+    }
+    else {
+        dsmLockPageProt(invInfo.pageOffset);
+        if (!DSM_PTE(invInfo.pageOffset).owner) {
+            __sync_fetch_and_or(&DSM_PTE(invInfo.pageOffset).pteFlags,
+                    DSM_PTE_FLAG_INV_PENDING);
+            dsmSetPageAccess(invInfo.pageOffset, PROT_NONE);
+        }
+        dsmUnlockPageProt(invInfo.pageOffset);
+    }
+
+    /* acknowledge the invalidation */
+    pMsg->msgType = DSM_MSG_INVALIDATE_RSP;
+    pMsg->payloadLen = sizeof(dsmInvalidateInfo);
+    memcpy(pMsg->payload, &invInfo, sizeof(dsmInvalidateInfo));
+    if (-1 == dsmReplyMsg(pConn, pMsg)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_INVALIDATE_RSP]\n");
+        dsmExitFunc();
+        return -1;
+    }
+
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * returns true if the faulting access described by the signal context is a
+ * write; faults which cannot be told apart are treated as writes
+ */
+bool dsmIsWriteFault(void* context)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    /* bit 1 of the page fault error code is set for write accesses */
+    return (0 != (((ucontext_t*)context)->uc_mcontext.gregs[REG_ERR] & 0x2));
+#else
+    return true;
+#endif
+}
+
+/*
+ * invalidates the read-only copies of a page owned by this node so that it
+ * can be written. Must be called with the page lock held.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmInvalidateCopies(uInt32 pageOffset)
+{
+    dsmInvalidateInfo   invInfo;
+    uInt32              copyset = 0;
+    uInt8               msgBuf[sizeof(dsmMsg) + sizeof(dsmInvalidateInfo)];
+    dsmMsg*             pMsg = (dsmMsg*)msgBuf;
+
+    dsmEnterFunc();
+
+    copyset = DSM_PTE(pageOffset).copyset & ~DSM_NODE_BIT(dsmMmapInfo.nodeId);
+    if (0 != copyset) {
+        invInfo.pageOffset = pageOffset;
+        invInfo.ownerId = dsmMmapInfo.nodeId;
+        invInfo.ownerVersion = DSM_PTE(pageOffset).ownerVersion;
+        pMsg->msgType = DSM_MSG_INVALIDATE_REQ;
+        pMsg->payloadLen = sizeof(dsmInvalidateInfo);
+        memcpy(pMsg->payload, &invInfo, sizeof(dsmInvalidateInfo));
+        if (-1 == dsmMulticastAndRecv(copyset, pMsg)) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalidation failed for page with "
+                    "offset [%u]\n", pageOffset);
+            dsmExitFunc();
+            return -1;
+        }
+    }
+    DSM_PTE(pageOffset).copyset = 0;
+
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * sends a redirect to the requester of a page, naming the node this node
+ * believes to be the owner; an owner that is busy with the page names
+ * itself, and the requester retries
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmPageRedirect(uInt32 pageOffset, dsmConnCtx* pConn)
+{
+    dsmOwnerInfo        ownerInfo;
+    uInt8               msgBuf[sizeof(dsmMsg) + sizeof(dsmOwnerInfo)];
+    dsmMsg*             pMsg = (dsmMsg*)msgBuf;
+
+    dsmEnterFunc();
+    ownerInfo.pageOffset = pageOffset;
+    ownerInfo.ownerId = DSM_PTE(pageOffset).owner ? dsmMmapInfo.nodeId :
+            DSM_PTE(pageOffset).probOwner;
+    ownerInfo.ownerVersion = DSM_PTE(pageOffset).ownerVersion;
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Redirecting request for page with offset "
+            "[%u] to node [%u]\n", pageOffset, ownerInfo.ownerId);
+
+    pMsg->msgType = DSM_MSG_PAGE_REDIRECT_RSP;
+    pMsg->payloadLen = sizeof(dsmOwnerInfo);
+    memcpy(pMsg->payload, &ownerInfo, sizeof(dsmOwnerInfo));
+    if (-1 == dsmReplyMsg(pConn, pMsg)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Msg send failed for msg with API Id: "
+                "[DSM_MSG_PAGE_REDIRECT_RSP]\n");
+        dsmExitFunc();
+        return -1;
+    }
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * records the owner hint of a redirect; the requesting thread holds the
+ * page lock and retries with it
+ * Returns 0 on success, -1 on failure
+ */
+int dsmPageRedirectRspHandler(void* payload)
+{
+    dsmOwnerInfo        ownerInfo;
+
+    dsmEnterFunc();
+    memcpy(&ownerInfo, payload, sizeof(dsmOwnerInfo));
+    dsmUpdateProbOwner(ownerInfo.pageOffset, ownerInfo.ownerId, ownerInfo.ownerVersion);
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * records the new owner of a page this node is the home of
+ * Returns 0 on success, -1 on failure
+ */
+int dsmOwnerUpdateHandler(void* payload)
+{
+    dsmOwnerInfo        ownerInfo;
+
+    dsmEnterFunc();
+    memcpy(&ownerInfo, payload, sizeof(dsmOwnerInfo));
+    dsmUpdateProbOwner(ownerInfo.pageOffset, ownerInfo.ownerId, ownerInfo.ownerVersion);
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * updates the probable owner of a page this node does not own. Every
+ * ownership change increments the page's owner version, and a hint is only
+ * replaced by a newer one, so following hints always moves forward to the
+ * current owner even when updates arrive out of order. The hint is stored
+ * under the protection lock only, as the faulting thread may hold the page
+ * lock.
+ */
+void dsmUpdateProbOwner(uInt32 pageOffset, uInt32 ownerId, uInt32 ownerVersion)
+{
+    if (ownerId >= dsmMmapInfo.numNodes || ownerId == dsmMmapInfo.nodeId) {
+        return;
+    }
+    dsmLockPageProt(pageOffset);
+    if (!DSM_PTE(pageOffset).owner &&
+            (int32)(ownerVersion - DSM_PTE(pageOffset).ownerVersion) > 0) {
+        DSM_PTE(pageOffset).probOwner = ownerId;
+        DSM_PTE(pageOffset).ownerVersion = ownerVersion;
+    }
+    dsmUnlockPageProt(pageOffset);
+}
+
+/*
+ * requests the page from its owner, with write access (ownership) or as a
+ * read-only copy; the response handler installs the page.
+ * The request goes to the probable owner. A node that does not own the page
+ * redirects with its own, newer hint, which is followed; without a newer
+ * hint the request goes to the page's home node, which is told of every
+ * ownership change. A fault thus takes a small, bounded number of hops.
+ * A read request carries the pages picked by dsmPrefetchPick(), which the
+ * owner sends ahead of the response.
+ * Must be called with the page lock held.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmRequestPage(uInt32 pageOffset, bool isWrite, int32 prefetchStride,
+        uInt32 prefetchMask)
+{
+    dsmPageReqInfo      reqInfo;
+    dsmOwnerInfo        ownerInfo;
+    dsmPageStatus       prevStatus;
+    uInt32              target = 0;
+    uInt32              homeId = 0;
+    bool                askedHome = false;
+    int32               hops = 0;
+    uInt8               msgBuf[sizeof(dsmMsg) + sizeof(dsmPageReqInfo) +
+                            sizeof(dsmOwnerInfo)];
+    dsmMsg*             pMsg = (dsmMsg*)msgBuf;
+
+    dsmEnterFunc();
+
+    /* Compose the request message; the buffer is reused for the update */
+    reqInfo.pageOffset = pageOffset;
+    reqInfo.requesterId = dsmMmapInfo.nodeId;
+    reqInfo.prefetchStride = prefetchStride;
+    reqInfo.prefetchMask = isWrite ? 0 : prefetchMask;
+    pMsg->msgType = isWrite ? DSM_MSG_PAGE_REQ : DSM_MSG_PAGE_READ_REQ;
+    pMsg->payloadLen = sizeof(dsmPageReqInfo);
+    memcpy(pMsg->payload, &reqInfo, sizeof(dsmPageReqInfo));
+
+    homeId = DSM_HOME_NODE(pageOffset);
+    target = DSM_PTE(pageOffset).probOwner;
+    if (target == dsmMmapInfo.nodeId) {
+        target = homeId;
+    }
+
+    /* Request the page from the probable owner over the persistent
+     * connection; Set the Page table entry accordingly;
+     * Block the handler to receive the page */
+    prevStatus = (dsmPageStatus)DSM_PTE(pageOffset).pageStatus;
+    for (hops = 0; hops < DSM_MAX_FAULT_HOPS; hops += 1) {
+        askedHome = askedHome || (target == homeId);
+        DSM_PTE(pageOffset).pageStatus = DSM_PAGE_REQUESTED;
+        DSM_TRACE_EVENT(DSM_EVENT_REQ_SENT, pageOffset, target,
+                isWrite ? DSM_EVENT_FLAG_WRITE : 0, 0);
+        if (-1 == dsmSendAndRecv(&dsmPeers[target], pMsg)) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Page request failed for page with "
+                    "offset [%u]\n", pageOffset);
+            DSM_PTE(pageOffset).pageStatus = prevStatus;
+            dsmExitFunc();
+            return -1;
+        }
+        if (DSM_PAGE_REQUESTED != DSM_PTE(pageOffset).pageStatus) {
+            break;
+        }
+
+        /* redirected; follow a newer hint, else ask the home node */
+        if (DSM_PTE(pageOffset).probOwner != target) {
+            target = DSM_PTE(pageOffset).probOwner;
+        }
+        else if (!askedHome && homeId != dsmMmapInfo.nodeId) {
+            target = homeId;
+        }
+        else {
+            /* the owner is busy with the page; back off */
+            usleep(DSM_BUSY_RETRY_US);
+        }
+    }
+    if (DSM_PAGE_REQUESTED == DSM_PTE(pageOffset).pageStatus) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "Owner of page with offset [%u] not found "
+                "in [%d] hops\n", pageOffset, DSM_MAX_FAULT_HOPS);
+        DSM_PTE(pageOffset).pageStatus = prevStatus;
+        dsmExitFunc();
+        return -1;
+    }
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Response rcvd for page with "
+            "offset [%u] from node [%u]\n", pageOffset, target);
+
+    if (DSM_PTE(pageOffset).owner && homeId != dsmMmapInfo.nodeId &&
+            homeId != target) {
+        /* tell the home node of the new owner */
+        ownerInfo.pageOffset = pageOffset;
+        ownerInfo.ownerId = dsmMmapInfo.nodeId;
+        ownerInfo.ownerVersion = DSM_PTE(pageOffset).ownerVersion;
+        pMsg->msgType = DSM_MSG_OWNER_UPDATE;
+        pMsg->payloadLen = sizeof(dsmOwnerInfo);
+        memcpy(pMsg->payload, &ownerInfo, sizeof(dsmOwnerInfo));
+        dsmSendToPeer(&dsmPeers[homeId], pMsg);
+    }
+
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * sets the access of the local copy of a page to PROT_NONE, PROT_READ or
+ * PROT_READ | PROT_WRITE with the configured fault engine; aborts if the
+ * access cannot be set, e.g. the mappings of the process would exceed
+ * vm.max_map_count, as the page would fault over and over
+ * Returns void
+ */
+void dsmSetPageAccess(uInt32 pageOffset, int32 prot)
+{
+    uInt64      startNs = dsmStatsPhaseStart();
+
+    if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+        dsmUffdSetPageAccess(pageOffset, prot);
+    }
+    else if (-1 == mprotect(DSM_PAGE_ADDR(pageOffset), DSM_PAGE_SIZE, prot)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Access of page with offset [%u] not set, "
+                "errno: [%d]\n", pageOffset, errno);
+        abort();
+    }
+    /* a page made writable is saved by the next checkpoint; the entry is
+     * reached directly, this runs while its chunk is set up too */
+    if (prot & PROT_WRITE) {
+        __sync_fetch_and_or(&dsmPageTable[pageOffset].pteFlags, DSM_PTE_FLAG_CKPT_DIRTY);
+    }
+    dsmStatsPhaseEnd(DSM_PHASE_MPROTECT, startNs);
+}
+
+/*
+ * installs the contents of a page rcvd from a peer and gives it the access
+ * given; with userfaultfd, or through the alias of the region, the page
+ * becomes visible with its final access at once, else it is briefly
+ * writable to the process while it is copied
+ * Returns void
+ */
+void dsmInstallPage(uInt32 pageOffset, const void* pPage, int32 prot)
+{
+    uInt8*      pageBaseAddr = NULL;
+    uInt64      startNs = dsmStatsPhaseStart();
+
+    __sync_fetch_and_or(&DSM_PTE(pageOffset).pteFlags, DSM_PTE_FLAG_CKPT_DIRTY);
+    /* userfaultfd copies and maps the page in one step, timed as the copy */
+    if (DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+        dsmUffdInstallPage(pageOffset, pPage, prot);
+        dsmStatsPhaseEnd(DSM_PHASE_COPY, startNs);
+        return;
+    }
+    pageBaseAddr = DSM_PAGE_ADDR(pageOffset);
+    if (NULL != pDsmRegionAlias) {
+        memcpy(DSM_PAGE_ALIAS(pageOffset), pPage, DSM_PAGE_SIZE);
+        dsmStatsPhaseEnd(DSM_PHASE_COPY, startNs);
+        dsmSetPageAccess(pageOffset, prot);
+        return;
+    }
+    dsmSetPageAccess(pageOffset, PROT_WRITE);
+    startNs = dsmStatsPhaseStart();
+    memcpy(pageBaseAddr, pPage, DSM_PAGE_SIZE);
+    dsmStatsPhaseEnd(DSM_PHASE_COPY, startNs);
+    dsmSetPageAccess(pageOffset, prot);
+}
+
+/*
+ * signal handler invoked on page fault; a fault outside the shared region
+ * is a real crash and is left to the default action
  * Returns void
  */
 void dsmPageFaultHandler(int signal, siginfo_t *data, void *other)
 {
-	int         offsetPageMultiple = -1;
-	int         retval = -1;
+	int32               offsetPageMultiple = -1;
+	struct sigaction    defAction;
 
 	dsmPrintLog(DSM_TRACE_TYPE_INFO, "Page Fault occured for address [%p] "
             "with code [%d]\n", data->si_addr, data->si_code);
 
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Access to invalid region: [%p]\n", data->si_addr);
+	if (NULL == pDsmSharedRegion || (uInt8*)data->si_addr < (uInt8*)pDsmSharedRegion ||
+            (uInt8*)data->si_addr >= (uInt8*)pDsmSharedRegion +
+            (size_t)dsmMmapInfo.numPagesToAlloc * DSM_PAGE_SIZE) {
+		/* the faulting access is retried without the handler */
+		memset(&defAction, 0, sizeof(struct sigaction));
+		defAction.sa_handler = SIG_DFL;
+		sigemptyset(&defAction.sa_mask);
+		sigaction(SIGSEGV, &defAction, NULL);
+		return;
+	}
+
 	/*Calculate the page offset in multiples of page size
 	 * offsetPageMultiple is an index into the Page Table array */
 	offsetPageMultiple = ((char*)data->si_addr - (char*)pDsmSharedRegion)/DSM_PAGE_SIZE;
-	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Page offset: [%d]\n", offsetPageMultiple);
+	dsmServeFault(offsetPageMultiple, dsmIsWriteFault(other));
+}
+
+/*
+ * serves a fault on a page of the shared region for either fault engine;
+ * read faults fetch a read-only copy of the page, write faults take
+ * ownership of it; the owner of a read-only page invalidates the copies
+ * before it writes. Waits until the page is accessible.
+ * Returns 0 on success, -1 if the faulting access has to be retried
+ */
+int32 dsmServeFault(uInt32 offsetPageMultiple, bool isWrite)
+{
+	int32       retval = 0;
+	int32       prefetchStride = 0;
+	uInt32      prefetchMask = 0;
+	uInt32      prefetchPicked = 0;
+	dsmThreadStats* pStats = dsmStats();
+	uInt64      startNs = dsmNowNs();
+
+	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Page offset: [%d], write: [%d]\n",
+            offsetPageMultiple, isWrite);
+
+	/* the phases of the fault path are timed from here on */
+	if (isWrite) {
+		pStats->stats.write_faults += 1;
+	}
+	else {
+		pStats->stats.read_faults += 1;
+	}
+	pStats->inFault = true;
+	DSM_TRACE_EVENT(DSM_EVENT_FAULT, offsetPageMultiple, DSM_TRACE_NO_PEER,
+            isWrite ? DSM_EVENT_FLAG_WRITE : 0, 0);
 
-	pthread_mutex_lock(&(dsmPageTable[offsetPageMultiple].pteMutexVar));
+	dsmLockPte(offsetPageMultiple);
 	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Mutex Lock acquired successfully\n");
 
-	/* The page fault handler should continue only if the page is not present
-     * at the machine */
-	if (dsmPageTable[offsetPageMultiple].pageStatus != DSM_PAGE_NOT_PRESENT) {
+	/* apply an invalidation of the read-only copy rcvd while the lock was held */
+	if ((__sync_fetch_and_and(&DSM_PTE(offsetPageMultiple).pteFlags,
+                    ~DSM_PTE_FLAG_INV_PENDING) & DSM_PTE_FLAG_INV_PENDING) &&
+            !DSM_PTE(offsetPageMultiple).owner &&
+            DSM_PAGE_READ_ONLY == DSM_PTE(offsetPageMultiple).pageStatus) {
+		DSM_PTE(offsetPageMultiple).pageStatus = DSM_PAGE_NOT_PRESENT;
+	}
+
+	/* wait while the page is in transfer */
+	while (DSM_PAGE_REQUESTED == DSM_PTE(offsetPageMultiple).pageStatus ||
+            DSM_PAGE_IN_TRANSFER == DSM_PTE(offsetPageMultiple).pageStatus) {
 		dsmPrintLog(DSM_TRACE_TYPE_DEBUG,"Waiting for signal...\n");
-		while (!pthread_cond_wait(&dsmPageTable[offsetPageMultiple].pteCondVar,
-                    &dsmPageTable[offsetPageMultiple].pteMutexVar))
-			dsmPrintLog(DSM_TRACE_TYPE_ERROR, "pthread_cond_wait returned erroneously\n");
+		dsmWaitPte(offsetPageMultiple);
 	}
 
-	if (dsmPageTable[offsetPageMultiple].pageStatus != DSM_PAGE_IN_TRANSFER) {
-		/* request for page which caused the segmentation fault */
-		dsmCreateSocket();
-		do {
-			usleep(100);
-            if (dsmMmapInfo.isMaster) {
-			    retval = dsmConnectToPeer(dsmSockInfo.reqSockSd, dsmMmapInfo.oIpAddr,
-					dsmMmapInfo.oPort);
-            }
-            else {
-			    retval = dsmConnectToPeer(dsmSockInfo.reqSockSd, dsmMmapInfo.mIpAddr,
-					dsmMmapInfo.mPort);
-            }
-		} while (-1 == retval);
-
-		/* Compose the request message */
-		dsmMsg msg;
-		memset(&msg, 0, sizeof(dsmMsg));
-		msg.msgType = DSM_MSG_PAGE_REQ;
-		msg.payloadLen = sizeof(uInt32);
-		memcpy(msg.payload, &offsetPageMultiple, msg.payloadLen);
-
-		/* Request the page from the other process; 
-         * Set the Page table entry accordingly;
-         * Block the handler to receive the page */
-		dsmPageTable[offsetPageMultiple].pageStatus = DSM_PAGE_REQUESTED;
-		dsmSendMsg(dsmSockInfo.reqSockSd, &msg);
-	    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Page request sent for page with "
-                "offset [%d]\n", offsetPageMultiple);
-		dsmPageTable[offsetPageMultiple].pageStatus = DSM_PAGE_IN_TRANSFER;
-		dsmRecvMsg(dsmSockInfo.reqSockSd);
-	    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Response rcvd for page with "
-                "offset [%d]\n", offsetPageMultiple);
-
-		close(dsmSockInfo.reqSockSd);
-
-		/* Release the mutex variable */
-		pthread_mutex_unlock(&dsmPageTable[offsetPageMultiple].pteMutexVar);
-	    dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Mutex Lock released successfully\n");
-        dsmExitFunc();
+	/* a read of a page that is not here may read ahead the pages a scan
+	 * touches next, unless advised random */
+	if (!isWrite && !DSM_PTE(offsetPageMultiple).owner &&
+            DSM_PAGE_NOT_PRESENT == DSM_PTE(offsetPageMultiple).pageStatus &&
+            0 != dsmConfig.prefetchMaxPages &&
+            DSM_ADVICE_RANDOM != DSM_PAGE_ADVICE(offsetPageMultiple)) {
+		prefetchPicked = dsmPrefetchPick(offsetPageMultiple, &prefetchStride);
+		prefetchMask = prefetchPicked;
 	}
-}
 
+	/* The page fault handler should continue only until the page is
+     * accessible for the faulting access */
+	while (DSM_PAGE_PRESENT != DSM_PTE(offsetPageMultiple).pageStatus &&
+            (isWrite || DSM_PAGE_READ_ONLY != DSM_PTE(offsetPageMultiple).pageStatus)) {
+		if (DSM_PTE(offsetPageMultiple).owner &&
+                DSM_PAGE_READ_ONLY == DSM_PTE(offsetPageMultiple).pageStatus &&
+                DSM_MULTI_WRITER()) {
+			/* lazy release: the home notes the write for its next release */
+			dsmLockPageProt(offsetPageMultiple);
+			__sync_fetch_and_or(&DSM_PTE(offsetPageMultiple).pteFlags,
+                    DSM_PTE_FLAG_HOME_DIRTY);
+			dsmSetPageAccess(offsetPageMultiple, PROT_READ | PROT_WRITE);
+			DSM_PTE(offsetPageMultiple).pageStatus = DSM_PAGE_PRESENT;
+			dsmUnlockPageProt(offsetPageMultiple);
+		}
+		else if (DSM_PTE(offsetPageMultiple).owner &&
+                DSM_PAGE_READ_ONLY == DSM_PTE(offsetPageMultiple).pageStatus) {
+			/* write to an owned page: invalidate the copies and upgrade */
+			if (-1 == dsmInvalidateCopies(offsetPageMultiple)) {
+				retval = -1;
+				break;
+			}
+			dsmSetPageAccess(offsetPageMultiple, PROT_READ | PROT_WRITE);
+			DSM_PTE(offsetPageMultiple).pageStatus = DSM_PAGE_PRESENT;
+			DSM_PAGE_META(offsetPageMultiple).writeTimeMs = dsmNowMs();
+		}
+		else if (DSM_MULTI_WRITER() &&
+                DSM_PAGE_READ_ONLY == DSM_PTE(offsetPageMultiple).pageStatus) {
+			/* multiple writers: write the copy here, diffed at dsm_sync() */
+			if (-1 == dsmMakeTwin(offsetPageMultiple)) {
+				retval = -1;
+				break;
+			}
+		}
+		else if (-1 == dsmRequestPage(offsetPageMultiple,
+                    isWrite && !DSM_MULTI_WRITER(),
+                    prefetchStride, prefetchMask)) {
+            /* the faulting access is retried and requests the page again */
+			retval = -1;
+			break;
+		}
+		/* the pages prefetched are asked for once */
+		prefetchMask = 0;
+	}
+	dsmPrefetchDone(offsetPageMultiple, prefetchStride, prefetchPicked);
+
+	/* with userfaultfd an owned page the node never touched is not mapped
+	 * yet; map it zero filled with its access */
+	if (0 == retval && DSM_PTE(offsetPageMultiple).owner &&
+            DSM_FAULT_ENGINE_UFFD == dsmConfig.faultEngine) {
+		dsmUffdPopulatePage(offsetPageMultiple,
+                (DSM_PAGE_PRESENT == DSM_PTE(offsetPageMultiple).pageStatus) ?
+                (PROT_READ | PROT_WRITE) : PROT_READ);
+	}
 
+	/* Release the mutex variable */
+	dsmWakePte(offsetPageMultiple);
+	dsmUnlockPte(offsetPageMultiple);
+	dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Mutex Lock released successfully\n");
+	startNs = dsmNowNs() - startNs;
+	dsmStatsRecord(&pStats->stats.phases[DSM_PHASE_FAULT], startNs);
+	pStats->inFault = false;
+	DSM_TRACE_EVENT(DSM_EVENT_FAULT_DONE, offsetPageMultiple, DSM_TRACE_NO_PEER,
+            isWrite ? DSM_EVENT_FLAG_WRITE : 0,
+            (startNs > 0xffffffffULL) ? 0xffffffffU : (uInt32)startNs);
+	dsmExitFunc();
+	return retval;
+}
@@ -0,0 +1,213 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/* stride detector of the faulting thread; with userfaultfd all faults are
+ * served by the fault thread */
+static __thread dsmPrefetchInfo dsmPrefetch;
+
+/*
+ * Returns the time in ms on a monotonic clock; wraps around
+ */
+uInt32 dsmNowMs(void)
+{
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return (uInt32)(now.tv_sec * 1000 + now.tv_nsec / 1000000);
+}
+
+/*
+ * Returns the page i + 1 strides after pageOffset, or -1 if it lies outside
+ * the shared region
+ */
+int32 dsmPrefetchPage(uInt32 pageOffset, int32 stride, uInt32 i)
+{
+    long        page = 0;
+
+    page = (long)pageOffset + (long)stride * (long)(i + 1);
+    if (page < 0 || page >= dsmMmapInfo.numPagesToAlloc) {
+        return -1;
+    }
+    return (int32)page;
+}
+
+/*
+ * Returns the most pages prefetched along with a fault
+ */
+uInt32 dsmPrefetchCap(void)
+{
+    uInt32      cap = dsmConfig.prefetchMaxPages;
+
+    if (cap > DSM_PREFETCH_MAX_BYTES / DSM_PAGE_SIZE) {
+        cap = DSM_PREFETCH_MAX_BYTES / DSM_PAGE_SIZE;
+    }
+    return cap;
+}
+
+/*
+ * Feeds a read fault that goes to the owner to the stride detector of the
+ * calling thread, and picks the pages to ask for along with the faulting
+ * one: the next pages of a stride seen twice in a row, or of a page advised
+ * sequential, as many as the window allows, that are neither owned nor
+ * present here. Their page locks
+ * are taken without waiting and held until dsmPrefetchDone(); a page with
+ * a busy lock is skipped. Must be called with the page lock held.
+ * Returns the mask of the pages picked, bit i is the page i + 1 strides
+ * after the faulting one
+ */
+uInt32 dsmPrefetchPick(uInt32 pageOffset, int32* pStride)
+{
+    int32       stride = 0;
+    int32       page = -1;
+    uInt32      cap = 0;
+    uInt32      mask = 0;
+    uInt32      i = 0;
+
+    cap = dsmPrefetchCap();
+    stride = (int32)(pageOffset - dsmPrefetch.lastPage);
+    dsmPrefetch.lastPage = pageOffset;
+    if (DSM_ADVICE_SEQUENTIAL == DSM_PAGE_ADVICE(pageOffset) &&
+            (0 == stride || stride != dsmPrefetch.stride)) {
+        /* advised sequential: the scan is taken as started, at full window */
+        stride = 1;
+        dsmPrefetch.stride = stride;
+        dsmPrefetch.window = cap;
+    }
+    else if (0 == stride || stride != dsmPrefetch.stride) {
+        /* no pattern (yet); start over */
+        dsmPrefetch.stride = stride;
+        dsmPrefetch.window = 0;
+        return 0;
+    }
+    if (0 == dsmPrefetch.window) {
+        dsmPrefetch.window = 1;
+    }
+    if (dsmPrefetch.window > cap) {
+        dsmPrefetch.window = cap;
+    }
+
+    for (i = 0; i < dsmPrefetch.window; i += 1) {
+        page = dsmPrefetchPage(pageOffset, stride, i);
+        if (-1 == page) {
+            break;
+        }
+        if (0 != dsmTryLockPte(page)) {
+            continue;
+        }
+        if (DSM_PTE(page).owner ||
+                DSM_PAGE_NOT_PRESENT != DSM_PTE(page).pageStatus) {
+            dsmUnlockPte(page);
+            continue;
+        }
+        /* an invalidation recorded earlier is for a copy already gone */
+        __sync_fetch_and_and(&DSM_PTE(page).pteFlags, ~DSM_PTE_FLAG_INV_PENDING);
+        DSM_PTE(page).pageStatus = DSM_PAGE_REQUESTED;
+        mask |= (1U << i);
+    }
+
+    dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Prefetching mask [%x] with stride [%d] "
+            "along with page with offset [%u]\n", mask, stride, pageOffset);
+    *pStride = stride;
+    return mask;
+}
+
+/*
+ * Releases the pages picked by dsmPrefetchPick() once the request is done;
+ * a picked page that did not arrive is left not present. The detector moves
+ * on past the pages now readable, so that the next fault of the scan keeps
+ * the stride. The window doubles while the owner sends every page asked
+ * for and halves when it declines some.
+ * Returns void
+ */
+void dsmPrefetchDone(uInt32 pageOffset, int32 stride, uInt32 mask)
+{
+    int32       page = -1;
+    uInt32      asked = 0;
+    uInt32      rcvd = 0;
+    uInt32      i = 0;
+    bool        inRun = true;
+
+    if (0 == stride) {
+        return;
+    }
+    for (i = 0; i < dsmPrefetch.window; i += 1) {
+        page = dsmPrefetchPage(pageOffset, stride, i);
+        if (-1 == page) {
+            break;
+        }
+        if (mask & (1U << i)) {
+            asked += 1;
+            if (DSM_PAGE_REQUESTED == DSM_PTE(page).pageStatus) {
+                DSM_PTE(page).pageStatus = DSM_PAGE_NOT_PRESENT;
+                inRun = false;
+            }
+            else {
+                rcvd += 1;
+            }
+            dsmWakePte(page);
+            dsmUnlockPte(page);
+        }
+        else if (DSM_PAGE_NOT_PRESENT == DSM_PTE(page).pageStatus) {
+            /* read without the lock; only a hint for the detector */
+            inRun = false;
+        }
+        if (inRun) {
+            dsmPrefetch.lastPage = page;
+        }
+    }
+
+    if (asked > 0 && rcvd == asked) {
+        dsmPrefetch.window *= 2;
+        if (dsmPrefetch.window > dsmPrefetchCap()) {
+            dsmPrefetch.window = dsmPrefetchCap();
+        }
+    }
+    else if (asked > 0) {
+        dsmPrefetch.window /= 2;
+    }
+}
+
+/*
+ * Sends read-only copies of the pages a read request asks for along with
+ * its page, ahead of the response for that page. Only pages owned here are
+ * sent; a page whose lock is busy or that was given write access within
+ * DSM_PREFETCH_HOLD_MS is declined, as the owner is likely still writing it,
+ * unless it is advised read mostly.
+ * Returns void
+ */
+void dsmPrefetchServe(dsmPageReqInfo* pReqInfo, dsmConnCtx* pConn)
+{
+    int32       page = -1;
+    uInt32      i = 0;
+
+    dsmEnterFunc();
+    for (i = 0; i < DSM_PREFETCH_MAX_MASK_PAGES; i += 1) {
+        if (0 == (pReqInfo->prefetchMask & (1U << i))) {
+            continue;
+        }
+        page = dsmPrefetchPage(pReqInfo->pageOffset, pReqInfo->prefetchStride, i);
+        if (-1 == page) {
+            break;
+        }
+        if (!DSM_PTE(page).owner ||
+                0 != dsmTryLockPte(page)) {
+            continue;
+        }
+        if (!DSM_PTE(page).owner ||
+                (DSM_PAGE_PRESENT == DSM_PTE(page).pageStatus &&
+                 DSM_ADVICE_READ_MOSTLY != DSM_PAGE_ADVICE(page) &&
+                 dsmNowMs() - DSM_PAGE_META(page).writeTimeMs < DSM_PREFETCH_HOLD_MS)) {
+            dsmUnlockPte(page);
+            continue;
+        }
+        if (-1 == dsmSendReadCopy(page, pReqInfo->requesterId,
+                    DSM_MSG_PAGE_PREFETCH_RSP, pConn)) {
+            dsmUnlockPte(page);
+            break;
+        }
+        dsmUnlockPte(page);
+    }
+    dsmExitFunc();
+}
@@ -5,30 +5,268 @@
 #include "dsm.h"
 
 /* init functions */
-int dsmThreadInit(int, char*, int, char*, int, unsigned);
+int dsmThreadInit(int, int, char**, int*, unsigned);
 void* dsmSharedMemoryInit(void*);
+void* dsmMapRegion(void*, unsigned long, int, int, int);
+void* dsmPlaceRegion(unsigned long, int, int, int);
+int dsmOpenBackingFile(const char*, unsigned long);
+void dsmMapRegionAlias(void*, unsigned long);
 void* dsmCreateSharedRegion(dsmMapInitInfo);
 void initializeDSM(int, char*, int, char, int, unsigned);
+void initializeDSMCluster(int, int, char**, int*, unsigned);
 void* getsharedregion(void);
+void dsmInstallFaultHandler(void);
+int dsm_setopt(int, long);
+int dsm_set_backing_file(const char*);
 
 
 /* comm functions */
 int dsmOpenSocket(char*, int );
 int dsmCreateSocket(void);
+unsigned dsmLocalSockAddr(struct sockaddr_un*, char*, int);
+int dsmOpenLocalSocket(char*, int);
+int dsmConnectLocal(dsmPeerInfo*);
+int dsmConnectTcp(dsmPeerInfo*);
+void dsmAcceptConns(int);
 void* dsmAcceptAndRead(void*);
-int dsmConnectToPeer(int, char*, int);
+void dsmQueueConn(dsmConnCtx*);
+dsmConnCtx* dsmDequeueConn(void);
+void* dsmServeConnections(void*);
+int dsmRunDetached(void* (*)(void*), void*);
+int dsmResolvePeer(dsmPeerInfo*, char*, int);
+int dsmConnectToPeer(dsmPeerInfo*);
+int dsmGetPeerConnection(dsmPeerInfo*);
+void dsmClosePeerConnection(dsmPeerInfo*);
+int dsmRecvAll(int, void*, unsigned);
+int dsmSendAll(int, const void*, unsigned);
+int dsmSendAllv(int, struct iovec*, int);
+int dsmReadMsg(int, void*, unsigned);
 int dsmSendMsg(int, dsmMsg*);
+int dsmReplyMsg(dsmConnCtx*, dsmMsg*);
+unsigned dsmNewReqId(void);
+void dsmAddWaiter(dsmPeerInfo*, dsmRspWaiter*, unsigned);
+void dsmRemoveWaiter(dsmPeerInfo*, dsmRspWaiter*);
+int dsmAwaitRsp(dsmPeerInfo*, dsmRspWaiter*);
+void* dsmRspReader(void*);
+int dsmStartRspReader(dsmPeerInfo*, int);
+int dsmSendPageMsg(dsmConnCtx*, dsmMsgType, dsmPageRspInfo*, const void*);
 int dsmRecvMsg(int);
+int dsmSendAndRecv(dsmPeerInfo*, dsmMsg*);
+int dsmSendToPeer(dsmPeerInfo*, dsmMsg*);
+int dsmMulticastAndRecv(unsigned, dsmMsg*);
 
 
 /* msg functions */
-void dsmDecodeMsg(void*);
-int dsmInitSharedRegionReqHandler(void*);
+void dsmDecodeMsg(void*, dsmConnCtx*);
+int dsmInitSharedRegionReqHandler(void*, dsmConnCtx*);
 int dsmInitSharedRegionRspHandler(void*);
-int dsmPageReqHandler(void*);
+int dsmPageReqHandler(void*, dsmConnCtx*);
+void dsmPrepareTransfer(unsigned, unsigned, dsmPageRspInfo*);
+void dsmCompleteTransfer(unsigned, unsigned, dsmPageRspInfo*, bool);
 int dsmPageRspHandler(void*);
+void dsmInstallOwnedPage(dsmPageRspInfo*, const void*);
+void dsmPrepareReadCopy(unsigned, dsmPageRspInfo*);
+int dsmSendReadCopy(unsigned, unsigned, dsmMsgType, dsmConnCtx*);
+int dsmPageReadReqHandler(void*, dsmConnCtx*);
+int dsmPageReadRspHandler(void*);
+void dsmInstallReadCopy(dsmPageRspInfo*, const void*);
+int dsmInvalidateReqHandler(void*, dsmConnCtx*);
+void dsmLockPageProt(unsigned);
+void dsmUnlockPageProt(unsigned);
+bool dsmIsWriteFault(void*);
+int dsmInvalidateCopies(unsigned);
+int dsmRequestPage(unsigned, bool, int, unsigned);
+int dsmPageRedirect(unsigned, dsmConnCtx*);
+int dsmPageRedirectRspHandler(void*);
+int dsmOwnerUpdateHandler(void*);
+void dsmUpdateProbOwner(unsigned, unsigned, unsigned);
+void dsmSetPageAccess(unsigned, int);
+void dsmInstallPage(unsigned, const void*, int);
 void dsmPageFaultHandler(int, siginfo_t*, void*);
-    
+int dsmServeFault(unsigned, bool);
+
+/* userfaultfd functions */
+int dsmUffdOpen(void);
+int dsmUffdRegister(void*, unsigned);
+void* dsmUffdFaultThread(void*);
+void dsmUffdPopulatePage(unsigned, int);
+void dsmUffdSetPageAccess(unsigned, int);
+void dsmUffdInstallPage(unsigned, const void*, int);
+
+/* prefetch functions */
+unsigned dsmNowMs(void);
+int dsmPrefetchPage(unsigned, int, unsigned);
+unsigned dsmPrefetchCap(void);
+unsigned dsmPrefetchPick(unsigned, int*);
+void dsmPrefetchDone(unsigned, int, unsigned);
+void dsmPrefetchServe(dsmPageReqInfo*, dsmConnCtx*);
+
+/* batch functions */
+int dsmPickPage(unsigned, bool, dsmPageStatus*);
+unsigned dsmBatchTarget(unsigned);
+int dsmFetchPages(const dsmPageRange*, unsigned, bool);
+int dsmFetchPicked(unsigned*, dsmPageStatus*, unsigned, bool);
+int dsmPageBatchReqHandler(void*, dsmConnCtx*);
+int dsmPageBatchRspHandler(void*, unsigned);
+int dsm_prefetch(void*, size_t, int);
+
+/* multiple writers */
+void dsmFlushBegin(unsigned);
+void dsmFlushEnd(unsigned);
+void dsmFlushWait(void);
+int dsmMakeTwin(unsigned);
+unsigned dsmEncodeDiff(const unsigned char*, const unsigned char*, unsigned*,
+        unsigned char*, unsigned);
+int dsmApplyDiff(unsigned, const unsigned char*, unsigned, unsigned*);
+int dsmDiffReqHandler(void*, dsmConnCtx*);
+int dsmDiffRspHandler(void*);
+int dsmSendDiffs(unsigned, dsmMsg*);
+void dsmInitDiffMsg(dsmMsg*);
+int dsmDiffPage(unsigned, dsmMsg*);
+int dsmFlushDiffs(unsigned, const unsigned*, unsigned, dsmMsg*);
+int dsmDropCopy(unsigned, dsmMsg*);
+int dsmDropCopies(void);
+int dsmReleaseWrites(void);
+int dsm_sync(void);
+
+/* lazy release functions */
+void dsmNoteWrite(unsigned, unsigned);
+void dsmCloseHomeWrites(void);
+unsigned dsmGatherNotices(unsigned*, unsigned char*);
+int dsmMergeNotices(dsmNoticeSet*, const dsmWriteNotice*, unsigned, unsigned);
+void dsmApplyNotices(const dsmWriteNotice*, unsigned, dsmMsg*);
+int dsmAcquireWrites(const dsmWriteNotice*, unsigned);
+
+/* lock functions */
+void dsmInitLocks(void);
+bool dsmLockGrantable(dsmLockInfo*, unsigned);
+void dsmPrepareGrant(unsigned, unsigned, unsigned, dsmMsgType, dsmMsg*);
+unsigned dsmLockRevokeTargets(dsmLockInfo*, unsigned*);
+int dsmLockSendRevokes(unsigned, unsigned, const unsigned*);
+unsigned dsmLockAcquireAt(unsigned, unsigned, unsigned, dsmMsg*, unsigned*);
+int dsmLockReleaseAt(unsigned, unsigned, const dsmWriteNotice*, unsigned);
+int dsmLockGranted(void*);
+bool dsmLockToReturn(dsmLockInfo*);
+int dsmLockReturn(unsigned);
+bool dsmLockRevoked(unsigned, unsigned);
+void* dsmLockTaskThread(void*);
+int dsmLockHandOff(const dsmLockTask*, const dsmWriteNotice*);
+int dsmLockAsk(unsigned, unsigned);
+int dsmLockAcquire(int, unsigned);
+int dsmLockRelease(int);
+int dsmLockAcquireReqHandler(void*, dsmConnCtx*);
+int dsmLockAcquireRspHandler(void*);
+int dsmLockReleaseReqHandler(void*, dsmConnCtx*);
+int dsmLockGrantReqHandler(void*, dsmConnCtx*);
+int dsmLockRevokeReqHandler(void*, dsmConnCtx*);
+int dsm_acquire(int);
+int dsm_release(int);
+
+/* barrier functions */
+void dsmInitBarriers(void);
+int dsmBarrierArriveAt(unsigned, unsigned, unsigned, const dsmWriteNotice*, unsigned);
+int dsmBarrierOpened(void*);
+int dsmBarrierReqHandler(void*, dsmConnCtx*);
+int dsmBarrierDoneReqHandler(void*, dsmConnCtx*);
+
+/* hold window functions */
+unsigned dsmNowUs(void);
+void dsmHoldAcquired(unsigned);
+void dsmHoldLost(unsigned);
+bool dsmPageHeld(unsigned, bool);
+
+/* page table functions */
+int dsmInitPageTable(unsigned);
+dsmPageTableEntry* dsmInitPteChunk(unsigned);
+void dsmLockPte(unsigned);
+int dsmTryLockPte(unsigned);
+void dsmUnlockPte(unsigned);
+void dsmWaitPte(unsigned);
+void dsmWakePte(unsigned);
+
+/* stats functions */
+unsigned long long dsmNowNs(void);
+void dsmStatsInitKey(void);
+dsmThreadStats* dsmStats(void);
+void dsmStatsMerge(dsm_stats_t*, const dsm_stats_t*);
+void dsmStatsRetire(void*);
+void dsmStatsRecord(dsm_hist_t*, unsigned long long);
+unsigned long long dsmStatsPhaseStart(void);
+void dsmStatsPhaseEnd(unsigned, unsigned long long);
+void* dsmStatsDump(void*);
+int dsm_get_stats(dsm_stats_t*);
+unsigned long long dsm_hist_percentile(const dsm_hist_t*, double);
+
+/* trace functions */
+void dsmTraceInitKey(void);
+dsmTraceRing* dsmTraceGetRing(void);
+void dsmTraceRetire(void*);
+void dsmTraceRecord(unsigned, unsigned, unsigned, unsigned, unsigned);
+void dsmTraceDrain(void);
+void* dsmTraceFlusher(void*);
+int dsm_trace_start(const char*);
+int dsm_trace_stop(void);
+
+/* advice functions */
+void dsmReleasePage(unsigned);
+bool dsmDiscardCopy(unsigned);
+int dsmSendReclaim(dsmMsg*, unsigned);
+int dsmReclaimPages(unsigned, unsigned);
+void* dsmReclaimThread(void*);
+int dsmPageReclaimHandler(void*);
+int dsm_advise(void*, size_t, int);
+
+/* checkpoint functions */
+bool dsmCkptResident(unsigned, unsigned);
+int dsmCkptScan(const unsigned char*, unsigned long long, dsmCkptPage*, unsigned int,
+        unsigned long long*);
+FILE* dsmCkptOpen(const char*);
+int dsmCkptSavePage(unsigned, FILE*, unsigned char*);
+int dsm_checkpoint(const char*);
+int dsmCkptCmpPage(const void*, const void*);
+bool dsmCkptInstallPage(unsigned, const unsigned char*);
+int dsm_restore(const char*);
+
+/* trace analyzer functions */
+int dsmTraceLoad(const char*, dsmTraceEvent**, unsigned*, unsigned*, unsigned*);
+int dsmTraceCmpPage(const void*, const void*);
+int dsmTraceCmpBusy(const void*, const void*);
+int dsmTraceCmpPingPong(const void*, const void*);
+int dsmTraceCmpLatency(const void*, const void*);
+unsigned dsmTraceSummarize(const dsmTraceEvent*, unsigned, unsigned long long,
+        dsmTracePageInfo**);
+void dsmTracePrintLatency(const char*, unsigned*, unsigned);
+void dsmTracePrintPage(const dsmTracePageInfo*);
+void dsmTracePrintHeatmap(const dsmTraceEvent*, const dsmTracePageInfo*, unsigned,
+        unsigned, unsigned long long);
+
+/* atomic functions */
+unsigned long long dsmAtomicExec(void*, unsigned, unsigned, unsigned long long,
+        unsigned long long);
+int dsmAtomicAtOwner(dsmAtomicInfo*);
+int dsmAtomicAtHome(dsmAtomicInfo*);
+int dsmAtomicReqHandler(void*, dsmConnCtx*);
+int dsmAtomicRspHandler(void*);
+int dsmAtomicAskOwner(dsmAtomicInfo*);
+int dsmAtomicOp(void*, unsigned, unsigned, unsigned long long, unsigned long long,
+        unsigned long long*);
+
+/* compression functions */
+unsigned dsmFillEncode(const unsigned char*, unsigned, unsigned char*, unsigned);
+int dsmFillDecode(const unsigned char*, unsigned, unsigned char*, unsigned);
+int dsmLzPutLen(unsigned char*, int, unsigned, unsigned);
+int dsmLzPutSeq(unsigned char*, int, unsigned, const unsigned char*, unsigned,
+        unsigned, unsigned);
+unsigned dsmLzEncode(const unsigned char*, unsigned, unsigned char*, unsigned);
+int dsmLzGetLen(const unsigned char*, unsigned, unsigned, unsigned*);
+int dsmLzDecode(const unsigned char*, unsigned, unsigned char*, unsigned);
+const char* dsmCodecName(unsigned);
+const unsigned char* dsmEncodePage(const unsigned char*, unsigned, unsigned char*,
+        dsmPageRspInfo*);
+const unsigned char* dsmDecodePage(const dsmPageRspInfo*, const unsigned char*);
+int dsmHelloReqHandler(void*, dsmConnCtx*);
+int dsmHelloRspHandler(void*);
+
 /* util functions */
 void dsmPrintf(const char *format, ...);
 
@@ -0,0 +1,209 @@
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * The page table is sized from the region and set up lazily: the entries
+ * are reserved at init without backing memory, and a chunk of
+ * DSM_PTE_CHUNK_PAGES entries is set up the first time one of them is used,
+ * through DSM_PTE(), so a region of many GB costs nothing until touched.
+ * An entry is kept small, 24 bytes: the status, owner and flags of a page
+ * are a byte each, and its lock and the wait for a change of the page are
+ * two futex words instead of a mutex and a condition variable. The state
+ * only some paths use, the hold window, versions and twin, is in a table
+ * alongside, DSM_PAGE_META(), whose zero entries need no set up.
+ */
+
+dsmPageTableEntry*      dsmPageTable = NULL;
+dsmPageMetaEntry*       dsmPageMeta = NULL;
+volatile uInt8*         dsmPteChunkReady = NULL;    /* a byte per chunk set up */
+volatile uInt8*         dsmPageAdvice = NULL;       /* a byte per page, see dsm_advise() */
+
+static pthread_mutex_t  dsmPteInitMutex = PTHREAD_MUTEX_INITIALIZER;
+static uInt32           dsmPteCapacity = 0;         /* entries reserved */
+
+/*
+ * Reserves the page table for numPages pages, and the meta entries and
+ * advice of the pages alongside it; the entries are zero until their chunk
+ * is set up
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmInitPageTable(uInt32 numPages)
+{
+    uInt32      numChunks = 0;
+    void*       pTable = NULL;
+    void*       pMeta = NULL;
+    void*       pAdvice = NULL;
+
+    dsmEnterFunc();
+    numChunks = (numPages + DSM_PTE_CHUNK_PAGES - 1) / DSM_PTE_CHUNK_PAGES;
+    pTable = mmap(NULL, (size_t)numChunks * DSM_PTE_CHUNK_PAGES * sizeof(dsmPageTableEntry),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    pMeta = mmap(NULL, (size_t)numChunks * DSM_PTE_CHUNK_PAGES * sizeof(dsmPageMetaEntry),
+            PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    pAdvice = mmap(NULL, (size_t)numChunks * DSM_PTE_CHUNK_PAGES, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    dsmPteChunkReady = (volatile uInt8*)calloc(numChunks, sizeof(uInt8));
+    if (MAP_FAILED == pTable || MAP_FAILED == pMeta || MAP_FAILED == pAdvice ||
+            NULL == dsmPteChunkReady) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Page table creation failed for [%u] pages "
+                "with errno: [%d]\n", numPages, errno);
+        dsmExitFunc();
+        return -1;
+    }
+    dsmPageTable = (dsmPageTableEntry*)pTable;
+    dsmPageMeta = (dsmPageMetaEntry*)pMeta;
+    dsmPageAdvice = (volatile uInt8*)pAdvice;
+    dsmPteCapacity = numChunks * DSM_PTE_CHUNK_PAGES;
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Sets up the chunk of entries of a page on its first use
+ * Master: Initially has access to all the pages
+ * Multiple writers: each node has access to the pages it is home of; the
+ * region is mapped inaccessible, so the first access of one of them faults
+ * here to open it
+ * Returns the entry of the page
+ */
+dsmPageTableEntry* dsmInitPteChunk(uInt32 pageOffset)
+{
+    uInt32      chunk = pageOffset / DSM_PTE_CHUNK_PAGES;
+    uInt32      page = chunk * DSM_PTE_CHUNK_PAGES;
+    uInt32      endPage = page + DSM_PTE_CHUNK_PAGES;
+    int32       prot = PROT_NONE;
+
+    pthread_mutex_lock(&dsmPteInitMutex);
+    if (dsmPteChunkReady[chunk]) {
+        pthread_mutex_unlock(&dsmPteInitMutex);
+        return &dsmPageTable[pageOffset];
+    }
+
+    for (; page < endPage && page < dsmPteCapacity; page += 1) {
+        if (DSM_MULTI_WRITER()) {
+            /* the home of a page keeps its copy; the others fetch from it.
+             * With lazy release the home write protects its copy so that
+             * its writes are noted for the write notices. */
+            dsmPageTable[page].owner = (DSM_HOME_NODE(page) == dsmMmapInfo.nodeId);
+            if (!dsmPageTable[page].owner) {
+                dsmPageTable[page].pageStatus = DSM_PAGE_NOT_PRESENT;
+                prot = PROT_NONE;
+            }
+            else if (DSM_WRITE_MODE_LAZY_RELEASE == dsmMmapInfo.writeMode) {
+                dsmPageTable[page].pageStatus = DSM_PAGE_READ_ONLY;
+                prot = PROT_READ;
+            }
+            else {
+                dsmPageTable[page].pageStatus = DSM_PAGE_PRESENT;
+                prot = PROT_READ | PROT_WRITE;
+            }
+            if (PROT_NONE != prot && page < dsmMmapInfo.numPagesToAlloc) {
+                dsmSetPageAccess(page, prot);
+            }
+            dsmPageTable[page].probOwner = DSM_HOME_NODE(page);
+        }
+        else if (dsmMmapInfo.isMaster) {
+            dsmPageTable[page].owner = true;
+            dsmPageTable[page].pageStatus = DSM_PAGE_PRESENT;
+            dsmPageTable[page].probOwner = DSM_MASTER_NODE_ID;
+        }
+        else {
+            dsmPageTable[page].owner = false;
+            dsmPageTable[page].pageStatus = DSM_PAGE_NOT_PRESENT;
+            dsmPageTable[page].probOwner = DSM_MASTER_NODE_ID;
+        }
+    }
+
+    /* the entries are seen set up by whoever sees the chunk ready */
+    __sync_synchronize();
+    dsmPteChunkReady[chunk] = 1;
+    pthread_mutex_unlock(&dsmPteInitMutex);
+    return &dsmPageTable[pageOffset];
+}
+
+/*
+ * locks the entry of a page; the lock word is 0 when free, 1 when locked
+ * and 2 when locked with threads sleeping on it
+ * Returns void
+ */
+void dsmLockPte(uInt32 pageOffset)
+{
+    volatile uInt32*    pLock = &DSM_PTE(pageOffset).pteLock;
+    uInt32              state = 0;
+
+    state = __sync_val_compare_and_swap(pLock, 0, 1);
+    if (0 == state) {
+        return;
+    }
+    if (2 != state) {
+        state = __sync_lock_test_and_set(pLock, 2);
+    }
+    while (0 != state) {
+        syscall(SYS_futex, pLock, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+        state = __sync_lock_test_and_set(pLock, 2);
+    }
+}
+
+/*
+ * locks the entry of a page if it is free
+ * Returns 0 on success, -1 if the entry is locked
+ */
+int32 dsmTryLockPte(uInt32 pageOffset)
+{
+    return (0 == __sync_val_compare_and_swap(&DSM_PTE(pageOffset).pteLock, 0, 1)) ? 0 : -1;
+}
+
+/*
+ * unlocks the entry of a page and wakes a thread sleeping on it
+ * Returns void
+ */
+void dsmUnlockPte(uInt32 pageOffset)
+{
+    volatile uInt32*    pLock = &DSM_PTE(pageOffset).pteLock;
+
+    if (1 != __sync_fetch_and_sub(pLock, 1)) {
+        __sync_lock_release(pLock);
+        syscall(SYS_futex, pLock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+/*
+ * waits for dsmWakePte() on a page; the entry lock is released meanwhile
+ * and held again on return. Wakeups may be spurious, the caller checks the
+ * entry again. Must be called with the entry locked.
+ * Returns void
+ */
+void dsmWaitPte(uInt32 pageOffset)
+{
+    dsmPageTableEntry*  pEntry = &DSM_PTE(pageOffset);
+    uInt32              seq = 0;
+
+    __sync_fetch_and_add(&pEntry->pteWaiters, 1);
+    seq = __sync_fetch_and_add(&pEntry->pteWaitSeq, 0);
+    dsmUnlockPte(pageOffset);
+    syscall(SYS_futex, &pEntry->pteWaitSeq, FUTEX_WAIT_PRIVATE, seq, NULL, NULL, 0);
+    __sync_fetch_and_sub(&pEntry->pteWaiters, 1);
+    dsmLockPte(pageOffset);
+}
+
+/*
+ * wakes the threads waiting for a change of a page
+ * Returns void
+ */
+void dsmWakePte(uInt32 pageOffset)
+{
+    dsmPageTableEntry*  pEntry = &DSM_PTE(pageOffset);
+
+    /* a waiter counts itself before it reads the seq, so either it is seen
+     * here or it sees the new seq and does not sleep */
+    __sync_fetch_and_add(&pEntry->pteWaitSeq, 1);
+    if (0 != __sync_fetch_and_add(&pEntry->pteWaiters, 0)) {
+        syscall(SYS_futex, &pEntry->pteWaitSeq, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
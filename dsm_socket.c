@@ -6,11 +6,17 @@
 
 /* global definitions */
 dsmSocketInfo   dsmSockInfo;
+dsmConnQueue    dsmReadyConns = {NULL, NULL, PTHREAD_MUTEX_INITIALIZER,
+                    PTHREAD_COND_INITIALIZER};
+dsmPeerInfo     dsmPeers[DSM_MAX_NODES];
+
+static volatile uInt32  dsmNextReqId = 0;
 
 
 /*
- * Creates a tcp socket; sets global socket fd
- * Returns 0 on success, -1 on failure
+ * Creates a tcp socket for sending req to peer; disables Nagle since every
+ * msg on it is a latency bound req/rsp
+ * Returns socket fd on success, -1 on failure
  */
 int32 dsmCreateSocket()
 {
@@ -33,16 +39,16 @@ int32 dsmCreateSocket()
     if (-1 == retVal) {
         dsmPrintLog(DSM_TRACE_TYPE_ERROR, "setsockopt failed with errno: [%d]\n",
                 errno);
+        close(socketDesc);
         dsmExitFunc();
         return -1;
     }
+    setsockopt(socketDesc, IPPROTO_TCP, TCP_NODELAY, (void*) &optVal, optLen);
 
-    /* set the client socket descriptor */
-    dsmSockInfo.reqSockSd = socketDesc;
     dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Socket fd [%d] opened for sending req to "
             "peer\n", socketDesc);
     dsmExitFunc();
-    return 0;
+    return socketDesc;
 }
 
 /*
@@ -91,12 +97,29 @@ int32 dsmOpenSocket(int8 *ipAddr, int32 port)
         return -1;
     }
 
-    /* listen on the socket */
+    /* listen on the socket; the acceptor takes every connection pending
+     * on a listening socket at once, until accept would block */
     if(listen(socketDesc, 10) == -1) {
         dsmPrintLog(DSM_TRACE_TYPE_ERROR, "listen failed with errno: [%d]\n", errno);
         dsmExitFunc();
         return -1;
     }
+    fcntl(socketDesc, F_SETFL, fcntl(socketDesc, F_GETFL) | O_NONBLOCK);
+
+    /* peers on this host connect to a unix socket named after the tcp addr */
+    dsmSockInfo.localSd = -1;
+    if (dsmConfig.localTransport) {
+        dsmSockInfo.localSd = dsmOpenLocalSocket(ipAddr, port);
+    }
+
+    /* the acceptor watches the listening socket and the peers with epoll */
+    dsmSockInfo.epollFd = epoll_create1(0);
+    if (-1 == dsmSockInfo.epollFd) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "epoll_create1 failed with errno: [%d]\n",
+                errno);
+        dsmExitFunc();
+        return -1;
+    }
 
     /* set the server socket descriptor */
     dsmSockInfo.serverSd = socketDesc;
@@ -107,233 +130,1105 @@ int32 dsmOpenSocket(int8 *ipAddr, int32 port)
 }
 
 /*
- * Waits for connection from peer; on receving a msg calls decodeMsg
- * Returns 0 on success, -1 on failure
+ * fills pAddr with the unix socket addr of the node listening on ipAddr and
+ * port; the name is in the abstract namespace, so it needs no file and goes
+ * away with the socket, and only a process of this host can have bound it
+ * Returns the length of the addr
  */
-void* dsmAcceptAndRead(void* socketDesc)
+uInt32 dsmLocalSockAddr(struct sockaddr_un* pAddr, int8* ipAddr, int32 port)
 {
-	struct sockaddr_in      cliAddr;
-    int32                   sd = -1;
-	socklen_t               size = sizeof(struct sockaddr_in);
-    void*                   pReadData = NULL;
-    void*                   pBuf = NULL;
+    int32       nameLen = 0;
+
+    memset(pAddr, 0, sizeof(struct sockaddr_un));
+    pAddr->sun_family = AF_UNIX;
+    nameLen = snprintf(pAddr->sun_path + 1, sizeof(pAddr->sun_path) - 1,
+            DSM_LOCAL_SOCK_NAME, ipAddr, port);
+    if (nameLen > (int32)sizeof(pAddr->sun_path) - 2) {
+        nameLen = sizeof(pAddr->sun_path) - 2;
+    }
+    return offsetof(struct sockaddr_un, sun_path) + 1 + nameLen;
+}
+
+/*
+ * Opens the unix socket peers on this host connect to instead of the tcp
+ * one; without it they use tcp
+ * Returns socket fd on success, -1 on failure
+ */
+int32 dsmOpenLocalSocket(int8* ipAddr, int32 port)
+{
+    struct sockaddr_un  localAddr;
+    uInt32              addrLen = 0;
+    int32               socketDesc = -1;
 
     dsmEnterFunc();
 
-    sd = *(int32*)socketDesc;
+    socketDesc = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (-1 == socketDesc) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "unix socket call failed with errno: "
+                "[%d], peers on this host use tcp\n", errno);
+        dsmExitFunc();
+        return -1;
+    }
+    addrLen = dsmLocalSockAddr(&localAddr, ipAddr, port);
+    if (-1 == bind(socketDesc, (struct sockaddr*)&localAddr, addrLen) ||
+            -1 == listen(socketDesc, 10)) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "unix socket bind failed with errno: [%d], "
+                "peers on this host use tcp\n", errno);
+        close(socketDesc);
+        dsmExitFunc();
+        return -1;
+    }
 
-    /* allocate memory for msg */
-    pReadData = malloc(DSM_MAX_MSG_LEN);
-    if (NULL == pReadData) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
-                "bytes\n", DSM_MAX_MSG_LEN);
-        return (void*)(-1);
+    dsmPrintLog(DSM_TRACE_TYPE_DEBUG, "Socket fd [%d] opened for listening to req "
+            "from peers on this host\n", socketDesc);
+    dsmExitFunc();
+    return socketDesc;
+}
+
+/*
+ * Reads exactly len bytes from the socket into buffer
+ * Returns 0 on success, -1 on failure or if the peer closed the connection
+ */
+int32 dsmRecvAll(int32 socketDesc, void* pBuf, uInt32 len)
+{
+    int32       bytesRead = 0;
+    uInt32      offset = 0;
+
+    while (offset < len) {
+        bytesRead = recv(socketDesc, (int8*)pBuf + offset, len - offset, 0);
+        if (0 == bytesRead) {
+            dsmPrintLog(DSM_TRACE_TYPE_WARN, "Peer closed connection on socket "
+                    "fd [%d]\n", socketDesc);
+            errno = ECONNRESET;
+            return -1;
+        }
+        if (-1 == bytesRead) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Recv from socket fd [%d] failed "
+                    "with errno: [%d]\n", socketDesc, errno);
+            return -1;
+        }
+        offset += bytesRead;
     }
-    pBuf = malloc(DSM_MAX_MSG_LEN);
-    if (NULL == pBuf) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
-                "bytes\n", DSM_MAX_MSG_LEN);
+    dsmStats()->stats.bytes_rcvd += len;
+    return 0;
+}
+
+/*
+ * Writes exactly len bytes from buffer to the socket; never raises SIGPIPE
+ * so that a dropped link is reported as an error instead
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmSendAll(int32 socketDesc, const void* pBuf, uInt32 len)
+{
+    int32       bytesSent = 0;
+    uInt32      offset = 0;
+
+    while (offset < len) {
+        bytesSent = send(socketDesc, (const int8*)pBuf + offset, len - offset,
+                MSG_NOSIGNAL);
+        if (-1 == bytesSent) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Send to socket fd [%d] failed "
+                    "with errno: [%d]\n", socketDesc, errno);
+            return -1;
+        }
+        offset += bytesSent;
+    }
+    dsmStats()->stats.bytes_sent += len;
+    return 0;
+}
+
+/*
+ * Writes all the buffers of the io vector to the socket with as few
+ * syscalls as possible; the vector is consumed as it is sent
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmSendAllv(int32 socketDesc, struct iovec* pIov, int32 iovCnt)
+{
+    struct msghdr   msgHdr;
+    ssize_t         bytesSent = 0;
+
+    memset(&msgHdr, 0, sizeof(struct msghdr));
+    while (iovCnt > 0) {
+        msgHdr.msg_iov = pIov;
+        msgHdr.msg_iovlen = iovCnt;
+        bytesSent = sendmsg(socketDesc, &msgHdr, MSG_NOSIGNAL);
+        if (-1 == bytesSent) {
+            if (errno == EINTR) {
+                continue;
+            }
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Send to socket fd [%d] failed "
+                    "with errno: [%d]\n", socketDesc, errno);
+            return -1;
+        }
+        dsmStats()->stats.bytes_sent += bytesSent;
+
+        /* skip what went out; a partial send resumes mid buffer */
+        while (iovCnt > 0 && (size_t)bytesSent >= pIov->iov_len) {
+            bytesSent -= pIov->iov_len;
+            pIov += 1;
+            iovCnt -= 1;
+        }
+        if (iovCnt > 0) {
+            pIov->iov_base = (int8*)pIov->iov_base + bytesSent;
+            pIov->iov_len -= bytesSent;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads one complete msg (header + payload) from the socket into pReadData,
+ * which holds bufLen bytes
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmReadMsg(int32 socketDesc, void* pReadData, uInt32 bufLen)
+{
+    uInt32      payloadLen = 0;
+
+    /* read the msg header to get payload length */
+    if (-1 == dsmRecvAll(socketDesc, pReadData, DSM_MSG_HDR_LEN)) {
+        return -1;
+    }
+
+    /* read the number of bytes specified by payload length */
+    payloadLen = *(uInt32*)((int32*)pReadData + 1);
+    if (payloadLen > bufLen - DSM_MSG_HDR_LEN) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid payload length [%u] rcvd on "
+                "socket fd [%d]\n", payloadLen, socketDesc);
+        errno = EPROTO;
+        return -1;
+    }
+    if (payloadLen > 0 &&
+            -1 == dsmRecvAll(socketDesc, (int8*)pReadData + DSM_MSG_HDR_LEN, payloadLen)) {
+        return -1;
+    }
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Total [%d] bytes rcvd from fd: [%d]\n",
+        DSM_MSG_HDR_LEN + payloadLen, socketDesc);
+    dsmStats()->stats.msgs_rcvd += 1;
+    return 0;
+}
+
+/*
+ * Acceptor of the communication thread; connections are long lived, so the
+ * listening sockets and every accepted connection are watched with epoll.
+ * A connection with a msg pending is handed to the worker threads, which
+ * read, decode and reply to the msg. Connections are armed one shot, so a
+ * connection is served by one worker at a time and its msgs are handled in
+ * order, while msgs from different peers are handled in parallel.
+ * Returns 0 on success, -1 on failure
+ */
+void* dsmAcceptAndRead(void* socketDesc)
+{
+    struct epoll_event      event;
+    struct epoll_event      events[DSM_MAX_EPOLL_EVENTS];
+    int32                   numEvents = 0;
+    int32                   i = 0;
+
+    dsmEnterFunc();
+
+    /* the listening sockets are the only ones registered without a context */
+    memset(&event, 0, sizeof(struct epoll_event));
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (-1 == epoll_ctl(dsmSockInfo.epollFd, EPOLL_CTL_ADD, *(int32*)socketDesc,
+                &event) || (-1 != dsmSockInfo.localSd &&
+                -1 == epoll_ctl(dsmSockInfo.epollFd, EPOLL_CTL_ADD, dsmSockInfo.localSd,
+                    &event))) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "epoll_ctl failed with errno: [%d]\n",
+                errno);
+        dsmExitFunc();
         return (void*)(-1);
     }
 
 	while (1)
 	{
-        /* wait for a connect req */
-        memset(&cliAddr, 0, sizeof(struct sockaddr_in));
-		int32 clientSd = accept(sd, (struct sockaddr *)&cliAddr, &size);
-        if (-1 == clientSd) {
+        numEvents = epoll_wait(dsmSockInfo.epollFd, events, DSM_MAX_EPOLL_EVENTS, -1);
+        if (-1 == numEvents) {
+            if (errno != EINTR) {
+                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "epoll_wait failed with errno: "
+                        "[%d]\n", errno);
+            }
             continue;
         }
+
+        for (i = 0; i < numEvents; i += 1) {
+            /* hand the connection with a msg pending to the workers */
+            if (NULL != events[i].data.ptr) {
+                dsmQueueConn((dsmConnCtx*)events[i].data.ptr);
+                continue;
+            }
+
+            /* accept new connections from peers on either listening socket */
+            dsmAcceptConns(*(int32*)socketDesc);
+            if (-1 != dsmSockInfo.localSd) {
+                dsmAcceptConns(dsmSockInfo.localSd);
+            }
+        }
+    }
+
+    dsmExitFunc();
+}
+
+/*
+ * accepts the connections pending on a listening socket, which does not
+ * block, and adds them to those watched by the acceptor
+ * Returns void
+ */
+void dsmAcceptConns(int32 listenSd)
+{
+    struct epoll_event      event;
+    int32                   clientSd = -1;
+    const int32             optVal = 1;
+    dsmConnCtx*             pConn = NULL;
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    while (-1 != (clientSd = accept(listenSd, NULL, NULL))) {
+        if (dsmSockInfo.numConns >= DSM_MAX_CONNECTIONS) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Too many peer connections, "
+                    "rejecting client fd: [%d]\n", clientSd);
+            close(clientSd);
+            continue;
+        }
+        pConn = (dsmConnCtx*)malloc(sizeof(dsmConnCtx));
+        if (NULL == pConn) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
+                    "bytes\n", sizeof(dsmConnCtx));
+            close(clientSd);
+            continue;
+        }
+        pConn->sd = clientSd;
+        pConn->codec = DSM_CODEC_RAW;
+        pConn->pNext = NULL;
+        if (listenSd == dsmSockInfo.serverSd) {
+            setsockopt(clientSd, IPPROTO_TCP, TCP_NODELAY, (void*) &optVal,
+                    sizeof(optVal));
+        }
+
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = pConn;
+        if (-1 == epoll_ctl(dsmSockInfo.epollFd, EPOLL_CTL_ADD, clientSd, &event)) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "epoll_ctl failed with errno: "
+                    "[%d]\n", errno);
+            close(clientSd);
+            free(pConn);
+            continue;
+        }
+        __sync_fetch_and_add(&dsmSockInfo.numConns, 1);
         dsmPrintLog(DSM_TRACE_TYPE_INFO, "Connection rcvd from client. "
                 "New client fd: [%d]\n", clientSd);
-        dsmSockInfo.currentClientSd = clientSd;
-
-		/* read the msg header to get payload length */
-		int32 bytesRead = 0, offset = 0;
-		int32 bytesToRead = DSM_MSG_HDR_LEN;
-		do {
-			memset(pBuf, 0, DSM_MAX_MSG_LEN);
-			bytesRead = recv(dsmSockInfo.currentClientSd, pBuf, bytesToRead, 0);
-            if (-1 == bytesRead) {
-				dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Recv from socket fd [%d] failed "
-	                "with errno: [%d]\n", socketDesc, errno);
-                dsmExitFunc();
-				return (void*)-1;
-			}
-			memcpy(((int8*)pReadData + offset), pBuf, bytesRead);
-			offset += bytesRead;
-		} while (offset < bytesToRead);
-		
-        /* read the number of bytes specified by payload length */
-		bytesRead = 0;
-		uInt32 payloadLen= *(uInt32*)((int32*)pReadData + 1);
-		if (payloadLen > 0) {
-			while ((offset - DSM_MSG_HDR_LEN) < payloadLen){
-			    memset(pBuf, 0, DSM_MAX_MSG_LEN);
-				bytesRead = recv(dsmSockInfo.currentClientSd, pBuf, payloadLen, 0);
-                if (-1 == bytesRead) {
-					dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Recv from socket fd [%d] failed "
-						"with errno: [%d]\n", socketDesc, errno);
-                    dsmExitFunc();
-					return (void*)-1;
-				}
-				memcpy(((int8*)pReadData + offset), pBuf, bytesRead);
-				offset += bytesRead;
-			}
-		}
-	    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Total [%d] bytes rcvd from client fd: [%d]\n",
-	        offset, dsmSockInfo.currentClientSd);
-
-        /* decode msg; close connection */
-        dsmDecodeMsg(pReadData);
-		close(clientSd);		
-        dsmSockInfo.currentClientSd = -1;
-        usleep(10000);    
+    }
+}
+
+/*
+ * appends a connection with a msg pending to the ready queue and wakes a
+ * worker
+ * Returns void
+ */
+void dsmQueueConn(dsmConnCtx* pConn)
+{
+    pthread_mutex_lock(&dsmReadyConns.queueMutex);
+    pConn->pNext = NULL;
+    if (NULL == dsmReadyConns.pTail) {
+        dsmReadyConns.pHead = pConn;
+    }
+    else {
+        dsmReadyConns.pTail->pNext = pConn;
+    }
+    dsmReadyConns.pTail = pConn;
+    pthread_cond_signal(&dsmReadyConns.queueCondVar);
+    pthread_mutex_unlock(&dsmReadyConns.queueMutex);
+}
+
+/*
+ * takes the next connection with a msg pending off the ready queue; waits
+ * for one if the queue is empty
+ * Returns the connection
+ */
+dsmConnCtx* dsmDequeueConn(void)
+{
+    dsmConnCtx*     pConn = NULL;
+
+    pthread_mutex_lock(&dsmReadyConns.queueMutex);
+    while (NULL == dsmReadyConns.pHead) {
+        pthread_cond_wait(&dsmReadyConns.queueCondVar, &dsmReadyConns.queueMutex);
+    }
+    pConn = dsmReadyConns.pHead;
+    dsmReadyConns.pHead = pConn->pNext;
+    if (NULL == dsmReadyConns.pHead) {
+        dsmReadyConns.pTail = NULL;
+    }
+    pthread_mutex_unlock(&dsmReadyConns.queueMutex);
+    return pConn;
+}
+
+/*
+ * Worker thread; reads the pending msg of a connection taken off the ready
+ * queue, decodes it and lets its handler reply on the same connection, then
+ * re-arms the connection. A connection is dropped only when the peer closes
+ * it or it fails, the peer reconnects on its next request.
+ * Returns 0 on success, -1 on failure
+ */
+void* dsmServeConnections(void* arg)
+{
+    struct epoll_event      event;
+    dsmConnCtx*             pConn = NULL;
+    void*                   pReadData = NULL;
+    void*                   pNewData = NULL;
+    uInt32                  bufLen = DSM_MAX_MSG_LEN;
+
+    dsmEnterFunc();
+
+    /* allocate memory for msg; the workers start before the page size is
+     * known */
+    pReadData = malloc(bufLen);
+    if (NULL == pReadData) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
+                "bytes\n", bufLen);
+        return (void*)(-1);
+    }
+
+    memset(&event, 0, sizeof(struct epoll_event));
+    while (1) {
+        pConn = dsmDequeueConn();
+
+        /* the msgs with notices grow with the region, known once joined */
+        if (bufLen < DSM_MAX_NOTICE_MSG_LEN) {
+            pNewData = realloc(pReadData, DSM_MAX_NOTICE_MSG_LEN);
+            if (NULL == pNewData) {
+                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%u] "
+                        "bytes\n", DSM_MAX_NOTICE_MSG_LEN);
+            }
+            else {
+                pReadData = pNewData;
+                bufLen = DSM_MAX_NOTICE_MSG_LEN;
+            }
+        }
+        if (-1 == dsmReadMsg(pConn->sd, pReadData, bufLen)) {
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "Connection with client fd: [%d] "
+                    "closed\n", pConn->sd);
+            epoll_ctl(dsmSockInfo.epollFd, EPOLL_CTL_DEL, pConn->sd, &event);
+            close(pConn->sd);
+            free(pConn);
+            __sync_fetch_and_sub(&dsmSockInfo.numConns, 1);
+            continue;
+        }
+
+        /* decode msg; the handlers reply on the connection, with the id of
+         * the req */
+        pConn->reqId = ((dsmMsg*)pReadData)->reqId;
+        dsmDecodeMsg(pReadData, pConn);
+
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.ptr = pConn;
+        epoll_ctl(dsmSockInfo.epollFd, EPOLL_CTL_MOD, pConn->sd, &event);
     }
 
     /* free the allocated memory */
     free(pReadData);
-    free(pBuf);
     dsmExitFunc();
 }
 
 /*
- * Connects to peer specified by addr and port as args
+ * Runs pFunc(pArg) in a detached thread. A handler whose work sends reqs to
+ * the peers hands it on this way: the connection its msg came on is not
+ * read again until it returns, and the peer may be waiting on it to answer
+ * a req of its own to this node. Runs pFunc inline if no thread is created.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmRunDetached(void* (*pFunc)(void*), void* pArg)
+{
+    pthread_attr_t      attr;
+    pthread_t           threadId;
+    int32               retval = 0;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    retval = pthread_create(&threadId, &attr, pFunc, pArg);
+    pthread_attr_destroy(&attr);
+    if (0 != retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Thread creation failed with errno: "
+                "[%d]\n", retval);
+        pFunc(pArg);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Resolves the peer addr once and prepares the peer for a persistent
+ * connection; the connection itself is made on first use
  * Returns 0 on success, -1 on failure
  */
-int32 dsmConnectToPeer(int32 socketDesc, int8* ipAddr, int32 port)
+int32 dsmResolvePeer(dsmPeerInfo* pPeer, int8* ipAddr, int32 port)
+{
+    struct hostent*     host = NULL;
+
+    dsmEnterFunc();
+
+    host = gethostbyname(ipAddr);
+    if (NULL == host) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Failed to resolve peer addr [%s], "
+                "h_errno: [%d]\n", ipAddr, h_errno);
+        dsmExitFunc();
+        return -1;
+    }
+
+    memset(pPeer, 0, sizeof(dsmPeerInfo));
+    pPeer->ipAddr = ipAddr;
+    pPeer->port = port;
+    pPeer->sockAddr.sin_family = AF_INET;
+    pPeer->sockAddr.sin_port = htons(port);
+    pPeer->sockAddr.sin_addr = *((struct in_addr *)host->h_addr);
+    pPeer->localAddrLen = dsmLocalSockAddr(&pPeer->localAddr, ipAddr, port);
+    pPeer->sd = -1;
+    pthread_mutex_init(&pPeer->peerMutex, NULL);
+    pthread_mutex_init(&pPeer->rspMutex, NULL);
+
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Connects to the unix socket of peer, which is there only if the peer runs
+ * on this host
+ * Returns socket fd on success, -1 on failure
+ */
+int32 dsmConnectLocal(dsmPeerInfo* pPeer)
+{
+    int32       socketDesc = -1;
+
+    if (!dsmConfig.localTransport) {
+        return -1;
+    }
+    socketDesc = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (-1 == socketDesc) {
+        return -1;
+    }
+    if (-1 == connect(socketDesc, (struct sockaddr*)&pPeer->localAddr,
+                pPeer->localAddrLen)) {
+        close(socketDesc);
+        return -1;
+    }
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Connect to [%s] at port [%d] over unix socket "
+            "success\n", pPeer->ipAddr, pPeer->port);
+    return socketDesc;
+}
+
+/*
+ * Connects to peer over tcp using its resolved addr
+ * Returns socket fd on success, -1 on failure
+ */
+int32 dsmConnectTcp(dsmPeerInfo* pPeer)
 {
-    struct hostent *master = gethostbyname(ipAddr);   
-    struct sockaddr_in      serverAddr;
+    int32                   socketDesc = -1;
     int32                   retval = -1;
 
-    serverAddr.sin_family = AF_INET; 
-    serverAddr.sin_port = htons(port);
-    serverAddr.sin_addr = *((struct in_addr *)master->h_addr);
-    bzero(&(serverAddr.sin_zero), 8);
+    socketDesc = dsmCreateSocket();
+    if (-1 == socketDesc) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Error encountered in creating a socket!\n");
+        if (errno == EPROTONOSUPPORT) {
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "errno: [%d], Error Desc: "
+                    "[No protocol support]\nAborting...\n", errno);
+        }
+        else if(errno == ENFILE || errno == EMFILE) {
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "errno: [%d], Error Desc : "
+                    "[Too many file descriptors open]\n Aborting...\n", errno);
+        }
+        else if (errno == EACCES) {
+            dsmPrintLog(DSM_TRACE_TYPE_INFO, "errno: [%d], Error Desc: "
+                    "[Not enough privileges to create an AF_INET socket]\n"
+                    "Aborting...\n", errno);
+        }
+        abort();
+    }
+
+    retval = connect(socketDesc, (struct sockaddr *)&pPeer->sockAddr,
+            sizeof(struct sockaddr_in));
+    if (-1 == retval) {
+        close(socketDesc);
+        return -1;
+    }
 
-    retval = connect(socketDesc, (struct sockaddr *)&serverAddr, sizeof(struct sockaddr_in));
-    if (retval != -1) {
-        dsmPrintLog(DSM_TRACE_TYPE_INFO, "Connect to [%s] at port [%d] success\n",
-                ipAddr, port);
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Connect to [%s] at port [%d] success\n",
+            pPeer->ipAddr, pPeer->port);
+    return socketDesc;
+}
+
+/*
+ * Connects to peer, over its unix socket if it runs on this host, else over
+ * tcp, and says hello, which settles the codec of the pages the peer sends
+ * back; sets the peer connection fd
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmConnectToPeer(dsmPeerInfo* pPeer)
+{
+    dsmHelloInfo            helloInfo;
+    uInt8                   msgBuf[DSM_MSG_HDR_LEN + sizeof(dsmHelloInfo)];
+    dsmMsg*                 pMsg = (dsmMsg*)msgBuf;
+    int32                   socketDesc = -1;
+
+    socketDesc = dsmConnectLocal(pPeer);
+    pPeer->isLocal = (-1 != socketDesc);
+    if (!pPeer->isLocal) {
+        socketDesc = dsmConnectTcp(pPeer);
+        if (-1 == socketDesc) {
+            return -1;
+        }
     }
 
-    return retval;
+    /* agree on the codec of the pages the peer sends on this connection */
+    helloInfo.nodeId = dsmMmapInfo.nodeId;
+    helloInfo.codec = dsmConfig.compression;
+    pMsg->msgType = DSM_MSG_HELLO_REQ;
+    pMsg->reqId = 0;
+    pMsg->payloadLen = sizeof(dsmHelloInfo);
+    memcpy(pMsg->payload, &helloInfo, sizeof(dsmHelloInfo));
+    if (-1 == dsmSendMsg(socketDesc, pMsg) || -1 == dsmRecvMsg(socketDesc)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Hello to [%s] at port [%d] failed with "
+                "errno: [%d]\n", pPeer->ipAddr, pPeer->port, errno);
+        close(socketDesc);
+        return -1;
+    }
+
+    /* from now on rsps are read by the reader of the connection */
+    if (-1 == dsmStartRspReader(pPeer, socketDesc)) {
+        close(socketDesc);
+        return -1;
+    }
+    pPeer->sd = socketDesc;
+    return 0;
 }
 
 /*
- * sends msg on socket, both specified as args 
+ * Returns the persistent connection to peer, (re)connecting if the link is
+ * down; waits with growing back-off until the peer is up.
+ * Must be called with peerMutex held.
+ * Returns socket fd, aborts if the network is unreachable
+ */
+int32 dsmGetPeerConnection(dsmPeerInfo* pPeer)
+{
+    uInt32      retryUs = DSM_CONNECT_RETRY_US;
+    uInt64      startNs = 0;
+
+    if (-1 != pPeer->sd) {
+        return pPeer->sd;
+    }
+    /* the hello exchanged is timed as part of the connect */
+    startNs = dsmStatsPhaseStart();
+    dsmStats()->inFault = false;
+    while (-1 == pPeer->sd) {
+        if (0 == dsmConnectToPeer(pPeer)) {
+            break;
+        }
+        /* Abort if the network is unreachable */
+        if (errno == ENETUNREACH) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR,"errno: [%d], Error Desc: "
+                    "[The network isn't reachable from this host]\n Aborting ...\n", errno);
+            abort();
+        }
+        usleep(retryUs);
+        if (retryUs < DSM_CONNECT_MAX_RETRY_US) {
+            retryUs *= 2;
+        }
+    }
+    dsmStats()->inFault = (0 != startNs);
+    dsmStatsPhaseEnd(DSM_PHASE_CONNECT, startNs);
+    return pPeer->sd;
+}
+
+/*
+ * Drops the persistent connection to peer after a failure; the next
+ * exchange reconnects. The connection is only shut down here: its reader
+ * sees it end, fails the reqs still waiting on it and closes it.
+ * Must be called with peerMutex held.
+ */
+void dsmClosePeerConnection(dsmPeerInfo* pPeer)
+{
+    if (-1 != pPeer->sd) {
+        dsmPrintLog(DSM_TRACE_TYPE_WARN, "Dropping connection fd [%d] to [%s] "
+                "at port [%d]\n", pPeer->sd, pPeer->ipAddr, pPeer->port);
+        shutdown(pPeer->sd, SHUT_RDWR);
+        pPeer->sd = -1;
+    }
+}
+
+/*
+ * sends msg on socket, both specified as args; the header and payload are
+ * contiguous in the msg and are sent as they are
  * Returns 0 on success, -1 on failure
  */
 int32 dsmSendMsg(int32 socketDesc, dsmMsg* pMsg)
 {
-    uInt8*      pMsgBuf = NULL;
-    uInt8*      pBuffer = NULL;
-    uInt8       headerLen = 0;
-    uInt32      payloadLen = 0;
+    uInt64      startNs = dsmStatsPhaseStart();
 
     dsmEnterFunc();
 
-    /* create msg buffer and send to peer */
-    headerLen = (sizeof(pMsg->msgType) + sizeof(pMsg->payloadLen)); 
-    memcpy(&payloadLen, &(pMsg->payloadLen), sizeof(uInt32));
-    pMsgBuf = (uInt8*)malloc(headerLen + payloadLen);
-    if (NULL == pMsgBuf) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
-                "bytes\n", headerLen + payloadLen);
+    if (-1 == dsmSendAll(socketDesc, pMsg, (DSM_MSG_HDR_LEN + pMsg->payloadLen))) {
+        dsmExitFunc();
         return -1;
     }
-    memset(pMsgBuf, 0, headerLen + payloadLen);
-    pBuffer = pMsgBuf;
-    memcpy(pBuffer, pMsg, headerLen);
-    pBuffer += headerLen;
-    memcpy(pBuffer, pMsg->payload, payloadLen);
 
-    if (-1 == send(socketDesc, pMsgBuf, (headerLen + payloadLen), 0)) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Send to socket fd [%d] failed "
-                "with errno: [%d]\n", socketDesc, errno);
-        free(pMsgBuf);
+    dsmStats()->stats.msgs_sent += 1;
+    dsmStatsPhaseEnd(DSM_PHASE_SEND, startNs);
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * sends the rsp to the req being handled on the connection it came on
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmReplyMsg(dsmConnCtx* pConn, dsmMsg* pMsg)
+{
+    pMsg->reqId = pConn->reqId;
+    return dsmSendMsg(pConn->sd, pMsg);
+}
+
+/*
+ * sends a page rsp msg; the header, the rsp info and the page are gathered
+ * straight from where they are, the page from the shared region, so that
+ * the page is copied only once, into the socket buffer, unless it is
+ * compressed with the codec agreed on for the connection. The page must
+ * stay readable until the call returns.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmSendPageMsg(dsmConnCtx* pConn, dsmMsgType msgType, dsmPageRspInfo* pRspInfo,
+        const void* pPage)
+{
+    dsmMsg          msgHdr;
+    struct iovec    iov[3];
+
+    dsmEnterFunc();
+
+    iov[2].iov_base = (void*)dsmEncodePage((const uInt8*)pPage, pConn->codec, NULL,
+            pRspInfo);
+    iov[2].iov_len = pRspInfo->dataLen;
+    msgHdr.msgType = msgType;
+    msgHdr.reqId = pConn->reqId;
+    msgHdr.payloadLen = sizeof(dsmPageRspInfo) + pRspInfo->dataLen;
+    iov[0].iov_base = &msgHdr;
+    iov[0].iov_len = DSM_MSG_HDR_LEN;
+    iov[1].iov_base = pRspInfo;
+    iov[1].iov_len = sizeof(dsmPageRspInfo);
+
+    if (-1 == dsmSendAllv(pConn->sd, iov, 3)) {
         dsmExitFunc();
         return -1;
     }
-    
-    free(pMsgBuf);
+
+    dsmStats()->stats.msgs_sent += 1;
+    dsmStats()->stats.pages_sent += 1;
     dsmExitFunc();
     return 0;
 }
 
 /*
- * waits for msg on socket specified as arg; on receving msg calls decodeMsg
+ * waits for msg on socket specified as arg; on receving msg calls decodeMsg.
+ * Pages prefetched along with a page are sent ahead of its response; they
+ * are installed and the response is waited for.
  * Returns 0 on success, -1 on failure
  */
 int32 dsmRecvMsg(int32 socketDesc)
 {
-    int32 		noOfBytesPeek = 0;
-    int32 		bytesRead = 0;
-    int32	    offset = 0;
+    dsmMsg      msgHdr;
     void*       pReadData = NULL;
-    void*       pBuf = NULL;
+    uInt64      startNs = dsmStatsPhaseStart();
+    uInt64      waitNs = 0;
 
     dsmEnterFunc();
 
-    /* allocate memory for msg */
-    pReadData = malloc(DSM_MAX_MSG_LEN);
-    if (NULL == pReadData) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
-                "bytes\n", DSM_MAX_MSG_LEN);
-        dsmExitFunc();
-        return (-1);
+    do {
+        /* read the msg header to size the buffer for the payload */
+        if (0 != startNs) {
+            startNs = dsmNowNs();
+        }
+        if (-1 == dsmRecvAll(socketDesc, &msgHdr, DSM_MSG_HDR_LEN)) {
+            dsmExitFunc();
+            return -1;
+        }
+        if (msgHdr.payloadLen > DSM_MAX_NOTICE_MSG_LEN - DSM_MSG_HDR_LEN) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid payload length [%u] rcvd on "
+                    "socket fd [%d]\n", msgHdr.payloadLen, socketDesc);
+            errno = EPROTO;
+            dsmExitFunc();
+            return -1;
+        }
+
+        /* allocate memory for msg */
+        pReadData = malloc(DSM_MSG_HDR_LEN + msgHdr.payloadLen);
+        if (NULL == pReadData) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
+                    "bytes\n", DSM_MSG_HDR_LEN + msgHdr.payloadLen);
+            dsmExitFunc();
+            return (-1);
+        }
+        memcpy(pReadData, &msgHdr, DSM_MSG_HDR_LEN);
+        if (msgHdr.payloadLen > 0 && -1 == dsmRecvAll(socketDesc,
+                    (int8*)pReadData + DSM_MSG_HDR_LEN, msgHdr.payloadLen)) {
+            free(pReadData);
+            dsmExitFunc();
+            return -1;
+        }
+
+        /* the wait for the msgs is timed, not their handling */
+        if (0 != startNs) {
+            waitNs += dsmNowNs() - startNs;
+        }
+        dsmStats()->stats.msgs_rcvd += 1;
+
+        /* decode msg and free memory; responses are not replied to */
+        dsmDecodeMsg(pReadData, NULL);
+        free(pReadData);
+    } while (DSM_MSG_PAGE_PREFETCH_RSP == msgHdr.msgType);
+
+    if (0 != startNs) {
+        dsmStatsRecord(&dsmStats()->stats.phases[DSM_PHASE_WAIT], waitNs);
     }
-    pBuf = malloc(DSM_MAX_MSG_LEN);
-    if (NULL == pBuf) {
-        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
-                "bytes\n", DSM_MAX_MSG_LEN);
-        dsmExitFunc();
-        return (-1);
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Returns a new req id; never 0, which marks msgs not answered
+ */
+uInt32 dsmNewReqId(void)
+{
+    uInt32      reqId = 0;
+
+    do {
+        reqId = __sync_add_and_fetch(&dsmNextReqId, 1);
+    } while (0 == reqId);
+    return reqId;
+}
+
+/*
+ * registers a thread waiting for the rsps to req reqId, sent on the current
+ * connection to peer. Must be called with peerMutex held, before the req is
+ * sent, so that no rsp comes before its waiter.
+ * Returns void
+ */
+void dsmAddWaiter(dsmPeerInfo* pPeer, dsmRspWaiter* pWaiter, uInt32 reqId)
+{
+    pWaiter->reqId = reqId;
+    pWaiter->sd = pPeer->sd;
+    pWaiter->failed = false;
+    pWaiter->pHead = NULL;
+    pWaiter->pTail = NULL;
+    pthread_cond_init(&pWaiter->rspCondVar, NULL);
+    pthread_mutex_lock(&pPeer->rspMutex);
+    pWaiter->pNext = pPeer->pWaiters;
+    pPeer->pWaiters = pWaiter;
+    pthread_mutex_unlock(&pPeer->rspMutex);
+}
+
+/*
+ * takes a waiter off the peer and frees the rsps it left unhandled
+ * Returns void
+ */
+void dsmRemoveWaiter(dsmPeerInfo* pPeer, dsmRspWaiter* pWaiter)
+{
+    dsmRspWaiter**      ppLink = NULL;
+    dsmRspBuf*          pBuf = NULL;
+
+    pthread_mutex_lock(&pPeer->rspMutex);
+    for (ppLink = &pPeer->pWaiters; NULL != *ppLink; ppLink = &(*ppLink)->pNext) {
+        if (*ppLink == pWaiter) {
+            *ppLink = pWaiter->pNext;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&pPeer->rspMutex);
+    while (NULL != (pBuf = pWaiter->pHead)) {
+        pWaiter->pHead = pBuf->pNext;
+        free(pBuf);
     }
+    pthread_cond_destroy(&pWaiter->rspCondVar);
+}
 
-	/* read the msg header to get payload length */
-	int32 bytesToRead = DSM_MSG_HDR_LEN;
-	do {
-		memset(pBuf, 0, DSM_MAX_MSG_LEN);
-		bytesRead = recv(socketDesc, pBuf, bytesToRead, 0);
-		if (-1 == bytesRead) {
-			dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Recv from socket fd [%d] failed "
-                "with errno: [%d]\n", socketDesc, errno);
-            dsmExitFunc();
-			return -1;
-		}
-        memcpy(((int8*)pReadData + offset), pBuf, bytesRead);
-		offset += bytesRead;
+/*
+ * waits for the rsp of a registered waiter and handles it in the calling
+ * thread, as the handlers of rsps expect. Pages prefetched along with a
+ * page are sent ahead of its rsp; they are installed and the rsp is waited
+ * for. The waiter is taken off the peer.
+ * Returns 0 on success, -1 if the connection dropped before the rsp came
+ */
+int32 dsmAwaitRsp(dsmPeerInfo* pPeer, dsmRspWaiter* pWaiter)
+{
+    dsmRspBuf*  pBuf = NULL;
+    dsmMsgType  msgType = DSM_MSG_PAGE_PREFETCH_RSP;
+    uInt64      startNs = dsmStatsPhaseStart();
+    uInt64      waitNs = 0;
+    int32       retval = 0;
 
-	} while (offset < bytesToRead);
-	
-    /* read the number of bytes specified by payload length */
-	bytesRead = 0;
-	uInt32 payloadLen= *(uInt32*)((int32*)pReadData + 1);
-	if (payloadLen > 0) {
-		while ((offset - DSM_MSG_HDR_LEN) < payloadLen){
-		    memset(pBuf, 0, DSM_MAX_MSG_LEN);
-			bytesRead = recv(socketDesc, pBuf, payloadLen, 0);
-            if (-1 == bytesRead) {
-				dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Recv from socket fd [%d] failed "
-					"with errno: [%d]\n", socketDesc, errno);
-                dsmExitFunc();
-				return -1;
-			}
-			memcpy(((int8*)pReadData + offset), pBuf, bytesRead);
-			offset += bytesRead;
-		}
-	}
-    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Total [%d] bytes rcvd from client fd: [%d]\n",
-        offset, socketDesc);
-
-    /* decode msg and free memory */
-    dsmDecodeMsg(pReadData);
-    free(pBuf);
-    free(pReadData);
+    dsmEnterFunc();
+
+    while (DSM_MSG_PAGE_PREFETCH_RSP == msgType) {
+        if (0 != startNs) {
+            startNs = dsmNowNs();
+        }
+        pthread_mutex_lock(&pPeer->rspMutex);
+        while (NULL == pWaiter->pHead && !pWaiter->failed) {
+            pthread_cond_wait(&pWaiter->rspCondVar, &pPeer->rspMutex);
+        }
+        pBuf = pWaiter->pHead;
+        if (NULL != pBuf) {
+            pWaiter->pHead = pBuf->pNext;
+        }
+        pthread_mutex_unlock(&pPeer->rspMutex);
+        if (NULL == pBuf) {
+            errno = ECONNRESET;
+            retval = -1;
+            break;
+        }
 
+        /* the wait for the msgs is timed, not their handling */
+        if (0 != startNs) {
+            waitNs += dsmNowNs() - startNs;
+        }
+        msgType = ((dsmMsg*)pBuf->msg)->msgType;
+        dsmDecodeMsg(pBuf->msg, NULL);
+        free(pBuf);
+    }
+
+    if (0 != startNs && 0 == retval) {
+        dsmStatsRecord(&dsmStats()->stats.phases[DSM_PHASE_WAIT], waitNs);
+    }
+    dsmRemoveWaiter(pPeer, pWaiter);
     dsmExitFunc();
+    return retval;
+}
+
+/*
+ * Reader of a connection to a peer; reads the rsps coming on it and hands
+ * each to the thread waiting for the req it answers, so that many reqs of
+ * different threads can be outstanding on one connection. When the
+ * connection ends the reqs still waiting on it fail and it is closed.
+ * Returns NULL
+ */
+void* dsmRspReader(void* pArg)
+{
+    dsmRspReaderInfo*   pInfo = (dsmRspReaderInfo*)pArg;
+    dsmPeerInfo*        pPeer = pInfo->pPeer;
+    int32               socketDesc = pInfo->sd;
+    dsmRspWaiter*       pWaiter = NULL;
+    dsmRspBuf*          pBuf = NULL;
+    dsmMsg              msgHdr;
+
+    free(pInfo);
+    while (1) {
+        if (-1 == dsmRecvAll(socketDesc, &msgHdr, DSM_MSG_HDR_LEN)) {
+            break;
+        }
+        if (msgHdr.payloadLen > DSM_MAX_NOTICE_MSG_LEN - DSM_MSG_HDR_LEN) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Invalid payload length [%u] rcvd on "
+                    "socket fd [%d]\n", msgHdr.payloadLen, socketDesc);
+            break;
+        }
+        pBuf = (dsmRspBuf*)malloc(sizeof(dsmRspBuf) + DSM_MSG_HDR_LEN +
+                msgHdr.payloadLen);
+        if (NULL == pBuf) {
+            dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
+                    "bytes\n", DSM_MSG_HDR_LEN + msgHdr.payloadLen);
+            break;
+        }
+        memcpy(pBuf->msg, &msgHdr, DSM_MSG_HDR_LEN);
+        if (msgHdr.payloadLen > 0 && -1 == dsmRecvAll(socketDesc,
+                    pBuf->msg + DSM_MSG_HDR_LEN, msgHdr.payloadLen)) {
+            free(pBuf);
+            break;
+        }
+        dsmStats()->stats.msgs_rcvd += 1;
+
+        /* queue the rsp to its waiter */
+        pBuf->pNext = NULL;
+        pthread_mutex_lock(&pPeer->rspMutex);
+        for (pWaiter = pPeer->pWaiters; NULL != pWaiter; pWaiter = pWaiter->pNext) {
+            if (pWaiter->reqId == msgHdr.reqId && pWaiter->sd == socketDesc) {
+                break;
+            }
+        }
+        if (NULL != pWaiter) {
+            if (NULL == pWaiter->pHead) {
+                pWaiter->pHead = pBuf;
+            }
+            else {
+                pWaiter->pTail->pNext = pBuf;
+            }
+            pWaiter->pTail = pBuf;
+            pthread_cond_signal(&pWaiter->rspCondVar);
+            pBuf = NULL;
+        }
+        pthread_mutex_unlock(&pPeer->rspMutex);
+        if (NULL != pBuf) {
+            dsmPrintLog(DSM_TRACE_TYPE_WARN, "Rsp type [%d] to req [%u] rcvd on fd "
+                    "[%d] has no waiter\n", msgHdr.msgType, msgHdr.reqId, socketDesc);
+            free(pBuf);
+        }
+    }
+
+    /* the next req reconnects; the reqs waiting on this connection fail */
+    pthread_mutex_lock(&pPeer->peerMutex);
+    if (pPeer->sd == socketDesc) {
+        pPeer->sd = -1;
+    }
+    pthread_mutex_unlock(&pPeer->peerMutex);
+    pthread_mutex_lock(&pPeer->rspMutex);
+    for (pWaiter = pPeer->pWaiters; NULL != pWaiter; pWaiter = pWaiter->pNext) {
+        if (pWaiter->sd == socketDesc) {
+            pWaiter->failed = true;
+            pthread_cond_signal(&pWaiter->rspCondVar);
+        }
+    }
+    pthread_mutex_unlock(&pPeer->rspMutex);
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Connection fd [%d] to [%s] at port [%d] "
+            "closed\n", socketDesc, pPeer->ipAddr, pPeer->port);
+    close(socketDesc);
+    return NULL;
+}
+
+/*
+ * starts the reader of a new connection to peer
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmStartRspReader(dsmPeerInfo* pPeer, int32 socketDesc)
+{
+    dsmRspReaderInfo*   pInfo = NULL;
+    pthread_attr_t      attr;
+    pthread_t           threadId;
+    int32               retval = 0;
+
+    pInfo = (dsmRspReaderInfo*)malloc(sizeof(dsmRspReaderInfo));
+    if (NULL == pInfo) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Memory allocation failed for [%d] "
+                "bytes\n", sizeof(dsmRspReaderInfo));
+        return -1;
+    }
+    pInfo->pPeer = pPeer;
+    pInfo->sd = socketDesc;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    retval = pthread_create(&threadId, &attr, dsmRspReader, pInfo);
+    pthread_attr_destroy(&attr);
+    if (0 != retval) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Reader thread creation failed with "
+                "errno: [%d]\n", retval);
+        free(pInfo);
+        return -1;
+    }
     return 0;
 }
 
+/*
+ * sends a request to peer on the persistent connection and handles the
+ * response. The peer lock is held only while the request is sent, so other
+ * threads' requests to the peer are outstanding at the same time; the
+ * response finds this thread by the id of the request. A request that
+ * could not be sent because the link dropped is retried once on a fresh
+ * connection; a lost response is reported to the caller, since the peer
+ * may already have acted on the request.
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmSendAndRecv(dsmPeerInfo* pPeer, dsmMsg* pMsg)
+{
+    dsmRspWaiter    waiter;
+    int32           retval = -1;
+    int32           attempt = 0;
+
+    dsmEnterFunc();
+
+    for (attempt = 0; attempt < 2 && -1 == retval; attempt += 1) {
+        pthread_mutex_lock(&pPeer->peerMutex);
+        dsmGetPeerConnection(pPeer);
+        pMsg->reqId = dsmNewReqId();
+        dsmAddWaiter(pPeer, &waiter, pMsg->reqId);
+        retval = dsmSendMsg(pPeer->sd, pMsg);
+        if (-1 == retval) {
+            dsmClosePeerConnection(pPeer);
+            pthread_mutex_unlock(&pPeer->peerMutex);
+            dsmRemoveWaiter(pPeer, &waiter);
+            continue;
+        }
+        pthread_mutex_unlock(&pPeer->peerMutex);
+        retval = dsmAwaitRsp(pPeer, &waiter);
+        break;
+    }
+
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * sends a msg to peer on the persistent connection without waiting for a
+ * response; used for notifications the peer does not answer
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmSendToPeer(dsmPeerInfo* pPeer, dsmMsg* pMsg)
+{
+    int32       retval = -1;
+
+    dsmEnterFunc();
+
+    pthread_mutex_lock(&pPeer->peerMutex);
+    pMsg->reqId = 0;
+    retval = dsmSendMsg(dsmGetPeerConnection(pPeer), pMsg);
+    if (-1 == retval) {
+        dsmClosePeerConnection(pPeer);
+    }
+    pthread_mutex_unlock(&pPeer->peerMutex);
+
+    dsmExitFunc();
+    return retval;
+}
+
+/*
+ * sends the same request to every node in nodeMask and handles all the
+ * responses. All requests are sent before the first response is awaited so
+ * that the exchanges overlap.
+ * Returns 0 if every exchange succeeded, -1 otherwise
+ */
+int32 dsmMulticastAndRecv(uInt32 nodeMask, dsmMsg* pMsg)
+{
+    dsmRspWaiter    waiters[DSM_MAX_NODES];
+    uInt32          nodeId = 0;
+    uInt32          sentMask = 0;
+    int32           retval = 0;
+
+    dsmEnterFunc();
+
+    for (nodeId = 0; nodeId < dsmMmapInfo.numNodes; nodeId += 1) {
+        if (!(nodeMask & DSM_NODE_BIT(nodeId))) {
+            continue;
+        }
+        pthread_mutex_lock(&dsmPeers[nodeId].peerMutex);
+        dsmGetPeerConnection(&dsmPeers[nodeId]);
+        pMsg->reqId = dsmNewReqId();
+        dsmAddWaiter(&dsmPeers[nodeId], &waiters[nodeId], pMsg->reqId);
+        if (-1 == dsmSendMsg(dsmPeers[nodeId].sd, pMsg)) {
+            dsmClosePeerConnection(&dsmPeers[nodeId]);
+            pthread_mutex_unlock(&dsmPeers[nodeId].peerMutex);
+            dsmRemoveWaiter(&dsmPeers[nodeId], &waiters[nodeId]);
+            retval = -1;
+            continue;
+        }
+        pthread_mutex_unlock(&dsmPeers[nodeId].peerMutex);
+        sentMask |= DSM_NODE_BIT(nodeId);
+    }
+
+    for (nodeId = 0; nodeId < dsmMmapInfo.numNodes; nodeId += 1) {
+        if (!(sentMask & DSM_NODE_BIT(nodeId))) {
+            continue;
+        }
+        if (-1 == dsmAwaitRsp(&dsmPeers[nodeId], &waiters[nodeId])) {
+            retval = -1;
+        }
+    }
+
+    dsmExitFunc();
+    return retval;
+}
@@ -0,0 +1,242 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Runtime statistics: every thread counts into a block of its own with
+ * plain stores, so counting takes no lock and no atomic instruction; the
+ * blocks are linked on a list that dsm_get_stats() sums under a mutex,
+ * which is also taken when a thread first counts and when it exits and its
+ * counts are folded into those of the exited threads.
+ */
+
+static __thread dsmThreadStats* pDsmThreadStats = NULL;
+static dsmThreadStats*          pDsmStatsList = NULL;       /* threads alive */
+static dsm_stats_t              dsmStatsExited;             /* threads gone */
+static pthread_mutex_t          dsmStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t           dsmStatsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t            dsmStatsKey;
+static const char*              dsmPhaseNames[DSM_NUM_PHASES] = {"fault", "connect",
+                                    "send", "wait", "copy", "mprotect"};
+
+/*
+ * Returns the time in ns on a monotonic clock
+ */
+uInt64 dsmNowNs(void)
+{
+    struct timespec     now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uInt64)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * creates the key whose destructor folds the stats of an exiting thread
+ * Returns void
+ */
+void dsmStatsInitKey(void)
+{
+    pthread_key_create(&dsmStatsKey, dsmStatsRetire);
+}
+
+/*
+ * Returns the stats of the calling thread, set up on its first call; a
+ * thread they cannot be allocated for counts in a block of its own that is
+ * never summed
+ */
+dsmThreadStats* dsmStats(void)
+{
+    static __thread dsmThreadStats  spareStats;
+    dsmThreadStats*                 pStats = pDsmThreadStats;
+
+    if (NULL != pStats) {
+        return pStats;
+    }
+    pthread_once(&dsmStatsOnce, dsmStatsInitKey);
+    pStats = (dsmThreadStats*)calloc(1, sizeof(dsmThreadStats));
+    if (NULL == pStats) {
+        pDsmThreadStats = &spareStats;
+        return pDsmThreadStats;
+    }
+    pthread_mutex_lock(&dsmStatsMutex);
+    pStats->pNext = pDsmStatsList;
+    pDsmStatsList = pStats;
+    pthread_mutex_unlock(&dsmStatsMutex);
+    pthread_setspecific(dsmStatsKey, pStats);
+    pDsmThreadStats = pStats;
+    return pStats;
+}
+
+/*
+ * adds the stats of pFrom to those of pTo
+ * Returns void
+ */
+void dsmStatsMerge(dsm_stats_t* pTo, const dsm_stats_t* pFrom)
+{
+    uInt32      phase = 0;
+    uInt32      i = 0;
+
+    pTo->read_faults += pFrom->read_faults;
+    pTo->write_faults += pFrom->write_faults;
+    pTo->pages_sent += pFrom->pages_sent;
+    pTo->pages_rcvd += pFrom->pages_rcvd;
+    pTo->msgs_sent += pFrom->msgs_sent;
+    pTo->msgs_rcvd += pFrom->msgs_rcvd;
+    pTo->bytes_sent += pFrom->bytes_sent;
+    pTo->bytes_rcvd += pFrom->bytes_rcvd;
+    for (phase = 0; phase < DSM_NUM_PHASES; phase += 1) {
+        pTo->phases[phase].count += pFrom->phases[phase].count;
+        pTo->phases[phase].sum_ns += pFrom->phases[phase].sum_ns;
+        for (i = 0; i < DSM_STATS_BUCKETS; i += 1) {
+            pTo->phases[phase].buckets[i] += pFrom->phases[phase].buckets[i];
+        }
+    }
+}
+
+/*
+ * folds the stats of an exiting thread into those of the threads gone and
+ * takes them off the list
+ * Returns void
+ */
+void dsmStatsRetire(void* pArg)
+{
+    dsmThreadStats*     pStats = (dsmThreadStats*)pArg;
+    dsmThreadStats**    ppLink = NULL;
+
+    pthread_mutex_lock(&dsmStatsMutex);
+    for (ppLink = &pDsmStatsList; NULL != *ppLink; ppLink = &(*ppLink)->pNext) {
+        if (*ppLink == pStats) {
+            *ppLink = pStats->pNext;
+            break;
+        }
+    }
+    dsmStatsMerge(&dsmStatsExited, &pStats->stats);
+    pthread_mutex_unlock(&dsmStatsMutex);
+    free(pStats);
+}
+
+/*
+ * adds a latency sample to a histogram
+ * Returns void
+ */
+void dsmStatsRecord(dsm_hist_t* pHist, uInt64 ns)
+{
+    uInt32      bucket = 0;
+
+    if (ns > 1) {
+        bucket = 63 - __builtin_clzll(ns);
+        if (bucket >= DSM_STATS_BUCKETS) {
+            bucket = DSM_STATS_BUCKETS - 1;
+        }
+    }
+    pHist->count += 1;
+    pHist->sum_ns += ns;
+    pHist->buckets[bucket] += 1;
+}
+
+/*
+ * Returns the start time of a phase of the fault path, 0 if the calling
+ * thread is not serving a fault and the phase is not timed
+ */
+uInt64 dsmStatsPhaseStart(void)
+{
+    return dsmStats()->inFault ? dsmNowNs() : 0;
+}
+
+/*
+ * records the time a phase of the fault path took since startNs, unless
+ * it was not timed
+ * Returns void
+ */
+void dsmStatsPhaseEnd(uInt32 phase, uInt64 startNs)
+{
+    if (0 != startNs) {
+        dsmStatsRecord(&dsmStats()->stats.phases[phase], dsmNowNs() - startNs);
+    }
+}
+
+/*
+ * Sums the statistics of the threads of this node since it started; the
+ * counts of a thread are read while it may update them, so they are only
+ * consistent with each other to a few events
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_get_stats(dsm_stats_t* pStats)
+{
+    dsmThreadStats*     pThread = NULL;
+
+    dsmEnterFunc();
+    if (NULL == pStats) {
+        errno = EINVAL;
+        dsmExitFunc();
+        return -1;
+    }
+    pthread_mutex_lock(&dsmStatsMutex);
+    memcpy(pStats, &dsmStatsExited, sizeof(dsm_stats_t));
+    for (pThread = pDsmStatsList; NULL != pThread; pThread = pThread->pNext) {
+        dsmStatsMerge(pStats, &pThread->stats);
+    }
+    pthread_mutex_unlock(&dsmStatsMutex);
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Returns the end of the bucket holding the sample below which pct percent
+ * of the samples of the histogram lie, 0 if it has none
+ */
+unsigned long long dsm_hist_percentile(const dsm_hist_t* pHist, double pct)
+{
+    uInt64      rank = 0;
+    uInt64      seen = 0;
+    uInt32      i = 0;
+
+    if (NULL == pHist || 0 == pHist->count) {
+        return 0;
+    }
+    rank = (uInt64)(pct / 100.0 * pHist->count + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+    for (i = 0; i < DSM_STATS_BUCKETS - 1; i += 1) {
+        seen += pHist->buckets[i];
+        if (seen >= rank) {
+            break;
+        }
+    }
+    return (2ULL << i) - 1;
+}
+
+/*
+ * prints the stats of this node to stderr every dsmConfig.statsDumpMs ms
+ * Returns never
+ */
+void* dsmStatsDump(void* pArg)
+{
+    dsm_stats_t         stats;
+    const dsm_hist_t*   pHist = NULL;
+    uInt32              phase = 0;
+
+    while (1) {
+        usleep(dsmConfig.statsDumpMs * 1000);
+        dsm_get_stats(&stats);
+        fprintf(stderr, "dsm node [%u]: faults read [%llu] write [%llu], pages sent "
+                "[%llu] rcvd [%llu], msgs sent [%llu] rcvd [%llu], bytes sent [%llu] "
+                "rcvd [%llu]\n", dsmMmapInfo.nodeId, stats.read_faults,
+                stats.write_faults, stats.pages_sent, stats.pages_rcvd,
+                stats.msgs_sent, stats.msgs_rcvd, stats.bytes_sent, stats.bytes_rcvd);
+        for (phase = 0; phase < DSM_NUM_PHASES; phase += 1) {
+            pHist = &stats.phases[phase];
+            if (0 == pHist->count) {
+                continue;
+            }
+            fprintf(stderr, "dsm node [%u]:   %-8s count [%llu] mean [%llu] p50 [%llu] "
+                    "p99 [%llu] p999 [%llu] ns\n", dsmMmapInfo.nodeId,
+                    dsmPhaseNames[phase], pHist->count, pHist->sum_ns / pHist->count,
+                    dsm_hist_percentile(pHist, 50), dsm_hist_percentile(pHist, 99),
+                    dsm_hist_percentile(pHist, 99.9));
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,254 @@
+#include <sys/syscall.h>
+
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+
+/*
+ * Binary trace of page movements: the fault path and the page handlers
+ * record fixed size events into a ring of the thread, a plain store and a
+ * release of the ring head, so recording takes no lock and no syscall. A
+ * flusher thread writes the rings to the trace file every
+ * DSM_TRACE_FLUSH_US. A ring that fills up in between drops the events
+ * recorded and the file notes how many. Read by dsmtrace, the analyzer.
+ */
+
+volatile bool               dsmTraceOn = false;
+
+static __thread dsmTraceRing*   pDsmTraceRing = NULL;
+static dsmTraceRing*        pDsmTraceRings = NULL;      /* rings of the threads */
+static pthread_mutex_t      dsmTraceMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t       dsmTraceOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t        dsmTraceKey;
+static pthread_t            dsmTraceFlushThread;
+static volatile bool        dsmTraceStopping = false;
+static FILE*                pDsmTraceFile = NULL;
+
+/*
+ * creates the key whose destructor hands the ring of an exiting thread to
+ * the flusher
+ * Returns void
+ */
+void dsmTraceInitKey(void)
+{
+    pthread_key_create(&dsmTraceKey, dsmTraceRetire);
+}
+
+/*
+ * Returns the trace ring of the calling thread, set up on its first event;
+ * NULL if it cannot be allocated
+ */
+dsmTraceRing* dsmTraceGetRing(void)
+{
+    dsmTraceRing*       pRing = pDsmTraceRing;
+
+    if (NULL != pRing) {
+        return pRing;
+    }
+    pthread_once(&dsmTraceOnce, dsmTraceInitKey);
+    pRing = (dsmTraceRing*)calloc(1, sizeof(dsmTraceRing));
+    if (NULL == pRing) {
+        return NULL;
+    }
+    pRing->threadId = syscall(SYS_gettid);
+    pthread_mutex_lock(&dsmTraceMutex);
+    pRing->pNext = pDsmTraceRings;
+    pDsmTraceRings = pRing;
+    pthread_mutex_unlock(&dsmTraceMutex);
+    pthread_setspecific(dsmTraceKey, pRing);
+    pDsmTraceRing = pRing;
+    return pRing;
+}
+
+/*
+ * marks the ring of an exiting thread to be freed once drained
+ * Returns void
+ */
+void dsmTraceRetire(void* pArg)
+{
+    ((dsmTraceRing*)pArg)->exited = true;
+}
+
+/*
+ * records an event in the ring of the calling thread; dropped if the ring
+ * is full. Called through DSM_TRACE_EVENT(), which skips it when the trace
+ * is off.
+ * Returns void
+ */
+void dsmTraceRecord(uInt32 event, uInt32 pageOffset, uInt32 peerId, uInt32 flags,
+        uInt32 arg)
+{
+    dsmTraceRing*       pRing = dsmTraceGetRing();
+    dsmTraceEvent*      pEvent = NULL;
+    uInt32              head = 0;
+
+    if (NULL == pRing) {
+        return;
+    }
+    head = pRing->head;
+    if (head - pRing->tail >= DSM_TRACE_RING_EVENTS) {
+        pRing->dropped += 1;
+        return;
+    }
+    pEvent = &pRing->events[head & (DSM_TRACE_RING_EVENTS - 1)];
+    pEvent->timeNs = dsmNowNs();
+    pEvent->pageOffset = pageOffset;
+    pEvent->arg = arg;
+    pEvent->threadId = pRing->threadId;
+    pEvent->event = event;
+    pEvent->nodeId = dsmMmapInfo.nodeId;
+    pEvent->peerId = peerId;
+    pEvent->flags = flags;
+
+    /* the flusher sees the event written once it sees the head moved */
+    __atomic_store_n(&pRing->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * writes the events recorded in the rings since the last drain to the trace
+ * file and frees the rings of the threads gone
+ * Returns void
+ */
+void dsmTraceDrain(void)
+{
+    dsmTraceRing**      ppLink = NULL;
+    dsmTraceRing*       pRing = NULL;
+    dsmTraceEvent       dropEvent;
+    uInt32              head = 0;
+    uInt32              tail = 0;
+    uInt32              start = 0;
+    uInt32              count = 0;
+    uInt32              dropped = 0;
+
+    pthread_mutex_lock(&dsmTraceMutex);
+    ppLink = &pDsmTraceRings;
+    while (NULL != (pRing = *ppLink)) {
+        head = __atomic_load_n(&pRing->head, __ATOMIC_ACQUIRE);
+        for (tail = pRing->tail; tail != head; tail += count) {
+            /* at most two runs, the second from the start of the ring */
+            start = tail & (DSM_TRACE_RING_EVENTS - 1);
+            count = head - tail;
+            if (count > DSM_TRACE_RING_EVENTS - start) {
+                count = DSM_TRACE_RING_EVENTS - start;
+            }
+            fwrite(&pRing->events[start], sizeof(dsmTraceEvent), count, pDsmTraceFile);
+        }
+        __atomic_store_n(&pRing->tail, head, __ATOMIC_RELEASE);
+
+        dropped = pRing->dropped;
+        if (dropped != pRing->droppedSeen) {
+            memset(&dropEvent, 0, sizeof(dsmTraceEvent));
+            dropEvent.timeNs = dsmNowNs();
+            dropEvent.arg = dropped - pRing->droppedSeen;
+            dropEvent.threadId = pRing->threadId;
+            dropEvent.event = DSM_EVENT_DROPPED;
+            dropEvent.nodeId = dsmMmapInfo.nodeId;
+            dropEvent.peerId = DSM_TRACE_NO_PEER;
+            fwrite(&dropEvent, sizeof(dsmTraceEvent), 1, pDsmTraceFile);
+            pRing->droppedSeen = dropped;
+        }
+
+        if (pRing->exited && head == pRing->head) {
+            *ppLink = pRing->pNext;
+            free(pRing);
+            continue;
+        }
+        ppLink = &pRing->pNext;
+    }
+    pthread_mutex_unlock(&dsmTraceMutex);
+    fflush(pDsmTraceFile);
+}
+
+/*
+ * flusher thread; drains the rings to the trace file until the trace is
+ * stopped, then a last time
+ * Returns NULL
+ */
+void* dsmTraceFlusher(void* pArg)
+{
+    while (!dsmTraceStopping) {
+        usleep(DSM_TRACE_FLUSH_US);
+        dsmTraceDrain();
+    }
+    dsmTraceDrain();
+    return NULL;
+}
+
+/*
+ * Starts recording the binary trace of this node to the file at path,
+ * which is truncated; each node writes a file of its own
+ * Returns 0 on success, -1 on failure
+ */
+int dsm_trace_start(const char* path)
+{
+    dsmTraceHeader      header;
+    dsmTraceRing*       pRing = NULL;
+
+    dsmEnterFunc();
+    if (NULL == path || NULL != pDsmTraceFile) {
+        errno = (NULL == path) ? EINVAL : EBUSY;
+        dsmExitFunc();
+        return -1;
+    }
+    pDsmTraceFile = fopen(path, "wb");
+    if (NULL == pDsmTraceFile) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Trace file [%s] not opened, errno: [%d]\n",
+                path, errno);
+        dsmExitFunc();
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(dsmTraceHeader));
+    memcpy(header.magic, DSM_TRACE_MAGIC, sizeof(header.magic));
+    header.version = DSM_TRACE_VERSION;
+    header.eventSize = sizeof(dsmTraceEvent);
+    header.nodeId = dsmMmapInfo.nodeId;
+    header.numNodes = dsmMmapInfo.numNodes;
+    header.pageSize = dsmMmapInfo.pageSize;
+    header.numPages = dsmMmapInfo.numPagesToAlloc;
+    header.startNs = dsmNowNs();
+    fwrite(&header, sizeof(dsmTraceHeader), 1, pDsmTraceFile);
+
+    /* events left over from an earlier trace are not part of this one */
+    pthread_mutex_lock(&dsmTraceMutex);
+    for (pRing = pDsmTraceRings; NULL != pRing; pRing = pRing->pNext) {
+        pRing->tail = pRing->head;
+        pRing->droppedSeen = pRing->dropped;
+    }
+    pthread_mutex_unlock(&dsmTraceMutex);
+
+    dsmTraceStopping = false;
+    if (0 != pthread_create(&dsmTraceFlushThread, NULL, dsmTraceFlusher, NULL)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Trace Thread creation failed with "
+                "errno: %d\n", errno);
+        fclose(pDsmTraceFile);
+        pDsmTraceFile = NULL;
+        dsmExitFunc();
+        return -1;
+    }
+    dsmTraceOn = true;
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Stops the trace and writes out the events recorded
+ * Returns 0 on success, -1 if no trace was started
+ */
+int dsm_trace_stop(void)
+{
+    dsmEnterFunc();
+    if (NULL == pDsmTraceFile) {
+        errno = EINVAL;
+        dsmExitFunc();
+        return -1;
+    }
+    dsmTraceOn = false;
+    dsmTraceStopping = true;
+    pthread_join(dsmTraceFlushThread, NULL);
+    fclose(pDsmTraceFile);
+    pDsmTraceFile = NULL;
+    dsmExitFunc();
+    return 0;
+}
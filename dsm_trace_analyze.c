@@ -0,0 +1,391 @@
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_prototype.h"
+
+/*
+ * dsmtrace: reads the trace files written by dsm_trace_start(), one per
+ * node, and prints the fault latency percentiles, the pages with the most
+ * traffic, the pages whose ownership ping-pongs between nodes and a
+ * heatmap of the traffic of those pages over time. Times are taken from
+ * the start of each file's trace, so files of nodes on different hosts can
+ * be read together.
+ *
+ * usage: dsmtrace [-n pages] [-w pingpong_us] [-c columns] file...
+ */
+
+static const char*  dsmHeatChars = " .:-=+*#%@";
+
+/*
+ * appends the events of a trace file to the array at *ppEvents, which holds
+ * *pNumEvents events and room for *pCapEvents; the times are made relative
+ * to the start of the trace
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmTraceLoad(const char* path, dsmTraceEvent** ppEvents, uInt32* pNumEvents,
+        uInt32* pCapEvents, uInt32* pDropped)
+{
+    dsmTraceHeader      header;
+    dsmTraceEvent       event;
+    dsmTraceEvent*      pGrown = NULL;
+    FILE*               pFile = NULL;
+
+    pFile = fopen(path, "rb");
+    if (NULL == pFile) {
+        fprintf(stderr, "%s: cannot open: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (1 != fread(&header, sizeof(dsmTraceHeader), 1, pFile) ||
+            0 != memcmp(header.magic, DSM_TRACE_MAGIC, sizeof(header.magic)) ||
+            DSM_TRACE_VERSION != header.version ||
+            sizeof(dsmTraceEvent) != header.eventSize) {
+        fprintf(stderr, "%s: not a trace file of this version\n", path);
+        fclose(pFile);
+        return -1;
+    }
+
+    while (1 == fread(&event, sizeof(dsmTraceEvent), 1, pFile)) {
+        if (DSM_EVENT_DROPPED == event.event) {
+            *pDropped += event.arg;
+            continue;
+        }
+        if (*pNumEvents == *pCapEvents) {
+            *pCapEvents = (0 == *pCapEvents) ? 65536 : 2 * *pCapEvents;
+            pGrown = (dsmTraceEvent*)realloc(*ppEvents,
+                    (size_t)*pCapEvents * sizeof(dsmTraceEvent));
+            if (NULL == pGrown) {
+                fprintf(stderr, "%s: out of memory\n", path);
+                fclose(pFile);
+                return -1;
+            }
+            *ppEvents = pGrown;
+        }
+        event.timeNs = (event.timeNs > header.startNs) ? event.timeNs - header.startNs : 0;
+        (*ppEvents)[(*pNumEvents)++] = event;
+    }
+    printf("%s: node %u of %u, %u pages of %u bytes\n", path, header.nodeId,
+            header.numNodes, header.numPages, header.pageSize);
+    fclose(pFile);
+    return 0;
+}
+
+/*
+ * orders events by page, then node, then time
+ */
+int dsmTraceCmpPage(const void* pA, const void* pB)
+{
+    const dsmTraceEvent*    pEventA = (const dsmTraceEvent*)pA;
+    const dsmTraceEvent*    pEventB = (const dsmTraceEvent*)pB;
+
+    if (pEventA->pageOffset != pEventB->pageOffset) {
+        return (pEventA->pageOffset < pEventB->pageOffset) ? -1 : 1;
+    }
+    if (pEventA->nodeId != pEventB->nodeId) {
+        return (pEventA->nodeId < pEventB->nodeId) ? -1 : 1;
+    }
+    if (pEventA->timeNs != pEventB->timeNs) {
+        return (pEventA->timeNs < pEventB->timeNs) ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * orders pages by their number of events, most first
+ */
+int dsmTraceCmpBusy(const void* pA, const void* pB)
+{
+    const dsmTracePageInfo* pPageA = (const dsmTracePageInfo*)pA;
+    const dsmTracePageInfo* pPageB = (const dsmTracePageInfo*)pB;
+
+    if (pPageA->numEvents != pPageB->numEvents) {
+        return (pPageA->numEvents > pPageB->numEvents) ? -1 : 1;
+    }
+    return (pPageA->pageOffset < pPageB->pageOffset) ? -1 : 1;
+}
+
+/*
+ * orders pages by their ping-pongs, most first
+ */
+int dsmTraceCmpPingPong(const void* pA, const void* pB)
+{
+    const dsmTracePageInfo* pPageA = (const dsmTracePageInfo*)pA;
+    const dsmTracePageInfo* pPageB = (const dsmTracePageInfo*)pB;
+
+    if (pPageA->pingPongs != pPageB->pingPongs) {
+        return (pPageA->pingPongs > pPageB->pingPongs) ? -1 : 1;
+    }
+    return dsmTraceCmpBusy(pA, pB);
+}
+
+/*
+ * orders latencies, shortest first
+ */
+int dsmTraceCmpLatency(const void* pA, const void* pB)
+{
+    uInt32      a = *(const uInt32*)pA;
+    uInt32      b = *(const uInt32*)pB;
+
+    return (a < b) ? -1 : ((a > b) ? 1 : 0);
+}
+
+/*
+ * gathers what happened to each page from the events, sorted by page, node
+ * and time. Ownership of a page coming back to a node within pingPongNs of
+ * the node sending it away counts as a ping-pong.
+ * Returns the number of pages, their info in *ppPages; 0 on failure
+ */
+uInt32 dsmTraceSummarize(const dsmTraceEvent* pEvents, uInt32 numEvents, uInt64 pingPongNs,
+        dsmTracePageInfo** ppPages)
+{
+    dsmTracePageInfo*       pPages = NULL;
+    dsmTracePageInfo*       pPage = NULL;
+    const dsmTraceEvent*    pEvent = NULL;
+    uInt64                  lostNs = 0;
+    bool                    lost = false;
+    uInt32                  numPages = 0;
+    uInt32                  i = 0;
+
+    pPages = (dsmTracePageInfo*)calloc(numEvents, sizeof(dsmTracePageInfo));
+    if (NULL == pPages) {
+        return 0;
+    }
+    for (i = 0; i < numEvents; i += 1) {
+        pEvent = &pEvents[i];
+        if (0 == i || pEvent->pageOffset != pEvents[i - 1].pageOffset) {
+            pPage = &pPages[numPages++];
+            pPage->pageOffset = pEvent->pageOffset;
+            pPage->first = i;
+        }
+        if (0 == i || pEvent->pageOffset != pEvents[i - 1].pageOffset ||
+                pEvent->nodeId != pEvents[i - 1].nodeId) {
+            lost = false;
+        }
+        pPage->numEvents += 1;
+
+        switch (pEvent->event) {
+            case DSM_EVENT_FAULT:
+                if (pEvent->flags & DSM_EVENT_FLAG_WRITE) {
+                    pPage->writeFaults += 1;
+                }
+                else {
+                    pPage->readFaults += 1;
+                }
+                break;
+            case DSM_EVENT_PAGE_SERVED:
+                pPage->serves += 1;
+                if (pEvent->flags & DSM_EVENT_FLAG_WRITE) {
+                    lost = true;
+                    lostNs = pEvent->timeNs;
+                    if (pEvent->peerId < DSM_MAX_NODES) {
+                        pPage->peerMask |= DSM_NODE_BIT(pEvent->peerId);
+                    }
+                }
+                break;
+            case DSM_EVENT_PAGE_INSTALLED:
+                pPage->installs += 1;
+                if (pEvent->flags & DSM_EVENT_FLAG_WRITE) {
+                    pPage->moves += 1;
+                    if (lost && pEvent->timeNs - lostNs < pingPongNs) {
+                        pPage->pingPongs += 1;
+                    }
+                    lost = false;
+                }
+                break;
+            case DSM_EVENT_INVALIDATED:
+                pPage->invalidations += 1;
+                break;
+            default:
+                break;
+        }
+    }
+    *ppPages = pPages;
+    return numPages;
+}
+
+/*
+ * prints the percentiles of a set of fault latencies in ns, which are
+ * sorted in place
+ * Returns void
+ */
+void dsmTracePrintLatency(const char* pLabel, uInt32* pLatencies, uInt32 num)
+{
+    const double    pcts[] = {50, 90, 99, 99.9};
+    uInt32          i = 0;
+    uInt32          rank = 0;
+
+    printf("  %-6s %10u", pLabel, num);
+    if (0 == num) {
+        printf("\n");
+        return;
+    }
+    qsort(pLatencies, num, sizeof(uInt32), dsmTraceCmpLatency);
+    for (i = 0; i < sizeof(pcts) / sizeof(pcts[0]); i += 1) {
+        rank = (uInt32)(pcts[i] / 100.0 * num + 0.999999);
+        printf(" %9.1f", pLatencies[(rank > 0) ? rank - 1 : 0] / 1000.0);
+    }
+    printf(" %9.1f\n", pLatencies[num - 1] / 1000.0);
+}
+
+/*
+ * prints a row of page info
+ * Returns void
+ */
+void dsmTracePrintPage(const dsmTracePageInfo* pPage)
+{
+    uInt32      nodeId = 0;
+
+    printf("  %10u %7u %7u %7u %7u %7u %7u %9u  ", pPage->pageOffset, pPage->readFaults,
+            pPage->writeFaults, pPage->installs, pPage->serves, pPage->moves,
+            pPage->invalidations, pPage->pingPongs);
+    for (nodeId = 0; nodeId < DSM_MAX_NODES; nodeId += 1) {
+        if (pPage->peerMask & DSM_NODE_BIT(nodeId)) {
+            printf("%u ", nodeId);
+        }
+    }
+    printf("\n");
+}
+
+/*
+ * prints a heatmap of the events of the pages over time, a row per page and
+ * columns of spanNs / numColumns each
+ * Returns void
+ */
+void dsmTracePrintHeatmap(const dsmTraceEvent* pEvents, const dsmTracePageInfo* pPages,
+        uInt32 numPages, uInt32 numColumns, uInt64 spanNs)
+{
+    uInt32*     pCells = NULL;
+    uInt32      maxCell = 0;
+    uInt32      numLevels = strlen(dsmHeatChars) - 1;
+    uInt32      column = 0;
+    uInt32      cell = 0;
+    uInt32      i = 0;
+    uInt32      j = 0;
+
+    pCells = (uInt32*)calloc((size_t)numPages * numColumns, sizeof(uInt32));
+    if (NULL == pCells || 0 == numPages) {
+        free(pCells);
+        return;
+    }
+    for (i = 0; i < numPages; i += 1) {
+        for (j = 0; j < pPages[i].numEvents; j += 1) {
+            column = (uInt32)(pEvents[pPages[i].first + j].timeNs * numColumns / (spanNs + 1));
+            cell = ++pCells[i * numColumns + column];
+            if (cell > maxCell) {
+                maxCell = cell;
+            }
+        }
+    }
+
+    printf("\nheatmap: events of the busiest pages over %.3f s, %.3f ms a column, "
+            "'%c' = %u events\n", spanNs / 1e9, spanNs / 1e6 / numColumns,
+            dsmHeatChars[numLevels], maxCell);
+    for (i = 0; i < numPages; i += 1) {
+        printf("  %10u |", pPages[i].pageOffset);
+        for (column = 0; column < numColumns; column += 1) {
+            cell = pCells[i * numColumns + column];
+            putchar(dsmHeatChars[((uInt64)cell * numLevels + maxCell - 1) / maxCell]);
+        }
+        printf("|\n");
+    }
+    free(pCells);
+}
+
+int main(int argc, char** argv)
+{
+    dsmTraceEvent*      pEvents = NULL;
+    dsmTracePageInfo*   pPages = NULL;
+    uInt32*             pLatencies[3] = {NULL, NULL, NULL};
+    uInt32              numLatencies[3] = {0, 0, 0};
+    uInt32              numEvents = 0;
+    uInt32              capEvents = 0;
+    uInt32              numPages = 0;
+    uInt32              numShown = 0;
+    uInt32              dropped = 0;
+    uInt32              topPages = 20;
+    uInt32              numColumns = 64;
+    uInt64              pingPongNs = 1000000;
+    uInt64              spanNs = 0;
+    uInt32              i = 0;
+    int                 opt = 0;
+
+    while (-1 != (opt = getopt(argc, argv, "n:w:c:"))) {
+        switch (opt) {
+            case 'n':
+                topPages = strtoul(optarg, NULL, 0);
+                break;
+            case 'w':
+                pingPongNs = strtoull(optarg, NULL, 0) * 1000;
+                break;
+            case 'c':
+                numColumns = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                optind = argc;
+                break;
+        }
+    }
+    if (optind >= argc || 0 == numColumns) {
+        fprintf(stderr, "usage: %s [-n pages] [-w pingpong_us] [-c columns] file...\n",
+                argv[0]);
+        return 1;
+    }
+    for (; optind < argc; optind += 1) {
+        if (-1 == dsmTraceLoad(argv[optind], &pEvents, &numEvents, &capEvents, &dropped)) {
+            return 1;
+        }
+    }
+
+    /* fault latencies, read, write and all */
+    for (i = 0; i < 3; i += 1) {
+        pLatencies[i] = (uInt32*)malloc((size_t)(numEvents + 1) * sizeof(uInt32));
+        if (NULL == pLatencies[i]) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+    }
+    for (i = 0; i < numEvents; i += 1) {
+        if (pEvents[i].timeNs > spanNs) {
+            spanNs = pEvents[i].timeNs;
+        }
+        if (DSM_EVENT_FAULT_DONE != pEvents[i].event) {
+            continue;
+        }
+        opt = (pEvents[i].flags & DSM_EVENT_FLAG_WRITE) ? 1 : 0;
+        pLatencies[opt][numLatencies[opt]++] = pEvents[i].arg;
+        pLatencies[2][numLatencies[2]++] = pEvents[i].arg;
+    }
+    printf("\n%u events over %.3f s, %u lost to full rings\n", numEvents, spanNs / 1e9,
+            dropped);
+    printf("\nfault latency (us)  count       p50       p90       p99     p99.9       max\n");
+    dsmTracePrintLatency("read", pLatencies[0], numLatencies[0]);
+    dsmTracePrintLatency("write", pLatencies[1], numLatencies[1]);
+    dsmTracePrintLatency("all", pLatencies[2], numLatencies[2]);
+
+    /* per page */
+    qsort(pEvents, numEvents, sizeof(dsmTraceEvent), dsmTraceCmpPage);
+    numPages = dsmTraceSummarize(pEvents, numEvents, pingPongNs, &pPages);
+    numShown = (topPages < numPages) ? topPages : numPages;
+    printf("\n%u pages seen\n", numPages);
+    printf("\n      page  rfault  wfault      in     out   moved   inval  pingpong  "
+            "ownership to\n");
+    qsort(pPages, numPages, sizeof(dsmTracePageInfo), dsmTraceCmpPingPong);
+    printf("ping-pong (ownership back within %llu us):\n", pingPongNs / 1000);
+    for (i = 0; i < numShown && 0 != pPages[i].pingPongs; i += 1) {
+        dsmTracePrintPage(&pPages[i]);
+    }
+    qsort(pPages, numPages, sizeof(dsmTracePageInfo), dsmTraceCmpBusy);
+    printf("busiest:\n");
+    for (i = 0; i < numShown; i += 1) {
+        dsmTracePrintPage(&pPages[i]);
+    }
+    dsmTracePrintHeatmap(pEvents, pPages, numShown, numColumns, spanNs);
+
+    free(pEvents);
+    free(pPages);
+    for (i = 0; i < 3; i += 1) {
+        free(pLatencies[i]);
+    }
+    return 0;
+}
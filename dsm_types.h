@@ -8,6 +8,10 @@
 #include <time.h>
 
 #include <bits/pthreadtypes.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+
+#include "dsm.h"
 
 typedef int             int32;
 typedef unsigned int    uInt32;
@@ -15,12 +19,43 @@ typedef char            int8;
 typedef unsigned char   uInt8;
 typedef short           int16;
 typedef unsigned short  uInt16;
+typedef unsigned long long uInt64;
+
+#define DSM_MAX_NODES           (32)    /* bounded by the copyset bitmask */
 
 typedef enum {
     DSM_MSG_INIT_SHARED_REGION_REQ,
     DSM_MSG_INIT_SHARED_REGION_RSP,
     DSM_MSG_PAGE_REQ,
-    DSM_MSG_PAGE_RSP
+    DSM_MSG_PAGE_RSP,
+    DSM_MSG_PAGE_READ_REQ,
+    DSM_MSG_PAGE_READ_RSP,
+    DSM_MSG_INVALIDATE_REQ,
+    DSM_MSG_INVALIDATE_RSP,
+    DSM_MSG_PAGE_REDIRECT_RSP,
+    DSM_MSG_OWNER_UPDATE,
+    DSM_MSG_PAGE_PREFETCH_RSP,      /* read-only copy sent ahead of a READ_RSP */
+    DSM_MSG_PAGE_BATCH_REQ,
+    DSM_MSG_PAGE_BATCH_RSP,
+    DSM_MSG_DIFF_REQ,
+    DSM_MSG_DIFF_RSP,
+    DSM_MSG_HELLO_REQ,
+    DSM_MSG_HELLO_RSP,
+    DSM_MSG_LOCK_ACQUIRE_REQ,
+    DSM_MSG_LOCK_ACQUIRE_RSP,
+    DSM_MSG_LOCK_RELEASE_REQ,
+    DSM_MSG_LOCK_RELEASE_RSP,
+    DSM_MSG_LOCK_GRANT_REQ,
+    DSM_MSG_LOCK_GRANT_RSP,
+    DSM_MSG_LOCK_REVOKE_REQ,
+    DSM_MSG_LOCK_REVOKE_RSP,
+    DSM_MSG_BARRIER_REQ,
+    DSM_MSG_BARRIER_RSP,
+    DSM_MSG_BARRIER_DONE_REQ,
+    DSM_MSG_BARRIER_DONE_RSP,
+    DSM_MSG_ATOMIC_REQ,
+    DSM_MSG_ATOMIC_RSP,
+    DSM_MSG_PAGE_RECLAIM            /* pages for master to take back, unanswered */
 }dsmMsgType;
 
 typedef enum {
@@ -35,45 +70,448 @@ typedef struct {
     dsmMsgType      msgType;
     /* length of msg */
     uInt32          payloadLen;
+    /* id of the req, echoed in its rsps; 0 for msgs not answered */
+    uInt32          reqId;
     /* strechable array for msg payload */
     uInt8           payload[1];
 
 }dsmMsg;
 
+/* payload of DSM_MSG_PAGE_REQ and DSM_MSG_PAGE_READ_REQ */
+typedef struct {
+    uInt32          pageOffset;
+    uInt32          requesterId;    /* node id of the faulting node */
+    int32           prefetchStride; /* read requests: pages asked for along with */
+    uInt32          prefetchMask;   /* the page, bit i is i + 1 strides after it */
+}dsmPageReqInfo;
+
+/* payload of DSM_MSG_PAGE_RSP and DSM_MSG_PAGE_READ_RSP; followed by the
+ * page, encoded with codec in dataLen bytes */
+typedef struct {
+    uInt32          pageOffset;
+    uInt32          copyset;        /* read-only copies the new owner must invalidate */
+    uInt32          ownerId;        /* owner of the page once the rsp is handled */
+    uInt32          ownerVersion;   /* number of ownership changes of the page */
+    uInt32          pageVersion;    /* multiple writers: version of the home copy */
+    uInt32          codec;          /* DSM_CODEC_* the page is encoded with */
+    uInt32          dataLen;        /* length of the page as encoded */
+}dsmPageRspInfo;
+
+/* payload of DSM_MSG_PAGE_REDIRECT_RSP and DSM_MSG_OWNER_UPDATE */
+typedef struct {
+    uInt32          pageOffset;
+    uInt32          ownerId;        /* node believed to own the page */
+    uInt32          ownerVersion;   /* ownership change the belief is based on */
+}dsmOwnerInfo;
+
+/* a run of pages */
+typedef struct {
+    uInt32          firstPage;
+    uInt32          numPages;
+}dsmPageRange;
+
+/* payload of DSM_MSG_PAGE_BATCH_REQ; followed by numRanges dsmPageRange */
+typedef struct {
+    uInt32          requesterId;
+    uInt32          isWrite;        /* ownership, else read-only copies */
+    uInt32          numRanges;
+}dsmPageBatchReqInfo;
+
+/* payload of DSM_MSG_PAGE_RECLAIM; followed by numRanges dsmPageRange */
+typedef struct {
+    uInt32          numRanges;
+}dsmPageReclaimInfo;
+
+/* payload of DSM_MSG_PAGE_BATCH_RSP; followed by numPages dsmPageRspInfo,
+ * each followed by its page, and then numHints dsmOwnerInfo for the pages
+ * asked for that the sender does not own */
+typedef struct {
+    uInt32          isWrite;
+    uInt32          numPages;
+    uInt32          numHints;
+}dsmPageBatchRspInfo;
+
+/* payload of DSM_MSG_DIFF_REQ; followed by numDiffs dsmDiffInfo, each
+ * followed by diffLen bytes of dsmDiffRun */
+typedef struct {
+    uInt32          numDiffs;
+}dsmDiffBatchInfo;
+
+typedef struct {
+    uInt32          pageOffset;
+    uInt32          diffLen;
+}dsmDiffInfo;
+
+/* a run of modified bytes of a page; followed by the length bytes */
+typedef struct {
+    uInt32          offset;
+    uInt32          length;
+}dsmDiffRun;
+
+/* the home copy of a page changed, up to version */
+typedef struct {
+    uInt32          pageOffset;
+    uInt32          version;
+}dsmWriteNotice;
+
+/* payload of DSM_MSG_DIFF_RSP; followed by numNotices dsmWriteNotice */
+typedef struct {
+    uInt32          numNotices;
+}dsmNoticeBatchInfo;
+
+/* payload of DSM_MSG_LOCK_*; followed by numNotices dsmWriteNotice */
+typedef struct {
+    uInt32          lockId;
+    uInt32          nodeId;
+    uInt32          mode;           /* DSM_LOCK_MODE_* asked for or granted */
+    uInt32          granted;        /* acquire rsp: the lock is held, else queued */
+    uInt32          seq;            /* grant of the lock to the node it is about */
+    uInt32          numNotices;
+}dsmLockMsgInfo;
+
+/* payload of DSM_MSG_BARRIER_*; followed by numNotices dsmWriteNotice */
+typedef struct {
+    uInt32          barrierId;
+    uInt32          nodeId;
+    uInt32          count;          /* threads the barrier waits for */
+    uInt32          arrivals;       /* DONE: arrivals of the node counted so far */
+    uInt32          numNotices;
+}dsmBarrierMsgInfo;
+
+/* payload of DSM_MSG_ATOMIC_REQ and DSM_MSG_ATOMIC_RSP */
+typedef struct {
+    uInt32          pageOffset;
+    uInt32          offset;         /* of the word in the page */
+    uInt32          op;             /* DSM_ATOMIC_OP_* */
+    uInt32          size;           /* of the word, 4 or 8 bytes */
+    uInt64          operand;        /* value added, stored or swapped in */
+    uInt64          compare;        /* compare-exchange: value expected */
+    uInt64          result;         /* rsp: value the word held before */
+    uInt32          status;         /* rsp: DSM_ATOMIC_STATUS_* */
+    uInt32          ownerId;        /* redirect: node believed to own the page */
+    uInt32          ownerVersion;
+    uInt32          version;        /* multiple writers: version of the home copy */
+}dsmAtomicInfo;
+
+/* payload of DSM_MSG_HELLO_REQ and DSM_MSG_HELLO_RSP */
+typedef struct {
+    uInt32          nodeId;
+    uInt32          codec;          /* req: best codec of the sender, rsp: agreed */
+}dsmHelloInfo;
+
+/* a page codec; encode returns 0 if the page does not fit in dstCap */
+typedef struct {
+    const char*     pName;
+    uInt32          (*pEncode)(const uInt8* pSrc, uInt32 srcLen, uInt8* pDst,
+                            uInt32 dstCap);
+    int32           (*pDecode)(const uInt8* pSrc, uInt32 srcLen, uInt8* pDst,
+                            uInt32 dstLen);
+}dsmCodec;
+
+/* payload of DSM_MSG_INVALIDATE_REQ and DSM_MSG_INVALIDATE_RSP */
+typedef struct {
+    uInt32          pageOffset;
+    uInt32          ownerId;        /* node id of the node taking write access */
+    uInt32          ownerVersion;
+}dsmInvalidateInfo;
+
 typedef struct {
     int32   isMaster;
-    char*   mIpAddr;
-    int32   mPort;
-    char*   oIpAddr;
-    int32   oPort;
-    uInt32  numPagesToAlloc;
+    uInt32  nodeId;
+    uInt32  numNodes;
+    char**  ipAddrs;            /* cluster membership, indexed by node id */
+    int32*  ports;
+    uInt32  numPagesToAlloc;    /* in pages of pageSize once the region is created */
+    uInt32  pageSize;           /* coherence unit, decided by the master */
+    uInt32  writeMode;          /* DSM_WRITE_MODE_*, decided by the master */
 }dsmMapInitInfo;
 
+typedef struct {
+    uInt64  regionAddr;         /* base addr of the shared region on master */
+    uInt32  pageSize;
+    uInt32  writeMode;
+}dsmRegionInfo;
+
+typedef struct dsmConnCtx {
+    int32               sd;             /* connection accepted from a peer */
+    uInt32              codec;          /* codec agreed on for the pages sent */
+    uInt32              reqId;          /* id of the req being handled */
+    struct dsmConnCtx*  pNext;          /* next connection in the ready queue */
+}dsmConnCtx;
+
+typedef struct dsmRspBuf {
+    struct dsmRspBuf*   pNext;
+    uInt8               msg[1];         /* header and payload of a rsp */
+}dsmRspBuf;
+
+typedef struct dsmRspWaiter {
+    uInt32              reqId;          /* req the rsps are waited for */
+    int32               sd;             /* connection the req went out on */
+    bool                failed;         /* the connection dropped */
+    dsmRspBuf*          pHead;          /* rsps rcvd, not yet handled */
+    dsmRspBuf*          pTail;
+    pthread_cond_t      rspCondVar;     /* signalled when a rsp is rcvd */
+    struct dsmRspWaiter* pNext;
+}dsmRspWaiter;
+
+typedef struct {
+    dsmConnCtx*         pHead;          /* connections with a msg pending */
+    dsmConnCtx*         pTail;
+    pthread_mutex_t     queueMutex;
+    pthread_cond_t      queueCondVar;
+}dsmConnQueue;
+
+typedef struct {
+    int32   faultEngine;        /* DSM_FAULT_ENGINE_*, see dsm_setopt() */
+    uInt32  pageSize;           /* coherence unit asked for on the master */
+    uInt32  prefetchMaxPages;   /* cap of the prefetch window, 0 disables it */
+    uInt32  writeMode;          /* write mode asked for on the master */
+    uInt32  compression;        /* best codec for pages sent and rcvd */
+    uInt32  holdWindowUs;       /* cap of the ownership hold window, 0 disables it */
+    uInt32  statsDumpMs;        /* period of the stats dump, 0 disables it */
+    uInt32  localTransport;     /* reach peers on this host over a unix socket */
+    const char* pBackingFile;   /* file backing the region of master, or NULL */
+}dsmConfigInfo;
+
 typedef struct {
     int32   serverSd;           /* socket fd to listen to req from peer */
-    int32   reqSockSd;          /* socket fd to send req to peer */
-    int32   currentClientSd;    /* socket fd of current client */
+    int32   localSd;            /* unix socket fd to listen to peers on this host */
+    int32   epollFd;            /* watches the listening socket and the peers */
+    int32   numConns;           /* connections accepted from peers */
 }dsmSocketInfo;
 
+typedef struct {
+    int8*               ipAddr;         /* peer ip addr as configured */
+    int32               port;           /* peer listening port */
+    struct sockaddr_in  sockAddr;       /* peer addr, resolved once at init */
+    struct sockaddr_un  localAddr;      /* unix socket of the peer if on this host */
+    uInt32              localAddrLen;
+    bool                isLocal;        /* connected over the unix socket */
+    uInt32              nodeId;         /* node id of the peer */
+    int32               sd;             /* persistent connection to peer, -1 if down */
+    pthread_mutex_t     peerMutex;      /* serializes sending on sd and connecting */
+    pthread_mutex_t     rspMutex;       /* guards the waiters */
+    dsmRspWaiter*       pWaiters;       /* threads waiting for rsps from peer */
+}dsmPeerInfo;
+
+typedef struct {
+    dsmPeerInfo*        pPeer;
+    int32               sd;             /* connection read */
+}dsmRspReaderInfo;
+
 typedef enum {
     DSM_MAIN_THREAD,
-    DSM_COMMUNICATION_THREAD
+    DSM_COMMUNICATION_THREAD,
+    DSM_WORKER_THREAD           /* first of the DSM_NUM_WORKER_THREADS workers */
 }dsmThreadType;
 
 typedef enum {
     DSM_PAGE_REQUESTED = 1, // the page is requested from the owner
     DSM_PAGE_IN_TRANSFER,   // the page is currently getting transferred from the owner
     DSM_PAGE_PRESENT,       // the page is present at the current location
-    DSM_PAGE_NOT_PRESENT    // the page is not present at the current location
+    DSM_PAGE_NOT_PRESENT,   // the page is not present at the current location
+    DSM_PAGE_READ_ONLY      // a read-only copy of the page is present
 }dsmPageStatus;
 
+/* the state of a page every fault and request looks at */
 typedef struct {
+    volatile uInt32         pteLock;        /* futex: 0 free, 1 locked, 2 contended */
+    volatile uInt32         pteWaitSeq;     /* futex: bumped when the page changes */
+    uInt32                  copyset;        /* owner: nodes holding read-only copies */
+    uInt32                  ownerVersion;   /* ownership change owned or believed in */
+    volatile uInt16         pteWaiters;     /* threads waiting for pteWaitSeq */
     bool                    owner;
-    dsmPageStatus           pageStatus;
-    pthread_mutex_t         pteMutexVar;
-    pthread_cond_t          pteCondVar;
+    uInt8                   probOwner;      /* non-owner: node believed to own the page */
+    uInt8                   pageStatus;     /* dsmPageStatus */
+    volatile uInt8          pteFlags;       /* DSM_PTE_FLAG_*, updated atomically */
 }dsmPageTableEntry;
 
+/* the state of a page only some paths use, kept aside from its entry; zero
+ * until used */
+typedef struct {
+    uInt32                  writeTimeMs;    /* owner: when write access was granted */
+    uInt32                  acquireTimeUs;  /* owner: when the page came here to write */
+    uInt32                  lossTimeUs;     /* when ownership was last given up */
+    uInt32                  holdUs;         /* page kept this long after it came here,
+                                               adapted to how fast it comes back */
+    uInt32                  pageVersion;    /* multiple writers: merges into the home
+                                               copy, as of the local copy */
+    uInt32                  noticeVersion;  /* latest version a write notice told of */
+    uInt32                  noticeSeq;      /* local order of the notice, see dsm_lrc.c */
+    uInt8*                  pTwin;          /* multiple writers: copy before the writes */
+}dsmPageMetaEntry;
+
+/* write notice kept by the manager of a lock or barrier; seq orders the merges */
+typedef struct {
+    uInt32                  pageOffset;
+    uInt32                  version;
+    uInt32                  seq;
+    uInt32                  writers;        /* nodes whose releases it merges */
+}dsmLockNotice;
+
+typedef struct {
+    dsmLockNotice*          pNotices;       /* one per page */
+    uInt32                  numNotices;
+    uInt32                  maxNotices;
+    uInt32                  seq;            /* merges so far */
+}dsmNoticeSet;
+
+typedef struct {
+    /* manager: the lock itself */
+    pthread_mutex_t         lockMutex;
+    int32                   holder;         /* node holding it exclusive, -1 if none */
+    uInt32                  sharers;        /* nodes holding it shared */
+    uInt32                  revoked;        /* holders asked to give it back */
+    uInt32                  waiters[DSM_MAX_NODES];     /* nodes queued, in order */
+    uInt32                  waiterModes[DSM_MAX_NODES];
+    uInt32                  firstWaiter;
+    uInt32                  numWaiters;
+    uInt32                  grantSeq[DSM_MAX_NODES];    /* grants to each node */
+    dsmNoticeSet            notices;        /* notices of the releases */
+    uInt32                  sentSeq[DSM_MAX_NODES];     /* merges each node got */
+
+    /* every node: its use of the lock */
+    pthread_mutex_t         grantMutex;
+    pthread_cond_t          grantCondVar;
+    uInt32                  heldMode;       /* DSM_LOCK_MODE_* held by this node */
+    uInt32                  readers;        /* local threads holding it shared */
+    bool                    writer;         /* a local thread holds it exclusive */
+    bool                    pending;        /* asked the manager for it */
+    bool                    returning;      /* being given back to the manager */
+    bool                    granted;        /* the manager answered the ask */
+    uInt32                  grantMode;
+    uInt32                  tenureSeq;      /* grant held */
+    uInt32                  revokeSeq;      /* latest grant asked back */
+    dsmWriteNotice*         pGrantNotices;  /* notices rcvd with the grant */
+    uInt32                  numGrantNotices;
+    uInt32                  releaseSeq;     /* local notice order at the last release */
+}dsmLockInfo;
+
+/* work of a lock handler done in a thread of its own, see dsmLockHandOff() */
+typedef struct {
+    uInt32                  taskType;       /* DSM_LOCK_TASK_* */
+    uInt32                  lockId;
+    uInt32                  nodeId;         /* releaser */
+    uInt32                  targets;        /* holders to ask the lock back from */
+    uInt32                  seqs[DSM_MAX_NODES];        /* their grants */
+    uInt32                  numNotices;     /* of the release, after the task */
+}dsmLockTask;
+
+typedef struct {
+    /* manager: the threads arrived so far */
+    pthread_mutex_t         barrierMutex;
+    pthread_mutex_t         openMutex;      /* keeps the openings in order */
+    uInt32                  arrived;
+    uInt32                  nodes;          /* nodes with threads arrived */
+    uInt32                  counted[DSM_MAX_NODES];     /* arrivals of each node */
+    dsmNoticeSet            notices;        /* notices of the arrivals */
+
+    /* every node: the threads arriving and waiting here */
+    pthread_mutex_t         arriveMutex;    /* keeps the arrivals in order */
+    uInt32                  arrivals;       /* arrivals sent */
+    uInt32                  releaseSeq;     /* local notice order at the last arrival */
+    pthread_mutex_t         waitMutex;
+    pthread_cond_t          waitCondVar;
+    uInt32                  opened;         /* arrivals the openings rcvd let go */
+    uInt32                  released;       /* those whose notices are applied */
+    bool                    applying;       /* a waiter applies the notices */
+    dsmWriteNotice*         pOpenNotices;   /* notices rcvd with the openings */
+    uInt32                  numOpenNotices;
+}dsmBarrierInfo;
+
+/* stride detector of a faulting thread */
+typedef struct {
+    uInt32                  lastPage;       /* last page faulted or prefetched */
+    int32                   stride;         /* in pages */
+    uInt32                  window;         /* pages prefetched per fault */
+}dsmPrefetchInfo;
+
+/* an event of the binary trace; see DSM_EVENT_* */
+typedef struct {
+    uInt64                  timeNs;         /* monotonic clock of the node */
+    uInt32                  pageOffset;
+    uInt32                  arg;            /* depends on the event */
+    uInt32                  threadId;       /* kernel thread id */
+    uInt8                   event;
+    uInt8                   nodeId;
+    uInt8                   peerId;         /* DSM_TRACE_NO_PEER if none */
+    uInt8                   flags;          /* DSM_EVENT_FLAG_* */
+}dsmTraceEvent;
+
+/* start of a trace file; the events follow until the end of the file */
+typedef struct {
+    int8                    magic[8];       /* DSM_TRACE_MAGIC */
+    uInt32                  version;
+    uInt32                  eventSize;      /* sizeof(dsmTraceEvent) */
+    uInt32                  nodeId;
+    uInt32                  numNodes;
+    uInt32                  pageSize;
+    uInt32                  numPages;
+    uInt64                  startNs;        /* time the trace was started */
+}dsmTraceHeader;
+
+#define DSM_TRACE_RING_EVENTS   (8192)  /* per thread, a power of two */
+
+/* trace ring of a thread; the thread moves head, the flusher tail */
+typedef struct dsmTraceRing {
+    dsmTraceEvent           events[DSM_TRACE_RING_EVENTS];
+    volatile uInt32         head;           /* events recorded */
+    volatile uInt32         tail;           /* events written to the file */
+    volatile uInt32         dropped;        /* events lost to a full ring */
+    uInt32                  droppedSeen;    /* of those, reported in the file */
+    volatile bool           exited;         /* freed once drained */
+    uInt32                  threadId;
+    struct dsmTraceRing*    pNext;
+}dsmTraceRing;
+
+/* what the trace analyzer gathers about a page */
+typedef struct {
+    uInt32                  pageOffset;
+    uInt32                  first;          /* index of its first event, sorted */
+    uInt32                  numEvents;
+    uInt32                  readFaults;
+    uInt32                  writeFaults;
+    uInt32                  installs;       /* copies and ownership rcvd */
+    uInt32                  serves;         /* copies and ownership sent */
+    uInt32                  moves;          /* ownership rcvd */
+    uInt32                  invalidations;
+    uInt32                  pingPongs;      /* ownership back soon after it left */
+    uInt32                  peerMask;       /* nodes ownership went to */
+}dsmTracePageInfo;
+
+/* statistics of a thread; only the thread itself writes them */
+typedef struct dsmThreadStats {
+    dsm_stats_t             stats;
+    bool                    inFault;        /* the phases of a fault are timed */
+    struct dsmThreadStats*  pNext;          /* next thread with stats */
+}dsmThreadStats;
+
+/* start of a checkpoint file; the checkpoints are appended after it */
+typedef struct {
+    int8                    magic[8];       /* DSM_CKPT_MAGIC */
+    uInt32                  version;
+    uInt32                  nodeId;         /* node whose pages the file holds */
+    uInt32                  numNodes;
+    uInt32                  pageSize;
+    uInt32                  numPages;
+    uInt32                  reserved;
+}dsmCkptHeader;
+
+/* record of a checkpoint: a begin, a page or drop record per page saved,
+ * and an end; a checkpoint without its end was cut short */
+typedef struct {
+    uInt32                  tag;            /* DSM_CKPT_TAG_* */
+    uInt32                  pageOffset;
+    uInt64                  value;
+}dsmCkptRecord;
+
+/* page found in a checkpoint file by dsm_restore() */
+typedef struct {
+    uInt32                  pageOffset;
+    uInt32                  seq;            /* order in the file */
+    const uInt8*            pData;          /* NULL for a drop */
+}dsmCkptPage;
+
 
 
 #endif
@@ -0,0 +1,223 @@
+#include "dsm_types.h"
+#include "dsm_defs.h"
+#include "dsm_socket.h"
+#include "dsm_prototype.h"
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+/* userfaultfd the shared region is registered with */
+static int32    dsmUffd = -1;
+
+/* source of the zero filled pages mapped for untouched owned pages */
+static uInt8*   pDsmZeroPage = NULL;
+
+/*
+ * opens the userfaultfd and checks that the kernel reports write protect
+ * faults of anonymous memory, which the read-only copies rely on
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmUffdOpen(void)
+{
+    struct uffdio_api   api;
+
+    dsmEnterFunc();
+    dsmUffd = syscall(SYS_userfaultfd, O_CLOEXEC);
+    if (-1 == dsmUffd) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "userfaultfd failed with errno: [%d]\n",
+                errno);
+        dsmExitFunc();
+        return -1;
+    }
+
+    memset(&api, 0, sizeof(struct uffdio_api));
+    api.api = UFFD_API;
+    api.features = UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+    if (-1 == ioctl(dsmUffd, UFFDIO_API, &api)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "UFFDIO_API failed with errno: [%d]\n",
+                errno);
+        close(dsmUffd);
+        dsmUffd = -1;
+        dsmExitFunc();
+        return -1;
+    }
+
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * registers the shared region for missing and write protect faults and
+ * spawns the fault thread serving them
+ * Returns 0 on success, -1 on failure
+ */
+int32 dsmUffdRegister(void* pRegion, uInt32 len)
+{
+    struct uffdio_register  reg;
+    pthread_t               threadId;
+    const __u64             reqIoctls = (1ULL << _UFFDIO_COPY) |
+                                (1ULL << _UFFDIO_WRITEPROTECT) | (1ULL << _UFFDIO_WAKE);
+
+    dsmEnterFunc();
+    memset(&reg, 0, sizeof(struct uffdio_register));
+    reg.range.start = (unsigned long)pRegion;
+    reg.range.len = len;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING | UFFDIO_REGISTER_MODE_WP;
+    if (-1 == ioctl(dsmUffd, UFFDIO_REGISTER, &reg)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "UFFDIO_REGISTER failed with errno: "
+                "[%d]\n", errno);
+        dsmExitFunc();
+        return -1;
+    }
+    if (reqIoctls != (reg.ioctls & reqIoctls)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "userfaultfd does not support write "
+                "protection of the shared region\n");
+        dsmExitFunc();
+        return -1;
+    }
+
+    /* one page of the coherence unit, known only once the region is created */
+    pDsmZeroPage = (uInt8*)mmap(NULL, DSM_PAGE_SIZE, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0);
+    if (MAP_FAILED == (void*)pDsmZeroPage) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Zero page allocation failed with errno: "
+                "[%d]\n", errno);
+        dsmExitFunc();
+        return -1;
+    }
+
+    if (0 != pthread_create(&threadId, NULL, dsmUffdFaultThread, NULL)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Fault Thread creation failed with "
+                "errno: %d\n", errno);
+        dsmExitFunc();
+        return -1;
+    }
+    pthread_detach(threadId);
+    dsmPrintLog(DSM_TRACE_TYPE_INFO, "Fault Thread created with id: %x\n", threadId);
+
+    dsmExitFunc();
+    return 0;
+}
+
+/*
+ * Fault thread; serves the faults on the shared region reported by the
+ * userfaultfd. The faulting thread sleeps in the kernel until the page is
+ * installed, or is woken to retry the access if the fault was not served.
+ * Returns 0 on success, -1 on failure
+ */
+void* dsmUffdFaultThread(void* arg)
+{
+    struct uffd_msg         msg;
+    struct uffdio_range     range;
+    uInt32                  pageOffset = 0;
+    ssize_t                 bytesRead = 0;
+
+    dsmEnterFunc();
+    while (1) {
+        bytesRead = read(dsmUffd, &msg, sizeof(struct uffd_msg));
+        if (bytesRead != sizeof(struct uffd_msg)) {
+            if (-1 == bytesRead && errno != EINTR && errno != EAGAIN) {
+                dsmPrintLog(DSM_TRACE_TYPE_ERROR, "Read from userfaultfd failed "
+                        "with errno: [%d]\n", errno);
+            }
+            continue;
+        }
+        if (UFFD_EVENT_PAGEFAULT != msg.event) {
+            continue;
+        }
+
+        dsmPrintLog(DSM_TRACE_TYPE_INFO, "Page Fault occured for address [%p] "
+                "with flags [%llx]\n", (void*)msg.arg.pagefault.address,
+                msg.arg.pagefault.flags);
+        pageOffset = ((uInt8*)msg.arg.pagefault.address - (uInt8*)pDsmSharedRegion) /
+            DSM_PAGE_SIZE;
+        dsmServeFault(pageOffset,
+                0 != (msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WRITE));
+
+        /* the faulting thread retries the access */
+        range.start = (unsigned long)DSM_PAGE_ADDR(pageOffset);
+        range.len = DSM_PAGE_SIZE;
+        ioctl(dsmUffd, UFFDIO_WAKE, &range);
+    }
+    dsmExitFunc();
+}
+
+/*
+ * maps an owned page the node never touched zero filled with the given
+ * access; a page that is mapped already is left as it is
+ * Returns void
+ */
+void dsmUffdPopulatePage(uInt32 pageOffset, int32 prot)
+{
+    struct uffdio_copy      copy;
+
+    memset(&copy, 0, sizeof(struct uffdio_copy));
+    copy.dst = (unsigned long)DSM_PAGE_ADDR(pageOffset);
+    copy.src = (unsigned long)pDsmZeroPage;
+    copy.len = DSM_PAGE_SIZE;
+    copy.mode = UFFDIO_COPY_MODE_DONTWAKE |
+        ((prot & PROT_WRITE) ? 0 : UFFDIO_COPY_MODE_WP);
+    if (-1 == ioctl(dsmUffd, UFFDIO_COPY, &copy) && EEXIST != errno) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "UFFDIO_COPY failed for page with offset "
+                "[%u], errno: [%d]\n", pageOffset, errno);
+    }
+    if (prot & PROT_WRITE) {
+        __sync_fetch_and_or(&dsmPageTable[pageOffset].pteFlags, DSM_PTE_FLAG_CKPT_DIRTY);
+    }
+}
+
+/*
+ * sets the access of a page; a revoked page is dropped so that the next
+ * access faults as missing, read-only pages are write protected. The page
+ * is mapped first, a write protect of a missing page would be lost.
+ * Returns void
+ */
+void dsmUffdSetPageAccess(uInt32 pageOffset, int32 prot)
+{
+    struct uffdio_writeprotect  wp;
+    uInt8*                      pageBaseAddr = NULL;
+
+    pageBaseAddr = DSM_PAGE_ADDR(pageOffset);
+    if (PROT_NONE == prot) {
+        madvise(pageBaseAddr, DSM_PAGE_SIZE, MADV_DONTNEED);
+        return;
+    }
+
+    dsmUffdPopulatePage(pageOffset, prot);
+    memset(&wp, 0, sizeof(struct uffdio_writeprotect));
+    wp.range.start = (unsigned long)pageBaseAddr;
+    wp.range.len = DSM_PAGE_SIZE;
+    wp.mode = (prot & PROT_WRITE) ? 0 : UFFDIO_WRITEPROTECT_MODE_WP;
+    if (-1 == ioctl(dsmUffd, UFFDIO_WRITEPROTECT, &wp)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "UFFDIO_WRITEPROTECT failed for page with "
+                "offset [%u], errno: [%d]\n", pageOffset, errno);
+    }
+}
+
+/*
+ * installs the contents of a page atomically with its access; the stale
+ * local copy, if any, is dropped first. Threads waiting for the page are
+ * woken.
+ * Returns void
+ */
+void dsmUffdInstallPage(uInt32 pageOffset, const void* pPage, int32 prot)
+{
+    struct uffdio_copy      copy;
+    uInt8*                  pageBaseAddr = NULL;
+
+    pageBaseAddr = DSM_PAGE_ADDR(pageOffset);
+    madvise(pageBaseAddr, DSM_PAGE_SIZE, MADV_DONTNEED);
+    if (PROT_NONE == prot) {
+        return;
+    }
+
+    memset(&copy, 0, sizeof(struct uffdio_copy));
+    copy.dst = (unsigned long)pageBaseAddr;
+    copy.src = (unsigned long)pPage;
+    copy.len = DSM_PAGE_SIZE;
+    copy.mode = (prot & PROT_WRITE) ? 0 : UFFDIO_COPY_MODE_WP;
+    if (-1 == ioctl(dsmUffd, UFFDIO_COPY, &copy)) {
+        dsmPrintLog(DSM_TRACE_TYPE_ERROR, "UFFDIO_COPY failed for page with offset "
+                "[%u], errno: [%d]\n", pageOffset, errno);
+    }
+}
@@ -14,12 +14,7 @@ struct testlist {
   struct testlist *next;
 };
 
-#define LOCK_PREFIX \
-  ".section .smp_locks,\"a\"\n" /* push current section and change section to .smp_locks */ \
-  "  .align 4\n"                /* align to 4 bytes */ \
-  "  .long 661f\n"/* address */ /* create an entry in the up/smp alternative locking table */ \
-  ".previous\n"                 /* pop back the old section */  \
-  "661:\n\tlock; "              /* assert processor LOCK# signal */ 
+#define LOCK_PREFIX "lock; "            /* assert processor LOCK# signal */
 
 
 static inline void atomic_inc(volatile int *v) {
@@ -198,5 +193,143 @@ int main(int arg, char **argv) {
       sleep(10);//let the other thread finish
     }
     break;
+  case 6:
+    //counting under a distributed lock, checked after a barrier
+    {
+      volatile int *p=(volatile int *)region;
+      dsm_lock_t lock;
+      dsm_barrier_t barrier;
+      int i=0;
+      dsm_lock_init(&lock, 1);
+      dsm_barrier_init(&barrier, 1, 2);
+      for(;i<20000;i++) {
+	dsm_lock(&lock);
+	(*p)++;
+	dsm_unlock(&lock);
+      }
+      dsm_barrier_wait(&barrier);//both machines are done counting
+      dsm_lock(&lock);
+      printf("%d -both machines should match 40000\n",*p);
+      dsm_unlock(&lock);
+      dsm_barrier_wait(&barrier);//keep the locks served until both printed
+    }
+    break;
+  case 7:
+    //counting with atomics run at the owner of the page, which stays there
+    {
+      unsigned int *p=(unsigned int *)region;
+      unsigned int v=0;
+      dsm_barrier_t barrier;
+      int i=0;
+      dsm_barrier_init(&barrier, 1, 2);
+      for(;i<20000;i++) {
+	dsm_atomic_fetch_add32(p, 1, NULL);
+      }
+      dsm_barrier_wait(&barrier);//both machines are done counting
+      dsm_atomic_fetch_add32(p, 0, &v);
+      printf("%u -both machines should match 40000\n",v);
+      dsm_barrier_wait(&barrier);//keep the page served until both printed
+    }
+    break;
+  case 8:
+    //fault counts and latencies of the fault path
+    {
+      volatile char *p=(volatile char *)region;
+      dsm_barrier_t barrier;
+      dsm_stats_t stats;
+      int i=0;
+      dsm_barrier_init(&barrier, 1, 2);
+      for(;i<1000;i++) {
+	p[(i*4096+(master?0:8))%(10000*4096)]++;
+      }
+      dsm_barrier_wait(&barrier);//both machines are done faulting
+      dsm_get_stats(&stats);
+      printf("faults read=%llu write=%llu pages rcvd=%llu sent=%llu\n",
+	     stats.read_faults, stats.write_faults, stats.pages_rcvd, stats.pages_sent);
+      for(i=0;i<DSM_NUM_PHASES;i++) {
+	printf("phase %d: count=%llu p50=%lluns p99=%lluns\n", i, stats.phases[i].count,
+	       dsm_hist_percentile(&stats.phases[i], 50),
+	       dsm_hist_percentile(&stats.phases[i], 99));
+      }
+      dsm_barrier_wait(&barrier);//keep the pages served until both printed
+    }
+    break;
+  case 9:
+    //page conflicts recorded in a trace; read with: ./dsmtrace dsm_trace.0 dsm_trace.1
+    {
+      volatile int *p=(volatile int *)region;
+      dsm_barrier_t barrier;
+      int i=0;
+      dsm_barrier_init(&barrier, 1, 2);
+      dsm_trace_start(master ? "dsm_trace.0" : "dsm_trace.1");
+      dsm_barrier_wait(&barrier);//both machines are tracing
+      for(;i<2000;i++) {
+	p[master ? 0 : 1]++;
+	usleep(20);
+      }
+      dsm_barrier_wait(&barrier);//both machines are done writing
+      dsm_trace_stop();
+      printf("trace written\n");
+      dsm_barrier_wait(&barrier);//keep the page served until both stopped
+    }
+    break;
+  case 10:
+    //checkpoint twice and cut the second short as a crash would; run it
+    //again to restore what the first checkpoint saved
+    {
+      int *p=(int *)region;
+      const char *path=master ? "dsm_ckpt.0" : "dsm_ckpt.1";
+      struct stat st;
+      dsm_barrier_t barrier;
+      int i=0;
+      dsm_barrier_init(&barrier, 1, 2);
+      if (0==dsm_restore(path)) {
+	dsm_barrier_wait(&barrier);//both machines restored
+	printf("restored %d %d\n", p[(master?0:100)*1024], p[(master?100:0)*1024]);
+      }
+      else {
+	for(;i<100;i++) {
+	  p[((master?0:100)+i)*1024]=i+1;
+	}
+	dsm_barrier_wait(&barrier);//both machines are done writing
+	dsm_checkpoint(path);
+	dsm_barrier_wait(&barrier);//both machines saved the first one
+	for(i=0;i<100;i++) {
+	  p[((master?0:100)+i)*1024]=999;
+	}
+	dsm_barrier_wait(&barrier);//both machines are done writing again
+	dsm_checkpoint(path);
+	stat(path, &st);
+	truncate(path, st.st_size-100);
+	printf("checkpoint written\n");
+      }
+      dsm_barrier_wait(&barrier);//keep the pages served until both are done
+    }
+    break;
+  case 11:
+    //advice: the other machine scans pages read ahead, then hands them back
+    {
+      volatile char *p=(volatile char *)region;
+      dsm_barrier_t barrier;
+      int i=0;
+      int sum=0;
+      dsm_barrier_init(&barrier, 1, 2);
+      if (master) {
+	for(;i<1000;i++) {
+	  p[i*4096]=1;
+	}
+      }
+      dsm_barrier_wait(&barrier);//master is done writing
+      if (!master) {
+	dsm_advise((void *)p, 1000*4096, DSM_ADVICE_SEQUENTIAL);
+	for(;i<1000;i++) {
+	  sum+=p[i*4096];
+	}
+	dsm_advise((void *)p, 1000*4096, DSM_ADVICE_DONTNEED);
+	printf("sum=%d\n", sum);
+      }
+      dsm_barrier_wait(&barrier);//keep the pages served until both are done
+    }
+    break;
   }
 }